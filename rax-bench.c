@@ -0,0 +1,862 @@
+/* Rax -- A radix tree implementation.
+ *
+ * Copyright (c) 2017-2018, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* rax-bench: benchmark of the radix tree with different key shapes and
+ * access patterns. For every workload the throughput, the latency
+ * percentiles of the single operations, and the memory used per key are
+ * reported, optionally with the hardware counters of the CPU, as text or
+ * as JSON, so that the results of different builds can be compared.
+ * Run "./rax-bench --help" for the options. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "rax.h"
+#include "rc4rand.h"
+
+uint16_t crc16(const char *buf, int len); /* From crc16.c */
+
+/* ------------------------------- Configuration ---------------------------- */
+
+struct benchConfig {
+    size_t keys;            /* Number of keys of the tree. */
+    size_t ops;             /* Operations of every workload. */
+    const char *shapes;     /* Comma separated key shapes, or "all". */
+    const char *workloads;  /* Comma separated workloads, or "all". */
+    int zipf;               /* Zipfian access instead of uniform. */
+    double theta;           /* Skew of the Zipfian distribution. */
+    int writes;             /* Percentage of writes of the mixed workload. */
+    int flags;              /* RAX_FLAG_... flags of the trees. */
+    int arena;              /* Use the slab arena allocator. */
+    int json;               /* Output JSON instead of text. */
+    int perf;               /* Read the hardware counters. */
+    uint64_t seed;
+} config = {1000000, 1000000, "all", "all", 0, 0.99, 20, 0, 0, 0, 0, 1234};
+
+/* --------------------------------- Timing -------------------------------- */
+
+static inline uint64_t nstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+/* Hardware counters, read with perf_event_open() on Linux as a group, so
+ * that they are enabled and disabled together. */
+#define BENCH_COUNTERS 4
+static const char *counterNames[BENCH_COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"
+};
+static int counterFd[BENCH_COUNTERS] = {-1, -1, -1, -1};
+
+/* Open the counters. Returns 0 if they are not available. */
+static int countersOpen(void) {
+#ifdef __linux__
+    uint64_t events[BENCH_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (int j = 0; j < BENCH_COUNTERS; j++) {
+        struct perf_event_attr attr;
+        memset(&attr,0,sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = events[j];
+        attr.disabled = j == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        counterFd[j] = syscall(__NR_perf_event_open,&attr,0,-1,
+                               j ? counterFd[0] : -1,0);
+        if (counterFd[j] == -1) {
+            while(j--) close(counterFd[j]);
+            counterFd[0] = -1;
+            return 0;
+        }
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void countersStart(void) {
+#ifdef __linux__
+    if (counterFd[0] == -1) return;
+    ioctl(counterFd[0],PERF_EVENT_IOC_RESET,PERF_IOC_FLAG_GROUP);
+    ioctl(counterFd[0],PERF_EVENT_IOC_ENABLE,PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+/* Stop the counters, storing their values in 'values'. Returns 0 if the
+ * counters are not available. */
+static int countersStop(uint64_t *values) {
+#ifdef __linux__
+    if (counterFd[0] == -1) return 0;
+    ioctl(counterFd[0],PERF_EVENT_IOC_DISABLE,PERF_IOC_FLAG_GROUP);
+    uint64_t buf[1+BENCH_COUNTERS];
+    if (read(counterFd[0],buf,sizeof(buf)) != sizeof(buf)) return 0;
+    memcpy(values,buf+1,sizeof(uint64_t)*BENCH_COUNTERS);
+    return 1;
+#else
+    (void)values;
+    return 0;
+#endif
+}
+
+/* ---------------------------------- Keys --------------------------------- */
+
+/* All the keys of a shape are generated before running the workloads, so
+ * that generating them is not measured. */
+typedef struct benchKeys {
+    const char *shape;
+    unsigned char **keys;
+    size_t *lens;
+    size_t count;
+    unsigned char *buf;     /* Storage of all the keys. */
+} benchKeys;
+
+#define BENCH_MAX_KEYLEN 64
+
+/* Scramble the key index, so that consecutive keys don't share prefixes
+ * more than real keys would do. */
+static uint32_t scramble(uint32_t i) {
+    i ^= i >> 16;
+    i *= 0x45d9f3b;
+    i ^= i >> 16;
+    return i;
+}
+
+/* Redis Cluster keys: the hash slot of the key, in two bytes, followed by
+ * the key itself, as used to map slots to keys. */
+static size_t keyCluster(unsigned char *buf, size_t i) {
+    int len = snprintf((char*)buf+2,BENCH_MAX_KEYLEN-2,"user:%u:profile",
+                       scramble(i));
+    int slot = crc16((char*)buf+2,len) & 0x3FFF;
+    buf[0] = slot >> 8;
+    buf[1] = slot & 0xff;
+    return len+2;
+}
+
+/* Stream IDs: milliseconds time and sequence number, both as 64 bit big
+ * endian numbers, so that they sort by time. Groups of four entries are
+ * added with the same time, a few milliseconds after the previous ones. */
+static size_t keyStream(unsigned char *buf, size_t i) {
+    static uint64_t ms;
+    if (i == 0) ms = 1700000000000ULL;
+    else if (i%4 == 0) ms += 1+rc4rand()%5;
+    uint64_t seq = i%4;
+    for (int j = 0; j < 8; j++) {
+        buf[j] = ms >> (56-j*8);
+        buf[8+j] = seq >> (56-j*8);
+    }
+    return 16;
+}
+
+/* URL paths, from a small set of path components and an unique id. */
+static size_t keyUrl(unsigned char *buf, size_t i) {
+    static const char *parts[] = {
+        "api", "v1", "v2", "users", "orders", "items", "static", "img",
+        "css", "search", "cart", "account", "products", "reviews"
+    };
+    size_t numparts = sizeof(parts)/sizeof(parts[0]);
+    size_t len = 0;
+    int depth = 1+rc4rand()%3;
+    for (int j = 0; j < depth; j++) {
+        len += snprintf((char*)buf+len,BENCH_MAX_KEYLEN-len,"/%s",
+                        parts[rc4rand()%numparts]);
+    }
+    len += snprintf((char*)buf+len,BENCH_MAX_KEYLEN-len,"/%u",scramble(i));
+    if (rc4rand()%2) {
+        len += snprintf((char*)buf+len,BENCH_MAX_KEYLEN-len,"/%s",
+                        parts[rc4rand()%numparts]);
+    }
+    return len;
+}
+
+/* Random binary keys from 8 to 32 bytes. */
+static size_t keyBinary(unsigned char *buf, size_t i) {
+    (void)i;
+    size_t len = 8+rc4rand()%25;
+    for (size_t j = 0; j < len; j++) buf[j] = rc4rand();
+    return len;
+}
+
+static struct {
+    const char *name;
+    size_t (*gen)(unsigned char *buf, size_t i);
+} shapes[] = {
+    {"cluster", keyCluster},
+    {"stream", keyStream},
+    {"url", keyUrl},
+    {"binary", keyBinary},
+    {NULL, NULL}
+};
+
+static void keysGenerate(benchKeys *k, int shape, size_t count) {
+    k->shape = shapes[shape].name;
+    k->count = count;
+    k->keys = malloc(sizeof(unsigned char*)*count);
+    k->lens = malloc(sizeof(size_t)*count);
+    k->buf = malloc((size_t)BENCH_MAX_KEYLEN*count);
+    if (!k->keys || !k->lens || !k->buf) {
+        fprintf(stderr,"Out of memory generating the keys\n");
+        exit(1);
+    }
+    rc4srand(config.seed);
+    for (size_t i = 0; i < count; i++) {
+        k->keys[i] = k->buf+(size_t)BENCH_MAX_KEYLEN*i;
+        k->lens[i] = shapes[shape].gen(k->keys[i],i);
+    }
+}
+
+static void keysFree(benchKeys *k) {
+    free(k->keys);
+    free(k->lens);
+    free(k->buf);
+}
+
+/* Build a key that is not in the tree from the key 'i', adding two bytes
+ * that only binary keys can contain (and are unlikely to). */
+static size_t keyMissing(benchKeys *k, size_t i, unsigned char *buf) {
+    size_t len = k->lens[i];
+    memcpy(buf,k->keys[i],len);
+    buf[len++] = 0xfe;
+    buf[len++] = 0xff;
+    return len;
+}
+
+/* ---------------------------- Access patterns ---------------------------- */
+
+/* The index of the keys accessed by the operations is generated in
+ * advance as well. With the Zipfian distribution the rank is mapped to a
+ * key index with a permutation, so that the hot keys are spread across
+ * the tree. */
+static size_t *accessGenerate(size_t count, size_t ops) {
+    size_t *idx = malloc(sizeof(size_t)*ops);
+    if (idx == NULL) {
+        fprintf(stderr,"Out of memory generating the accesses\n");
+        exit(1);
+    }
+    rc4srand(config.seed+1);
+    if (!config.zipf) {
+        for (size_t j = 0; j < ops; j++) idx[j] = rc4rand64() % count;
+        return idx;
+    }
+
+    /* Cumulative distribution of the ranks, searched with a binary search
+     * for every random number. */
+    double *cdf = malloc(sizeof(double)*count);
+    if (cdf == NULL) {
+        fprintf(stderr,"Out of memory generating the accesses\n");
+        exit(1);
+    }
+    double sum = 0;
+    for (size_t r = 0; r < count; r++) {
+        sum += 1.0/pow((double)(r+1),config.theta);
+        cdf[r] = sum;
+    }
+    size_t mask = 1;
+    while(mask < count) mask <<= 1;
+    for (size_t j = 0; j < ops; j++) {
+        double u = (double)rc4rand64()/(double)UINT64_MAX*sum;
+        size_t lo = 0, hi = count-1;
+        while(lo < hi) {
+            size_t mid = (lo+hi)/2;
+            if (cdf[mid] < u) lo = mid+1;
+            else hi = mid;
+        }
+        /* Multiplying by an odd number is a permutation of the integers
+         * modulo a power of two: retry the values out of range. */
+        size_t key = lo;
+        do key = (key*2654435761ULL+1) & (mask-1); while(key >= count);
+        idx[j] = key;
+    }
+    free(cdf);
+    return idx;
+}
+
+/* -------------------------------- Results -------------------------------- */
+
+typedef struct benchResult {
+    const char *workload;
+    size_t ops;             /* Operations performed. */
+    uint64_t start;         /* Start time of the measurement. */
+    uint64_t ns;            /* Total time. */
+    uint64_t *lat;          /* Latency of every operation, or NULL. */
+    size_t numlat;
+    uint64_t bytes;         /* Memory used by the tree after the workload. */
+    uint64_t keys;          /* Keys of the tree after the workload. */
+    uint64_t counters[BENCH_COUNTERS];
+    int hascounters;
+} benchResult;
+
+static int cmpU64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(benchResult *r, double p) {
+    if (r->numlat == 0) return 0;
+    size_t j = (size_t)(p*(r->numlat-1));
+    return r->lat[j];
+}
+
+static int firstResult = 1;
+
+static void reportResult(benchKeys *k, benchResult *r, uint64_t overhead) {
+    /* The timer overhead is subtracted from the latencies. */
+    for (size_t j = 0; j < r->numlat; j++)
+        r->lat[j] = r->lat[j] > overhead ? r->lat[j]-overhead : 0;
+    qsort(r->lat,r->numlat,sizeof(uint64_t),cmpU64);
+    double secs = (double)r->ns/1e9;
+    double opsec = secs > 0 ? r->ops/secs : 0;
+    double bpk = r->keys ? (double)r->bytes/r->keys : 0;
+
+    if (config.json) {
+        printf("%s\n    {\"shape\": \"%s\", \"workload\": \"%s\", "
+               "\"ops\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, ",
+               firstResult ? "" : ",", k->shape, r->workload, r->ops, secs,
+               opsec);
+        if (r->numlat) {
+            printf("\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, ",
+                (unsigned long long)percentile(r,0.5),
+                (unsigned long long)percentile(r,0.99),
+                (unsigned long long)percentile(r,0.999));
+        } else {
+            printf("\"p50_ns\": null, \"p99_ns\": null, \"p999_ns\": null, ");
+        }
+        printf("\"keys\": %llu, \"bytes\": %llu, \"bytes_per_key\": %.2f",
+            (unsigned long long)r->keys, (unsigned long long)r->bytes, bpk);
+        for (int j = 0; config.perf && j < BENCH_COUNTERS; j++) {
+            if (r->hascounters)
+                printf(", \"%s_per_op\": %.2f", counterNames[j],
+                    r->ops ? (double)r->counters[j]/r->ops : 0);
+            else
+                printf(", \"%s_per_op\": null", counterNames[j]);
+        }
+        printf("}");
+        firstResult = 0;
+        return;
+    }
+
+    printf("%-8s %-12s %10.0f ops/sec", k->shape, r->workload, opsec);
+    if (r->numlat) {
+        printf("  p50 %6llu  p99 %6llu  p999 %7llu ns",
+            (unsigned long long)percentile(r,0.5),
+            (unsigned long long)percentile(r,0.99),
+            (unsigned long long)percentile(r,0.999));
+    }
+    if (r->keys) printf("  %.1f bytes/key", bpk);
+    if (r->hascounters) {
+        printf("  %.0f cycles/op  %.2f IPC  %.2f cache misses/op",
+            (double)r->counters[0]/r->ops,
+            r->counters[0] ? (double)r->counters[1]/r->counters[0] : 0,
+            (double)r->counters[2]/r->ops);
+    }
+    printf("\n");
+}
+
+/* ------------------------------- Workloads ------------------------------- */
+
+/* The state shared by the workloads of a key shape: they run one after the
+ * other on the same tree, so that the read workloads find all the keys.
+ * Workloads creating their own tree free it before returning. */
+typedef struct benchState {
+    benchKeys *k;
+    rax *t;
+    size_t *access;         /* Index of the key of every operation. */
+    size_t ops;
+} benchState;
+
+static rax *newBenchRax(void) {
+    rax *t = config.arena ? raxNewWithArena(config.flags) :
+                            raxNewWithFlags(config.flags);
+    if (t == NULL) {
+        fprintf(stderr,"Out of memory creating the tree\n");
+        exit(1);
+    }
+    return t;
+}
+
+/* Restart the measurement of the workload, for workloads that need some
+ * setup before the operations. */
+static void benchRestart(benchResult *r) {
+    countersStart();
+    r->start = nstime();
+}
+
+/* Stop the measurement. Called by the workloads that have to clean up
+ * after the operations, otherwise when they return. */
+static void benchStop(benchResult *r) {
+    r->ns = nstime()-r->start;
+    r->hascounters = countersStop(r->counters);
+}
+
+/* Time a single operation, storing its latency. The macro is used in the
+ * loops of the workloads, so that the operations are not function calls. */
+#define TIMED(r, op) do { \
+    uint64_t _start = nstime(); \
+    op; \
+    (r)->lat[(r)->numlat++] = nstime()-_start; \
+} while(0)
+
+static void benchInsert(benchState *s, benchResult *r) {
+    for (size_t i = 0; i < s->k->count; i++)
+        TIMED(r, raxInsert(s->t,s->k->keys[i],s->k->lens[i],
+                           (void*)(long)(i+1),NULL));
+    r->ops = s->k->count;
+}
+
+static void benchLookup(benchState *s, benchResult *r) {
+    size_t found = 0;
+    for (size_t j = 0; j < s->ops; j++) {
+        size_t i = s->access[j];
+        void *v;
+        TIMED(r, v = raxFind(s->t,s->k->keys[i],s->k->lens[i]));
+        found += v != raxNotFound;
+    }
+    if (found != s->ops) fprintf(stderr,"lookup: %zu keys not found\n",
+                                 s->ops-found);
+    r->ops = s->ops;
+}
+
+static void benchMiss(benchState *s, benchResult *r) {
+    unsigned char buf[BENCH_MAX_KEYLEN+2];
+    size_t found = 0;
+    for (size_t j = 0; j < s->ops; j++) {
+        size_t len = keyMissing(s->k,s->access[j],buf);
+        void *v;
+        TIMED(r, v = raxFind(s->t,buf,len));
+        found += v != raxNotFound;
+    }
+    if (found) fprintf(stderr,"miss: %zu keys found\n",found);
+    r->ops = s->ops;
+}
+
+/* Longest prefix match of keys extended with two bytes: the longest prefix
+ * is the original key, found walking past it. */
+static void benchPrefix(benchState *s, benchResult *r) {
+    unsigned char buf[BENCH_MAX_KEYLEN+2];
+    size_t found = 0;
+    for (size_t j = 0; j < s->ops; j++) {
+        size_t i = s->access[j];
+        size_t len = keyMissing(s->k,i,buf), matched = 0;
+        TIMED(r, raxFindLongestPrefix(s->t,buf,len,&matched));
+        found += matched == s->k->lens[i];
+    }
+    if (found != s->ops) fprintf(stderr,"prefix: %zu keys not matched\n",
+                                 s->ops-found);
+    r->ops = s->ops;
+}
+
+static void benchFindMany(benchState *s, benchResult *r) {
+    unsigned char *keys[64];
+    size_t lens[64];
+    void *results[64];
+    for (size_t j = 0; j < s->ops; j += 64) {
+        size_t n = s->ops-j < 64 ? s->ops-j : 64;
+        for (size_t b = 0; b < n; b++) {
+            keys[b] = s->k->keys[s->access[j+b]];
+            lens[b] = s->k->lens[s->access[j+b]];
+        }
+        /* The latency is the one of the batch, divided by its keys. */
+        uint64_t start = nstime();
+        raxFindMany(s->t,keys,lens,n,results);
+        uint64_t lat = (nstime()-start)/n;
+        for (size_t b = 0; b < n; b++) r->lat[r->numlat++] = lat;
+    }
+    r->ops = s->ops;
+}
+
+static void benchIterate(benchState *s, benchResult *r) {
+    raxIterator it;
+    raxStart(&it,s->t);
+    raxSeek(&it,"^",NULL,0);
+    int more = 1;
+    while(more) TIMED(r, more = raxNext(&it));
+    r->numlat--; /* The last call returned no key. */
+    raxStop(&it);
+    r->ops = r->numlat;
+}
+
+static void benchSeek(benchState *s, benchResult *r) {
+    raxIterator it;
+    raxStart(&it,s->t);
+    for (size_t j = 0; j < s->ops; j++) {
+        size_t i = s->access[j];
+        TIMED(r, {
+            raxSeek(&it,">=",s->k->keys[i],s->k->lens[i]);
+            for (int n = 0; n < 10 && raxNext(&it); n++);
+        });
+    }
+    raxStop(&it);
+    r->ops = s->ops;
+}
+
+static void benchRandomWalk(benchState *s, benchResult *r) {
+    raxIterator it;
+    raxStart(&it,s->t);
+    raxSeek(&it,"^",NULL,0);
+    for (size_t j = 0; j < s->ops; j++) TIMED(r, raxRandomWalk(&it,0));
+    raxStop(&it);
+    r->ops = s->ops;
+}
+
+/* Reads, and writes removing or inserting back the keys (half and half, so
+ * that the size of the tree stays about the same). */
+static void benchMixed(benchState *s, benchResult *r) {
+    rc4srand(config.seed+2);
+    for (size_t j = 0; j < s->ops; j++) {
+        size_t i = s->access[j];
+        uint32_t dice = rc4rand()%200;
+        if (dice >= (uint32_t)config.writes*2) {
+            TIMED(r, raxFind(s->t,s->k->keys[i],s->k->lens[i]));
+        } else if (dice % 2) {
+            TIMED(r, raxRemove(s->t,s->k->keys[i],s->k->lens[i],NULL));
+        } else {
+            TIMED(r, raxInsert(s->t,s->k->keys[i],s->k->lens[i],
+                               (void*)(long)(i+1),NULL));
+        }
+    }
+    r->ops = s->ops;
+}
+
+static void benchInsertMany(benchState *s, benchResult *r) {
+    rax *t = newBenchRax();
+    void *values[64];
+    for (size_t i = 0; i < s->k->count; i += 64) {
+        size_t n = s->k->count-i < 64 ? s->k->count-i : 64;
+        for (size_t b = 0; b < n; b++) values[b] = (void*)(long)(i+b+1);
+        uint64_t start = nstime();
+        raxInsertMany(t,s->k->keys+i,s->k->lens+i,n,values);
+        uint64_t lat = (nstime()-start)/n;
+        for (size_t b = 0; b < n; b++) r->lat[r->numlat++] = lat;
+    }
+    benchStop(r);
+    r->ops = s->k->count;
+    r->bytes = raxMemoryUsage(t);
+    r->keys = raxSize(t);
+    raxFree(t);
+}
+
+/* Keys for raxBulkLoad(), that needs them sorted and without duplicates. */
+typedef struct bulkState {
+    unsigned char **keys;
+    size_t *lens;
+    size_t count, next;
+} bulkState;
+
+static benchKeys *sortKeys; /* Used by the sort comparator. */
+
+static int cmpKeys(const void *a, const void *b) {
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    size_t lx = sortKeys->lens[x], ly = sortKeys->lens[y];
+    int cmp = memcmp(sortKeys->keys[x],sortKeys->keys[y],lx < ly ? lx : ly);
+    if (cmp) return cmp;
+    return lx < ly ? -1 : lx > ly;
+}
+
+static int bulkNext(void *privdata, unsigned char **key, size_t *len, void **data) {
+    bulkState *bs = privdata;
+    if (bs->next == bs->count) return 0;
+    *key = bs->keys[bs->next];
+    *len = bs->lens[bs->next];
+    *data = (void*)(long)(bs->next+1);
+    bs->next++;
+    return 1;
+}
+
+static void benchBulkLoad(benchState *s, benchResult *r) {
+    size_t count = s->k->count;
+    size_t *order = malloc(sizeof(size_t)*count);
+    bulkState bs = {malloc(sizeof(unsigned char*)*count),
+                    malloc(sizeof(size_t)*count),0,0};
+    if (!order || !bs.keys || !bs.lens) {
+        fprintf(stderr,"Out of memory sorting the keys\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) order[i] = i;
+    sortKeys = s->k;
+    qsort(order,count,sizeof(size_t),cmpKeys);
+    for (size_t i = 0; i < count; i++) {
+        if (bs.count && cmpKeys(&order[i],&order[i-1]) == 0) continue;
+        bs.keys[bs.count] = s->k->keys[order[i]];
+        bs.lens[bs.count] = s->k->lens[order[i]];
+        bs.count++;
+    }
+
+    /* The keys are loaded in a single call: only the total time is
+     * reported. */
+    rax *t = newBenchRax();
+    benchRestart(r);
+    raxBulkLoad(t,bulkNext,&bs);
+    benchStop(r);
+    r->ops = bs.count;
+    r->bytes = raxMemoryUsage(t);
+    r->keys = raxSize(t);
+    raxFree(t);
+    free(order);
+    free(bs.keys);
+    free(bs.lens);
+}
+
+/* Remove all the keys, in random order. */
+static void benchRemove(benchState *s, benchResult *r) {
+    size_t count = s->k->count;
+    size_t *order = malloc(sizeof(size_t)*count);
+    if (order == NULL) {
+        fprintf(stderr,"Out of memory shuffling the keys\n");
+        exit(1);
+    }
+    rc4srand(config.seed+3);
+    for (size_t i = 0; i < count; i++) order[i] = i;
+    for (size_t i = count-1; i > 0; i--) {
+        size_t j = rc4rand64()%(i+1), aux = order[i];
+        order[i] = order[j];
+        order[j] = aux;
+    }
+    benchRestart(r);
+    for (size_t j = 0; j < count; j++) {
+        size_t i = order[j];
+        TIMED(r, raxRemove(s->t,s->k->keys[i],s->k->lens[i],NULL));
+    }
+    benchStop(r);
+    r->ops = count;
+    free(order);
+}
+
+static struct {
+    const char *name;
+    void (*fn)(benchState *s, benchResult *r);
+} workloads[] = {
+    {"insert", benchInsert},
+    {"lookup", benchLookup},
+    {"miss", benchMiss},
+    {"prefix", benchPrefix},
+    {"findmany", benchFindMany},
+    {"iterate", benchIterate},
+    {"seek", benchSeek},
+    {"randomwalk", benchRandomWalk},
+    {"mixed", benchMixed},
+    {"insertmany", benchInsertMany},
+    {"bulkload", benchBulkLoad},
+    {"remove", benchRemove},
+    {NULL, NULL}
+};
+
+/* Return true if 'name' is in the comma separated list 'list'. */
+static int inList(const char *list, const char *name) {
+    if (!strcmp(list,"all")) return 1;
+    size_t len = strlen(name);
+    while(*list) {
+        const char *end = strchr(list,',');
+        size_t n = end ? (size_t)(end-list) : strlen(list);
+        if (n == len && !memcmp(list,name,len)) return 1;
+        if (!end) break;
+        list = end+1;
+    }
+    return 0;
+}
+
+/* Run the selected workloads with the keys 'k'. The tree is created by
+ * the "insert" workload, or before the first workload that needs it if
+ * "insert" is not selected. */
+static void runShape(benchKeys *k, uint64_t overhead) {
+    benchState s = {k,NULL,accessGenerate(k->count,config.ops),config.ops};
+    size_t maxlat = (k->count > s.ops ? k->count : s.ops)+64;
+    benchResult r;
+    r.lat = malloc(sizeof(uint64_t)*maxlat);
+    if (r.lat == NULL) {
+        fprintf(stderr,"Out of memory allocating the latencies\n");
+        exit(1);
+    }
+
+    for (int w = 0; workloads[w].name; w++) {
+        if (!inList(config.workloads,workloads[w].name)) continue;
+        int creates = workloads[w].fn == benchInsertMany ||
+                      workloads[w].fn == benchBulkLoad;
+        if (s.t == NULL && !creates) {
+            s.t = newBenchRax();
+            if (workloads[w].fn != benchInsert) {
+                for (size_t i = 0; i < k->count; i++)
+                    raxInsert(s.t,k->keys[i],k->lens[i],
+                              (void*)(long)(i+1),NULL);
+            }
+        }
+
+        r.workload = workloads[w].name;
+        r.numlat = 0;
+        r.ops = 0;
+        r.bytes = 0;
+        r.keys = 0;
+        r.ns = 0;
+        benchRestart(&r);
+        workloads[w].fn(&s,&r);
+        if (r.ns == 0) benchStop(&r);
+        if (!creates) {
+            r.bytes = raxMemoryUsage(s.t);
+            r.keys = raxSize(s.t);
+        }
+        reportResult(k,&r,overhead);
+
+        /* After the removal of all the keys, the next workloads start
+         * with a new tree. */
+        if (workloads[w].fn == benchRemove) {
+            raxFree(s.t);
+            s.t = NULL;
+        }
+    }
+    if (s.t) raxFree(s.t);
+    free(s.access);
+    free(r.lat);
+}
+
+/* Estimate the time taken by nstime() itself, to subtract it from the
+ * latencies. */
+static uint64_t timerOverhead(void) {
+    uint64_t min = UINT64_MAX;
+    for (int j = 0; j < 1000; j++) {
+        uint64_t start = nstime();
+        uint64_t lat = nstime()-start;
+        if (lat < min) min = lat;
+    }
+    return min;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+"Usage: %s [options]\n"
+"  --keys <count>       Keys in the tree (default 1000000).\n"
+"  --ops <count>        Operations of the read and mixed workloads\n"
+"                       (default: the number of keys).\n"
+"  --shapes <list>      Comma separated key shapes: cluster, stream, url,\n"
+"                       binary (default all).\n"
+"  --workloads <list>   Comma separated workloads: insert, lookup, miss,\n"
+"                       prefix, findmany, iterate, seek, randomwalk, mixed,\n"
+"                       insertmany, bulkload, remove (default all).\n"
+"  --zipf [theta]       Zipfian access (default skew 0.99), instead of\n"
+"                       uniform.\n"
+"  --writes <percent>   Writes of the mixed workload (default 20).\n"
+"  --dense, --rank      Create the trees with RAX_FLAG_DENSE/RAX_FLAG_RANK.\n"
+"  --buckets            Create the trees with RAX_FLAG_BUCKETS (not with\n"
+"                       --rank).\n"
+"  --arena              Use the slab arena allocator.\n"
+"  --perf               Report the CPU hardware counters (Linux only).\n"
+"  --json               Output the results as JSON.\n"
+"  --seed <seed>        Seed of the keys and of the accesses.\n",
+    prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int ops_set = 0;
+    for (int j = 1; j < argc; j++) {
+        int more = j+1 < argc;
+        if (!strcmp(argv[j],"--keys") && more) {
+            config.keys = strtoull(argv[++j],NULL,10);
+        } else if (!strcmp(argv[j],"--ops") && more) {
+            config.ops = strtoull(argv[++j],NULL,10);
+            ops_set = 1;
+        } else if (!strcmp(argv[j],"--shapes") && more) {
+            config.shapes = argv[++j];
+        } else if (!strcmp(argv[j],"--workloads") && more) {
+            config.workloads = argv[++j];
+        } else if (!strcmp(argv[j],"--zipf")) {
+            config.zipf = 1;
+            if (more && argv[j+1][0] != '-') config.theta = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--writes") && more) {
+            config.writes = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--dense")) {
+            config.flags |= RAX_FLAG_DENSE;
+        } else if (!strcmp(argv[j],"--rank")) {
+            config.flags |= RAX_FLAG_RANK;
+        } else if (!strcmp(argv[j],"--buckets")) {
+            config.flags |= RAX_FLAG_BUCKETS;
+        } else if (!strcmp(argv[j],"--arena")) {
+            config.arena = 1;
+        } else if (!strcmp(argv[j],"--perf")) {
+            config.perf = 1;
+        } else if (!strcmp(argv[j],"--json")) {
+            config.json = 1;
+        } else if (!strcmp(argv[j],"--seed") && more) {
+            config.seed = strtoull(argv[++j],NULL,10);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!ops_set) config.ops = config.keys;
+    if (config.keys == 0 || config.ops == 0 || config.writes < 0 ||
+        config.writes > 100 || config.theta <= 0 ||
+        ((config.flags & RAX_FLAG_BUCKETS) && (config.flags & RAX_FLAG_RANK)))
+        usage(argv[0]);
+    if (config.perf && !countersOpen())
+        fprintf(stderr,"Hardware counters not available\n");
+
+    uint64_t overhead = timerOverhead();
+    if (config.json) {
+        printf("{\"config\": {\"keys\": %zu, \"ops\": %zu, "
+               "\"distribution\": \"%s\", \"theta\": %.2f, \"writes\": %d, "
+               "\"flags\": %d, \"arena\": %s, \"seed\": %llu, "
+               "\"timer_overhead_ns\": %llu},\n  \"results\": [",
+               config.keys, config.ops, config.zipf ? "zipf" : "uniform",
+               config.theta, config.writes, config.flags,
+               config.arena ? "true" : "false",
+               (unsigned long long)config.seed,
+               (unsigned long long)overhead);
+    } else {
+        printf("%zu keys, %zu ops, %s access, timer overhead %llu ns\n",
+            config.keys, config.ops, config.zipf ? "zipfian" : "uniform",
+            (unsigned long long)overhead);
+    }
+
+    for (int j = 0; shapes[j].name; j++) {
+        if (!inList(config.shapes,shapes[j].name)) continue;
+        benchKeys k;
+        keysGenerate(&k,j,config.keys);
+        runShape(&k,overhead);
+        keysFree(&k);
+        fflush(stdout);
+    }
+    if (config.json) printf("\n  ]\n}\n");
+    return 0;
+}
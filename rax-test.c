@@ -33,6 +33,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <assert.h>
 #include <errno.h>
 
@@ -209,13 +213,16 @@ long long ustime(void) {
  * KEY_RANDOM: Totally random string up to maxlen bytes.
  * KEY_RANDOM_ALPHA: Alphanumerical random string up to maxlen bytes.
  * KEY_RANDOM_SMALL_CSET: Small charset random strings.
- * KEY_CHAIN: 'i' times the character "A". */
+ * KEY_CHAIN: 'i' times the character "A".
+ * KEY_HEX: Random-looking hex string of 8 digits, unique for every 'i', in
+ *          order to have many nodes with 16 children. */
 #define KEY_INT 0
 #define KEY_UNIQUE_ALPHA 1
 #define KEY_RANDOM 2
 #define KEY_RANDOM_ALPHA 3
 #define KEY_RANDOM_SMALL_CSET 4
 #define KEY_CHAIN 5
+#define KEY_HEX 6
 static size_t int2key(char *s, size_t maxlen, uint32_t i, int mode) {
     if (mode == KEY_INT) {
         return snprintf(s,maxlen,"%lu",(unsigned long)i);
@@ -242,6 +249,8 @@ static size_t int2key(char *s, size_t maxlen, uint32_t i, int mode) {
         if (i > maxlen) i = maxlen;
         memset(s,'A',i);
         return i;
+    } else if (mode == KEY_HEX) {
+        return snprintf(s,maxlen,"%08lx",(unsigned long)int2int(i));
     } else {
         return 0;
     }
@@ -249,12 +258,41 @@ static size_t int2key(char *s, size_t maxlen, uint32_t i, int mode) {
 
 /* -------------------------------------------------------------------------- */
 
-/* Perform a fuzz test, returns 0 on success, 1 on error. */
-int fuzzTest(int keymode, size_t count, double addprob, double remprob) {
+/* Not a real rax flag: used by the tests in order to create trees using a
+ * slab arena for their nodes. */
+#define TEST_FLAG_ARENA (1<<30)
+
+rax *newTestRax(int flags) {
+    if (flags & TEST_FLAG_ARENA)
+        return raxNewWithArena(flags & ~TEST_FLAG_ARENA);
+    return raxNewWithFlags(flags);
+}
+
+/* Check that the memory usage of the tree, that is updated incrementally,
+ * matches the one obtained walking the tree. Returns 0 on success, 1 on
+ * error. */
+int memoryCheckTree(rax *t, const char *test) {
+    raxTreeStats stats;
+    raxStats(t,&stats);
+    if (raxMemoryUsage(t) != stats.bytes || stats.nodes != t->numnodes) {
+        printf("%s: memory usage %llu bytes, %llu expected\n", test,
+            (unsigned long long)raxMemoryUsage(t),
+            (unsigned long long)stats.bytes);
+        return 1;
+    }
+    return 0;
+}
+
+/* Perform a fuzz test, returns 0 on success, 1 on error. The radix tree
+ * is created with the specified RAX_FLAG_... flags. */
+int fuzzTestWithFlags(int keymode, size_t count, double addprob, double remprob, int flags) {
     hashtable *ht = htNew();
-    rax *rax = raxNew();
+    rax *rax = newTestRax(flags);
 
-    printf("Fuzz test in mode %d [%zu]: ", keymode, count);
+    printf("Fuzz test in mode %d [%zu]", keymode, count);
+    if (flags & ~TEST_FLAG_ARENA) printf(" flags %d", flags & ~TEST_FLAG_ARENA);
+    if (flags & TEST_FLAG_ARENA) printf(" arena");
+    printf(": ");
     fflush(stdout);
 
     /* Perform random operations on both the dictionaries. */
@@ -300,6 +338,7 @@ int fuzzTest(int keymode, size_t count, double addprob, double remprob) {
         return 1;
     }
     printf("%lu elements inserted\n", (unsigned long)ht->numele);
+    if (memoryCheckTree(rax,"Fuzz")) return 1;
 
     /* Check that elements match. */
     raxIterator iter;
@@ -333,6 +372,119 @@ int fuzzTest(int keymode, size_t count, double addprob, double remprob) {
     return 0;
 }
 
+int fuzzTest(int keymode, size_t count, double addprob, double remprob) {
+    return fuzzTestWithFlags(keymode,count,addprob,remprob,0);
+}
+
+/* Generate the inline value for the specified seed into 'buf', that must
+ * be at least 300 bytes, returning its length. Most values are small, but
+ * some are large enough to need a multi bytes length prefix. */
+size_t inlineValue(unsigned char *buf, uint32_t seed) {
+    size_t len = (seed % 8) ? seed % 24 : seed % 300;
+    for (size_t j = 0; j < len; j++) buf[j] = (seed >> (j % 24)) + j;
+    return len;
+}
+
+long freedPointers = 0;
+void countFreedPointer(void *val) {
+    (void)val;
+    freedPointers++;
+}
+
+/* Fuzz test for inline values: keys with inline values and keys with
+ * pointer values are mixed in the same tree. The hash table stores the
+ * seed of inline values as odd pointers, and pointer values are even.
+ * Returns 0 on success, 1 on error. */
+int inlineFuzzTest(int keymode, size_t count, int flags) {
+    hashtable *ht = htNew();
+    rax *rax = newTestRax(flags);
+    unsigned char val[300];
+
+    printf("Inline values fuzz test in mode %d [%zu]: ", keymode, count);
+    fflush(stdout);
+
+    for (size_t i = 0; i < count; i++) {
+        unsigned char key[1024];
+        uint32_t keylen = int2key((char*)key,sizeof(key),i,keymode);
+        int retval1, retval2;
+
+        if (rc4rand() % 3) {
+            uint32_t seed = rc4rand();
+            if (rc4rand() % 4) {
+                size_t vlen = inlineValue(val,seed);
+                retval1 = htAdd(ht,key,keylen,
+                                (void*)(((unsigned long)seed<<1)|1));
+                retval2 = raxInsertInline(rax,key,keylen,val,vlen);
+            } else {
+                void *ptr = (void*)(((unsigned long)seed<<1)+2);
+                retval1 = htAdd(ht,key,keylen,ptr);
+                retval2 = raxInsert(rax,key,keylen,ptr,NULL);
+            }
+        } else {
+            retval1 = htRem(ht,key,keylen);
+            retval2 = raxRemove(rax,key,keylen,NULL);
+        }
+        if (retval1 != retval2) {
+            printf("Inline fuzz: mismatching return value HT=%d RAX=%d "
+                   "for key %.*s\n", retval1, retval2, (int)keylen,
+                   (char*)key);
+            return 1;
+        }
+    }
+
+    if (ht->numele != raxSize(rax)) {
+        printf("Inline fuzz: HT / RAX keys count mismatch: %lu vs %lu\n",
+            (unsigned long) ht->numele,
+            (unsigned long) raxSize(rax));
+        return 1;
+    }
+    printf("%lu elements inserted\n", (unsigned long)ht->numele);
+    if (memoryCheckTree(rax,"Inline fuzz")) return 1;
+
+    /* Check the values reported by the iterator and the lookups. */
+    raxIterator iter;
+    raxStart(&iter,rax);
+    raxSeek(&iter,"^",NULL,0);
+    long pointers = 0;
+    while(raxNext(&iter)) {
+        unsigned long htval =
+            (unsigned long)htFind(ht,iter.key,iter.key_len);
+        size_t vlen;
+        void *inl = raxFindInline(rax,iter.key,iter.key_len,&vlen);
+        if (htval & 1) {
+            size_t explen = inlineValue(val,htval>>1);
+            if (iter.data_len != explen || memcmp(iter.data,val,explen) ||
+                inl != iter.data || vlen != explen)
+            {
+                printf("Inline fuzz: wrong inline value for key %.*s\n",
+                    (int)iter.key_len,(char*)iter.key);
+                return 1;
+            }
+        } else {
+            if (iter.data != (void*)htval || inl != raxNotFound ||
+                raxFind(rax,iter.key,iter.key_len) != (void*)htval)
+            {
+                printf("Inline fuzz: wrong value for key %.*s\n",
+                    (int)iter.key_len,(char*)iter.key);
+                return 1;
+            }
+            pointers++;
+        }
+    }
+    raxStop(&iter);
+
+    /* The free callback is only called for pointer values. */
+    freedPointers = 0;
+    raxFreeWithCallback(rax,countFreedPointer);
+    if (freedPointers != pointers) {
+        printf("Inline fuzz: free callback called %ld times instead "
+               "of %ld\n", freedPointers, pointers);
+        return 1;
+    }
+    htFree(ht);
+    return 0;
+}
+
 /* Redis Cluster alike fuzz testing.
  *
  * This test simulates the radix tree usage made by Redis Cluster in order
@@ -443,9 +595,9 @@ int arraySeek(arrayItem *array, int count, unsigned char *key, size_t len, char
     return i;
 }
 
-int iteratorFuzzTest(int keymode, size_t count) {
+int iteratorFuzzTest(int keymode, size_t count, int flags) {
     count = rc4rand()%count;
-    rax *rax = raxNew();
+    rax *rax = newTestRax(flags);
     arrayItem *array = malloc(sizeof(arrayItem)*count);
 
     /* Fill a radix tree and a linear array with some data. */
@@ -549,6 +701,459 @@ int iteratorFuzzTest(int keymode, size_t count) {
     return 0;
 }
 
+/* Rank fuzz testing: after random insertions and deletions, check that
+ * raxRank() and raxSelect() agree with the position of the keys in a
+ * sorted array obtained by iterating the tree. */
+int rankFuzzTest(int keymode, size_t count, int flags) {
+    rax *rax = newTestRax(flags|RAX_FLAG_RANK);
+    unsigned char key[1024];
+    uint32_t keylen;
+
+    printf("Rank fuzz test in mode %d [%zu]: ", keymode, count);
+    fflush(stdout);
+
+    /* Fill the tree, using inline values as well, since they change the
+     * layout of the nodes, and removing some key. */
+    for (size_t i = 0; i < count; i++) {
+        keylen = int2key((char*)key,sizeof(key),rc4rand()%count,keymode);
+        if (rc4rand() % 3) {
+            if (rc4rand() % 2)
+                raxInsert(rax,key,keylen,(void*)(unsigned long)i,NULL);
+            else
+                raxInsertInline(rax,key,keylen,key,keylen % 20);
+        } else {
+            raxRemove(rax,key,keylen,NULL);
+        }
+    }
+
+    /* Collect the keys in order: they are already sorted. */
+    count = raxSize(rax);
+    arrayItem *array = malloc(sizeof(arrayItem)*(count+1));
+    raxIterator iter;
+    raxStart(&iter,rax);
+    raxSeek(&iter,"^",NULL,0);
+    size_t j = 0;
+    while(raxNext(&iter)) {
+        array[j].key = malloc(iter.key_len ? iter.key_len : 1);
+        array[j].key_len = iter.key_len;
+        memcpy(array[j].key,iter.key,iter.key_len);
+        j++;
+    }
+
+    for (j = 0; j < count; j++) {
+        uint64_t rank = raxRank(rax,array[j].key,array[j].key_len);
+        if (rank != j) {
+            printf("Rank fuzz: rank of key %zu is %llu\n",
+                j, (unsigned long long)rank);
+            return 1;
+        }
+        raxSelect(&iter,j);
+        if (!raxNext(&iter) || iter.key_len != array[j].key_len ||
+            memcmp(iter.key,array[j].key,iter.key_len))
+        {
+            printf("Rank fuzz: select of rank %zu returned the wrong key\n",
+                j);
+            return 1;
+        }
+    }
+
+    /* The rank of keys not in the tree is the number of smaller keys. */
+    for (int k = 0; k < 100; k++) {
+        keylen = int2key((char*)key,sizeof(key),rc4rand(),keymode);
+        if (rc4rand() % 2 && keylen) keylen--;
+        uint64_t expected = 0;
+        while(expected < count &&
+              compareAB(array[expected].key,array[expected].key_len,
+                        key,keylen) < 0) expected++;
+        if (raxRank(rax,key,keylen) != expected) {
+            printf("Rank fuzz: wrong rank for a missing key\n");
+            return 1;
+        }
+    }
+
+    /* Out of range ranks seek to EOF. */
+    raxSelect(&iter,count);
+    if (raxNext(&iter)) {
+        printf("Rank fuzz: select of rank %zu did not reach EOF\n", count);
+        return 1;
+    }
+    printf("%zu keys checked\n", count);
+
+    for (j = 0; j < count; j++) free(array[j].key);
+    free(array);
+    raxStop(&iter);
+    raxFree(rax);
+    return 0;
+}
+
+/* Callback for raxBulkLoad() returning the items of an arrayItem array. */
+typedef struct bulkLoadArray {
+    arrayItem *items;
+    size_t count, next;
+} bulkLoadArray;
+
+int bulkLoadNext(void *privdata, unsigned char **key, size_t *len, void **data) {
+    bulkLoadArray *ba = privdata;
+    if (ba->next == ba->count) return 0;
+    *key = ba->items[ba->next].key;
+    *len = ba->items[ba->next].key_len;
+    *data = (void*)(unsigned long)ba->next;
+    ba->next++;
+    return 1;
+}
+
+/* Bulk load fuzz testing: bulk load a set of sorted keys, and check that
+ * the resulting tree is the same obtained inserting the keys one after the
+ * other, and that it can be modified later. */
+int bulkLoadFuzzTest(int keymode, size_t count, int flags) {
+    rax *bulk = newTestRax(flags);
+    rax *ref = newTestRax(flags);
+    arrayItem *array = malloc(sizeof(arrayItem)*(count+1));
+
+    printf("Bulk load fuzz test in mode %d [%zu]: ", keymode, count);
+    fflush(stdout);
+
+    /* Create the reference tree, and collect its keys in order. */
+    unsigned char key[1024];
+    for (size_t i = 0; i < count; i++) {
+        uint32_t keylen = int2key((char*)key,sizeof(key),i,keymode);
+        raxInsert(ref,key,keylen,NULL,NULL);
+    }
+    raxIterator iter;
+    raxStart(&iter,ref);
+    raxSeek(&iter,"^",NULL,0);
+    size_t j = 0;
+    while(raxNext(&iter)) {
+        array[j].key = malloc(iter.key_len ? iter.key_len : 1);
+        array[j].key_len = iter.key_len;
+        memcpy(array[j].key,iter.key,iter.key_len);
+        j++;
+    }
+    raxStop(&iter);
+    count = j;
+    for (j = 0; j < count; j++)
+        raxInsert(ref,array[j].key,array[j].key_len,(void*)(unsigned long)j,
+                  NULL);
+
+    bulkLoadArray ba = {array,count,0};
+    if (!raxBulkLoad(bulk,bulkLoadNext,&ba)) {
+        printf("Bulk load fuzz: raxBulkLoad() failed\n");
+        return 1;
+    }
+    if (raxSize(bulk) != count || bulk->numnodes != ref->numnodes) {
+        printf("Bulk load fuzz: %llu keys and %llu nodes instead of "
+               "%llu and %llu\n",
+               (unsigned long long)raxSize(bulk),
+               (unsigned long long)bulk->numnodes,
+               (unsigned long long)raxSize(ref),
+               (unsigned long long)ref->numnodes);
+        return 1;
+    }
+    for (j = 0; j < count; j++) {
+        if (raxFind(bulk,array[j].key,array[j].key_len) !=
+            (void*)(unsigned long)j)
+        {
+            printf("Bulk load fuzz: wrong value for key %zu\n", j);
+            return 1;
+        }
+        if ((flags & RAX_FLAG_RANK) &&
+            raxRank(bulk,array[j].key,array[j].key_len) != j)
+        {
+            printf("Bulk load fuzz: wrong rank for key %zu\n", j);
+            return 1;
+        }
+    }
+
+    /* Modify both the trees in the same way: they must remain equal. */
+    for (size_t i = 0; i < count; i++) {
+        uint32_t keylen = int2key((char*)key,sizeof(key),
+                                  rc4rand()%(count*2),keymode);
+        int retval1, retval2;
+        if (rc4rand() % 2) {
+            retval1 = raxInsert(ref,key,keylen,NULL,NULL);
+            retval2 = raxInsert(bulk,key,keylen,NULL,NULL);
+        } else {
+            retval1 = raxRemove(ref,key,keylen,NULL);
+            retval2 = raxRemove(bulk,key,keylen,NULL);
+        }
+        if (retval1 != retval2) {
+            printf("Bulk load fuzz: modifications return values mismatch\n");
+            return 1;
+        }
+    }
+    if (raxSize(bulk) != raxSize(ref) || bulk->numnodes != ref->numnodes) {
+        printf("Bulk load fuzz: trees differ after modifications\n");
+        return 1;
+    }
+    printf("%zu keys loaded\n", count);
+
+    for (j = 0; j < count; j++) free(array[j].key);
+    free(array);
+    raxFree(bulk);
+    raxFree(ref);
+    return 0;
+}
+
+/* Value callback used by the frozen images tests: one value every three is
+ * stored inside the image, the others are stored as pointers. */
+int frozenValueCallback(void *privdata, void *data, const void **buf, size_t *len) {
+    unsigned long *valbuf = privdata;
+    if ((unsigned long)data % 3) return 0;
+    *valbuf = (unsigned long)data;
+    *buf = valbuf;
+    *len = sizeof(*valbuf);
+    return 1;
+}
+
+/* Check that the value 'fdata' of 'flen' bytes found in a frozen image is
+ * the same of the value 'data' of 'len' bytes of the original tree, given
+ * the callback above. */
+int frozenSameValue(void *data, size_t len, void *fdata, size_t flen) {
+    unsigned long v = (unsigned long)data;
+    if (len == 0 && data != NULL && v % 3 == 0)
+        return flen == sizeof(v) && memcmp(fdata,&v,sizeof(v)) == 0;
+    if (len == 0) return flen == 0 && fdata == data;
+    return flen == len && memcmp(fdata,data,len) == 0;
+}
+
+/* Check that two iterators, one of the original tree and one of its frozen
+ * image, are at the same key with the same value. */
+int frozenSameIterators(raxIterator *it, raxIterator *fit) {
+    return it->key_len == fit->key_len &&
+           memcmp(it->key,fit->key,it->key_len) == 0 &&
+           frozenSameValue(it->data,it->data_len,fit->data,fit->data_len);
+}
+
+/* Frozen images fuzz testing: serialize a tree, and check that lookups and
+ * iterators give the same results in the tree and in its frozen image. The
+ * image is moved to a different address before using it, in order to check
+ * that it is position independent. If 'compact' is true the image is
+ * produced by raxSerializeCompact(). */
+int frozenFuzzTest(int keymode, size_t count, int flags, int compact) {
+    rax *rax = newTestRax(flags);
+    unsigned char key[1024];
+    uint32_t keylen;
+    char *inlineval = "0123456789abcdefghij";
+
+    printf("Frozen%s fuzz test in mode %d [%zu]: ",
+        compact ? " compact" : "", keymode, count);
+    fflush(stdout);
+
+    /* Fill the tree with NULL, pointer and inline values. */
+    for (size_t i = 0; i < count; i++) {
+        keylen = int2key((char*)key,sizeof(key),rc4rand()%count,keymode);
+        int r = rc4rand() % 4;
+        if (r == 0)
+            raxInsertInline(rax,key,keylen,inlineval,1+keylen%19);
+        else if (r == 1)
+            raxInsert(rax,key,keylen,NULL,NULL);
+        else
+            raxInsert(rax,key,keylen,(void*)(unsigned long)(i+1),NULL);
+    }
+
+    unsigned long valbuf;
+    size_t len;
+    unsigned char *image = compact ?
+        raxSerializeCompact(rax,frozenValueCallback,&valbuf,&len) :
+        raxSerialize(rax,frozenValueCallback,&valbuf,&len);
+    if (image == NULL) {
+        printf("Frozen fuzz: raxSerialize() failed\n");
+        return 1;
+    }
+    unsigned char *moved = malloc(len);
+    memcpy(moved,image,len);
+    memset(image,0xff,len);
+    free(image);
+
+    raxFrozen f;
+    if (!raxFrozenOpen(&f,moved,len) || raxSize(&f.rt) != raxSize(rax)) {
+        printf("Frozen fuzz: raxFrozenOpen() failed\n");
+        return 1;
+    }
+
+    /* Lookups and full iterations in both the directions. */
+    raxIterator it, fit;
+    raxStart(&it,rax);
+    raxFrozenStart(&fit,&f);
+    for (int next = 0; next < 2; next++) {
+        raxSeek(&it,next ? "^" : "$",NULL,0);
+        raxSeek(&fit,next ? "^" : "$",NULL,0);
+        while(1) {
+            int res = next ? raxNext(&it) : raxPrev(&it);
+            int fres = next ? raxNext(&fit) : raxPrev(&fit);
+            if (res != fres || (res && !frozenSameIterators(&it,&fit))) {
+                printf("Frozen fuzz: iterators mismatch\n");
+                return 1;
+            }
+            if (!res) break;
+            size_t flen = 0;
+            void *fdata = raxFrozenFindInline(&f,it.key,it.key_len,&flen);
+            if (fdata == raxNotFound) {
+                fdata = raxFrozenFind(&f,it.key,it.key_len);
+                flen = 0;
+            }
+            if (!frozenSameValue(it.data,it.data_len,fdata,flen)) {
+                printf("Frozen fuzz: lookup mismatch\n");
+                return 1;
+            }
+        }
+    }
+
+    /* Random lookups, seeks and selects. */
+    char *seekops[] = {"==",">=","<=",">","<","^","$"};
+    for (int j = 0; j < 1000; j++) {
+        keylen = int2key((char*)key,sizeof(key),rc4rand()%(count*2+1),keymode);
+        if ((raxFind(rax,key,keylen) == raxNotFound) !=
+            (raxFrozenFind(&f,key,keylen) == raxNotFound))
+        {
+            printf("Frozen fuzz: random lookup mismatch\n");
+            return 1;
+        }
+        if ((flags & RAX_FLAG_RANK) && j % 2) {
+            uint64_t rank = rc4rand() % (raxSize(rax)+1);
+            raxSelect(&it,rank);
+            raxSelect(&fit,rank);
+        } else {
+            char *seekop = seekops[rc4rand() % 7];
+            raxSeek(&it,seekop,key,keylen);
+            raxSeek(&fit,seekop,key,keylen);
+        }
+        int next = rc4rand() % 2;
+        for (int k = 0; k < 10; k++) {
+            int res = next ? raxNext(&it) : raxPrev(&it);
+            int fres = next ? raxNext(&fit) : raxPrev(&fit);
+            if (res != fres || (res && !frozenSameIterators(&it,&fit))) {
+                printf("Frozen fuzz: iterators mismatch after seek\n");
+                return 1;
+            }
+            if (!res) break;
+        }
+    }
+    printf("%llu keys checked\n", (unsigned long long)raxSize(rax));
+
+    raxStop(&it);
+    raxStop(&fit);
+    free(moved);
+    raxFree(rax);
+    return 0;
+}
+
+/* Concurrent trees fuzz testing: a writer modifies the tree, while reader
+ * threads look up and iterate keys. The value of every key is its hash, and
+ * the first 'stable' keys are never removed, so that the readers know what
+ * to expect. Only key modes that don't use the random generator can be
+ * used, since the readers generate keys as well. */
+typedef struct concurrentFuzzState {
+    rax *t;
+    int keymode;
+    size_t stable, count;
+    int done;
+    long lookups, errors;
+} concurrentFuzzState;
+
+void *concurrentFuzzReader(void *arg) {
+    concurrentFuzzState *st = arg;
+    raxReader *r = raxReaderNew(st->t);
+    raxIterator iter;
+    unsigned char key[1024];
+    uint32_t seed = (uint32_t)(uintptr_t)&iter;
+    long lookups = 0, errors = 0;
+
+    raxStart(&iter,st->t);
+    while(!__atomic_load_n(&st->done,__ATOMIC_ACQUIRE)) {
+        raxReadBegin(r);
+        for (int j = 0; j < 100; j++) {
+            seed = seed*1103515245+12345;
+            uint32_t i = (seed >> 8) % st->count;
+            size_t keylen = int2key((char*)key,sizeof(key),i,st->keymode);
+            void *data = raxFind(st->t,key,keylen);
+            void *val = (void*)(unsigned long)htHash(key,keylen);
+            if ((data == raxNotFound && i < st->stable) ||
+                (data != raxNotFound && data != val)) errors++;
+            lookups++;
+        }
+        /* Iterate a few keys: they must be in order, with the right
+         * values. */
+        size_t keylen = int2key((char*)key,sizeof(key),seed % st->count,
+                                st->keymode);
+        raxSeek(&iter,">=",key,keylen);
+        for (int j = 0; j < 10 && raxNext(&iter); j++) {
+            if (compareAB(iter.key,iter.key_len,key,keylen) < 0 ||
+                iter.data != (void*)(unsigned long)htHash(iter.key,
+                                                          iter.key_len))
+                errors++;
+            keylen = iter.key_len;
+            memcpy(key,iter.key,keylen);
+        }
+        raxReadEnd(r);
+    }
+    raxStop(&iter);
+    raxReaderRelease(r);
+    __atomic_add_fetch(&st->lookups,lookups,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->errors,errors,__ATOMIC_RELAXED);
+    return NULL;
+}
+
+int concurrentFuzzTest(int keymode, size_t count, int flags) {
+    concurrentFuzzState st;
+    st.t = newTestRax(flags|RAX_FLAG_CONCURRENT);
+    st.keymode = keymode;
+    st.count = count;
+    st.stable = count/2;
+    st.done = 0;
+    st.lookups = 0;
+    st.errors = 0;
+    unsigned char key[1024];
+
+    printf("Concurrent fuzz test in mode %d [%zu]: ", keymode, count);
+    fflush(stdout);
+
+    for (size_t i = 0; i < st.stable; i++) {
+        size_t keylen = int2key((char*)key,sizeof(key),i,keymode);
+        raxInsert(st.t,key,keylen,(void*)(unsigned long)htHash(key,keylen),
+                  NULL);
+    }
+
+    pthread_t readers[4];
+    for (int j = 0; j < 4; j++)
+        pthread_create(&readers[j],NULL,concurrentFuzzReader,&st);
+
+    /* Insert and remove the other keys. */
+    for (size_t j = 0; j < count*20; j++) {
+        uint32_t i = st.stable+rc4rand()%(count-st.stable);
+        size_t keylen = int2key((char*)key,sizeof(key),i,keymode);
+        if (rc4rand() % 2) {
+            raxInsert(st.t,key,keylen,
+                      (void*)(unsigned long)htHash(key,keylen),NULL);
+        } else {
+            raxRemove(st.t,key,keylen,NULL);
+        }
+    }
+    __atomic_store_n(&st.done,1,__ATOMIC_RELEASE);
+    for (int j = 0; j < 4; j++) pthread_join(readers[j],NULL);
+
+    if (st.errors) {
+        printf("Concurrent fuzz: %ld wrong results\n", st.errors);
+        return 1;
+    }
+    if (memoryCheckTree(st.t,"Concurrent fuzz")) return 1;
+
+    /* Remove all the keys: no node must be left. */
+    for (size_t i = 0; i < count; i++) {
+        size_t keylen = int2key((char*)key,sizeof(key),i,keymode);
+        raxRemove(st.t,key,keylen,NULL);
+    }
+    if (raxSize(st.t) != 0 || st.t->numnodes != 1) {
+        printf("Concurrent fuzz: %llu keys and %llu nodes left\n",
+            (unsigned long long)raxSize(st.t),
+            (unsigned long long)st.t->numnodes);
+        return 1;
+    }
+    printf("%ld lookups\n", st.lookups);
+    raxFree(st.t);
+    return 0;
+}
+
 /* Test the random walk function. */
 int randomWalkTest(void) {
     rax *t = raxNew();
@@ -690,37 +1295,3796 @@ int tryInsertUnitTests(void) {
     return 0;
 }
 
-/* Regression test #1: Iterator wrong element returned after seek. */
-int regtest1(void) {
-    rax *rax = raxNew();
-    raxInsert(rax,(unsigned char*)"LKE",3,(void*)(long)1,NULL);
-    raxInsert(rax,(unsigned char*)"TQ",2,(void*)(long)2,NULL);
-    raxInsert(rax,(unsigned char*)"B",1,(void*)(long)3,NULL);
-    raxInsert(rax,(unsigned char*)"FY",2,(void*)(long)4,NULL);
-    raxInsert(rax,(unsigned char*)"WI",2,(void*)(long)5,NULL);
+/* Check that raxFindMany() and raxInsertMany() return the same results
+ * of calling raxFind() and raxInsert() for every key. */
+int manyKeysUnitTests(void) {
+    rax *t = raxNew();
+    unsigned char buf[1000][16];
+    unsigned char *keys[1000];
+    size_t lens[1000];
+    void *vals[1000], *results[1000];
 
-    raxIterator iter;
-    raxStart(&iter,rax);
-    raxSeek(&iter,">",(unsigned char*)"FMP",3);
-    if (raxNext(&iter)) {
-        if (iter.key_len != 2 ||
-            memcmp(iter.key,"FY",2))
-        {
-            printf("Regression test 1 failed: 'FY' expected, got: '%.*s'\n",
-                (int)iter.key_len, (char*)iter.key);
+    /* Use keys that are often prefixes of other keys, including the
+     * empty key, and some duplicated key. */
+    for (int j = 0; j < 1000; j++) {
+        lens[j] = int2key((char*)buf[j],sizeof(buf[j]),j,KEY_RANDOM_SMALL_CSET);
+        keys[j] = buf[j];
+        vals[j] = (void*)(long)j;
+    }
+    size_t inserted = raxInsertMany(t,keys,lens,500,vals);
+    if (inserted != raxSize(t)) {
+        printf("raxInsertMany() returned %zu, but %zu keys were added\n",
+            inserted, (size_t)raxSize(t));
+        return 1;
+    }
+
+    size_t found = raxFindMany(t,keys,lens,1000,results);
+    size_t expected = 0;
+    for (int j = 0; j < 1000; j++) {
+        void *val = raxFind(t,keys[j],lens[j]);
+        if (val != raxNotFound) expected++;
+        if (results[j] != val) {
+            printf("raxFindMany() returned %p instead of %p for %.*s\n",
+                results[j], val, (int)lens[j], (char*)keys[j]);
             return 1;
         }
     }
+    if (found != expected) {
+        printf("raxFindMany() found %zu keys instead of %zu\n",
+            found, expected);
+        return 1;
+    }
 
-    raxStop(&iter);
-    raxFree(rax);
+    /* Keys are inserted with a NULL value when no data is given. */
+    raxInsertMany(t,keys,lens,1000,NULL);
+    raxFindMany(t,keys,lens,1000,results);
+    for (int j = 0; j < 1000; j++) {
+        if (results[j] != NULL) {
+            printf("raxInsertMany() did not set a NULL value for %.*s\n",
+                (int)lens[j], (char*)keys[j]);
+            return 1;
+        }
+    }
+
+    raxFree(t);
     return 0;
 }
 
-/* Regression test #2: Crash when mixing NULL and not NULL values. */
-int regtest2(void) {
-    rax *rt = raxNew();
-    raxInsert(rt,(unsigned char *)"a",1,(void *)100,NULL);
+/* Allocator methods used to check that all the memory of a tree is
+ * obtained via its allocator: the context is a counter of the live
+ * allocations. */
+void *countingMalloc(void *ctx, size_t size) {
+    (*(long*)ctx)++;
+    return malloc(size);
+}
+
+void *countingRealloc(void *ctx, void *ptr, size_t size) {
+    if (ptr == NULL) (*(long*)ctx)++;
+    return realloc(ptr,size);
+}
+
+void countingFree(void *ctx, void *ptr) {
+    if (ptr) (*(long*)ctx)--;
+    free(ptr);
+}
+
+long freedValues = 0;
+void countFreedValue(void *val) {
+    (void)val;
+    freedValues++;
+}
+
+/* Allocators failing on demand, used to test out of memory conditions.
+ * The first one fails while the flag pointed by 'ctx' is set. */
+void *failingMalloc(void *ctx, size_t size) {
+    int *fail = ctx;
+    return *fail ? NULL : malloc(size);
+}
+
+void *failingRealloc(void *ctx, void *ptr, size_t size) {
+    int *fail = ctx;
+    return *fail ? NULL : realloc(ptr,size);
+}
+
+void failingFree(void *ctx, void *ptr) {
+    (void)ctx;
+    free(ptr);
+}
+
+/* This one fails after the number of allocations stored in 'ctx'. */
+void *countdownMalloc(void *ctx, size_t size) {
+    long *left = ctx;
+    if (*left == 0) return NULL;
+    (*left)--;
+    return malloc(size);
+}
+
+void *countdownRealloc(void *ctx, void *ptr, size_t size) {
+    long *left = ctx;
+    if (*left == 0) return NULL;
+    (*left)--;
+    return realloc(ptr,size);
+}
+
+int allocatorUnitTests(void) {
+    long live = 0;
+    raxAllocator alloc = {countingMalloc, countingRealloc, countingFree,
+                          NULL, &live};
+    rax *t = raxNewWithAllocator(&alloc,0);
+    rax *arena = raxNewWithArena(0);
+
+    for (int j = 0; j < 10000; j++) {
+        unsigned char key[16];
+        size_t len = int2key((char*)key,sizeof(key),j,KEY_RANDOM);
+        raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+        raxInsert(arena,key,len,(void*)(long)(j+1),NULL);
+        if (j % 3 == 0) {
+            len = int2key((char*)key,sizeof(key),j,KEY_RANDOM);
+            raxRemove(t,key,len,NULL);
+            raxRemove(arena,key,len,NULL);
+        }
+    }
+
+    /* One allocation for every node, plus the rax structure itself. */
+    if (live != (long)t->numnodes+1) {
+        printf("%ld live allocations, but the tree has %llu nodes\n",
+            live, (unsigned long long)t->numnodes);
+        return 1;
+    }
+
+    /* The arena tree must have exactly the same content. */
+    raxIterator a, b;
+    raxStart(&a,t);
+    raxStart(&b,arena);
+    raxSeek(&a,"^",NULL,0);
+    raxSeek(&b,"^",NULL,0);
+    while(1) {
+        int ra = raxNext(&a), rb = raxNext(&b);
+        if (ra != rb || (ra && (a.key_len != b.key_len ||
+            memcmp(a.key,b.key,a.key_len) || a.data != b.data)))
+        {
+            printf("Arena tree content does not match\n");
+            return 1;
+        }
+        if (!ra) break;
+    }
+    raxStop(&a);
+    raxStop(&b);
+
+    raxFree(t);
+    if (live != 0) {
+        printf("%ld allocations not freed by raxFree()\n", live);
+        return 1;
+    }
+
+    /* Arena trees don't free the nodes, but must still call the callback
+     * for every value. */
+    uint64_t numele = raxSize(arena);
+    raxFreeWithCallback(arena,countFreedValue);
+    if (freedValues != (long)numele) {
+        printf("%ld values freed instead of %llu\n",
+            freedValues, (unsigned long long)numele);
+        return 1;
+    }
+    return 0;
+}
+
+/* Check inline values in nodes of every kind, and the conversion between
+ * inline and pointer values. */
+int inlineUnitTests(void) {
+    rax *t = raxNew();
+    unsigned char big[200];
+    size_t vlen;
+    for (int j = 0; j < 200; j++) big[j] = j;
+
+    raxInsertInline(t,(unsigned char*)"foo",3,"bar",3);
+    raxInsertInline(t,(unsigned char*)"foobar",6,big,sizeof(big));
+    raxInsert(t,(unsigned char*)"fo",2,(void*)(long)5,NULL);
+    raxInsertInline(t,(unsigned char*)"foozap",6,"",0);
+
+    unsigned char *v = raxFindInline(t,(unsigned char*)"foo",3,&vlen);
+    if (v == raxNotFound || vlen != 3 || memcmp(v,"bar",3)) {
+        printf("Inline value of foo not found\n");
+        return 1;
+    }
+    v = raxFindInline(t,(unsigned char*)"foozap",6,&vlen);
+    if (v == raxNotFound || vlen != 0) {
+        printf("Empty inline value of foozap not found\n");
+        return 1;
+    }
+
+    /* Turn "foo" into a pointer value, then again into an inline one,
+     * and check that the other keys are not affected. */
+    raxInsert(t,(unsigned char*)"foo",3,(void*)(long)7,NULL);
+    if (raxFind(t,(unsigned char*)"foo",3) != (void*)(long)7 ||
+        raxFindInline(t,(unsigned char*)"foo",3,&vlen) != raxNotFound)
+    {
+        printf("Inline value of foo not replaced by a pointer\n");
+        return 1;
+    }
+    raxInsertInline(t,(unsigned char*)"foo",3,big,100);
+    raxRemove(t,(unsigned char*)"fo",2,NULL);
+    v = raxFindInline(t,(unsigned char*)"foo",3,&vlen);
+    if (v == raxNotFound || vlen != 100 || memcmp(v,big,100)) {
+        printf("Inline value of foo not updated\n");
+        return 1;
+    }
+    v = raxFindInline(t,(unsigned char*)"foobar",6,&vlen);
+    if (v == raxNotFound || vlen != sizeof(big) || memcmp(v,big,vlen)) {
+        printf("Inline value of foobar corrupted\n");
+        return 1;
+    }
+
+    /* Split the compressed node holding an inline value. */
+    raxInsert(t,(unsigned char*)"fooba",5,NULL,NULL);
+    raxInsert(t,(unsigned char*)"foobaz",6,NULL,NULL);
+    v = raxFindInline(t,(unsigned char*)"foobar",6,&vlen);
+    if (v == raxNotFound || vlen != sizeof(big) || memcmp(v,big,vlen)) {
+        printf("Inline value of foobar corrupted after split\n");
+        return 1;
+    }
+
+    /* Overwrite pointer values with values needing less space: the old
+     * value must be read before the node is shrunk. */
+    void *old = NULL;
+    raxInsert(t,(unsigned char*)"bar",3,(void*)(long)9,NULL);
+    raxInsert(t,(unsigned char*)"bar",3,NULL,&old);
+    if (old != (void*)(long)9 || raxFind(t,(unsigned char*)"bar",3) != NULL) {
+        printf("Old value of bar lost when overwritten by NULL\n");
+        return 1;
+    }
+    raxInsert(t,(unsigned char*)"bar",3,(void*)(long)10,NULL);
+    raxInsertInline(t,(unsigned char*)"bar",3,"x",1);
+    raxInsert(t,(unsigned char*)"bar",3,NULL,&old);
+    if (old != NULL) {
+        printf("Inline value of bar returned as a pointer\n");
+        return 1;
+    }
+    raxFree(t);
+    return 0;
+}
+
+int rankUnitTests(void) {
+    rax *t = raxNewWithFlags(RAX_FLAG_RANK);
+    char *toadd[] = {"alligator","alien","baloon","chromodynamic","romane","romanus","romulus","rubens","ruber","rubicon","rubicundus","all","rub","ba",NULL};
+    char *sorted[] = {"alien","all","alligator","ba","baloon","chromodynamic","romane","romanus","romulus","rub","rubens","ruber","rubicon","rubicundus",NULL};
+
+    long numele;
+    for (numele = 0; toadd[numele] != NULL; numele++) {
+        raxInsert(t,(unsigned char*)toadd[numele],
+                    strlen(toadd[numele]),(void*)numele,NULL);
+    }
+
+    raxIterator iter;
+    raxStart(&iter,t);
+    for (long i = 0; i < numele; i++) {
+        uint64_t rank = raxRank(t,(unsigned char*)sorted[i],strlen(sorted[i]));
+        if (rank != (uint64_t)i) {
+            printf("Rank of %s is %llu instead of %ld\n", sorted[i],
+                (unsigned long long)rank, i);
+            return 1;
+        }
+        raxSelect(&iter,i);
+        if (!raxNext(&iter) || iter.key_len != strlen(sorted[i]) ||
+            memcmp(iter.key,sorted[i],iter.key_len))
+        {
+            printf("Select of rank %ld did not return %s\n", i, sorted[i]);
+            return 1;
+        }
+    }
+
+    /* Keys that are not in the tree. */
+    struct {
+        char *key;
+        uint64_t rank;
+    } missing[] = {
+        {"",0}, {"a",0}, {"alf",0}, {"allz",3}, {"b",3}, {"bb",5},
+        {"rom",6}, {"romanz",8}, {"rubz",14}, {"z",14}, {NULL,0}
+    };
+    for (int i = 0; missing[i].key != NULL; i++) {
+        uint64_t rank = raxRank(t,(unsigned char*)missing[i].key,
+                                strlen(missing[i].key));
+        if (rank != missing[i].rank) {
+            printf("Rank of missing key %s is %llu instead of %llu\n",
+                missing[i].key, (unsigned long long)rank,
+                (unsigned long long)missing[i].rank);
+            return 1;
+        }
+    }
+
+    /* After a selection, the iteration continues in both directions. */
+    raxSelect(&iter,5);
+    raxNext(&iter);
+    raxNext(&iter);
+    if (iter.key_len != 6 || memcmp(iter.key,"romane",6)) {
+        printf("Iteration after select returned the wrong key\n");
+        return 1;
+    }
+
+    /* The random walk must be uniform: sample every element about 1000
+     * times. */
+    long hits[14] = {0};
+    for (long i = 0; i < numele*1000; i++) {
+        raxRandomWalk(&iter,0);
+        long idx = (long)raxRank(t,iter.key,iter.key_len);
+        if (raxFind(t,iter.key,iter.key_len) != (void*)iter.data) {
+            printf("Uniform random walk returned a wrong element\n");
+            return 1;
+        }
+        hits[idx]++;
+    }
+    for (long i = 0; i < numele; i++) {
+        if (hits[i] < 800 || hits[i] > 1200) {
+            printf("Uniform random walk reported %s %ld times\n",
+                sorted[i], hits[i]);
+            return 1;
+        }
+    }
+
+    /* Trees without the rank flag don't support ranks. */
+    rax *r = raxNew();
+    errno = 0;
+    if (raxRank(r,(unsigned char*)"foo",3) != 0 || errno != EINVAL) {
+        printf("raxRank() should fail without RAX_FLAG_RANK\n");
+        return 1;
+    }
+    raxFree(r);
+    raxStop(&iter);
+    raxFree(t);
+    return 0;
+}
+
+int bulkLoadUnitTests(void) {
+    char *sorted[] = {"","alien","all","alligator","ba","baloon","chromodynamic","romane","romanus","romulus","rub","rubens","ruber","rubicon","rubicundus"};
+    size_t count = sizeof(sorted)/sizeof(sorted[0]);
+    arrayItem items[sizeof(sorted)/sizeof(sorted[0])];
+    for (size_t j = 0; j < count; j++) {
+        items[j].key = (unsigned char*)sorted[j];
+        items[j].key_len = strlen(sorted[j]);
+    }
+
+    rax *t = raxNewWithFlags(RAX_FLAG_RANK);
+    bulkLoadArray ba = {items,count,0};
+    if (!raxBulkLoad(t,bulkLoadNext,&ba) || raxSize(t) != count) {
+        printf("raxBulkLoad() failed\n");
+        return 1;
+    }
+    for (size_t j = 0; j < count; j++) {
+        if (raxFind(t,items[j].key,items[j].key_len) != (void*)j ||
+            raxRank(t,items[j].key,items[j].key_len) != j)
+        {
+            printf("Bulk loaded key %s not found\n", sorted[j]);
+            return 1;
+        }
+    }
+
+    /* Loading into a non empty tree is not allowed. */
+    ba.next = 0;
+    errno = 0;
+    if (raxBulkLoad(t,bulkLoadNext,&ba) || errno != EINVAL) {
+        printf("raxBulkLoad() into a non empty tree did not fail\n");
+        return 1;
+    }
+    raxFree(t);
+
+    /* Keys out of order or repeated. */
+    arrayItem bad[3] = {{(unsigned char*)"foo",3},{(unsigned char*)"foobar",6},
+                        {(unsigned char*)"fo",2}};
+    for (int j = 0; j < 2; j++) {
+        if (j == 1) bad[2] = bad[1];
+        t = raxNew();
+        ba = (bulkLoadArray){bad,3,0};
+        errno = 0;
+        if (raxBulkLoad(t,bulkLoadNext,&ba) || errno != EINVAL ||
+            raxSize(t) != 0 || t->numnodes != 1)
+        {
+            printf("raxBulkLoad() did not fail with keys out of order\n");
+            return 1;
+        }
+        raxFree(t);
+    }
+
+    /* Out of memory at any point leaves the tree empty. */
+    for (long fail = 1; ; fail++) {
+        long left = -1;
+        raxAllocator alloc = {countdownMalloc,countdownRealloc,failingFree,
+                              NULL,&left};
+        t = raxNewWithAllocator(&alloc,0);
+        left = fail;
+        ba = (bulkLoadArray){items,count,0};
+        int retval = raxBulkLoad(t,bulkLoadNext,&ba);
+        left = -1;
+        if (retval) {
+            if (raxSize(t) != count) {
+                printf("raxBulkLoad() loaded %llu keys\n",
+                    (unsigned long long)raxSize(t));
+                return 1;
+            }
+            raxFree(t);
+            break;
+        }
+        if (errno != ENOMEM || raxSize(t) != 0 || t->numnodes != 1) {
+            printf("raxBulkLoad() OOM left the tree in a bad state\n");
+            return 1;
+        }
+        raxFree(t);
+    }
+    return 0;
+}
+
+int frozenUnitTests(void) {
+    char *toadd[] = {"alligator","alien","baloon","chromodynamic","romane","romanus","romulus","rubens","ruber","rubicon","rubicundus","all","rub","ba",NULL};
+    rax *t = raxNewWithFlags(RAX_FLAG_RANK);
+    long numele;
+    for (numele = 0; toadd[numele] != NULL; numele++) {
+        raxInsert(t,(unsigned char*)toadd[numele],strlen(toadd[numele]),
+                  (void*)(numele+1),NULL);
+    }
+    raxInsertInline(t,(unsigned char*)"inline",6,"value",5);
+
+    /* Write the image into a file and map it in memory. */
+    unsigned long valbuf;
+    size_t len;
+    unsigned char *image = raxSerialize(t,frozenValueCallback,&valbuf,&len);
+    char *path = "rax-test-image.tmp";
+    int fd = open(path,O_RDWR|O_CREAT|O_TRUNC,0600);
+    if (image == NULL || fd == -1 || write(fd,image,len) != (ssize_t)len) {
+        printf("Can't write the tree image\n");
+        return 1;
+    }
+    unlink(path);
+    free(image);
+    void *map = mmap(NULL,len,PROT_READ,MAP_SHARED,fd,0);
+    if (map == MAP_FAILED) {
+        printf("Can't map the tree image\n");
+        return 1;
+    }
+
+    raxFrozen f;
+    if (!raxFrozenOpen(&f,map,len) || raxMemoryUsage(&f.rt) != len) {
+        printf("raxFrozenOpen() failed\n");
+        return 1;
+    }
+    for (long j = 0; j < numele; j++) {
+        unsigned char *key = (unsigned char*)toadd[j];
+        void *data = raxFrozenFind(&f,key,strlen(toadd[j]));
+        size_t vlen = 0;
+        if ((j+1) % 3 == 0)
+            data = raxFrozenFindInline(&f,key,strlen(toadd[j]),&vlen);
+        if (!frozenSameValue((void*)(j+1),0,data,vlen)) {
+            printf("Frozen key %s not found\n", toadd[j]);
+            return 1;
+        }
+    }
+    size_t vlen;
+    unsigned char *val = raxFrozenFindInline(&f,(unsigned char*)"inline",6,
+                                             &vlen);
+    if (val == raxNotFound || vlen != 5 || memcmp(val,"value",5) ||
+        raxFrozenFind(&f,(unsigned char*)"romanu",6) != raxNotFound)
+    {
+        printf("Wrong frozen lookup\n");
+        return 1;
+    }
+
+    raxIterator iter;
+    raxFrozenStart(&iter,&f);
+    raxSeek(&iter,">",(unsigned char*)"rom",3);
+    if (!raxNext(&iter) || iter.key_len != 6 ||
+        memcmp(iter.key,"romane",6) || !raxPrev(&iter) ||
+        iter.key_len != 6 || memcmp(iter.key,"inline",6))
+    {
+        printf("Wrong frozen iteration\n");
+        return 1;
+    }
+    raxSelect(&iter,0);
+    if (!raxNext(&iter) || iter.key_len != 5 || memcmp(iter.key,"alien",5)) {
+        printf("Wrong frozen select\n");
+        return 1;
+    }
+    raxStop(&iter);
+
+    /* Images with a bad header, truncated or misaligned are rejected. */
+    unsigned char *copy = malloc(len+sizeof(void*));
+    memcpy(copy,map,len);
+    copy[0] = 'X';
+    errno = 0;
+    if (raxFrozenOpen(&f,copy,len) || errno != EINVAL ||
+        raxFrozenOpen(&f,map,len-1) || errno != EINVAL)
+    {
+        printf("raxFrozenOpen() accepted a bad image\n");
+        return 1;
+    }
+    memcpy(copy+1,map,len);
+    if (raxFrozenOpen(&f,copy+1,len) || errno != EINVAL) {
+        printf("raxFrozenOpen() accepted a misaligned image\n");
+        return 1;
+    }
+    free(copy);
+    munmap(map,len);
+    close(fd);
+
+    /* Compact images are smaller, and work the same way. */
+    size_t clen;
+    unsigned char *cimage = raxSerializeCompact(t,frozenValueCallback,
+                                                &valbuf,&clen);
+    if (cimage == NULL || !raxFrozenOpen(&f,cimage,clen) ||
+        (sizeof(void*) == 8 && clen >= len))
+    {
+        printf("raxSerializeCompact() failed: %zu bytes, %zu normal\n",
+            clen, len);
+        return 1;
+    }
+    for (long j = 0; j < numele; j++) {
+        unsigned char *key = (unsigned char*)toadd[j];
+        void *data = raxFrozenFind(&f,key,strlen(toadd[j]));
+        size_t vlen = 0;
+        if ((j+1) % 3 == 0)
+            data = raxFrozenFindInline(&f,key,strlen(toadd[j]),&vlen);
+        if (!frozenSameValue((void*)(j+1),0,data,vlen)) {
+            printf("Compact frozen key %s not found\n", toadd[j]);
+            return 1;
+        }
+    }
+    raxFrozenStart(&iter,&f);
+    raxSeek(&iter,"$",NULL,0);
+    if (!raxPrev(&iter) || iter.key_len != 10 ||
+        memcmp(iter.key,"rubicundus",10))
+    {
+        printf("Wrong compact frozen iteration\n");
+        return 1;
+    }
+    raxSelect(&iter,numele);
+    if (!raxNext(&iter) || iter.key_len != 10 ||
+        memcmp(iter.key,"rubicundus",10) || raxNext(&iter))
+    {
+        printf("Wrong compact frozen select\n");
+        return 1;
+    }
+    raxStop(&iter);
+    free(cimage);
+    raxFree(t);
+    return 0;
+}
+
+int concurrentUnitTests(void) {
+    char *toadd[] = {"alligator","alien","baloon","chromodynamic","romane","romanus","romulus","rubens","ruber","rubicon","rubicundus","all","rub","ba",NULL};
+    long live = 0;
+    raxAllocator alloc = {countingMalloc,countingRealloc,countingFree,NULL,
+                          &live};
+    rax *t = raxNewWithAllocator(&alloc,RAX_FLAG_CONCURRENT);
+    long numele;
+    for (numele = 0; toadd[numele] != NULL; numele++) {
+        raxInsert(t,(unsigned char*)toadd[numele],strlen(toadd[numele]),
+                  (void*)(numele+1),NULL);
+    }
+
+    rax *plain = raxNew();
+    errno = 0;
+    if (raxReaderNew(plain) != NULL || errno != EINVAL) {
+        printf("raxReaderNew() accepted a non concurrent tree\n");
+        return 1;
+    }
+    raxFree(plain);
+
+    /* A reader in a read section keeps seeing the tree as it was when its
+     * iterator was seeked, while the tree is modified. */
+    raxReader *r = raxReaderNew(t);
+    raxReadBegin(r);
+    raxIterator iter;
+    raxStart(&iter,t);
+    raxSeek(&iter,"^",NULL,0);
+    for (long j = 0; j < numele; j++)
+        raxRemove(t,(unsigned char*)toadd[j],strlen(toadd[j]),NULL);
+    raxInsert(t,(unsigned char*)"foo",3,NULL,NULL);
+    long seen = 0;
+    while(raxNext(&iter)) {
+        long j = (long)iter.data-1;
+        if (j < 0 || j >= numele || strlen(toadd[j]) != iter.key_len ||
+            memcmp(toadd[j],iter.key,iter.key_len))
+        {
+            printf("Wrong key seen by a concurrent reader\n");
+            return 1;
+        }
+        seen++;
+    }
+    raxStop(&iter);
+    if (seen != numele || raxSize(t) != 1 ||
+        raxFind(t,(unsigned char*)"foo",3) != NULL ||
+        raxFind(t,(unsigned char*)"ba",2) != raxNotFound)
+    {
+        printf("Wrong concurrent tree content\n");
+        return 1;
+    }
+
+    /* The old nodes are freed once there are no readers left that could
+     * access them. */
+    if (live == (long)t->numnodes+1) {
+        printf("Nodes freed while a reader could access them\n");
+        return 1;
+    }
+    raxReadEnd(r);
+    raxInsert(t,(unsigned char*)"bar",3,NULL,NULL);
+    if (live != (long)t->numnodes+1) {
+        printf("Retired nodes not freed: %ld allocations for %llu nodes\n",
+            live, (unsigned long long)t->numnodes);
+        return 1;
+    }
+
+    /* Released readers are reused. */
+    raxReaderRelease(r);
+    if (raxReaderNew(t) != r) {
+        printf("Released reader not reused\n");
+        return 1;
+    }
+    raxFree(t);
+    if (live != 0) {
+        printf("Concurrent tree leaked %ld allocations\n", live);
+        return 1;
+    }
+
+    /* On out of memory the tree is not modified. */
+    int fail = 0;
+    raxAllocator failing = {failingMalloc,failingRealloc,failingFree,NULL,
+                            &fail};
+    t = raxNewWithAllocator(&failing,RAX_FLAG_CONCURRENT|RAX_FLAG_RANK);
+    raxInsert(t,(unsigned char*)"foo",3,(void*)1,NULL);
+    fail = 1;
+    errno = 0;
+    if (raxInsert(t,(unsigned char*)"foobar",6,NULL,NULL) ||
+        errno != ENOMEM || raxRemove(t,(unsigned char*)"foo",3,NULL) ||
+        raxSize(t) != 1 || raxFind(t,(unsigned char*)"foo",3) != (void*)1)
+    {
+        printf("Concurrent tree modified on out of memory\n");
+        return 1;
+    }
+    fail = 0;
+    raxFree(t);
+    return 0;
+}
+
+int forkUnitTests(void) {
+    long live = 0;
+    raxAllocator alloc = {countingMalloc,countingRealloc,countingFree,NULL,
+                          &live};
+    rax *t = raxNewWithAllocator(&alloc,RAX_FLAG_RANK);
+    unsigned char key[16];
+    size_t len;
+
+    for (int j = 0; j < 1000; j++) {
+        len = int2key((char*)key,sizeof(key),j,KEY_INT);
+        raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+    }
+
+    /* Forking just allocates the new tree structure, and the two trees are
+     * modified independently. */
+    long before = live;
+    rax *f = raxFork(t);
+    if (f == NULL || live != before+1 || raxSize(f) != 1000) {
+        printf("raxFork() failed\n");
+        return 1;
+    }
+    for (int j = 0; j < 1000; j += 2) {
+        len = int2key((char*)key,sizeof(key),j,KEY_INT);
+        raxRemove(f,key,len,NULL);
+    }
+    raxInsert(f,(unsigned char*)"foo",3,(void*)1,NULL);
+    raxInsert(t,(unsigned char*)"bar",3,(void*)2,NULL);
+    if (raxSize(t) != 1001 || raxSize(f) != 501 ||
+        raxFind(t,(unsigned char*)"0",1) != (void*)1 ||
+        raxFind(f,(unsigned char*)"0",1) != raxNotFound ||
+        raxFind(t,(unsigned char*)"foo",3) != raxNotFound ||
+        raxFind(f,(unsigned char*)"bar",3) != raxNotFound ||
+        raxRank(f,(unsigned char*)"999",3) != 499)
+    {
+        printf("Forked trees are not independent\n");
+        return 1;
+    }
+
+    /* Values are freed only with the last tree. Once the other trees are
+     * freed, nodes are no longer tracked as shared. */
+    freedValues = 0;
+    raxFreeWithCallback(t,countFreedValue);
+    if (freedValues != 0) {
+        printf("Values freed while shared with forked trees\n");
+        return 1;
+    }
+    raxInsert(f,(unsigned char*)"foobar",6,(void*)3,NULL);
+    if (f->shared != NULL || raxFind(f,(unsigned char*)"1",1) != (void*)2) {
+        printf("Wrong forked tree after freeing the original\n");
+        return 1;
+    }
+    raxFreeWithCallback(f,countFreedValue);
+    if (freedValues != 502 || live != 0) {
+        printf("Forked trees freed %ld values, leaked %ld allocations\n",
+            freedValues, live);
+        return 1;
+    }
+
+    /* Trees whose memory is released at once can't be forked. */
+    rax *arena = raxNewWithArena(0);
+    errno = 0;
+    if (raxFork(arena) != NULL || errno != EINVAL) {
+        printf("raxFork() accepted an arena tree\n");
+        return 1;
+    }
+    raxFree(arena);
+
+    /* On out of memory the trees are not modified. */
+    int fail = 0;
+    raxAllocator failing = {failingMalloc,failingRealloc,failingFree,NULL,
+                            &fail};
+    t = raxNewWithAllocator(&failing,0);
+    raxInsert(t,(unsigned char*)"foo",3,(void*)1,NULL);
+    raxInsert(t,(unsigned char*)"foobar",6,(void*)2,NULL);
+    f = raxFork(t);
+    fail = 1;
+    errno = 0;
+    if (raxInsert(f,(unsigned char*)"fo",2,NULL,NULL) || errno != ENOMEM ||
+        raxRemove(t,(unsigned char*)"foo",3,NULL) || raxSize(t) != 2 ||
+        raxSize(f) != 2 || raxFind(f,(unsigned char*)"fo",2) != raxNotFound ||
+        raxFind(t,(unsigned char*)"foo",3) != (void*)1)
+    {
+        printf("Forked trees modified on out of memory\n");
+        return 1;
+    }
+    fail = 0;
+    raxFree(t);
+    raxFree(f);
+    return 0;
+}
+
+/* Fork fuzz test: a few trees forked from each other are modified at
+ * random, checking that every tree always holds its own content. Keys are
+ * identified by their index, so for every tree we just remember the value
+ * of every key, or zero if the key is missing. */
+#define FORK_TREES 4
+int forkCheckTree(rax *t, unsigned long *vals, unsigned char **keys, size_t *lens, size_t count) {
+    uint64_t numele = 0;
+    for (size_t i = 0; i < count; i++) {
+        void *data = raxFind(t,keys[i],lens[i]);
+        if ((vals[i] == 0 && data != raxNotFound) ||
+            (vals[i] != 0 && data != (void*)vals[i]))
+        {
+            printf("Fork fuzz: wrong value for key %.*s\n",
+                (int)lens[i],(char*)keys[i]);
+            return 1;
+        }
+        if (vals[i]) numele++;
+    }
+
+    /* Iterate the tree: keys must be in order, and in trees with subtree
+     * counts their rank must match. */
+    raxIterator iter;
+    raxStart(&iter,t);
+    raxSeek(&iter,"^",NULL,0);
+    unsigned char prev[1024];
+    size_t prevlen = 0;
+    uint64_t seen = 0;
+    while(raxNext(&iter)) {
+        if ((seen && compareAB(prev,prevlen,iter.key,iter.key_len) >= 0) ||
+            ((t->flags & RAX_FLAG_RANK) &&
+             raxRank(t,iter.key,iter.key_len) != seen))
+        {
+            printf("Fork fuzz: wrong iteration order or rank\n");
+            return 1;
+        }
+        memcpy(prev,iter.key,iter.key_len);
+        prevlen = iter.key_len;
+        seen++;
+    }
+    raxStop(&iter);
+    if (seen != numele || raxSize(t) != numele) {
+        printf("Fork fuzz: %llu keys iterated, %llu expected\n",
+            (unsigned long long)seen, (unsigned long long)numele);
+        return 1;
+    }
+    return memoryCheckTree(t,"Fork fuzz");
+}
+
+int forkFuzzTest(int keymode, size_t count, int flags) {
+    long live = 0;
+    raxAllocator alloc = {countingMalloc,countingRealloc,countingFree,NULL,
+                          &live};
+    rax *trees[FORK_TREES] = {NULL};
+    unsigned long *vals = calloc(FORK_TREES*count,sizeof(*vals));
+    unsigned char **keys = malloc(sizeof(*keys)*count);
+    size_t *lens = malloc(sizeof(*lens)*count);
+    unsigned char buf[1024];
+
+    printf("Fork fuzz test in mode %d [%zu]", keymode, count);
+    if (flags) printf(" flags %d", flags);
+    printf(": ");
+    fflush(stdout);
+
+    for (size_t i = 0; i < count; i++) {
+        lens[i] = int2key((char*)buf,sizeof(buf),i,keymode);
+        keys[i] = malloc(lens[i]);
+        memcpy(keys[i],buf,lens[i]);
+    }
+
+    trees[0] = raxNewWithAllocator(&alloc,flags);
+    long forks = 0;
+    for (size_t j = 0; j < count*20; j++) {
+        int t = rc4rand() % FORK_TREES;
+        unsigned long *v = vals+t*count;
+        int r = rc4rand() % 1000;
+        if (r < 5) {
+            /* Replace a tree with a fork of another one. */
+            int src = rc4rand() % FORK_TREES;
+            if (src == t || trees[src] == NULL) continue;
+            if (trees[t]) raxFree(trees[t]);
+            trees[t] = raxFork(trees[src]);
+            memcpy(v,vals+src*count,sizeof(*v)*count);
+            forks++;
+        } else if (r < 7) {
+            /* Free a tree, unless it is the last one. */
+            int alive = 0;
+            for (int k = 0; k < FORK_TREES; k++) alive += trees[k] != NULL;
+            if (alive == 1 || trees[t] == NULL) continue;
+            raxFree(trees[t]);
+            trees[t] = NULL;
+        } else if (trees[t]) {
+            size_t i = rc4rand() % count;
+            if (r < 600) {
+                unsigned long val = rc4rand() | 1;
+                if (raxInsert(trees[t],keys[i],lens[i],(void*)val,NULL) !=
+                    (v[i] == 0))
+                {
+                    printf("Fork fuzz: wrong insert return value\n");
+                    return 1;
+                }
+                v[i] = val;
+            } else {
+                if (raxRemove(trees[t],keys[i],lens[i],NULL) != (v[i] != 0)) {
+                    printf("Fork fuzz: wrong remove return value\n");
+                    return 1;
+                }
+                v[i] = 0;
+            }
+        }
+    }
+
+    for (int t = 0; t < FORK_TREES; t++) {
+        if (trees[t] && forkCheckTree(trees[t],vals+t*count,keys,lens,count))
+            return 1;
+    }
+    for (int t = 0; t < FORK_TREES; t++) if (trees[t]) raxFree(trees[t]);
+    if (live != 0) {
+        printf("Fork fuzz: %ld allocations leaked\n", live);
+        return 1;
+    }
+    printf("%ld forks\n", forks);
+
+    for (size_t i = 0; i < count; i++) free(keys[i]);
+    free(keys);
+    free(lens);
+    free(vals);
+    return 0;
+}
+
+int rangeUnitTests(void) {
+    char *toadd[] = {"alligator","alien","baloon","chromodynamic","romane","romanus","romulus","rubens","ruber","rubicon","rubicundus","all","rub","ba",NULL};
+    rax *t = raxNewWithFlags(RAX_FLAG_RANK);
+    for (int j = 0; toadd[j]; j++)
+        raxInsert(t,(unsigned char*)toadd[j],strlen(toadd[j]),NULL,NULL);
+
+    /* Prefixes matching inside compressed nodes, and whole nodes. */
+    if (raxRemovePrefix(t,(unsigned char*)"romu",4,NULL) != 1 ||
+        raxRemovePrefix(t,(unsigned char*)"rub",3,NULL) != 5 ||
+        raxRemovePrefix(t,(unsigned char*)"x",1,NULL) != 0 ||
+        raxSize(t) != 8 || raxFind(t,(unsigned char*)"romane",6) != NULL ||
+        raxFind(t,(unsigned char*)"rub",3) != raxNotFound)
+    {
+        printf("raxRemovePrefix() failed\n");
+        return 1;
+    }
+
+    /* Ranges: the end is excluded, and empty ranges remove nothing. */
+    if (raxRemoveRange(t,(unsigned char*)"all",3,(unsigned char*)"ba",2,
+                       NULL) != 2 ||
+        raxRemoveRange(t,(unsigned char*)"z",1,(unsigned char*)"a",1,NULL) ||
+        raxSize(t) != 6 || raxFind(t,(unsigned char*)"alien",5) != NULL ||
+        raxFind(t,(unsigned char*)"all",3) != raxNotFound ||
+        raxRank(t,(unsigned char*)"romanus",7) != 5)
+    {
+        printf("raxRemoveRange() failed\n");
+        return 1;
+    }
+
+    /* Detach the "rom" subtree, then everything. */
+    rax *d = raxDetachPrefix(t,(unsigned char*)"rom",3);
+    if (d == NULL || raxSize(d) != 2 || raxSize(t) != 4 ||
+        raxFind(d,(unsigned char*)"romanus",7) != NULL ||
+        raxFind(t,(unsigned char*)"romanus",7) != raxNotFound ||
+        raxRank(d,(unsigned char*)"romanus",7) != 1)
+    {
+        printf("raxDetachPrefix() failed\n");
+        return 1;
+    }
+    raxFree(d);
+    d = raxDetachPrefix(t,NULL,0);
+    if (d == NULL || raxSize(d) != 4 || raxSize(t) != 0 ||
+        t->numnodes != 1 || raxFind(d,(unsigned char*)"ba",2) != NULL)
+    {
+        printf("raxDetachPrefix() of the whole tree failed\n");
+        return 1;
+    }
+    raxFree(d);
+
+    /* Concurrent trees remove the keys one by one. */
+    rax *c = raxNewWithFlags(RAX_FLAG_CONCURRENT);
+    for (int j = 0; toadd[j]; j++)
+        raxInsert(c,(unsigned char*)toadd[j],strlen(toadd[j]),NULL,NULL);
+    errno = 0;
+    if (raxRemoveRange(c,(unsigned char*)"b",1,NULL,0,NULL) != 11 ||
+        raxSize(c) != 3 || raxDetachPrefix(c,NULL,0) != NULL ||
+        errno != EINVAL)
+    {
+        printf("Range deletion failed in a concurrent tree\n");
+        return 1;
+    }
+    raxFree(c);
+    raxFree(t);
+    return 0;
+}
+
+/* Thread freeing the tree of a raxFreeAsync() job. */
+void *freeAsyncThread(void *job) {
+    raxFreeStep(job,0);
+    return NULL;
+}
+
+int freeUnitTests(void) {
+    long live = 0;
+    raxAllocator alloc = {countingMalloc,countingRealloc,countingFree,NULL,
+                          &live};
+    rax *t = raxNewWithAllocator(&alloc,0);
+    unsigned char key[5001];
+
+    /* A deep tree, with a node with two children for every byte of the
+     * longest key, is freed one node at a time. */
+    memset(key,'a',sizeof(key));
+    for (size_t len = 1; len < sizeof(key); len++) {
+        key[len-1] = 'b';
+        raxInsert(t,key,len,(void*)(long)len,NULL);
+        key[len-1] = 'a';
+    }
+    uint64_t numnodes = t->numnodes, numele = raxSize(t);
+    freedValues = 0;
+    raxFreeJob *job = raxFreeAsync(t,countFreedValue);
+    uint64_t steps = 0;
+    do steps++; while(!raxFreeStep(job,1));
+    if (steps != numnodes || freedValues != (long)numele || live != 0) {
+        printf("raxFreeStep(): %llu steps for %llu nodes, %ld values freed, "
+               "%ld allocations left\n", (unsigned long long)steps,
+               (unsigned long long)numnodes, freedValues, live);
+        return 1;
+    }
+
+    /* Values shared with a fork are freed only with the last tree, even
+     * if it is freed in another thread. */
+    t = raxNewWithAllocator(&alloc,RAX_FLAG_RANK);
+    for (int j = 0; j < 10000; j++) {
+        size_t len = int2key((char*)key,sizeof(key),j,KEY_RANDOM);
+        raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+    }
+    rax *f = raxFork(t);
+    raxRemovePrefix(f,(unsigned char*)"a",1,NULL);
+    numele = raxSize(t);
+    freedValues = 0;
+    job = raxFreeAsync(t,countFreedValue);
+    while(!raxFreeStep(job,100));
+    if (freedValues != 0 || raxSize(f) == 0 ||
+        raxFind(f,(unsigned char*)"a",1) != raxNotFound)
+    {
+        printf("raxFreeAsync() freed the values of a forked tree\n");
+        return 1;
+    }
+    numele = raxSize(f);
+    pthread_t thread;
+    pthread_create(&thread,NULL,freeAsyncThread,
+                   raxFreeAsync(f,countFreedValue));
+    pthread_join(thread,NULL);
+    if (freedValues != (long)numele || live != 0) {
+        printf("raxFreeAsync() in a thread: %ld values freed, %ld "
+               "allocations left\n", freedValues, live);
+        return 1;
+    }
+
+    /* Arena trees just need to call the callback for the values. */
+    t = raxNewWithArena(0);
+    for (int j = 0; j < 1000; j++) {
+        size_t len = int2key((char*)key,sizeof(key),j,KEY_INT);
+        raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+    }
+    freedValues = 0;
+    job = raxFreeAsync(t,countFreedValue);
+    while(!raxFreeStep(job,10));
+    if (freedValues != 1000) {
+        printf("raxFreeAsync(): %ld arena values freed\n", freedValues);
+        return 1;
+    }
+    return 0;
+}
+
+/* Defragmentation callback that does not move the nodes, just counting
+ * them. */
+long defragVisited = 0;
+int defragCount(raxNode **noderef) {
+    (void)noderef;
+    defragVisited++;
+    return 0;
+}
+
+/* Check that 't' contains the keys 0 ... count-1 in the specified mode, and
+ * only them, with their index+1 as value. */
+int defragCheckTree(rax *t, int keymode, int count) {
+    unsigned char key[32];
+    for (int j = 0; j < count; j++) {
+        size_t len = int2key((char*)key,sizeof(key),j,keymode);
+        if (raxFind(t,key,len) != (void*)(long)(j+1)) {
+            printf("Defrag: key %.*s lost\n", (int)len, (char*)key);
+            return 1;
+        }
+    }
+    if (raxSize(t) != (uint64_t)count) {
+        printf("Defrag: %llu keys instead of %d\n",
+            (unsigned long long)raxSize(t), count);
+        return 1;
+    }
+    return 0;
+}
+
+int defragUnitTests(void) {
+    long live = 0;
+    raxAllocator alloc = {countingMalloc,countingRealloc,countingFree,NULL,
+                          &live};
+    rax *t = raxNewWithAllocator(&alloc,RAX_FLAG_RANK|RAX_FLAG_DENSE);
+    unsigned char key[32];
+    for (int j = 0; j < 5000; j++) {
+        size_t len = int2key((char*)key,sizeof(key),j,KEY_UNIQUE_ALPHA);
+        raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+    }
+
+    /* A pass over a tree that is not modified visits every node once. */
+    raxDefragCursor c;
+    raxDefragStart(&c);
+    int calls = 0;
+    defragVisited = 0;
+    while(raxDefragStep(t,&c,10,defragCount)) calls++;
+    if (errno != 0 || defragVisited != (long)t->numnodes ||
+        calls != (int)((t->numnodes-1)/10))
+    {
+        printf("Defrag: %ld nodes visited instead of %llu, %d calls\n",
+            defragVisited, (unsigned long long)t->numnodes, calls);
+        return 1;
+    }
+
+    /* Move all the nodes while the tree is modified between the steps. */
+    long before = live;
+    int count = 5000;
+    size_t len;
+    while(raxDefragStep(t,&c,7,NULL)) {
+        len = int2key((char*)key,sizeof(key),count,KEY_UNIQUE_ALPHA);
+        raxInsert(t,key,len,(void*)(long)(count+1),NULL);
+        count++;
+        int j = rc4rand() % count;
+        len = int2key((char*)key,sizeof(key),j,KEY_UNIQUE_ALPHA);
+        raxRemove(t,key,len,NULL);
+        raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+    }
+    if (defragCheckTree(t,KEY_UNIQUE_ALPHA,count)) return 1;
+    if (live != (long)t->numnodes+1 || live < before) {
+        printf("Defrag: %ld allocations for %llu nodes\n",
+            live, (unsigned long long)t->numnodes);
+        return 1;
+    }
+
+    /* Nodes shared with a fork are not visited. */
+    rax *f = raxFork(t);
+    len = int2key((char*)key,sizeof(key),0,KEY_UNIQUE_ALPHA);
+    raxRemove(t,key,len,NULL);
+    defragVisited = 0;
+    while(raxDefragStep(t,&c,0,defragCount));
+    if (defragVisited == 0 || defragVisited >= (long)t->numnodes) {
+        printf("Defrag: %ld nodes of a forked tree visited\n",
+               defragVisited);
+        return 1;
+    }
+    while(raxDefragStep(t,&c,100,NULL));
+    if (defragCheckTree(f,KEY_UNIQUE_ALPHA,count)) return 1;
+    raxFree(f);
+    raxFree(t);
+    raxDefragStop(&c);
+    if (live != 0) {
+        printf("Defrag: %ld allocations leaked\n", live);
+        return 1;
+    }
+
+    /* Concurrent trees are not supported. */
+    t = raxNewWithFlags(RAX_FLAG_CONCURRENT);
+    if (raxDefragStep(t,&c,0,NULL) != 0 || errno != EINVAL) {
+        printf("Defrag: concurrent tree accepted\n");
+        return 1;
+    }
+    raxFree(t);
+    return 0;
+}
+
+/* State of scanUnitTests(), and the callback collecting the scanned keys:
+ * the keys must be returned in order, each one just once. */
+typedef struct scanState {
+    unsigned char last[32];
+    long last_len;          /* -1 if no key was returned yet. */
+    long stable;            /* Stable keys returned. */
+    int errors;
+} scanState;
+
+void scanCollect(void *privdata, raxIterator *it) {
+    scanState *st = privdata;
+    if (st->last_len != -1 &&
+        compareAB(st->last,st->last_len,it->key,it->key_len) >= 0)
+    {
+        printf("Scan: key %.*s returned after %.*s\n",
+            (int)it->key_len,(char*)it->key,(int)st->last_len,
+            (char*)st->last);
+        st->errors++;
+    }
+    memcpy(st->last,it->key,it->key_len);
+    st->last_len = it->key_len;
+    if (it->key_len && it->key[0] == 's') {
+        if (it->data != (void*)1) st->errors++;
+        st->stable++;
+    }
+}
+
+int scanUnitTests(void) {
+    rax *t = raxNew();
+    scanState st = {{0},-1,0,0};
+    raxScanCursor c;
+    raxScanStart(&c);
+
+    /* Empty tree. */
+    if (raxScan(t,&c,10,scanCollect,&st) != 0 || errno != 0 ||
+        st.last_len != -1)
+    {
+        printf("Scan: keys returned from an empty tree\n");
+        return 1;
+    }
+
+    /* The stable keys are in the tree for the whole scan, while the other
+     * ones are added and removed between the calls. */
+    unsigned char key[32];
+    raxInsert(t,(unsigned char*)"",0,NULL,NULL);
+    for (int j = 0; j < 5000; j++) {
+        key[0] = 's';
+        size_t len = int2key((char*)key+1,sizeof(key)-1,j,KEY_UNIQUE_ALPHA);
+        raxInsert(t,key,len+1,(void*)1,NULL);
+    }
+    int calls = 0, added = 0;
+    while(raxScan(t,&c,13,scanCollect,&st)) {
+        calls++;
+        for (int j = 0; j < 10; j++) {
+            key[0] = 'a'+rc4rand()%26;
+            size_t len = int2key((char*)key+1,sizeof(key)-1,added++,KEY_INT);
+            if (key[0] == 's') continue;
+            if (rc4rand()%2) raxInsert(t,key,len+1,(void*)2,NULL);
+            else raxRemove(t,key,len+1,NULL);
+        }
+    }
+    if (st.errors || st.stable != 5000 || calls < 5000/13) {
+        printf("Scan: %ld stable keys returned in %d calls, %d errors\n",
+            st.stable, calls, st.errors);
+        return 1;
+    }
+
+    /* After a complete scan the cursor restarts, and a zero count returns
+     * all the keys. */
+    st.last_len = -1;
+    st.stable = 0;
+    if (raxScan(t,&c,0,scanCollect,&st) != 0 || st.stable != 5000 ||
+        st.errors)
+    {
+        printf("Scan: full scan returned %ld stable keys\n", st.stable);
+        return 1;
+    }
+    raxScanStop(&c);
+    raxFree(t);
+    return 0;
+}
+
+int statsUnitTests(void) {
+    rax *t = raxNew();
+    raxTreeStats stats;
+
+    /* "foobar" and "footer": "foo" -> [bt], followed by "ar" and "er", each
+     * one leading to a key node without children. */
+    raxInsert(t,(unsigned char*)"foobar",6,NULL,NULL);
+    raxInsert(t,(unsigned char*)"footer",6,NULL,NULL);
+    raxStats(t,&stats);
+    if (stats.nodes != 6 || stats.keys != 2 || stats.compressed != 3 ||
+        stats.branching != 1 || stats.leaves != 2 || stats.dense != 0 ||
+        stats.fanout[0] != 2 || stats.fanout[1] != 3 ||
+        stats.fanout[2] != 1 || stats.comprlen[1] != 3 ||
+        stats.maxdepth != 3 || stats.depth[0] != 1 || stats.depth[1] != 1 ||
+        stats.depth[2] != 2 || stats.depth[3] != 2)
+    {
+        printf("raxStats() reported wrong counts\n");
+        return 1;
+    }
+    if (memoryCheckTree(t,"Stats")) return 1;
+    raxFree(t);
+
+    /* The usage grows with the keys, and returns to the one of an empty
+     * tree once they are removed, in all the kinds of trees. The first byte
+     * of the keys takes all the values, so that the head is a dense node in
+     * dense trees. */
+    int flags[] = {0, RAX_FLAG_DENSE, RAX_FLAG_RANK,
+                   RAX_FLAG_DENSE|RAX_FLAG_RANK};
+    for (int f = 0; f < 4; f++) {
+        t = raxNewWithFlags(flags[f]);
+        uint64_t empty = raxMemoryUsage(t);
+        unsigned char key[32];
+        for (int j = 0; j < 5000; j++) {
+            key[0] = j;
+            size_t len = int2key((char*)key+1,sizeof(key)-1,j,KEY_HEX)+1;
+            if (j % 2) raxInsertInline(t,key,len,key,len);
+            else raxInsert(t,key,len,(void*)(long)j,NULL);
+        }
+        if (raxMemoryUsage(t) <= empty || memoryCheckTree(t,"Stats"))
+            return 1;
+        raxStats(t,&stats);
+        if ((flags[f] & RAX_FLAG_DENSE) && stats.dense == 0) {
+            printf("raxStats(): no dense nodes reported\n");
+            return 1;
+        }
+        rax *d = raxDetachPrefix(t,(unsigned char*)"a",1);
+        if (memoryCheckTree(t,"Stats") || memoryCheckTree(d,"Stats"))
+            return 1;
+        raxFree(d);
+        for (int j = 0; j < 5000; j++) {
+            key[0] = j;
+            size_t len = int2key((char*)key+1,sizeof(key)-1,j,KEY_HEX)+1;
+            raxRemove(t,key,len,NULL);
+        }
+        if (raxMemoryUsage(t) != empty) {
+            printf("Stats: %llu bytes used by an empty tree, %llu "
+                   "expected\n", (unsigned long long)raxMemoryUsage(t),
+                   (unsigned long long)empty);
+            return 1;
+        }
+        raxFree(t);
+    }
+
+    /* Out of memory in the middle of the modifications. */
+    long left = -1;
+    raxAllocator alloc = {countdownMalloc,countdownRealloc,failingFree,
+                          NULL,&left};
+    t = raxNewWithAllocator(&alloc,RAX_FLAG_RANK);
+    for (int j = 0; j < 20000; j++) {
+        unsigned char key[32];
+        size_t len = int2key((char*)key,sizeof(key),j%2000,KEY_UNIQUE_ALPHA);
+        left = rc4rand()%4;
+        if (rc4rand()%3) raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+        else raxRemove(t,key,len,NULL);
+        left = -1;
+        if (j % 1000 == 0 && memoryCheckTree(t,"Stats OOM")) return 1;
+    }
+    if (memoryCheckTree(t,"Stats OOM")) return 1;
+    raxFree(t);
+    return 0;
+}
+
+int countersUnitTests(void) {
+    raxCounters c;
+    raxResetCounters();
+    if (!raxGetCounters(&c)) {
+        /* Compiled without RAX_STATS: nothing is counted. */
+        raxCounters zero;
+        memset(&zero,0,sizeof(zero));
+        if (memcmp(&c,&zero,sizeof(c))) {
+            printf("raxGetCounters() returned counters without RAX_STATS\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    /* "foobar", then "foo" splits it at the end of the matching bytes, and
+     * "fox" in the middle of "foo". Removing the last two keys the nodes
+     * are compressed again into "foobar". */
+    rax *t = raxNew();
+    raxInsert(t,(unsigned char*)"foobar",6,NULL,NULL);
+    raxInsert(t,(unsigned char*)"foo",3,NULL,NULL);
+    raxInsert(t,(unsigned char*)"fox",3,NULL,NULL);
+    raxFind(t,(unsigned char*)"foobar",6);
+    raxRemove(t,(unsigned char*)"fox",3,NULL);
+    raxRemove(t,(unsigned char*)"foo",3,NULL);
+    raxGetCounters(&c);
+    if (c.splits != 2 || c.recompressions == 0 || c.walks < 6 ||
+        c.walknodes == 0 || c.reallocs == 0 || c.oom != 0)
+    {
+        printf("raxGetCounters(): %llu splits, %llu recompressions, "
+               "%llu walks\n", (unsigned long long)c.splits,
+               (unsigned long long)c.recompressions,
+               (unsigned long long)c.walks);
+        return 1;
+    }
+    raxFree(t);
+
+    /* Failed allocations. */
+    int fail = 0;
+    raxAllocator alloc = {failingMalloc,failingRealloc,failingFree,NULL,
+                          &fail};
+    t = raxNewWithAllocator(&alloc,0);
+    fail = 1;
+    raxInsert(t,(unsigned char*)"foo",3,NULL,NULL);
+    fail = 0;
+    raxGetCounters(&c);
+    raxFree(t);
+    if (c.oom == 0) {
+        printf("raxGetCounters(): no failed allocations counted\n");
+        return 1;
+    }
+
+    raxResetCounters();
+    raxGetCounters(&c);
+    if (c.walks != 0) {
+        printf("raxResetCounters() did not reset the counters\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Range deletion fuzz test: ranges and prefixes of keys are removed from a
+ * tree, checking the result against a sorted array of the keys. After every
+ * removal the tree must have the same number of nodes of a tree created
+ * from scratch with the remaining keys, so that we know that the nodes were
+ * compressed as needed. */
+int rangeHasKey(arrayItem *item, int prefix, unsigned char *start, size_t startlen, unsigned char *end, size_t endlen) {
+    if (prefix) {
+        return item->key_len >= startlen &&
+               memcmp(item->key,start,startlen) == 0;
+    }
+    return compareAB(item->key,item->key_len,start,startlen) >= 0 &&
+           (end == NULL || compareAB(item->key,item->key_len,end,endlen) < 0);
+}
+
+int rangeCheckTree(rax *t, arrayItem *items, size_t count) {
+    raxIterator iter;
+    raxStart(&iter,t);
+    raxSeek(&iter,"^",NULL,0);
+    size_t j = 0;
+    while(raxNext(&iter)) {
+        if (j == count ||
+            compareAB(iter.key,iter.key_len,items[j].key,items[j].key_len) ||
+            iter.data !=
+                (void*)(unsigned long)(htHash(iter.key,iter.key_len)+1) ||
+            ((t->flags & RAX_FLAG_RANK) &&
+             raxRank(t,iter.key,iter.key_len) != j))
+        {
+            printf("Range fuzz: wrong key %.*s\n",
+                (int)iter.key_len,(char*)iter.key);
+            return 1;
+        }
+        j++;
+    }
+    raxStop(&iter);
+    if (j != count || raxSize(t) != count) {
+        printf("Range fuzz: %zu keys found, %zu expected\n", j, count);
+        return 1;
+    }
+    if (memoryCheckTree(t,"Range fuzz")) return 1;
+
+    /* Like raxRemove(), the range deletion does not always leave the tree
+     * in the most compact form (key nodes with a single child are not
+     * merged with their child), so the tree created inserting the same
+     * keys is only a lower bound. The exact count is checked using the
+     * allocator. */
+    rax *check = raxNewWithFlags(t->flags);
+    for (j = 0; j < count; j++)
+        raxInsert(check,items[j].key,items[j].key_len,NULL,NULL);
+    int err = check->numnodes > t->numnodes;
+    if (err) {
+        printf("Range fuzz: %llu nodes, at least %llu expected\n",
+            (unsigned long long)t->numnodes,
+            (unsigned long long)check->numnodes);
+    }
+    raxFree(check);
+    return err;
+}
+
+/* Fill 'buf' with a random bound for the keys of 'items': a prefix of one of
+ * the keys, sometimes followed by a random byte. */
+size_t rangeRandomBound(unsigned char *buf, arrayItem *items, size_t count) {
+    size_t len = 0;
+    if (count) {
+        arrayItem *item = items+rc4rand()%count;
+        len = rc4rand()%(item->key_len+1);
+        memcpy(buf,item->key,len);
+    }
+    if (rc4rand()%4 == 0) buf[len++] = rc4rand()&0xff;
+    return len;
+}
+
+int rangeFuzzTest(int keymode, size_t count, int flags) {
+    long live = 0;
+    raxAllocator alloc = {countingMalloc,countingRealloc,countingFree,NULL,
+                          &live};
+    rax *t = raxNewWithAllocator(&alloc,flags);
+    arrayItem *items = malloc(sizeof(arrayItem)*count);
+    arrayItem *removed = malloc(sizeof(arrayItem)*count);
+    size_t numitems = 0;
+    unsigned char key[1024];
+
+    printf("Range deletion fuzz test in mode %d [%zu]", keymode, count);
+    if (flags) printf(" flags %d", flags);
+    printf(": ");
+    fflush(stdout);
+
+    for (size_t i = 0; i < count; i++) {
+        size_t keylen = int2key((char*)key,sizeof(key),i,keymode);
+        /* Values are never NULL, so all of them are passed to the free
+         * callback. */
+        void *val = (void*)(unsigned long)(htHash(key,keylen)+1);
+        if (raxInsert(t,key,keylen,val,NULL)) {
+            items[numitems].key = malloc(keylen);
+            items[numitems].key_len = keylen;
+            memcpy(items[numitems].key,key,keylen);
+            numitems++;
+        }
+    }
+    qsort(items,numitems,sizeof(arrayItem),compareArrayItems);
+
+    uint64_t total = 0;
+    for (int round = 0; round < 30 && numitems; round++) {
+        unsigned char start[1025], end[1025];
+        size_t startlen = rangeRandomBound(start,items,numitems);
+        size_t endlen = rangeRandomBound(end,items,numitems);
+        int op = rc4rand()%3; /* Prefix, range, or detach. */
+        if (op == 1 && compareAB(start,startlen,end,endlen) > 0) {
+            unsigned char aux[1025];
+            memcpy(aux,start,startlen);
+            memcpy(start,end,endlen);
+            memcpy(end,aux,startlen);
+            size_t auxlen = startlen;
+            startlen = endlen;
+            endlen = auxlen;
+        }
+        unsigned char *endptr = (rc4rand()%5 == 0) ? NULL : end;
+        rax *fork = (rc4rand()%3 == 0) ? raxFork(t) : NULL;
+
+        /* Split the keys into the removed and the remaining ones. */
+        size_t numremoved = 0, left = 0;
+        for (size_t j = 0; j < numitems; j++) {
+            if (rangeHasKey(items+j,op != 1,start,startlen,endptr,endlen))
+                removed[numremoved++] = items[j];
+            else
+                items[left++] = items[j];
+        }
+
+        freedValues = 0;
+        uint64_t retval;
+        rax *detached = NULL;
+        if (op == 0) {
+            retval = raxRemovePrefix(t,start,startlen,countFreedValue);
+        } else if (op == 1) {
+            retval = raxRemoveRange(t,start,startlen,endptr,endlen,
+                                    countFreedValue);
+        } else {
+            detached = raxDetachPrefix(t,start,startlen);
+            retval = raxSize(detached);
+        }
+        long expfreed = (op == 2 || fork) ? 0 : (long)numremoved;
+        if (retval != numremoved || freedValues != expfreed) {
+            printf("Range fuzz: %llu keys removed, %zu expected, "
+                   "%ld values freed\n", (unsigned long long)retval,
+                   numremoved, freedValues);
+            return 1;
+        }
+        if (rangeCheckTree(t,items,left)) return 1;
+        if (detached) {
+            if (rangeCheckTree(detached,removed,numremoved)) return 1;
+            long before = live;
+            uint64_t nodes = detached->numnodes;
+            int shared = detached->shared != NULL;
+            raxFree(detached);
+            if (!shared && before-live != (long)nodes+1) {
+                printf("Range fuzz: %ld allocations freed for %llu nodes\n",
+                    before-live, (unsigned long long)nodes);
+                return 1;
+            }
+        }
+        if (!t->shared && live != (long)t->numnodes+1) {
+            printf("Range fuzz: %ld allocations for %llu nodes\n",
+                live, (unsigned long long)t->numnodes);
+            return 1;
+        }
+        if (fork) {
+            /* The fork must still have all the keys. */
+            memcpy(items+left,removed,sizeof(arrayItem)*numremoved);
+            qsort(items,numitems,sizeof(arrayItem),compareArrayItems);
+            if (rangeCheckTree(fork,items,numitems)) return 1;
+            raxFree(fork);
+            left = 0;
+            for (size_t j = 0; j < numitems; j++) {
+                if (!rangeHasKey(items+j,op != 1,start,startlen,endptr,
+                                 endlen)) items[left++] = items[j];
+            }
+        }
+        for (size_t j = 0; j < numremoved; j++) free(removed[j].key);
+        numitems = left;
+        total += numremoved;
+    }
+    printf("%llu keys removed\n", (unsigned long long)total);
+
+    raxFree(t);
+    if (live != 0) {
+        printf("Range fuzz: %ld allocations leaked\n", live);
+        return 1;
+    }
+    for (size_t j = 0; j < numitems; j++) free(items[j].key);
+    free(items);
+    free(removed);
+    return 0;
+}
+
+int integerKeysUnitTests(void) {
+    rax *t = raxNewWithFlags(RAX_FLAG_RANK);
+    uint64_t keys[1000];
+    for (int j = 0; j < 1000; j++) {
+        /* Small and large values, so that the keys share prefixes of all
+         * the lengths. */
+        keys[j] = j % 2 ? (uint64_t)rc4rand() << (rc4rand()%33) : (uint64_t)j*10;
+        raxInsertU64(t,keys[j],(void*)(long)(j+1),NULL);
+    }
+
+    /* The keys are the big endian encoding of the integers. */
+    unsigned char buf[8];
+    for (int j = 0; j < 8; j++) buf[j] = (keys[1] >> (56-j*8)) & 0xff;
+    if (raxFind(t,buf,8) != raxFindU64(t,keys[1]) ||
+        raxFindU64(t,keys[1]) == raxNotFound ||
+        raxTryInsertU64(t,keys[1],NULL,NULL) ||
+        raxFindU64(t,1) != raxNotFound)
+    {
+        printf("Integer keys: wrong lookup\n");
+        return 1;
+    }
+
+    /* The iteration order is the numerical order, and seeks find the
+     * integers in a range. */
+    raxIterator it;
+    raxStart(&it,t);
+    raxSeekU64(&it,"^",0);
+    uint64_t prev = 0, key;
+    int count = 0;
+    while(raxNext(&it)) {
+        if (!raxIteratorKeyU64(&it,&key) || (count && key <= prev)) {
+            printf("Integer keys: wrong iteration order\n");
+            return 1;
+        }
+        prev = key;
+        count++;
+    }
+    if (count != (int)raxSize(t)) return 1;
+    for (int j = 0; j < 100; j++) {
+        uint64_t start = keys[rc4rand()%1000]+(int)(rc4rand()%3)-1;
+        uint64_t end = start+(rc4rand()%1000)*(uint64_t)rc4rand();
+        uint64_t expected = 0, found = 0;
+        for (int k = 0; k < 1000; k++) {
+            if (keys[k] >= start && keys[k] < end &&
+                raxFindU64(t,keys[k]) == (void*)(long)(k+1)) expected++;
+        }
+        raxSeekU64(&it,">=",start);
+        while(raxNext(&it) && raxIteratorKeyU64(&it,&key) && key < end)
+            found++;
+        if (found != expected) {
+            printf("Integer keys: %llu keys in range, %llu expected\n",
+                (unsigned long long)found, (unsigned long long)expected);
+            return 1;
+        }
+    }
+    raxStop(&it);
+    for (int j = 0; j < 1000; j++) raxRemoveU64(t,keys[j],NULL);
+    if (raxSize(t) != 0) return 1;
+    raxFree(t);
+
+    /* 128 bits keys are ordered by the high part first. */
+    t = raxNew();
+    raxU128 a = {1,0}, b = {0,UINT64_MAX}, c = {1,5};
+    raxInsertU128(t,a,(void*)1,NULL);
+    raxInsertU128(t,b,(void*)2,NULL);
+    raxInsertU128(t,c,(void*)3,NULL);
+    raxInsert(t,(unsigned char*)"short",5,NULL,NULL);
+    raxU128 k;
+    raxStart(&it,t);
+    raxSeekU128(&it,">",b);
+    if (!raxNext(&it) || !raxIteratorKeyU128(&it,&k) || k.hi != 1 ||
+        k.lo != 0 || raxFindU128(t,c) != (void*)3 ||
+        !raxRemoveU128(t,a,NULL) || raxFindU128(t,a) != raxNotFound)
+    {
+        printf("Integer keys: wrong 128 bits keys\n");
+        return 1;
+    }
+    raxSeek(&it,"=",(unsigned char*)"short",5);
+    if (!raxNext(&it) || raxIteratorKeyU128(&it,&k) ||
+        raxIteratorKeyU64(&it,&key))
+    {
+        printf("Integer keys: keys of other lengths decoded\n");
+        return 1;
+    }
+    raxStop(&it);
+    raxFree(t);
+    return 0;
+}
+
+int fingerUnitTests(void) {
+    /* Stream like IDs inserted in order, and looked up in order as well
+     * as far from the last key. */
+    rax *t = raxNewWithFlags(RAX_FLAG_RANK);
+    raxFinger f;
+    raxFingerStart(&f,t);
+    char buf[64];
+    void *old;
+    raxResetCounters();
+    for (int j = 0; j < 10000; j++) {
+        int len = snprintf(buf,sizeof(buf),"1526919030474-%d",j);
+        if (!raxInsertWithHint(&f,(unsigned char*)buf,len,
+                               (void*)(long)(j+1),NULL))
+        {
+            printf("Finger: key %s not inserted\n", buf);
+            return 1;
+        }
+    }
+    for (int j = 0; j < 10000; j++) {
+        int k = j % 3 ? j : 9999-j;
+        int len = snprintf(buf,sizeof(buf),"1526919030474-%d",k);
+        if (raxFindWithHint(&f,(unsigned char*)buf,len) != (void*)(long)(k+1))
+        {
+            printf("Finger: key %s not found\n", buf);
+            return 1;
+        }
+    }
+    raxCounters c;
+    if (raxGetCounters(&c) && c.fingerhits < 19000) {
+        printf("Finger: %llu lookups started below the head\n",
+            (unsigned long long)c.fingerhits);
+        return 1;
+    }
+    if (raxSize(t) != 10000 ||
+        raxFindWithHint(&f,(unsigned char*)"1526919030474-",14) != raxNotFound ||
+        raxFindWithHint(&f,(unsigned char*)"15",2) != raxNotFound ||
+        raxFindWithHint(&f,NULL,0) != raxNotFound ||
+        raxInsertWithHint(&f,(unsigned char*)"1526919030474-7",15,NULL,&old) ||
+        old != (void*)8 ||
+        raxFind(t,(unsigned char*)"1526919030474-7",15) != NULL)
+    {
+        printf("Finger: wrong lookup\n");
+        return 1;
+    }
+    raxInsertWithHint(&f,(unsigned char*)"1526919030474-7",15,(void*)8,NULL);
+
+    /* Removals and keys longer than the static buffer invalidate the path,
+     * but not the results. */
+    unsigned char longkey[300];
+    memset(longkey,'1',sizeof(longkey));
+    for (int j = 0; j < 10000; j += 2) {
+        int len = snprintf(buf,sizeof(buf),"1526919030474-%d",j);
+        raxRemove(t,(unsigned char*)buf,len,NULL);
+        if (raxFindWithHint(&f,(unsigned char*)buf,len) != raxNotFound)
+            return 1;
+        len = snprintf(buf,sizeof(buf),"1526919030474-%d",j+1);
+        if (raxFindWithHint(&f,(unsigned char*)buf,len) != (void*)(long)(j+2))
+        {
+            printf("Finger: key %s not found after removals\n", buf);
+            return 1;
+        }
+        if (j % 100 == 0) {
+            raxInsertWithHint(&f,longkey,sizeof(longkey)-j/100,NULL,NULL);
+            if (raxFindWithHint(&f,longkey,sizeof(longkey)-j/100) != NULL)
+                return 1;
+        }
+    }
+    if (raxSize(t) != 5100 || memoryCheckTree(t,"Finger")) return 1;
+    uint64_t rank = 100; /* The long keys are smaller. */
+    for (int j = 1; j < 10000; j += 2) {
+        snprintf(buf,sizeof(buf),"%d",j);
+        if (strcmp(buf,"5001") < 0) rank++;
+    }
+    int len = snprintf(buf,sizeof(buf),"1526919030474-%d",5001);
+    if (raxRank(t,(unsigned char*)buf,len) != rank) {
+        printf("Finger: wrong rank\n");
+        return 1;
+    }
+    raxFingerStop(&f);
+    raxFree(t);
+
+    /* Out of memory in the middle of the insertions does not leave the
+     * hint with nodes no longer in the tree. */
+    long left = -1;
+    raxAllocator alloc = {countdownMalloc,countdownRealloc,failingFree,
+                          NULL,&left};
+    t = raxNewWithAllocator(&alloc,RAX_FLAG_RANK);
+    raxFingerStart(&f,t);
+    uint64_t inserted = 0;
+    for (int j = 0; j < 3000; j++) {
+        int k = j % 7 ? j : j/2;
+        int len = snprintf(buf,sizeof(buf),"1526919030474-%d",k);
+        left = rc4rand()%4;
+        int retval = raxInsertWithHint(&f,(unsigned char*)buf,len,
+                                       (void*)(long)(k+1),NULL);
+        int oom = retval == 0 && errno == ENOMEM;
+        left = -1;
+        inserted += retval;
+        void *val = raxFindWithHint(&f,(unsigned char*)buf,len);
+        if ((oom && val != raxNotFound && val != (void*)(long)(k+1)) ||
+            (!oom && val != (void*)(long)(k+1)) || raxSize(t) != inserted)
+        {
+            printf("Finger: wrong key %s after out of memory\n", buf);
+            return 1;
+        }
+    }
+    if (memoryCheckTree(t,"Finger")) return 1;
+    raxFingerStop(&f);
+    raxFree(t);
+
+    /* Forked and concurrent trees just perform normal lookups. */
+    for (int j = 0; j < 2; j++) {
+        t = raxNewWithFlags(j ? RAX_FLAG_CONCURRENT : 0);
+        if (t == NULL) continue;
+        rax *fork = NULL;
+        raxFingerStart(&f,t);
+        for (int k = 0; k < 1000; k++) {
+            int len = snprintf(buf,sizeof(buf),"key:%d",k);
+            raxInsertWithHint(&f,(unsigned char*)buf,len,(void*)(long)k,NULL);
+            if (k == 500 && !j) fork = raxFork(t);
+        }
+        for (int k = 0; k < 1000; k++) {
+            int len = snprintf(buf,sizeof(buf),"key:%d",k);
+            if (raxFindWithHint(&f,(unsigned char*)buf,len) != (void*)(long)k ||
+                (fork && (raxFind(fork,(unsigned char*)buf,len) == raxNotFound)
+                         != (k > 500)))
+            {
+                printf("Finger: key %s not found in shared tree\n", buf);
+                return 1;
+            }
+        }
+        raxFingerStop(&f);
+        if (fork) raxFree(fork);
+        raxFree(t);
+    }
+    return 0;
+}
+
+/* Perform random insertions, removals and lookups of keys near to each
+ * other, using two hints, normal operations, forks and defragmentation
+ * steps, checking the tree against an hash table. */
+int fingerFuzzTest(int keymode, size_t count, int flags) {
+    hashtable *ht = htNew();
+    rax *t = raxNewWithFlags(flags);
+    raxFinger fingers[2];
+    raxFingerStart(fingers,t);
+    raxFingerStart(fingers+1,t);
+    raxDefragCursor c;
+    raxDefragStart(&c);
+    rax *fork = NULL;
+    size_t next = 0;
+
+    printf("Finger fuzz test in mode %d [%zu]", keymode, count);
+    if (flags) printf(" flags %d", flags);
+    printf(": ");
+    fflush(stdout);
+
+    for (size_t i = 0; i < count*4; i++) {
+        unsigned char key[1024];
+        /* Mostly the next key, otherwise one near to it or a random one. */
+        size_t id = next;
+        int r = rc4rand()%10;
+        if (r < 6) next++;
+        else if (r < 9) id = next - (next ? rc4rand()%(next < 100 ? next : 100) : 0);
+        else id = rc4rand()%(count+1);
+        size_t keylen = int2key((char*)key,sizeof(key),id,keymode);
+        raxFinger *f = fingers+(rc4rand()%4 == 0);
+        void *val = (void*)(unsigned long)rc4rand();
+
+        int op = rc4rand()%100;
+        if (op < 40) {
+            if (htAdd(ht,key,keylen,val) != raxInsertWithHint(f,key,keylen,val,NULL)) {
+                printf("Finger fuzz: insertion mismatch\n");
+                return 1;
+            }
+        } else if (op < 50) {
+            if (htAdd(ht,key,keylen,val) != raxInsert(t,key,keylen,val,NULL)) {
+                printf("Finger fuzz: insertion mismatch\n");
+                return 1;
+            }
+        } else if (op < 60) {
+            if (htRem(ht,key,keylen) != raxRemove(t,key,keylen,NULL)) {
+                printf("Finger fuzz: removal mismatch\n");
+                return 1;
+            }
+        } else if (op < 98) {
+            void *expected = htFind(ht,key,keylen);
+            if (expected == htNotFound) expected = raxNotFound;
+            if (raxFindWithHint(f,key,keylen) != expected) {
+                printf("Finger fuzz: lookup mismatch for key %.*s\n",
+                    (int)keylen, (char*)key);
+                return 1;
+            }
+        } else if (op == 98) {
+            raxDefragStep(t,&c,rc4rand()%100,NULL);
+        } else if (fork) {
+            raxFree(fork);
+            fork = NULL;
+        } else {
+            fork = raxFork(t);
+        }
+    }
+
+    if (ht->numele != raxSize(t) || memoryCheckTree(t,"Finger fuzz")) return 1;
+    raxIterator iter;
+    raxStart(&iter,t);
+    raxSeek(&iter,"^",NULL,0);
+    uint64_t rank = 0;
+    while(raxNext(&iter)) {
+        if (raxFindWithHint(fingers,iter.key,iter.key_len) !=
+            htFind(ht,iter.key,iter.key_len) ||
+            ((flags & RAX_FLAG_RANK) &&
+             raxRank(t,iter.key,iter.key_len) != rank))
+        {
+            printf("Finger fuzz: wrong key %.*s\n",
+                (int)iter.key_len, (char*)iter.key);
+            return 1;
+        }
+        rank++;
+    }
+    raxStop(&iter);
+    printf("%lu elements\n", (unsigned long)ht->numele);
+
+    raxDefragStop(&c);
+    raxFingerStop(fingers);
+    raxFingerStop(fingers+1);
+    if (fork) raxFree(fork);
+    raxFree(t);
+    htFree(ht);
+    return 0;
+}
+
+int lazyUnitTests(void) {
+    /* Removing "footer" leaves "foo" -> [b] -> "ar" uncompressed. */
+    rax *t = raxNewWithFlags(RAX_FLAG_LAZY_COMPACT|RAX_FLAG_RANK);
+    raxInsert(t,(unsigned char*)"foobar",6,(void*)1,NULL);
+    raxInsert(t,(unsigned char*)"footer",6,(void*)2,NULL);
+    raxRemove(t,(unsigned char*)"footer",6,NULL);
+    if (t->numnodes != 4 || !t->head->needcompr ||
+        raxFind(t,(unsigned char*)"foobar",6) != (void*)1)
+    {
+        printf("Lazy compaction: %llu nodes after the removal\n",
+            (unsigned long long)t->numnodes);
+        return 1;
+    }
+    if (raxCompactStep(t,0) || t->numnodes != 2 || t->head->needcompr ||
+        raxFind(t,(unsigned char*)"foobar",6) != (void*)1 ||
+        memoryCheckTree(t,"Lazy compaction"))
+    {
+        printf("Lazy compaction: %llu nodes after raxCompactStep()\n",
+            (unsigned long long)t->numnodes);
+        return 1;
+    }
+    raxFree(t);
+
+    /* Removing and inserting again the same keys allocates and frees less
+     * than with the compression at every removal, and once compacted the
+     * tree is the same. */
+    rax *eager = raxNew();
+    t = raxNewWithFlags(RAX_FLAG_LAZY_COMPACT);
+    char buf[64];
+    for (int j = 0; j < 1000; j++) {
+        int len = snprintf(buf,sizeof(buf),"session:%d:expire",j*7);
+        raxInsert(eager,(unsigned char*)buf,len,(void*)(long)j,NULL);
+        raxInsert(t,(unsigned char*)buf,len,(void*)(long)j,NULL);
+    }
+    uint64_t eagerops = eager->version, lazyops = t->version;
+    for (int round = 0; round < 10; round++) {
+        for (int j = round%2; j < 1000; j += 2) {
+            int len = snprintf(buf,sizeof(buf),"session:%d:expire",j*7);
+            raxRemove(eager,(unsigned char*)buf,len,NULL);
+            raxRemove(t,(unsigned char*)buf,len,NULL);
+        }
+        for (int j = round%2; j < 1000; j += 2) {
+            int len = snprintf(buf,sizeof(buf),"session:%d:expire",j*7);
+            raxInsert(eager,(unsigned char*)buf,len,(void*)(long)j,NULL);
+            raxInsert(t,(unsigned char*)buf,len,(void*)(long)j,NULL);
+        }
+    }
+    eagerops = eager->version-eagerops;
+    lazyops = t->version-lazyops;
+    if (lazyops >= eagerops) {
+        printf("Lazy compaction: %llu allocations, %llu without it\n",
+            (unsigned long long)lazyops, (unsigned long long)eagerops);
+        return 1;
+    }
+    for (int j = 0; j < 1000; j += 3) {
+        int len = snprintf(buf,sizeof(buf),"session:%d:expire",j*7);
+        raxRemove(eager,(unsigned char*)buf,len,NULL);
+        raxRemove(t,(unsigned char*)buf,len,NULL);
+    }
+
+    /* Forked trees are compacted once the other trees are freed. */
+    rax *fork = raxFork(t);
+    uint64_t nodes = t->numnodes;
+    if (!raxCompactStep(t,0) || t->numnodes != nodes) {
+        printf("Lazy compaction: forked tree compacted\n");
+        return 1;
+    }
+    raxFree(fork);
+
+    /* The work is bounded by the number of marked nodes. */
+    int steps = 0;
+    while(raxCompactStep(t,10) && steps < 10000) steps++;
+    if (steps < 2 || t->numnodes != eager->numnodes ||
+        memoryCheckTree(t,"Lazy compaction"))
+    {
+        printf("Lazy compaction: %llu nodes after %d steps, %llu expected\n",
+            (unsigned long long)t->numnodes, steps,
+            (unsigned long long)eager->numnodes);
+        return 1;
+    }
+    for (int j = 0; j < 1000; j++) {
+        int len = snprintf(buf,sizeof(buf),"session:%d:expire",j*7);
+        if (raxFind(t,(unsigned char*)buf,len) !=
+            raxFind(eager,(unsigned char*)buf,len)) return 1;
+    }
+    raxFree(t);
+    raxFree(eager);
+
+    t = raxNewWithFlags(RAX_FLAG_LAZY_COMPACT|RAX_FLAG_CONCURRENT);
+    if (t != NULL || errno != EINVAL) {
+        printf("Lazy compaction: concurrent tree created\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Perform random insertions and removals in a tree with lazy compaction,
+ * compacting it a few nodes at a time, and check that once compacted
+ * completely it has no more nodes than a tree without lazy compaction (it
+ * may have less, since the removals compress only around the removed key,
+ * while the compaction is done after all the removals). */
+int lazyFuzzTest(int keymode, size_t count, int flags) {
+    hashtable *ht = htNew();
+    rax *t = raxNewWithFlags(flags|RAX_FLAG_LAZY_COMPACT);
+    rax *eager = raxNewWithFlags(flags);
+
+    printf("Lazy compaction fuzz test in mode %d [%zu]", keymode, count);
+    if (flags) printf(" flags %d", flags);
+    printf(": ");
+    fflush(stdout);
+
+    for (size_t i = 0; i < count*4; i++) {
+        unsigned char key[1024];
+        size_t keylen = int2key((char*)key,sizeof(key),rc4rand()%(count+1),
+                                keymode);
+        void *val = (void*)(unsigned long)rc4rand();
+        int op = rc4rand()%100;
+        if (op < 45) {
+            if (htAdd(ht,key,keylen,val) != raxInsert(t,key,keylen,val,NULL)) {
+                printf("Lazy fuzz: insertion mismatch\n");
+                return 1;
+            }
+            raxInsert(eager,key,keylen,val,NULL);
+        } else if (op < 90) {
+            if (htRem(ht,key,keylen) != raxRemove(t,key,keylen,NULL)) {
+                printf("Lazy fuzz: removal mismatch\n");
+                return 1;
+            }
+            raxRemove(eager,key,keylen,NULL);
+        } else if (op < 98) {
+            void *expected = htFind(ht,key,keylen);
+            if (expected == htNotFound) expected = raxNotFound;
+            if (raxFind(t,key,keylen) != expected) {
+                printf("Lazy fuzz: lookup mismatch for key %.*s\n",
+                    (int)keylen, (char*)key);
+                return 1;
+            }
+        } else {
+            raxCompactStep(t,rc4rand()%10);
+        }
+    }
+
+    if (ht->numele != raxSize(t) || memoryCheckTree(t,"Lazy fuzz")) return 1;
+    if (raxCompactStep(t,0) || t->numnodes > eager->numnodes ||
+        memoryCheckTree(t,"Lazy fuzz"))
+    {
+        printf("Lazy fuzz: %llu nodes after the compaction, %llu without\n",
+            (unsigned long long)t->numnodes,
+            (unsigned long long)eager->numnodes);
+        return 1;
+    }
+    raxIterator iter;
+    raxStart(&iter,t);
+    raxSeek(&iter,"^",NULL,0);
+    uint64_t rank = 0;
+    while(raxNext(&iter)) {
+        if (iter.data != htFind(ht,iter.key,iter.key_len) ||
+            ((flags & RAX_FLAG_RANK) &&
+             raxRank(t,iter.key,iter.key_len) != rank))
+        {
+            printf("Lazy fuzz: wrong key %.*s\n",
+                (int)iter.key_len, (char*)iter.key);
+            return 1;
+        }
+        rank++;
+    }
+    raxStop(&iter);
+    printf("%lu elements\n", (unsigned long)ht->numele);
+
+    raxFree(t);
+    raxFree(eager);
+    htFree(ht);
+    return 0;
+}
+
+int iteratorRemoveUnitTests(void) {
+    char *toadd[] = {"alligator","alien","baloon","chromodynamic","romane","romanus","romulus","rubens","ruber","rubicon","rubicundus","all","rub","ba",NULL};
+    rax *t = raxNewWithFlags(RAX_FLAG_RANK);
+    long numele;
+    for (numele = 0; toadd[numele] != NULL; numele++) {
+        raxInsert(t,(unsigned char*)toadd[numele],strlen(toadd[numele]),
+                  (void*)(numele+1),NULL);
+    }
+
+    /* Remove the keys starting with "ro" and "rub", but "rubicon", in a
+     * single pass: every key is seen once, in order. */
+    char *seen[] = {"romane","romanus","romulus","rub","rubens","ruber",
+                    "rubicon","rubicundus",NULL};
+    raxIterator iter;
+    raxStart(&iter,t);
+    raxSeek(&iter,">=",(unsigned char*)"ro",2);
+    int j = 0;
+    while(raxNext(&iter)) {
+        if (seen[j] == NULL || strlen(seen[j]) != iter.key_len ||
+            memcmp(seen[j],iter.key,iter.key_len))
+        {
+            printf("raxIteratorRemove(): wrong key %.*s\n",
+                (int)iter.key_len, (char*)iter.key);
+            return 1;
+        }
+        j++;
+        if (iter.key_len == 7 && memcmp(iter.key,"rubicon",7) == 0)
+            continue;
+        void *old = NULL, *expected = iter.data;
+        if (!raxIteratorRemove(&iter,&old) || old != expected) {
+            printf("raxIteratorRemove() failed\n");
+            return 1;
+        }
+    }
+    if (seen[j] != NULL || raxSize(t) != 7 ||
+        raxFind(t,(unsigned char*)"rubicon",7) != (void*)10 ||
+        raxFind(t,(unsigned char*)"rub",3) != raxNotFound ||
+        raxRank(t,(unsigned char*)"rubicon",7) != 6 ||
+        memoryCheckTree(t,"raxIteratorRemove()"))
+    {
+        printf("raxIteratorRemove(): wrong tree after the removals\n");
+        return 1;
+    }
+
+    /* After removing "footer" and then "foo", the iterator is positioned
+     * on the next key, and the nodes are compressed as raxRemove() does. */
+    raxStop(&iter);
+    raxFree(t);
+    rax *eager = raxNew();
+    t = raxNew();
+    raxStart(&iter,t);
+    char *foo[] = {"foo","foobar","footer","fox",NULL};
+    for (j = 0; foo[j] != NULL; j++) {
+        raxInsert(t,(unsigned char*)foo[j],strlen(foo[j]),NULL,NULL);
+        raxInsert(eager,(unsigned char*)foo[j],strlen(foo[j]),NULL,NULL);
+    }
+    char *rem[] = {"footer","foo","fox"};
+    char *next[] = {"fox","foobar",NULL};
+    for (j = 0; j < 3; j++) {
+        size_t len = strlen(rem[j]);
+        raxSeek(&iter,"==",(unsigned char*)rem[j],len);
+        raxRemove(eager,(unsigned char*)rem[j],len,NULL);
+        if (!raxIteratorRemove(&iter,NULL) || t->numnodes != eager->numnodes) {
+            printf("raxIteratorRemove(): %llu nodes, %llu expected\n",
+                (unsigned long long)t->numnodes,
+                (unsigned long long)eager->numnodes);
+            return 1;
+        }
+        int res = raxNext(&iter);
+        if (res != (next[j] != NULL) ||
+            (res && (iter.key_len != strlen(next[j]) ||
+                     memcmp(iter.key,next[j],iter.key_len))))
+        {
+            printf("raxIteratorRemove(): wrong next key after %s\n",rem[j]);
+            return 1;
+        }
+    }
+    raxFree(eager);
+
+    /* Removing all the keys leaves the iterator at EOF. */
+    raxSeek(&iter,"^",NULL,0);
+    while(raxNext(&iter)) raxIteratorRemove(&iter,NULL);
+    errno = ENOMEM;
+    if (raxSize(t) != 0 || t->numnodes != 1 ||
+        raxIteratorRemove(&iter,NULL) || errno != 0)
+    {
+        printf("raxIteratorRemove(): %llu keys left\n",
+            (unsigned long long)raxSize(t));
+        return 1;
+    }
+    raxStop(&iter);
+    raxFree(t);
+
+    /* In forked trees the other trees are left untouched. */
+    t = raxNew();
+    for (j = 0; j < 1000; j++) {
+        char buf[32];
+        int len = snprintf(buf,sizeof(buf),"key:%d",j);
+        raxInsert(t,(unsigned char*)buf,len,NULL,NULL);
+    }
+    rax *fork = raxFork(t);
+    raxStart(&iter,fork);
+    raxSeek(&iter,"^",NULL,0);
+    j = 0;
+    while(raxNext(&iter)) {
+        if (j++ % 2) raxIteratorRemove(&iter,NULL);
+    }
+    raxStop(&iter);
+    if (j != 1000 || raxSize(fork) != 500 || raxSize(t) != 1000 ||
+        raxFind(t,(unsigned char*)"key:1",5) == raxNotFound)
+    {
+        printf("raxIteratorRemove(): wrong forked trees\n");
+        return 1;
+    }
+    raxFree(fork);
+
+    /* Frozen images can't be modified. */
+    size_t imglen;
+    unsigned char *image = raxSerialize(t,NULL,NULL,&imglen);
+    raxFrozen f;
+    raxFrozenOpen(&f,image,imglen);
+    raxFrozenStart(&iter,&f);
+    raxSeek(&iter,"^",NULL,0);
+    if (!raxNext(&iter) || raxIteratorRemove(&iter,NULL) || errno != EINVAL) {
+        printf("raxIteratorRemove() modified a frozen image\n");
+        return 1;
+    }
+    raxStop(&iter);
+    free(image);
+    raxFree(t);
+    return 0;
+}
+
+/* Iterate a tree removing random keys with raxIteratorRemove(), while a
+ * reference tree has the same keys removed with raxRemove() and its
+ * iterator is seeked again after every removal: the two iterators must
+ * see the same keys, and the two trees must be the same. */
+int iteratorRemoveFuzzTest(int keymode, size_t count, int flags) {
+    rax *t = newTestRax(flags);
+    rax *ref = raxNewWithFlags(flags & ~(TEST_FLAG_ARENA|RAX_FLAG_LAZY_COMPACT));
+
+    printf("Iterator remove fuzz test in mode %d [%zu]", keymode, count);
+    if (flags) printf(" flags %d", flags);
+    printf(": ");
+    fflush(stdout);
+
+    raxIterator it, rit;
+    raxStart(&it,t);
+    raxStart(&rit,ref);
+    size_t removed = 0;
+    for (int round = 0; round < 20; round++) {
+        for (size_t i = 0; i < count/10+1; i++) {
+            unsigned char key[1024];
+            size_t keylen = int2key((char*)key,sizeof(key),rc4rand()%count,
+                                    keymode);
+            void *val = (void*)(unsigned long)rc4rand();
+            raxInsert(t,key,keylen,val,NULL);
+            raxInsert(ref,key,keylen,val,NULL);
+        }
+
+        unsigned char key[1024];
+        size_t keylen = int2key((char*)key,sizeof(key),rc4rand()%count,
+                                keymode);
+        char *op = round % 4 ? ">=" : "^";
+        raxSeek(&it,op,key,keylen);
+        raxSeek(&rit,op,key,keylen);
+        int remprob = rc4rand()%100;
+        while(1) {
+            int res = raxNext(&it), rres = raxNext(&rit);
+            if (res != rres || (res && (it.key_len != rit.key_len ||
+                memcmp(it.key,rit.key,it.key_len) || it.data != rit.data)))
+            {
+                printf("Iterator remove fuzz: iterators mismatch\n");
+                return 1;
+            }
+            if (!res) break;
+            if ((int)(rc4rand()%100) >= remprob) continue;
+            void *old, *refold;
+            raxRemove(ref,rit.key,rit.key_len,&refold);
+            raxSeek(&rit,">",rit.key,rit.key_len);
+            if (!raxIteratorRemove(&it,&old) || old != refold) {
+                printf("Iterator remove fuzz: removal mismatch\n");
+                return 1;
+            }
+            removed++;
+        }
+        if (raxSize(t) != raxSize(ref) ||
+            (!(flags & RAX_FLAG_LAZY_COMPACT) &&
+             t->numnodes != ref->numnodes) ||
+            memoryCheckTree(t,"Iterator remove fuzz"))
+        {
+            printf("Iterator remove fuzz: %llu nodes, %llu expected\n",
+                (unsigned long long)t->numnodes,
+                (unsigned long long)ref->numnodes);
+            return 1;
+        }
+    }
+    if (flags & RAX_FLAG_LAZY_COMPACT) raxCompactStep(t,0);
+
+    /* Check the content of the tree, and the subtree counts. */
+    raxSeek(&it,"^",NULL,0);
+    uint64_t rank = 0;
+    while(raxNext(&it)) {
+        if (raxFind(ref,it.key,it.key_len) != it.data ||
+            ((flags & RAX_FLAG_RANK) && raxRank(t,it.key,it.key_len) != rank))
+        {
+            printf("Iterator remove fuzz: wrong key %.*s\n",
+                (int)it.key_len, (char*)it.key);
+            return 1;
+        }
+        rank++;
+    }
+    if (rank != raxSize(ref)) {
+        printf("Iterator remove fuzz: %llu keys, %llu expected\n",
+            (unsigned long long)rank, (unsigned long long)raxSize(ref));
+        return 1;
+    }
+    printf("%zu keys removed\n", removed);
+
+    raxStop(&it);
+    raxStop(&rit);
+    raxFree(t);
+    raxFree(ref);
+    return 0;
+}
+
+/* Writer thread of the sharded trees tests: inserts the keys from 'first'
+ * to 'first'+'count'-1. */
+typedef struct shardedWriterState {
+    raxSharded *s;
+    int first, count;
+    pthread_t thread;
+} shardedWriterState;
+
+void *shardedWriter(void *arg) {
+    shardedWriterState *st = arg;
+    for (int j = st->first; j < st->first+st->count; j++) {
+        char buf[32];
+        int len = snprintf(buf,sizeof(buf),"%d",j);
+        raxShardedInsert(st->s,(unsigned char*)buf,len,(void*)(long)j,NULL);
+    }
+    return NULL;
+}
+
+/* raxShardedForEach() callback: removes the odd values of the shard, and
+ * counts the remaining keys. */
+void shardedRemoveOdd(void *privdata, int shard, rax *t) {
+    long *counts = privdata;
+    raxIterator iter;
+    raxStart(&iter,t);
+    raxSeek(&iter,"^",NULL,0);
+    while(raxNext(&iter)) {
+        if ((long)iter.data % 2) raxIteratorRemove(&iter,NULL);
+    }
+    raxStop(&iter);
+    counts[shard] = raxSize(t);
+}
+
+long shardedFreed = 0;
+void shardedFreeCallback(void *data) {
+    (void)data;
+    shardedFreed++;
+}
+
+int shardedUnitTests(void) {
+    errno = 0;
+    if (raxShardedNew(0,RAX_SHARD_HASH,0) != NULL || errno != EINVAL ||
+        raxShardedNew(300,RAX_SHARD_PREFIX,0) != NULL ||
+        raxShardedNew(4,RAX_SHARD_HASH,RAX_FLAG_CONCURRENT) != NULL)
+    {
+        printf("raxShardedNew() accepted invalid arguments\n");
+        return 1;
+    }
+
+    for (int mode = 0; mode < 2; mode++) {
+        raxSharded *s = raxShardedNew(mode ? 7 : 16,mode,RAX_FLAG_RANK);
+        rax *ref = raxNew();
+
+        /* Insert the keys from four threads. */
+        shardedWriterState writers[4];
+        for (int j = 0; j < 4; j++) {
+            writers[j].s = s;
+            writers[j].first = j*1000;
+            writers[j].count = 1000;
+            pthread_create(&writers[j].thread,NULL,shardedWriter,writers+j);
+        }
+        for (int j = 0; j < 4; j++) pthread_join(writers[j].thread,NULL);
+        for (int j = 0; j < 4000; j++) {
+            char buf[32];
+            int len = snprintf(buf,sizeof(buf),"%d",j);
+            raxInsert(ref,(unsigned char*)buf,len,(void*)(long)j,NULL);
+            if (raxShardedFind(s,(unsigned char*)buf,len) != (void*)(long)j) {
+                printf("Sharded tree: key %s not found\n", buf);
+                return 1;
+            }
+        }
+        if (raxShardedSize(s) != 4000 ||
+            raxShardedTryInsert(s,(unsigned char*)"12",2,NULL,NULL) ||
+            raxShardedFind(s,(unsigned char*)"12",2) != (void*)12)
+        {
+            printf("Sharded tree: wrong size or insertion\n");
+            return 1;
+        }
+
+        /* Iterators see the keys in order, in both directions, and don't
+         * see the modifications after the seek. */
+        raxShardedIterator it;
+        raxIterator ri;
+        raxShardedStart(&it,s);
+        raxStart(&ri,ref);
+        raxShardedSeek(&it,">=",(unsigned char*)"2",1);
+        raxSeek(&ri,">=",(unsigned char*)"2",1);
+        raxShardedRemove(s,(unsigned char*)"3",1,NULL);
+        raxShardedInsert(s,(unsigned char*)"25a",3,NULL,NULL);
+        char *moves = "nnnnpppppppppnnnnnnnnnnnnnnnnnnnnnnnnppppnnnnnnnn";
+        for (int j = 0; moves[j]; j++) {
+            int res = moves[j] == 'n' ? raxShardedNext(&it) :
+                                        raxShardedPrev(&it);
+            int rres = moves[j] == 'n' ? raxNext(&ri) : raxPrev(&ri);
+            if (res != rres || (res && (it.key_len != ri.key_len ||
+                memcmp(it.key,ri.key,it.key_len) || it.data != ri.data)))
+            {
+                printf("Sharded tree: wrong iteration at step %d\n", j);
+                return 1;
+            }
+        }
+        raxShardedSeek(&it,"^",NULL,0);
+        raxSeek(&ri,"^",NULL,0);
+        raxRemove(ref,(unsigned char*)"3",1,NULL);
+        raxInsert(ref,(unsigned char*)"25a",3,NULL,NULL);
+        long count = 0;
+        while(raxShardedNext(&it)) {
+            if (!raxNext(&ri) || it.key_len != ri.key_len ||
+                memcmp(it.key,ri.key,it.key_len))
+            {
+                printf("Sharded tree: wrong full iteration\n");
+                return 1;
+            }
+            count++;
+        }
+        raxShardedSeek(&it,"==",(unsigned char*)"999",3);
+        if (count != 4000 || !raxShardedNext(&it) ||
+            it.data != (void*)999 || raxShardedNext(&it))
+        {
+            printf("Sharded tree: %ld keys iterated\n", count);
+            return 1;
+        }
+
+        /* An exact seek continues with the keys of the other shards. */
+        raxShardedSeek(&it,"==",(unsigned char*)"1000",4);
+        if (!raxShardedNext(&it) || it.data != (void*)1000 ||
+            !raxShardedNext(&it) || it.data != (void*)1001 ||
+            !raxShardedPrev(&it) || it.data != (void*)1000)
+        {
+            printf("Sharded tree: wrong iteration after exact seek\n");
+            return 1;
+        }
+        raxShardedSeek(&it,"==",(unsigned char*)"10000",5);
+        if (raxShardedNext(&it)) {
+            printf("Sharded tree: exact seek of a missing key\n");
+            return 1;
+        }
+        raxShardedStop(&it);
+        raxStop(&ri);
+
+        /* Every shard is processed by its own thread. */
+        long counts[16] = {0};
+        raxShardedForEach(s,shardedRemoveOdd,counts);
+        long total = 0;
+        for (int j = 0; j < 16; j++) total += counts[j];
+        if (total != 2001 || raxShardedSize(s) != 2001 ||
+            raxShardedFind(s,(unsigned char*)"11",2) != raxNotFound ||
+            raxShardedFind(s,(unsigned char*)"10",2) != (void*)10)
+        {
+            printf("Sharded tree: %ld keys after raxShardedForEach()\n",
+                total);
+            return 1;
+        }
+        shardedFreed = 0;
+        raxShardedFreeWithCallback(s,shardedFreeCallback);
+        if (shardedFreed != 1999) { /* "0" and "25a" have NULL values. */
+            printf("Sharded tree: %ld values freed\n", shardedFreed);
+            return 1;
+        }
+        raxFree(ref);
+    }
+    return 0;
+}
+
+/* Perform random operations on a sharded tree and on a normal tree, and
+ * check that lookups and iterations with random seeks and directions give
+ * the same results. */
+int shardedFuzzTest(int keymode, size_t count, int mode, int numshards) {
+    raxSharded *s = raxShardedNew(numshards,mode,0);
+    rax *ref = raxNew();
+
+    printf("Sharded fuzz test in mode %d [%zu] %s, %d shards: ", keymode,
+        count, mode == RAX_SHARD_HASH ? "hash" : "prefix", numshards);
+    fflush(stdout);
+
+    raxShardedIterator it;
+    raxIterator ri;
+    raxShardedStart(&it,s);
+    raxStart(&ri,ref);
+    char *seekops[] = {"==",">=","<=",">","<","^","$"};
+    for (size_t i = 0; i < count; i++) {
+        unsigned char key[1024];
+        size_t keylen = int2key((char*)key,sizeof(key),rc4rand()%count,
+                                keymode);
+        void *val = (void*)(unsigned long)rc4rand();
+        int op = rc4rand() % 100;
+        if (op < 60) {
+            if (raxShardedInsert(s,key,keylen,val,NULL) !=
+                raxInsert(ref,key,keylen,val,NULL))
+            {
+                printf("Sharded fuzz: insertion mismatch\n");
+                return 1;
+            }
+        } else if (op < 80) {
+            if (raxShardedRemove(s,key,keylen,NULL) !=
+                raxRemove(ref,key,keylen,NULL))
+            {
+                printf("Sharded fuzz: removal mismatch\n");
+                return 1;
+            }
+        } else if (op < 95) {
+            if (raxShardedFind(s,key,keylen) != raxFind(ref,key,keylen)) {
+                printf("Sharded fuzz: lookup mismatch\n");
+                return 1;
+            }
+        } else {
+            char *seekop = seekops[rc4rand() % 7];
+            raxShardedSeek(&it,seekop,key,keylen);
+            raxSeek(&ri,seekop,key,keylen);
+            int steps = rc4rand() % 50;
+            for (int j = 0; j < steps; j++) {
+                int next = rc4rand() % 3 != 0;
+                int res = next ? raxShardedNext(&it) : raxShardedPrev(&it);
+                int rres = next ? raxNext(&ri) : raxPrev(&ri);
+                if (res != rres || (res && (it.key_len != ri.key_len ||
+                    memcmp(it.key,ri.key,it.key_len) || it.data != ri.data)))
+                {
+                    printf("Sharded fuzz: iterators mismatch\n");
+                    return 1;
+                }
+                if (!res) break;
+            }
+        }
+    }
+    if (raxShardedSize(s) != raxSize(ref)) {
+        printf("Sharded fuzz: %llu keys, %llu expected\n",
+            (unsigned long long)raxShardedSize(s),
+            (unsigned long long)raxSize(ref));
+        return 1;
+    }
+    printf("%llu keys\n", (unsigned long long)raxSize(ref));
+    raxShardedStop(&it);
+    raxStop(&ri);
+    raxShardedFree(s);
+    raxFree(ref);
+    return 0;
+}
+
+/* Check the 'count' boundaries returned by raxSplitRanges() for 'n' ranges
+ * of the tree 't', counting the keys of every range like a worker thread
+ * would do. The ranges must cover all the keys, and hold at most 'maxratio'
+ * times the keys of a perfectly balanced split, or, if 'maxratio' is zero,
+ * exactly the keys of the balanced split by rank. */
+int splitRangesCheck(rax *t, size_t n, raxBound *bounds, size_t count,
+                     double maxratio)
+{
+    uint64_t numele = raxSize(t), total = 0;
+    raxIterator it;
+    raxStart(&it,t);
+    for (size_t r = 0; r <= count; r++) {
+        uint64_t keys = 0;
+        if (r > 0) {
+            if (raxFind(t,bounds[r-1].key,bounds[r-1].key_len) ==
+                raxNotFound)
+            {
+                printf("Split ranges: boundary %zu is not a key\n", r-1);
+                return 1;
+            }
+            raxSeek(&it,">=",bounds[r-1].key,bounds[r-1].key_len);
+        } else {
+            raxSeek(&it,"^",NULL,0);
+        }
+        while(raxNext(&it)) {
+            if (r < count &&
+                !raxCompare(&it,"<",bounds[r].key,bounds[r].key_len)) break;
+            keys++;
+        }
+        /* In the exact split the range 'r' ends at the rank of the next
+         * boundary, that is the smallest of the ideal ranks above it. */
+        uint64_t start = total, end = numele;
+        total += keys;
+        if (maxratio == 0 && r < count) {
+            end = 0;
+            for (size_t i = 1; i < n && end <= start; i++)
+                end = i*numele/n;
+        }
+        if (keys == 0 || (maxratio == 0 && total != end) ||
+            (maxratio != 0 && keys > maxratio*numele/n+1))
+        {
+            printf("Split ranges: range %zu of %zu has %llu keys of %llu\n",
+                r, count+1, (unsigned long long)keys,
+                (unsigned long long)numele);
+            return 1;
+        }
+    }
+    raxStop(&it);
+    if (total != numele) {
+        printf("Split ranges: %llu keys in the ranges, %llu expected\n",
+            (unsigned long long)total, (unsigned long long)numele);
+        return 1;
+    }
+    return 0;
+}
+
+int splitRangesUnitTests(void) {
+    raxBound bounds[64];
+    for (int flags = 0; flags <= RAX_FLAG_RANK; flags += RAX_FLAG_RANK) {
+        rax *t = raxNewWithFlags(flags);
+
+        /* Empty trees and single ranges have no boundaries. */
+        if (raxSplitRanges(t,8,bounds) != 0 || errno != 0) {
+            printf("Split ranges: boundaries of the empty tree\n");
+            return 1;
+        }
+
+        /* Small trees are split exactly, even without subtree counts. */
+        for (int j = 0; j < 100; j++) {
+            char buf[16];
+            int len = snprintf(buf,sizeof(buf),"%04d",j);
+            raxInsert(t,(unsigned char*)buf,len,NULL,NULL);
+        }
+        size_t count = raxSplitRanges(t,4,bounds);
+        if (count != 3 || errno != 0 ||
+            bounds[0].key_len != 4 || memcmp(bounds[0].key,"0025",4) ||
+            bounds[1].key_len != 4 || memcmp(bounds[1].key,"0050",4) ||
+            bounds[2].key_len != 4 || memcmp(bounds[2].key,"0075",4) ||
+            raxSplitRanges(t,1,NULL) != 0)
+        {
+            printf("Split ranges: wrong boundaries of 100 keys\n");
+            return 1;
+        }
+        raxFreeBounds(bounds,count);
+
+        /* More ranges than keys: every range holds a single key. */
+        rax *small = raxNewWithFlags(flags);
+        raxInsert(small,(unsigned char*)"a",1,NULL,NULL);
+        raxInsert(small,(unsigned char*)"b",1,NULL,NULL);
+        raxInsert(small,(unsigned char*)"",0,NULL,NULL);
+        count = raxSplitRanges(small,64,bounds);
+        if (count != 2 || bounds[0].key_len != 1 || bounds[0].key[0] != 'a' ||
+            bounds[1].key_len != 1 || bounds[1].key[0] != 'b' ||
+            splitRangesCheck(small,64,bounds,count,0))
+        {
+            printf("Split ranges: wrong boundaries of 3 keys\n");
+            return 1;
+        }
+        raxFreeBounds(bounds,count);
+        raxFree(small);
+
+        /* Big trees: without subtree counts the split is estimated. */
+        for (int j = 0; j < 100000; j++) {
+            char buf[16];
+            int len = snprintf(buf,sizeof(buf),"key:%d",j*7);
+            raxInsert(t,(unsigned char*)buf,len,NULL,NULL);
+        }
+        /* The samples don't use rand(), whose sequence is not altered. */
+        srand(1234);
+        int next = rand();
+        srand(1234);
+        count = raxSplitRanges(t,16,bounds);
+        if (count != 15 || errno != 0 ||
+            splitRangesCheck(t,16,bounds,count,flags ? 0 : 2))
+        {
+            printf("Split ranges: wrong split of big tree\n");
+            return 1;
+        }
+        if (rand() != next) {
+            printf("Split ranges: the rand() sequence was altered\n");
+            return 1;
+        }
+        raxFreeBounds(bounds,count);
+        raxFree(t);
+    }
+    return 0;
+}
+
+/* Split random trees in a random number of ranges, checking that the ranges
+ * cover the tree and are balanced. */
+int splitRangesFuzzTest(int keymode, size_t count, int flags) {
+    rax *t = raxNewWithFlags(flags);
+    raxBound bounds[256];
+
+    printf("Split ranges fuzz test in mode %d [%zu]: ", keymode, count);
+    fflush(stdout);
+    for (size_t i = 0; i < count; i++) {
+        unsigned char key[1024];
+        size_t keylen = int2key((char*)key,sizeof(key),i,keymode);
+        raxInsert(t,key,keylen,NULL,NULL);
+    }
+    for (int j = 0; j < 10; j++) {
+        size_t n = 1+rc4rand()%256;
+        size_t numbounds = raxSplitRanges(t,n,bounds);
+        int exact = (flags & RAX_FLAG_RANK) ||
+                    raxSize(t) <= n*64; /* RAX_SPLIT_SAMPLES */
+        if (numbounds >= n || (n > 1 && raxSize(t) >= n && numbounds != n-1) ||
+            splitRangesCheck(t,n,bounds,numbounds,exact ? 0 : 3))
+        {
+            printf("Split ranges fuzz: %zu boundaries for %zu ranges\n",
+                numbounds, n);
+            return 1;
+        }
+        raxFreeBounds(bounds,numbounds);
+    }
+    printf("%llu keys\n", (unsigned long long)raxSize(t));
+    raxFree(t);
+    return 0;
+}
+
+/* In memory stream used by the stream dump tests. Writes fail once the
+ * stream would exceed 'maxlen' bytes. */
+typedef struct testStream {
+    unsigned char *buf;
+    size_t len, max, pos;
+    size_t maxlen;
+    char valbuf[32];        /* Bytes of the last value encoded. */
+    long decoded, freed;    /* Values decoded and released. */
+} testStream;
+
+int testStreamWrite(void *privdata, const void *buf, size_t len) {
+    testStream *ts = privdata;
+    if (ts->len+len > ts->maxlen) return 0;
+    if (ts->len+len > ts->max) {
+        ts->max = (ts->len+len)*2;
+        ts->buf = realloc(ts->buf,ts->max);
+    }
+    memcpy(ts->buf+ts->len,buf,len);
+    ts->len += len;
+    return 1;
+}
+
+size_t testStreamRead(void *privdata, void *buf, size_t len) {
+    testStream *ts = privdata;
+    if (len > ts->len-ts->pos) len = ts->len-ts->pos;
+    memcpy(buf,ts->buf+ts->pos,len);
+    ts->pos += len;
+    return len;
+}
+
+/* Odd values are stored in the stream as decimal strings, the others are
+ * stored as pointers. */
+int testStreamEncode(void *privdata, void *data, const void **buf, size_t *len) {
+    testStream *ts = privdata;
+    if ((unsigned long)data % 2 == 0) return 0;
+    *len = snprintf(ts->valbuf,sizeof(ts->valbuf),"%lu",(unsigned long)data);
+    *buf = ts->valbuf;
+    return 1;
+}
+
+/* Decode the values stored as decimal strings, that are the odd values
+ * and the inline values of the tests, into allocated copies. The copies
+ * are tagged setting the lowest bit of the pointer, so that they can be
+ * told apart from the even values, that are stored as pointers. */
+testStream *testStreamCurrent;
+int testStreamDecode(void *privdata, const unsigned char *buf, size_t len, void **data) {
+    testStream *ts = privdata;
+    char num[32];
+    if (len == 0 || len >= sizeof(num)) return 0;
+    memcpy(num,buf,len);
+    num[len] = '\0';
+    unsigned long *v = malloc(sizeof(*v));
+    *v = strtoul(num,NULL,10);
+    *data = (char*)v+1;
+    ts->decoded++;
+    return 1;
+}
+
+void testStreamFree(void *data) {
+    if (!((unsigned long)data & 1)) return;
+    testStreamCurrent->freed++;
+    free((char*)data-1);
+}
+
+/* Check that the tree 'loaded' has the keys of 'orig', with the values
+ * restored by the callbacks above, and release the decoded values. */
+int testStreamCompare(rax *orig, rax *loaded) {
+    raxIterator a, b;
+    raxStart(&a,orig);
+    raxStart(&b,loaded);
+    raxSeek(&a,"^",NULL,0);
+    raxSeek(&b,"^",NULL,0);
+    int err = 0;
+    while(raxNext(&a)) {
+        if (!raxNext(&b) || a.key_len != b.key_len ||
+            memcmp(a.key,b.key,a.key_len))
+        {
+            err = 1;
+            break;
+        }
+        unsigned long v = (unsigned long)a.data;
+        if (a.data_len) {
+            char num[32];
+            memcpy(num,a.data,a.data_len);
+            num[a.data_len] = '\0';
+            v = strtoul(num,NULL,10);
+        }
+        int decoded = a.data_len || v % 2;
+        if (decoded ? *(unsigned long*)((char*)b.data-1) != v :
+                      b.data != a.data)
+        {
+            err = 1;
+            break;
+        }
+        if (decoded) free((char*)b.data-1);
+    }
+    if (!err && raxNext(&b)) err = 1;
+    raxStop(&a);
+    raxStop(&b);
+    if (err) printf("Stream dump: loaded tree differs\n");
+    return err;
+}
+
+int streamUnitTests(void) {
+    testStream ts = {NULL,0,0,0,SIZE_MAX,{0},0,0};
+    testStreamCurrent = &ts;
+
+    /* Empty trees: the header and the last block. */
+    rax *t = raxNew(), *l = raxNew();
+    if (!raxDumpStream(t,testStreamWrite,NULL,&ts) || ts.len != 8+16+8 ||
+        !raxLoadStream(l,testStreamRead,NULL,NULL,&ts) || errno != 0 ||
+        raxSize(l) != 0 || ts.pos != ts.len)
+    {
+        printf("Stream dump: empty tree\n");
+        return 1;
+    }
+    raxFree(l);
+
+    /* Every kind of value: NULL, pointers, encoded and inline. */
+    char *keys[] = {"","a","alpha","alphabet","alps","b","beta",NULL};
+    for (int j = 0; keys[j]; j++) {
+        void *data = j == 0 ? NULL : (void*)(long)j;
+        raxInsert(t,(unsigned char*)keys[j],strlen(keys[j]),data,NULL);
+    }
+    raxInsertInline(t,(unsigned char*)"inline",6,"12345",5);
+    ts.len = 0;
+    if (!raxDumpStream(t,testStreamWrite,testStreamEncode,&ts)) {
+        printf("Stream dump: dump failed\n");
+        return 1;
+    }
+
+    /* The stream can be followed by other data, that is not read. */
+    testStreamWrite(&ts,"trailer",7);
+    ts.pos = 0;
+    ts.decoded = 0;
+    l = raxNewWithFlags(RAX_FLAG_RANK);
+    if (!raxLoadStream(l,testStreamRead,testStreamDecode,testStreamFree,&ts) ||
+        ts.decoded != 4 || ts.pos != ts.len-7 || raxSize(l) != 8 ||
+        raxRank(l,(unsigned char*)"beta",4) != 6 ||
+        testStreamCompare(t,l))
+    {
+        printf("Stream dump: wrong tree loaded\n");
+        return 1;
+    }
+    raxFree(l);
+    ts.len -= 7;
+
+    /* Loading needs an empty tree, and a decoder for the values stored as
+     * bytes. */
+    ts.pos = 0;
+    if (raxLoadStream(t,testStreamRead,testStreamDecode,NULL,&ts) ||
+        errno != EINVAL)
+    {
+        printf("Stream dump: loaded into a non empty tree\n");
+        return 1;
+    }
+    ts.pos = 0;
+    l = raxNew();
+    if (raxLoadStream(l,testStreamRead,NULL,NULL,&ts) || errno != EINVAL ||
+        raxSize(l) != 0 || l->numnodes != 1)
+    {
+        printf("Stream dump: loaded without a value decoder\n");
+        return 1;
+    }
+
+    /* Truncated and corrupted streams are detected, leaving the tree empty
+     * and releasing the values already decoded. */
+    size_t len = ts.len;
+    for (size_t j = 0; j < len*9; j++) {
+        int truncate = j < len;
+        size_t byte = j % len;
+        unsigned char orig = ts.buf[byte];
+        if (truncate) ts.len = j;
+        else ts.buf[byte] ^= 1 << (j/len-1);
+        ts.pos = 0;
+        ts.decoded = ts.freed = 0;
+        int res = raxLoadStream(l,testStreamRead,testStreamDecode,
+                                testStreamFree,&ts);
+        ts.len = len;
+        ts.buf[byte] = orig;
+        if (res || errno != (truncate ? EIO : EINVAL) || raxSize(l) != 0 ||
+            l->numnodes != 1 || ts.decoded != ts.freed)
+        {
+            printf("Stream dump: %s stream at byte %zu loaded\n",
+                truncate ? "truncated" : "corrupted", byte);
+            return 1;
+        }
+    }
+
+    /* A block header with a valid checksum, but a payload longer than the
+     * writer can produce, is rejected before allocating the payload. */
+    unsigned char forged[8+16];
+    memcpy(forged,ts.buf,8);
+    uint32_t hdr[3] = {0xfffffff0,1,0}, crc = 0xffffffff;
+    for (int j = 0; j < 12; j++) forged[8+j] = hdr[j/4] >> (j%4*8);
+    for (int j = 0; j < 8; j++) {
+        crc ^= forged[8+j];
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+    crc = ~crc;
+    for (int j = 0; j < 4; j++) forged[20+j] = crc >> (j*8);
+    testStream fs = {forged,sizeof(forged),sizeof(forged),0,SIZE_MAX,{0},0,0};
+    if (raxLoadStream(l,testStreamRead,testStreamDecode,NULL,&fs) ||
+        errno != EINVAL || fs.pos != sizeof(forged))
+    {
+        printf("Stream dump: oversized block not rejected\n");
+        return 1;
+    }
+
+    /* Write errors. */
+    for (size_t j = 0; j < len; j++) {
+        ts.len = 0;
+        ts.maxlen = j;
+        if (raxDumpStream(t,testStreamWrite,testStreamEncode,&ts) ||
+            errno != EIO)
+        {
+            printf("Stream dump: write error not reported\n");
+            return 1;
+        }
+    }
+    ts.maxlen = SIZE_MAX;
+    raxFree(t);
+
+    /* Big trees are written in many blocks, and are much smaller than
+     * the keys thanks to the shared prefixes. */
+    t = raxNew();
+    size_t keybytes = 0;
+    for (int j = 0; j < 100000; j++) {
+        char buf[32];
+        int klen = snprintf(buf,sizeof(buf),"user:%08d",j);
+        raxInsert(t,(unsigned char*)buf,klen,NULL,NULL);
+        keybytes += klen;
+    }
+    ts.len = 0;
+    ts.pos = 0;
+    if (!raxDumpStream(t,testStreamWrite,testStreamEncode,&ts) ||
+        ts.len > keybytes/2 ||
+        !raxLoadStream(l,testStreamRead,testStreamDecode,NULL,&ts) ||
+        testStreamCompare(t,l))
+    {
+        printf("Stream dump: big tree, %zu bytes for %zu bytes of keys\n",
+            ts.len, keybytes);
+        return 1;
+    }
+    raxFree(t);
+    raxFree(l);
+    free(ts.buf);
+    return 0;
+}
+
+/* Dump random trees, load them back into trees of different kinds, and
+ * check that random corruptions or truncations are detected. */
+int streamFuzzTest(int keymode, size_t count, int flags) {
+    rax *t = raxNew();
+    rax *l = newTestRax(flags);
+    testStream ts = {NULL,0,0,0,SIZE_MAX,{0},0,0};
+    testStreamCurrent = &ts;
+
+    printf("Stream dump fuzz test in mode %d [%zu]: ", keymode, count);
+    fflush(stdout);
+    for (size_t i = 0; i < count; i++) {
+        unsigned char key[1024];
+        size_t keylen = int2key((char*)key,sizeof(key),i,keymode);
+        if (rc4rand() % 8 == 0) {
+            char num[32];
+            int vlen = snprintf(num,sizeof(num),"%lu",
+                                (unsigned long)rc4rand());
+            raxInsertInline(t,key,keylen,num,vlen);
+        } else {
+            raxInsert(t,key,keylen,(void*)(unsigned long)rc4rand(),NULL);
+        }
+    }
+    if (!raxDumpStream(t,testStreamWrite,testStreamEncode,&ts) ||
+        !raxLoadStream(l,testStreamRead,testStreamDecode,NULL,&ts) ||
+        testStreamCompare(t,l) || memoryCheckTree(l,"Stream dump fuzz"))
+    {
+        printf("Stream dump fuzz: %llu keys\n",
+            (unsigned long long)raxSize(t));
+        return 1;
+    }
+    raxFree(l);
+
+    for (int j = 0; j < 10; j++) {
+        size_t len = ts.len, byte = rc4rand() % len;
+        unsigned char orig = ts.buf[byte];
+        int truncate = rc4rand() % 2;
+        if (truncate) ts.len = byte;
+        else ts.buf[byte] ^= 1 << (rc4rand() % 8);
+        l = newTestRax(flags);
+        ts.pos = 0;
+        ts.decoded = ts.freed = 0;
+        int res = raxLoadStream(l,testStreamRead,testStreamDecode,
+                                testStreamFree,&ts);
+        ts.len = len;
+        ts.buf[byte] = orig;
+        if (res || raxSize(l) != 0 || ts.decoded != ts.freed) {
+            printf("Stream dump fuzz: damaged stream at byte %zu loaded\n",
+                byte);
+            return 1;
+        }
+        raxFree(l);
+    }
+    printf("%zu bytes\n", ts.len);
+    raxFree(t);
+    free(ts.buf);
+    return 0;
+}
+
+/* raxForEachPrefix() callback used by the tests: it stores the lengths of
+ * the keys found in the array 'privdata', whose first item is the number
+ * of lengths stored, stopping after 'prefixLimit' keys. */
+long prefixLimit = 0;
+int prefixCollect(void *privdata, unsigned char *key, size_t len, void *data) {
+    long *found = privdata;
+    (void)key; (void)data;
+    found[1+found[0]++] = len;
+    return found[0] != prefixLimit;
+}
+
+int prefixUnitTests(void) {
+    rax *t = raxNewWithFlags(RAX_FLAG_DENSE);
+    char *routes[] = {"10.","10.1.","10.1.2.","10.1.2.3","192.168.",
+                      "192.168.1.",NULL};
+    for (int j = 0; routes[j]; j++)
+        raxInsert(t,(unsigned char*)routes[j],strlen(routes[j]),
+                  (void*)(long)(j+1),NULL);
+
+    /* The longest match, even in the middle of compressed nodes. */
+    struct {
+        char *addr;
+        void *data;
+        size_t matched;
+    } tests[] = {
+        {"10.1.2.3",(void*)4,8},
+        {"10.1.2.4",(void*)3,7},
+        {"10.1.20.1",(void*)2,5},
+        {"10.2.0.1",(void*)1,3},
+        {"10",raxNotFound,0},
+        {"192.168.10.1",(void*)5,8},
+        {"192.168.1.1",(void*)6,10},
+        {"192.16",raxNotFound,0},
+        {"",raxNotFound,0},
+        {NULL,NULL,0}
+    };
+    for (int j = 0; tests[j].addr; j++) {
+        size_t matched = 12345;
+        void *data = raxFindLongestPrefix(t,(unsigned char*)tests[j].addr,
+                                          strlen(tests[j].addr),&matched);
+        if (data != tests[j].data ||
+            (data != raxNotFound && matched != tests[j].matched) ||
+            (data == raxNotFound && matched != 12345))
+        {
+            printf("Longest prefix of %s: %p, %zu bytes\n", tests[j].addr,
+                data, matched);
+            return 1;
+        }
+    }
+
+    /* All the prefixes, from the shortest, with the empty key as well. */
+    raxInsertInline(t,(unsigned char*)"",0,"default",7);
+    long found[16] = {0};
+    prefixLimit = 0;
+    size_t calls = raxForEachPrefix(t,(unsigned char*)"10.1.2.3.4",10,
+                                    prefixCollect,found);
+    if (calls != 5 || found[0] != 5 || found[1] != 0 || found[2] != 3 ||
+        found[3] != 5 || found[4] != 7 || found[5] != 8)
+    {
+        printf("Prefixes of 10.1.2.3.4: %zu found\n", calls);
+        return 1;
+    }
+    size_t matched;
+    char *dflt = raxFindLongestPrefix(t,(unsigned char*)"172.16.0.1",10,
+                                      &matched);
+    if (dflt == raxNotFound || matched != 0 || memcmp(dflt,"default",7)) {
+        printf("Longest prefix: default route not found\n");
+        return 1;
+    }
+
+    /* The callback can stop the walk. */
+    found[0] = 0;
+    prefixLimit = 2;
+    calls = raxForEachPrefix(t,(unsigned char*)"10.1.2.3",8,
+                             prefixCollect,found);
+    if (calls != 2 || found[0] != 2 || found[2] != 3) {
+        printf("Prefixes: the walk was not stopped\n");
+        return 1;
+    }
+    raxFree(t);
+    return 0;
+}
+
+/* Compare the prefix lookups with raxFind() calls for every prefix of
+ * random strings. */
+int prefixFuzzTest(int keymode, size_t count, int flags) {
+    rax *t = newTestRax(flags);
+
+    printf("Prefix lookup fuzz test in mode %d [%zu]: ", keymode, count);
+    fflush(stdout);
+    for (size_t i = 0; i < count; i++) {
+        unsigned char key[1024];
+        size_t keylen = int2key((char*)key,sizeof(key),rc4rand()%count,
+                                keymode);
+        if (rc4rand() % 5 == 0) raxRemove(t,key,keylen,NULL);
+        else raxInsert(t,key,keylen,(void*)(unsigned long)i,NULL);
+    }
+    for (size_t i = 0; i < count; i++) {
+        /* Keys of the tree extended with random bytes, and random
+         * strings. */
+        unsigned char s[1024+8];
+        size_t len = int2key((char*)s,1024,rc4rand()%count,keymode);
+        size_t extra = rc4rand() % 8;
+        for (size_t j = 0; j < extra; j++) s[len++] = rc4rand() % 4 + 'A';
+
+        long found[1024+10] = {0};
+        size_t matched = 0, expected = 0;
+        void *data = raxFindLongestPrefix(t,s,len,&matched);
+        void *expdata = raxNotFound;
+        prefixLimit = 0;
+        size_t calls = raxForEachPrefix(t,s,len,prefixCollect,found);
+        size_t numprefixes = 0;
+        for (size_t l = 0; l <= len; l++) {
+            void *v = raxFind(t,s,l);
+            if (v == raxNotFound) continue;
+            if (found[0] <= (long)numprefixes ||
+                found[1+numprefixes] != (long)l)
+            {
+                printf("Prefix fuzz: prefix of %zu bytes not reported\n", l);
+                return 1;
+            }
+            numprefixes++;
+            expdata = v;
+            expected = l;
+        }
+        if (data != expdata || (data != raxNotFound && matched != expected) ||
+            calls != numprefixes || found[0] != (long)numprefixes)
+        {
+            printf("Prefix fuzz: longest prefix %zu bytes, %zu expected\n",
+                matched, expected);
+            return 1;
+        }
+    }
+    printf("ok\n");
+    raxFree(t);
+    return 0;
+}
+
+/* Check that the iterator of the tree with leaf buckets 'b' returns the
+ * same keys of the plain tree 't', in both the directions, after seeking
+ * 'key' with the operator 'op'. Returns 0 on success, 1 on error. */
+int bucketCheckSeek(rax *t, rax *b, const char *op, unsigned char *key, size_t len) {
+    raxIterator it1, it2;
+    raxStart(&it1,t);
+    raxStart(&it2,b);
+    for (int dir = 0; dir < 2; dir++) {
+        raxSeek(&it1,op,key,len);
+        raxSeek(&it2,op,key,len);
+        for (int steps = 0; steps < 50; steps++) {
+            int r1 = dir ? raxPrev(&it1) : raxNext(&it1);
+            int r2 = dir ? raxPrev(&it2) : raxNext(&it2);
+            if (r1 != r2 || (r1 && (it1.key_len != it2.key_len ||
+                memcmp(it1.key,it2.key,it1.key_len) ||
+                it1.data != it2.data)))
+            {
+                printf("Buckets: seek %s %.*s differs after %d steps\n",
+                    op, (int)len, (char*)key, steps);
+                return 1;
+            }
+            if (!r1) break;
+        }
+    }
+    raxStop(&it1);
+    raxStop(&it2);
+    return 0;
+}
+
+int bucketUnitTests(void) {
+    /* The flag can't be used with subtree counts and concurrent trees. */
+    errno = 0;
+    if (raxNewWithFlags(RAX_FLAG_BUCKETS|RAX_FLAG_RANK) != NULL ||
+        errno != EINVAL ||
+        raxNewWithFlags(RAX_FLAG_BUCKETS|RAX_FLAG_CONCURRENT) != NULL ||
+        errno != EINVAL)
+    {
+        printf("Buckets: incompatible flags accepted\n");
+        return 1;
+    }
+
+    /* The same keys need fewer nodes and less memory with buckets. */
+    rax *t = raxNew();
+    rax *b = raxNewWithFlags(RAX_FLAG_BUCKETS);
+    unsigned char key[64];
+    for (int j = 0; j < 10000; j++) {
+        size_t len = int2key((char*)key,sizeof(key),j,KEY_RANDOM_ALPHA);
+        raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+        raxInsert(b,key,len,(void*)(long)(j+1),NULL);
+        if (j % 3 == 0) {
+            len = int2key((char*)key,sizeof(key),j,KEY_INT);
+            raxInsert(t,key,len,NULL,NULL);
+            raxInsert(b,key,len,NULL,NULL);
+        }
+    }
+    raxTreeStats stats;
+    raxStats(b,&stats);
+    if (raxSize(b) != raxSize(t) || stats.keys != raxSize(b) ||
+        stats.buckets == 0 || b->numnodes >= t->numnodes ||
+        raxMemoryUsage(b) >= raxMemoryUsage(t) || memoryCheckTree(b,"Buckets"))
+    {
+        printf("Buckets: %llu keys, %llu nodes, %llu buckets, %zu bytes\n",
+            (unsigned long long)raxSize(b), (unsigned long long)b->numnodes,
+            (unsigned long long)stats.buckets, (size_t)raxMemoryUsage(b));
+        return 1;
+    }
+
+    /* Seeks inside buckets and between them. */
+    const char *ops[] = {"^","$","=",">=",">","<=","<"};
+    for (int j = 0; j < 1000; j++) {
+        size_t len = int2key((char*)key,sizeof(key),rc4rand()%12000,
+                             j % 2 ? KEY_RANDOM_ALPHA : KEY_INT);
+        if (j % 4 == 0) len = rc4rand() % (len+1);
+        if (bucketCheckSeek(t,b,ops[j%7],key,len)) return 1;
+    }
+    raxFree(t);
+    raxFree(b);
+
+    /* Keys with a common prefix burst the bucket into a compressed node
+     * and a branching node with buckets as children. */
+    b = raxNewWithFlags(RAX_FLAG_BUCKETS);
+    for (int j = 0; j < 17; j++) {
+        int len = snprintf((char*)key,sizeof(key),"user:%c%d",'a'+j%4,j);
+        raxInsert(b,key,len,(void*)(long)(j+1),NULL);
+    }
+    raxStats(b,&stats);
+    if (raxSize(b) != 17 || stats.buckets != 4 || b->numnodes != 6 ||
+        raxFind(b,(unsigned char*)"user:b13",8) != (void*)14 ||
+        memoryCheckTree(b,"Buckets burst"))
+    {
+        printf("Buckets: wrong burst, %llu nodes, %llu buckets\n",
+            (unsigned long long)b->numnodes,
+            (unsigned long long)stats.buckets);
+        return 1;
+    }
+
+    /* Large inline values don't fit, and burst the bucket as well. */
+    unsigned char val[300];
+    memset(val,'v',sizeof(val));
+    raxInsertInline(b,(unsigned char*)"user:a0x",8,val,sizeof(val));
+    raxInsertInline(b,(unsigned char*)"user:a0y",8,val,sizeof(val)-1);
+    size_t vlen;
+    unsigned char *v = raxFindInline(b,(unsigned char*)"user:a0y",8,&vlen);
+    if (v == NULL || vlen != sizeof(val)-1 || memcmp(v,val,vlen) ||
+        raxFind(b,(unsigned char*)"user:a0",7) != (void*)1 ||
+        memoryCheckTree(b,"Buckets inline"))
+    {
+        printf("Buckets: large inline values lost\n");
+        return 1;
+    }
+
+    /* Set operations and images are not supported. */
+    rax *other = raxNew();
+    size_t imglen;
+    errno = 0;
+    if (raxMerge(other,b,NULL,NULL) || errno != EINVAL ||
+        raxSerialize(b,NULL,NULL,&imglen) != NULL || errno != EINVAL)
+    {
+        printf("Buckets: unsupported operations did not fail\n");
+        return 1;
+    }
+    raxFree(other);
+
+    /* Removing all the keys frees the buckets. */
+    raxIterator it;
+    raxStart(&it,b);
+    raxSeek(&it,"^",NULL,0);
+    while(raxNext(&it)) {
+        raxRemove(b,it.key,it.key_len,NULL);
+        raxSeek(&it,">",it.key,it.key_len);
+    }
+    raxStop(&it);
+    if (raxSize(b) != 0 || b->numnodes != 1 || memoryCheckTree(b,"Buckets"))
+    {
+        printf("Buckets: %llu nodes left after removing all the keys\n",
+            (unsigned long long)b->numnodes);
+        return 1;
+    }
+    raxFree(b);
+
+    /* Out of memory while bursting: the keys are still there. */
+    long left = -1;
+    raxAllocator alloc = {countdownMalloc,countdownRealloc,failingFree,
+                          NULL,&left};
+    for (long fail = 0; ; fail++) {
+        b = raxNewWithAllocator(&alloc,RAX_FLAG_BUCKETS);
+        for (int j = 0; j < 16; j++) {
+            int len = snprintf((char*)key,sizeof(key),"key:%c",'a'+j);
+            raxInsert(b,key,len,(void*)(long)(j+1),NULL);
+        }
+        left = fail;
+        errno = 0;
+        int retval = raxInsert(b,(unsigned char*)"key:q",5,(void*)17,NULL);
+        left = -1;
+        if ((!retval && errno != ENOMEM) || raxSize(b) != 16+(size_t)retval ||
+            memoryCheckTree(b,"Buckets OOM"))
+        {
+            printf("Buckets: out of memory left the tree in a bad state\n");
+            return 1;
+        }
+        for (int j = 0; j < 16; j++) {
+            int len = snprintf((char*)key,sizeof(key),"key:%c",'a'+j);
+            if (raxFind(b,key,len) != (void*)(long)(j+1)) {
+                printf("Buckets: key lost on out of memory\n");
+                return 1;
+            }
+        }
+        raxFree(b);
+        if (retval) break;
+    }
+    return 0;
+}
+
+/* Check that the iterator 'it' returns all the keys of 't' in order,
+ * comparing it with a normal iterator. Returns 0 on success, 1 on error. */
+int iteratorBuffersCheck(raxIterator *it, rax *t) {
+    raxIterator ref;
+    raxStart(&ref,t);
+    raxSeek(&ref,"^",NULL,0);
+    raxSeek(it,"^",NULL,0);
+    while(1) {
+        int r1 = raxNext(&ref), r2 = raxNext(it);
+        if (r1 != r2 || (r1 && (ref.key_len != it->key_len ||
+            memcmp(ref.key,it->key,ref.key_len) || ref.data != it->data)))
+        {
+            printf("Iterator buffers: wrong key %.*s\n",
+                (int)it->key_len, (char*)it->key);
+            return 1;
+        }
+        if (!r1) break;
+    }
+    raxStop(&ref);
+    return 0;
+}
+
+int iteratorBuffersUnitTests(void) {
+    /* Long keys, and a chain of keys as deep as the tree can be. */
+    rax *t = raxNew();
+    unsigned char key[400];
+    for (int j = 0; j < 1000; j++) {
+        size_t len = 150+j%250;
+        memset(key,'k',len);
+        int2key((char*)key+len-16,16,j,KEY_HEX);
+        raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+    }
+    for (int j = 0; j < 100; j++) {
+        size_t len = int2key((char*)key,sizeof(key),j,KEY_CHAIN);
+        raxInsert(t,key,len,(void*)(long)(j+1),NULL);
+    }
+
+    /* With large enough buffers the iterator uses only them. */
+    unsigned char keybuf[512];
+    void *stackbuf[512];
+    raxIterator it;
+    raxStartWithBuffers(&it,t,keybuf,sizeof(keybuf),stackbuf,
+                        sizeof(stackbuf));
+    if (iteratorBuffersCheck(&it,t)) return 1;
+    for (int j = 0; j < 100; j++) {
+        size_t len = j % 4 ? 150+rc4rand()%250 : rc4rand()%100;
+        memset(key,j % 4 ? 'k' : 'A',len);
+        raxSeek(&it,j % 2 ? "<=" : ">",key,len);
+        raxNext(&it);
+    }
+    if (it.key != keybuf || it.key_onheap || it.stack.onheap ||
+        it.stack.stack != stackbuf)
+    {
+        printf("Iterator buffers: the caller buffers were not used\n");
+        return 1;
+    }
+
+    /* Resetting keeps the buffers, even to iterate another tree. */
+    rax *small = raxNew();
+    raxInsert(small,(unsigned char*)"a",1,NULL,NULL);
+    raxIteratorReset(&it,small);
+    if (raxNext(&it) || iteratorBuffersCheck(&it,small) ||
+        it.key != keybuf || it.stack.stack != stackbuf)
+    {
+        printf("Iterator buffers: wrong reset\n");
+        return 1;
+    }
+    raxStop(&it);
+
+    /* Small buffers are not used, and larger keys or paths allocate new
+     * buffers, that are kept by the reset, and freed by raxStop(). */
+    raxStartWithBuffers(&it,t,keybuf,RAX_ITER_STATIC_LEN/2,stackbuf,
+                        RAX_ITER_STACK_ITEM_LEN*(RAX_STACK_STATIC_ITEMS/2));
+    if (it.key != it.key_static_string ||
+        it.stack.maxitems != RAX_STACK_STATIC_ITEMS)
+    {
+        printf("Iterator buffers: small buffers used\n");
+        return 1;
+    }
+    raxStop(&it);
+    raxStartWithBuffers(&it,t,keybuf,200,stackbuf,RAX_ITER_STACK_ITEM_LEN*40);
+    if (iteratorBuffersCheck(&it,t) || !it.key_onheap || !it.stack.onheap)
+        return 1;
+    unsigned char *grown = it.key;
+    void **path = it.stack.stack;
+    raxIteratorReset(&it,NULL);
+    if (iteratorBuffersCheck(&it,t) || it.key != grown ||
+        it.stack.stack != path)
+    {
+        printf("Iterator buffers: grown buffers not kept\n");
+        return 1;
+    }
+    raxStop(&it);
+
+    /* The iterators of frozen images can be reset as well. */
+    size_t imglen;
+    unsigned char *img = raxSerialize(t,NULL,NULL,&imglen);
+    raxFrozen f;
+    if (img == NULL || !raxFrozenOpen(&f,img,imglen)) {
+        printf("Iterator buffers: can't serialize the tree\n");
+        return 1;
+    }
+    raxFrozenStart(&it,&f);
+    raxSeek(&it,"$",NULL,0);
+    raxIteratorReset(&it,NULL);
+    if (iteratorBuffersCheck(&it,t)) return 1;
+    raxStop(&it);
+    free(img);
+    raxFree(small);
+    raxFree(t);
+    return 0;
+}
+
+/* Merge callback used by the tests: the new value is the sum of the two
+ * values, or, for inline values, the one of the second tree. */
+long mergeCalls = 0;
+void *mergeSum(void *privdata, unsigned char *key, size_t len, void *a, void *b) {
+    (void)key; (void)len;
+    mergeCalls++;
+    if (privdata) return b;
+    return (void*)((unsigned long)a+(unsigned long)b);
+}
+
+int setOpsUnitTests(void) {
+    char *akeys[] = {"foo","foobar","zip","alpha","",NULL};
+    char *bkeys[] = {"fo","foobar","footer","zap","zipper","alpha",NULL};
+    rax *a = raxNewWithFlags(RAX_FLAG_RANK);
+    rax *b = raxNewWithFlags(RAX_FLAG_RANK);
+    for (int j = 0; akeys[j]; j++)
+        raxInsert(a,(unsigned char*)akeys[j],strlen(akeys[j]),
+                  (void*)(long)(j+1),NULL);
+    for (int j = 0; bkeys[j]; j++)
+        raxInsert(b,(unsigned char*)bkeys[j],strlen(bkeys[j]),
+                  (void*)(long)(100+j),NULL);
+
+    /* Union: "foobar" and "alpha" are resolved by the callback, the other
+     * keys of the second tree are moved, leaving it empty. */
+    mergeCalls = 0;
+    if (!raxMerge(a,b,mergeSum,NULL) || errno != 0 || raxSize(a) != 9 ||
+        raxSize(b) != 0 || b->numnodes != 1 || mergeCalls != 2 ||
+        raxFind(a,(unsigned char*)"foobar",6) != (void*)103 ||
+        raxFind(a,(unsigned char*)"alpha",5) != (void*)109 ||
+        raxFind(a,(unsigned char*)"zipper",6) != (void*)104 ||
+        raxFind(a,(unsigned char*)"foo",3) != (void*)1 ||
+        raxRank(a,(unsigned char*)"zipper",6) != 8 ||
+        memoryCheckTree(a,"Merge") || memoryCheckTree(b,"Merge"))
+    {
+        printf("raxMerge() failed\n");
+        return 1;
+    }
+
+    /* The result is as compact as the tree created inserting the keys. */
+    rax *check = raxNewWithFlags(RAX_FLAG_RANK);
+    for (int j = 0; akeys[j]; j++)
+        raxInsert(check,(unsigned char*)akeys[j],strlen(akeys[j]),NULL,NULL);
+    for (int j = 0; bkeys[j]; j++)
+        raxInsert(check,(unsigned char*)bkeys[j],strlen(bkeys[j]),NULL,NULL);
+    if (check->numnodes != a->numnodes) {
+        printf("raxMerge(): %llu nodes, %llu expected\n",
+            (unsigned long long)a->numnodes,
+            (unsigned long long)check->numnodes);
+        return 1;
+    }
+    raxFree(check);
+
+    /* Intersection and difference with a tree that is not modified. */
+    char *ckeys[] = {"foo","foot","footer","zap","zip",NULL};
+    rax *c = raxNewWithFlags(RAX_FLAG_RANK);
+    for (int j = 0; ckeys[j]; j++)
+        raxInsert(c,(unsigned char*)ckeys[j],strlen(ckeys[j]),
+                  (void*)(long)(1000+j),NULL);
+    freedValues = 0;
+    if (!raxIntersect(a,c,NULL,NULL,countFreedValue) || raxSize(a) != 4 ||
+        raxSize(c) != 5 || freedValues != 5 ||
+        raxFind(a,(unsigned char*)"footer",6) != (void*)102 ||
+        raxFind(a,(unsigned char*)"foobar",6) != raxNotFound ||
+        raxFind(a,(unsigned char*)"",0) != raxNotFound ||
+        memoryCheckTree(a,"Intersect"))
+    {
+        printf("raxIntersect() failed\n");
+        return 1;
+    }
+    freedValues = 0;
+    raxRemove(c,(unsigned char*)"zip",3,NULL);
+    if (!raxDifference(a,c,countFreedValue) || raxSize(a) != 1 ||
+        freedValues != 3 || raxFind(a,(unsigned char*)"zip",3) != (void*)3 ||
+        raxRank(a,(unsigned char*)"zip",3) != 0 ||
+        memoryCheckTree(a,"Difference"))
+    {
+        printf("raxDifference() failed\n");
+        return 1;
+    }
+
+    /* Incompatible trees. */
+    rax *d = raxNewWithFlags(RAX_FLAG_CONCURRENT);
+    rax *e = raxNew();
+    errno = 0;
+    if (raxMerge(a,e,NULL,NULL) || errno != EINVAL ||
+        raxMerge(d,a,NULL,NULL) || errno != EINVAL ||
+        raxIntersect(d,a,NULL,NULL,NULL) || errno != EINVAL ||
+        raxDifference(a,a,NULL) || errno != EINVAL ||
+        !raxDifference(e,d,NULL))
+    {
+        printf("Set operations accepted incompatible trees\n");
+        return 1;
+    }
+
+    /* Forked trees can't be modified by set operations, but once their
+     * forks are freed they are like any other tree. */
+    rax *f = raxNew(), *g = raxNew(), *h = raxNew(), *m = raxNew();
+    char *fkeys[] = {"bar","foo","zap","zip",NULL};
+    for (int j = 0; fkeys[j]; j++)
+        raxInsert(f,(unsigned char*)fkeys[j],3,NULL,NULL);
+    raxInsert(g,(unsigned char*)"foo",3,NULL,NULL);
+    raxInsert(g,(unsigned char*)"zap",3,NULL,NULL);
+    raxInsert(h,(unsigned char*)"zap",3,NULL,NULL);
+    raxInsert(m,(unsigned char*)"abc",3,NULL,NULL);
+    rax *fork = raxFork(f);
+    if (raxDifference(f,h,NULL) || errno != EINVAL ||
+        raxMerge(m,f,NULL,NULL) || errno != EINVAL)
+    {
+        printf("Set operations accepted a forked tree\n");
+        return 1;
+    }
+    raxFree(fork);
+    raxFree(raxFork(f));
+    if (!raxIntersect(f,g,NULL,NULL,NULL) || raxSize(f) != 2) {
+        printf("raxIntersect() failed after freeing the fork\n");
+        return 1;
+    }
+    raxFree(raxFork(f));
+    if (!raxDifference(f,h,NULL) || raxSize(f) != 1) {
+        printf("raxDifference() failed after freeing the fork\n");
+        return 1;
+    }
+    raxFree(raxFork(f));
+    if (!raxMerge(m,f,NULL,NULL) || raxSize(m) != 2 || raxSize(f) != 0 ||
+        raxFind(m,(unsigned char*)"foo",3) != NULL ||
+        memoryCheckTree(m,"Merge after fork"))
+    {
+        printf("raxMerge() failed after freeing the fork\n");
+        return 1;
+    }
+    raxFree(f);
+    raxFree(g);
+    raxFree(h);
+    raxFree(m);
+    raxFree(a);
+    raxFree(b);
+    raxFree(c);
+    raxFree(d);
+    raxFree(e);
+
+    /* Inline values: the callback keeps one of the two values by
+     * returning it, and moved subtrees keep their values. */
+    a = raxNew();
+    b = raxNew();
+    raxInsertInline(a,(unsigned char*)"key",3,"abc",3);
+    raxInsertInline(b,(unsigned char*)"key",3,"defgh",5);
+    raxInsertInline(b,(unsigned char*)"other",5,"xy",2);
+    size_t vlen;
+    void *val;
+    if (!raxMerge(a,b,mergeSum,(void*)1) ||
+        (val = raxFindInline(a,(unsigned char*)"key",3,&vlen)) == NULL ||
+        vlen != 5 || memcmp(val,"defgh",5) ||
+        (val = raxFindInline(a,(unsigned char*)"other",5,&vlen)) == NULL ||
+        vlen != 2 || memcmp(val,"xy",2) || memoryCheckTree(a,"Merge"))
+    {
+        printf("raxMerge() of inline values failed\n");
+        return 1;
+    }
+    raxFree(a);
+    raxFree(b);
+
+    /* Out of memory in the middle of a merge: both trees are still valid,
+     * with all the keys, and the merge can be completed later. */
+    long left = -1;
+    raxAllocator alloc = {countdownMalloc,countdownRealloc,failingFree,
+                          NULL,&left};
+    for (int fail = 0; fail < 2000; fail++) {
+        unsigned char key[32];
+        int flags = fail % 2 ? 0 : RAX_FLAG_RANK;
+        a = raxNewWithAllocator(&alloc,flags);
+        b = raxNewWithAllocator(&alloc,flags);
+        for (int j = 0; j < 300; j++) {
+            size_t len = int2key((char*)key,sizeof(key),j,KEY_INT);
+            if (j % 3) raxInsert(a,key,len,(void*)(long)(j+1),NULL);
+            if (j % 2) raxInsert(b,key,len,(void*)(long)(j+1),NULL);
+        }
+        left = fail/2;
+        int done = raxMerge(a,b,NULL,NULL);
+        left = -1;
+        if (!done && errno != ENOMEM) return 1;
+        for (int j = 0; j < 300; j++) {
+            size_t len = int2key((char*)key,sizeof(key),j,KEY_INT);
+            void *va = raxFind(a,key,len), *vb = raxFind(b,key,len);
+            int ina = j % 3 != 0, inb = j % 2 != 0;
+            if ((va == raxNotFound && vb == raxNotFound) != (!ina && !inb) ||
+                (ina && va == raxNotFound) || (!inb && vb != raxNotFound) ||
+                (va != raxNotFound && va != (void*)(long)(j+1)))
+            {
+                printf("raxMerge(): key %d lost on out of memory\n", j);
+                return 1;
+            }
+        }
+        if (memoryCheckTree(a,"Merge OOM") || memoryCheckTree(b,"Merge OOM"))
+            return 1;
+        if (!raxMerge(a,b,NULL,NULL) || raxSize(a) != 250 || raxSize(b) ||
+            (flags && raxRank(a,(unsigned char*)"99",2) != 249) ||
+            memoryCheckTree(a,"Merge OOM"))
+        {
+            printf("raxMerge() failed after out of memory\n");
+            return 1;
+        }
+        raxFree(a);
+        raxFree(b);
+        if (done && flags == 0) break;
+    }
+    return 0;
+}
+
+/* Check the content of a tree produced by a set operation: 'vals' are the
+ * expected values of the keys, zero for the keys that must not be there.
+ * If 'exact' is true the tree must be as compact as the one created
+ * inserting the keys. Returns 0 on success, 1 on error. */
+int setCheckTree(rax *t, unsigned long *vals, unsigned char **keys, size_t *lens, size_t count, int exact) {
+    uint64_t numele = 0;
+    for (size_t i = 0; i < count; i++) {
+        void *data = raxFind(t,keys[i],lens[i]);
+        if ((vals[i] == 0 && data != raxNotFound) ||
+            (vals[i] != 0 && data != (void*)vals[i]))
+        {
+            printf("Set fuzz: wrong value for key %.*s\n",
+                (int)lens[i],(char*)keys[i]);
+            return 1;
+        }
+        if (vals[i]) numele++;
+    }
+    if (raxSize(t) != numele) {
+        printf("Set fuzz: %llu keys, %llu expected\n",
+            (unsigned long long)raxSize(t), (unsigned long long)numele);
+        return 1;
+    }
+
+    raxIterator iter;
+    raxStart(&iter,t);
+    raxSeek(&iter,"^",NULL,0);
+    uint64_t seen = 0;
+    while(raxNext(&iter)) {
+        if ((t->flags & RAX_FLAG_RANK) &&
+            raxRank(t,iter.key,iter.key_len) != seen)
+        {
+            printf("Set fuzz: wrong rank\n");
+            return 1;
+        }
+        seen++;
+    }
+    raxStop(&iter);
+
+    /* Otherwise, like for the range deletion, the tree created inserting
+     * the same keys is just a lower bound of the number of nodes. */
+    rax *check = raxNewWithFlags(t->flags);
+    for (size_t i = 0; i < count; i++)
+        if (vals[i]) raxInsert(check,keys[i],lens[i],NULL,NULL);
+    int err = seen != numele || check->numnodes > t->numnodes ||
+              (exact && check->numnodes != t->numnodes);
+    if (err) printf("Set fuzz: %llu keys iterated, %llu nodes\n",
+        (unsigned long long)seen, (unsigned long long)t->numnodes);
+    raxFree(check);
+    return err || memoryCheckTree(t,"Set fuzz");
+}
+
+int setOpsFuzzTest(int keymode, size_t count, int flags) {
+    long live = 0;
+    raxAllocator alloc = {countingMalloc,countingRealloc,countingFree,NULL,
+                          &live};
+    hashtable *ht = htNew();
+    unsigned char **keys = malloc(sizeof(unsigned char*)*count);
+    size_t *lens = malloc(sizeof(size_t)*count);
+    unsigned long *avals = malloc(sizeof(unsigned long)*count);
+    unsigned long *bvals = malloc(sizeof(unsigned long)*count);
+    unsigned long *vals = malloc(sizeof(unsigned long)*count);
+    size_t numkeys = 0;
+
+    printf("Set operations fuzz test in mode %d [%zu]", keymode, count);
+    if (flags) printf(" flags %d", flags);
+    printf(": ");
+    fflush(stdout);
+
+    for (size_t i = 0; i < count; i++) {
+        unsigned char key[1024];
+        size_t keylen = int2key((char*)key,sizeof(key),i,keymode);
+        if (!htAdd(ht,key,keylen,NULL)) continue;
+        keys[numkeys] = malloc(keylen+1);
+        memcpy(keys[numkeys],key,keylen);
+        lens[numkeys] = keylen;
+        numkeys++;
+    }
+
+    long ops[3] = {0,0,0};
+    for (int round = 0; round < 20; round++) {
+        rax *a = raxNewWithAllocator(&alloc,flags);
+        rax *b = raxNewWithAllocator(&alloc,flags);
+
+        /* Keys in the first tree, in the second one, or in both: trees
+         * with a large overlap, one with a subset of the keys of the other
+         * one, disjoint trees, and independent random sets. */
+        int mix = round % 5;
+        for (size_t i = 0; i < numkeys; i++) {
+            int r = rc4rand()%8, ina, inb;
+            switch(mix) {
+            case 0: ina = r < 6; inb = r >= 2; break;
+            case 1: ina = 1; inb = r < 2; break;
+            case 2: ina = r < 2; inb = 1; break;
+            case 3: ina = r < 4; inb = r >= 4; break;
+            default: ina = r & 1; inb = r < 4; break;
+            }
+            avals[i] = ina ? ((i+1)<<2) : 0;
+            bvals[i] = inb ? ((i+1)<<3) : 0;
+            if (ina) raxInsert(a,keys[i],lens[i],(void*)avals[i],NULL);
+            if (inb) raxInsert(b,keys[i],lens[i],(void*)bvals[i],NULL);
+        }
+
+        int op = rc4rand()%3;
+        int withcb = rc4rand()%2;
+        long common = 0, aonly = 0;
+        for (size_t i = 0; i < numkeys; i++) {
+            if (avals[i] && bvals[i]) common++;
+            if (avals[i] && !bvals[i]) aonly++;
+            if (op == 0) {
+                vals[i] = avals[i] ? avals[i] : bvals[i];
+                if (withcb && avals[i] && bvals[i]) vals[i] += bvals[i];
+            } else if (op == 1) {
+                vals[i] = (avals[i] && bvals[i]) ? avals[i] : 0;
+                if (withcb && vals[i]) vals[i] += bvals[i];
+            } else {
+                vals[i] = bvals[i] ? 0 : avals[i];
+            }
+        }
+
+        mergeCalls = 0;
+        freedValues = 0;
+        int retval;
+        raxMergeCallback cb = withcb ? mergeSum : NULL;
+        if (op == 0) retval = raxMerge(a,b,cb,NULL);
+        else if (op == 1) retval = raxIntersect(a,b,cb,NULL,countFreedValue);
+        else retval = raxDifference(a,b,countFreedValue);
+        long expfreed = op == 0 ? 0 : (op == 1 ? aonly : common);
+        if (!retval || mergeCalls != (withcb && op != 2 ? common : 0) ||
+            freedValues != expfreed)
+        {
+            printf("Set fuzz: operation %d failed, %ld callbacks, "
+                   "%ld values freed\n", op, mergeCalls, freedValues);
+            return 1;
+        }
+        if (setCheckTree(a,vals,keys,lens,numkeys,op == 0)) return 1;
+        if (op == 0 && (raxSize(b) != 0 || b->numnodes != 1)) {
+            printf("Set fuzz: merged tree not empty\n");
+            return 1;
+        }
+        if (op != 0 && setCheckTree(b,bvals,keys,lens,numkeys,1)) return 1;
+        if (live != (long)(a->numnodes+b->numnodes+2)) {
+            printf("Set fuzz: %ld allocations for %llu nodes\n", live,
+                (unsigned long long)(a->numnodes+b->numnodes));
+            return 1;
+        }
+        raxFree(a);
+        raxFree(b);
+        ops[op]++;
+    }
+    printf("%ld merges, %ld intersections, %ld differences\n",
+        ops[0], ops[1], ops[2]);
+
+    if (live != 0) {
+        printf("Set fuzz: %ld allocations leaked\n", live);
+        return 1;
+    }
+    for (size_t i = 0; i < numkeys; i++) free(keys[i]);
+    free(keys);
+    free(lens);
+    free(avals);
+    free(bvals);
+    free(vals);
+    htFree(ht);
+    return 0;
+}
+
+/* Regression test #1: Iterator wrong element returned after seek. */
+int regtest1(void) {
+    rax *rax = raxNew();
+    raxInsert(rax,(unsigned char*)"LKE",3,(void*)(long)1,NULL);
+    raxInsert(rax,(unsigned char*)"TQ",2,(void*)(long)2,NULL);
+    raxInsert(rax,(unsigned char*)"B",1,(void*)(long)3,NULL);
+    raxInsert(rax,(unsigned char*)"FY",2,(void*)(long)4,NULL);
+    raxInsert(rax,(unsigned char*)"WI",2,(void*)(long)5,NULL);
+
+    raxIterator iter;
+    raxStart(&iter,rax);
+    raxSeek(&iter,">",(unsigned char*)"FMP",3);
+    if (raxNext(&iter)) {
+        if (iter.key_len != 2 ||
+            memcmp(iter.key,"FY",2))
+        {
+            printf("Regression test 1 failed: 'FY' expected, got: '%.*s'\n",
+                (int)iter.key_len, (char*)iter.key);
+            return 1;
+        }
+    }
+
+    raxStop(&iter);
+    raxFree(rax);
+    return 0;
+}
+
+/* Regression test #2: Crash when mixing NULL and not NULL values. */
+int regtest2(void) {
+    rax *rt = raxNew();
+    raxInsert(rt,(unsigned char *)"a",1,(void *)100,NULL);
     raxInsert(rt,(unsigned char *)"ab",2,(void *)101,NULL);
     raxInsert(rt,(unsigned char *)"abc",3,(void *)NULL,NULL);
     raxInsert(rt,(unsigned char *)"abcd",4,(void *)NULL,NULL);
@@ -823,11 +5187,39 @@ int regtest6(void) {
     return 0;
 }
 
+/* Regression test #7: Out of memory adding a key below a leaf key used to
+ * remove the leaf key itself. */
+int regtest7(void) {
+    int fail = 0;
+    raxAllocator alloc = {failingMalloc,failingRealloc,failingFree,NULL,&fail};
+    rax *rax = raxNewWithAllocator(&alloc,RAX_FLAG_RANK);
+
+    raxInsert(rax,(unsigned char*)"foo",3,(void*)(long)1234,NULL);
+    fail = 1;
+    int retval = raxInsert(rax,(unsigned char*)"foobar",6,NULL,NULL);
+    fail = 0;
+    if (retval != 0 || errno != ENOMEM ||
+        raxFind(rax,(unsigned char*)"foo",3) != (void*)(long)1234 ||
+        raxSize(rax) != 1 || raxRank(rax,(unsigned char*)"z",1) != 1)
+    {
+        printf("Regression test 7 failed. Key removed on OOM.\n");
+        return 1;
+    }
+    raxFree(rax);
+    return 0;
+}
+
 void benchmark(void) {
-    for (int mode = 0; mode < 2; mode++) {
-        printf("Benchmark with %s keys:\n",
-            (mode == 0) ? "integer" : "alphanumerical");
-        rax *t = raxNew();
+    int modes[] = {KEY_INT, KEY_UNIQUE_ALPHA, KEY_HEX, KEY_UNIQUE_ALPHA,
+                   KEY_UNIQUE_ALPHA};
+    int flags[] = {0, 0, 0, RAX_FLAG_DENSE, TEST_FLAG_ARENA};
+    char *modenames[] = {"integer", "alphanumerical", "hex",
+                         "alphanumerical (dense nodes)",
+                         "alphanumerical (slab arena)"};
+    for (int m = 0; m < 5; m++) {
+        int mode = modes[m];
+        printf("Benchmark with %s keys:\n", modenames[m]);
+        rax *t = newTestRax(flags[m]);
         long long start = ustime();
         for (int i = 0; i < 5000000; i++) {
             char buf[64];
@@ -863,6 +5255,28 @@ void benchmark(void) {
         }
         printf("Random lookup: %f\n", (double)(ustime()-start)/1000000);
 
+        start = ustime();
+        for (int i = 0; i < 5000000; i += 64) {
+            char buf[64][64];
+            unsigned char *keys[64];
+            size_t lens[64];
+            void *results[64];
+            int r[64];
+            for (int k = 0; k < 64; k++) {
+                r[k] = rc4rand() % 5000000;
+                lens[k] = int2key(buf[k],sizeof(buf[k]),r[k],mode);
+                keys[k] = (unsigned char*)buf[k];
+            }
+            raxFindMany(t,keys,lens,64,results);
+            for (int k = 0; k < 64; k++) {
+                if (results[k] != (void*)(long)r[k]) {
+                    printf("Issue with %s: %p instead of %p\n", buf[k],
+                        results[k], (void*)(long)r[k]);
+                }
+            }
+        }
+        printf("Random batched lookup: %f\n", (double)(ustime()-start)/1000000);
+
         start = ustime();
         for (int i = 0; i < 5000000; i++) {
             char buf[64];
@@ -885,6 +5299,65 @@ void benchmark(void) {
         raxStop(&ri);
         printf("Full iteration: %f\n", (double)(ustime()-start)/1000000);
 
+        start = ustime();
+        raxStart(&ri,t);
+        raxSeek(&ri,"$",NULL,0);
+        iter = 0;
+        while (raxPrev(&ri)) iter++;
+        if (iter != 5000000) printf("** Warning iteration is incomplete\n");
+        raxStop(&ri);
+        printf("Reverse iteration: %f\n", (double)(ustime()-start)/1000000);
+
+        /* Rebuild the same tree from its keys, that are sorted, both
+         * inserting them and bulk loading them. */
+        arrayItem *items = malloc(sizeof(arrayItem)*5000000);
+        raxStart(&ri,t);
+        raxSeek(&ri,"^",NULL,0);
+        iter = 0;
+        while (raxNext(&ri)) {
+            items[iter].key = malloc(ri.key_len);
+            items[iter].key_len = ri.key_len;
+            memcpy(items[iter].key,ri.key,ri.key_len);
+            iter++;
+        }
+        raxStop(&ri);
+
+        start = ustime();
+        rax *sorted = newTestRax(flags[m]);
+        for (int i = 0; i < 5000000; i++)
+            raxInsert(sorted,items[i].key,items[i].key_len,(void*)(long)i,NULL);
+        printf("Sorted insert: %f\n", (double)(ustime()-start)/1000000);
+        raxFree(sorted);
+
+        start = ustime();
+        rax *bulk = newTestRax(flags[m]);
+        bulkLoadArray ba = {items,5000000,0};
+        raxBulkLoad(bulk,bulkLoadNext,&ba);
+        printf("Bulk load: %f\n", (double)(ustime()-start)/1000000);
+        raxFree(bulk);
+        for (int i = 0; i < 5000000; i++) free(items[i].key);
+        free(items);
+
+        /* Random lookups in the frozen image of the tree. */
+        size_t imglen;
+        unsigned char *image = raxSerialize(t,NULL,NULL,&imglen);
+        raxFrozen f;
+        raxFrozenOpen(&f,image,imglen);
+        start = ustime();
+        for (int i = 0; i < 5000000; i++) {
+            char buf[64];
+            int r = rc4rand() % 5000000;
+            int len = int2key(buf,sizeof(buf),r,mode);
+            void *data = raxFrozenFind(&f,(unsigned char*)buf,len);
+            if (data != (void*)(long)r) {
+                printf("Issue with %s: %p instead of %p\n", buf,
+                    data, (void*)(long)r);
+            }
+        }
+        printf("Frozen random lookup: %f\n",
+            (double)(ustime()-start)/1000000);
+        free(image);
+
         start = ustime();
         for (int i = 0; i < 5000000; i++) {
             char buf[64];
@@ -900,13 +5373,13 @@ void benchmark(void) {
     }
 }
 
-/* Compressed nodes can only hold (2^29)-1 characters, so it is important
+/* Compressed nodes can only hold (2^24)-1 characters, so it is important
  * to test for keys bigger than this amount, in order to make sure that
  * the code to handle this edge case works as expected.
  *
  * This test is disabled by default because it uses a lot of memory. */
 int testHugeKey(void) {
-    size_t max_keylen = ((1<<29)-1) + 100;
+    size_t max_keylen = RAX_NODE_MAX_SIZE+100;
     unsigned char *key = malloc(max_keylen);
     if (key == NULL) goto oom;
 
@@ -986,6 +5459,31 @@ int main(int argc, char **argv) {
         if (randomWalkTest()) errors++;
         if (iteratorUnitTests()) errors++;
         if (tryInsertUnitTests()) errors++;
+        if (manyKeysUnitTests()) errors++;
+        if (allocatorUnitTests()) errors++;
+        if (inlineUnitTests()) errors++;
+        if (rankUnitTests()) errors++;
+        if (bulkLoadUnitTests()) errors++;
+        if (frozenUnitTests()) errors++;
+        if (concurrentUnitTests()) errors++;
+        if (forkUnitTests()) errors++;
+        if (rangeUnitTests()) errors++;
+        if (freeUnitTests()) errors++;
+        if (defragUnitTests()) errors++;
+        if (scanUnitTests()) errors++;
+        if (statsUnitTests()) errors++;
+        if (countersUnitTests()) errors++;
+        if (setOpsUnitTests()) errors++;
+        if (integerKeysUnitTests()) errors++;
+        if (fingerUnitTests()) errors++;
+        if (lazyUnitTests()) errors++;
+        if (iteratorRemoveUnitTests()) errors++;
+        if (shardedUnitTests()) errors++;
+        if (splitRangesUnitTests()) errors++;
+        if (streamUnitTests()) errors++;
+        if (prefixUnitTests()) errors++;
+        if (bucketUnitTests()) errors++;
+        if (iteratorBuffersUnitTests()) errors++;
         if (errors == 0) printf("OK\n");
     }
 
@@ -997,6 +5495,7 @@ int main(int argc, char **argv) {
         if (regtest4()) errors++;
         if (regtest5()) errors++;
         if (regtest6()) errors++;
+        if (regtest7()) errors++;
         if (errors == 0) printf("OK\n");
     }
 
@@ -1035,12 +5534,221 @@ int main(int argc, char **argv) {
         }
 
         if (fuzzTest(KEY_CHAIN,1000,.7,.3)) errors++;
+
+        /* Dense nodes: use key modes producing nodes with many children. */
+        for (int i = 0; i < 10; i++) {
+            double alpha = (double)rc4rand() / RAND_MAX;
+            double beta = 1-alpha;
+            if (fuzzTestWithFlags(KEY_RANDOM,rc4rand()%10000,alpha,beta,
+                RAX_FLAG_DENSE)) errors++;
+            if (fuzzTestWithFlags(KEY_RANDOM_ALPHA,rc4rand()%10000,alpha,beta,
+                RAX_FLAG_DENSE)) errors++;
+        }
+        if (fuzzTestWithFlags(KEY_RANDOM,1000000,.7,.3,RAX_FLAG_DENSE))
+            errors++;
+        if (fuzzTestWithFlags(KEY_UNIQUE_ALPHA,1000000,.7,.3,RAX_FLAG_DENSE))
+            errors++;
+
+        /* Inline values, mixed with pointer values. */
+        for (int i = 0; i < 10; i++) {
+            if (inlineFuzzTest(KEY_INT,rc4rand()%10000,0)) errors++;
+            if (inlineFuzzTest(KEY_RANDOM,rc4rand()%10000,0)) errors++;
+            if (inlineFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000,0))
+                errors++;
+        }
+        if (inlineFuzzTest(KEY_RANDOM_ALPHA,1000000,0)) errors++;
+        if (inlineFuzzTest(KEY_RANDOM,1000000,RAX_FLAG_DENSE|TEST_FLAG_ARENA))
+            errors++;
+
+        /* Trees allocating their nodes from a slab arena. */
+        if (fuzzTestWithFlags(KEY_RANDOM,100000,.7,.3,TEST_FLAG_ARENA))
+            errors++;
+        if (fuzzTestWithFlags(KEY_RANDOM_ALPHA,1000000,.7,.3,
+            TEST_FLAG_ARENA|RAX_FLAG_DENSE)) errors++;
+        /* Subtree counts for raxRank() and raxSelect(). */
+        for (int i = 0; i < 10; i++) {
+            if (rankFuzzTest(KEY_INT,rc4rand()%10000,0)) errors++;
+            if (rankFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000,0))
+                errors++;
+            if (rankFuzzTest(KEY_RANDOM,rc4rand()%10000,RAX_FLAG_DENSE))
+                errors++;
+        }
+        if (rankFuzzTest(KEY_RANDOM_ALPHA,100000,TEST_FLAG_ARENA)) errors++;
+        if (rankFuzzTest(KEY_RANDOM,100000,RAX_FLAG_DENSE)) errors++;
+        /* Bulk loading of sorted keys. */
+        for (int i = 0; i < 10; i++) {
+            if (bulkLoadFuzzTest(KEY_INT,rc4rand()%10000,0)) errors++;
+            if (bulkLoadFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000,
+                RAX_FLAG_RANK)) errors++;
+            if (bulkLoadFuzzTest(KEY_RANDOM,rc4rand()%10000,RAX_FLAG_DENSE))
+                errors++;
+        }
+        if (bulkLoadFuzzTest(KEY_RANDOM_ALPHA,100000,TEST_FLAG_ARENA))
+            errors++;
+        if (bulkLoadFuzzTest(KEY_CHAIN,1000,0)) errors++;
+        /* Frozen images. */
+        for (int i = 0; i < 10; i++) {
+            int compact = i % 2;
+            if (frozenFuzzTest(KEY_INT,rc4rand()%10000,0,compact)) errors++;
+            if (frozenFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000,
+                RAX_FLAG_RANK,compact)) errors++;
+            if (frozenFuzzTest(KEY_RANDOM,rc4rand()%10000,RAX_FLAG_DENSE,
+                compact)) errors++;
+        }
+        if (frozenFuzzTest(KEY_RANDOM_ALPHA,100000,RAX_FLAG_RANK,0)) errors++;
+        if (frozenFuzzTest(KEY_RANDOM_ALPHA,100000,RAX_FLAG_RANK,1)) errors++;
+        if (frozenFuzzTest(KEY_CHAIN,1000,0,0)) errors++;
+        if (frozenFuzzTest(KEY_CHAIN,1000,0,1)) errors++;
+        /* Concurrent trees. */
+        if (concurrentFuzzTest(KEY_INT,10000,0)) errors++;
+        if (concurrentFuzzTest(KEY_UNIQUE_ALPHA,10000,RAX_FLAG_DENSE)) errors++;
+        if (concurrentFuzzTest(KEY_HEX,10000,RAX_FLAG_RANK|TEST_FLAG_ARENA))
+            errors++;
+        if (concurrentFuzzTest(KEY_CHAIN,300,0)) errors++;
+        /* Forked trees. */
+        for (int i = 0; i < 10; i++) {
+            if (forkFuzzTest(KEY_INT,rc4rand()%10000+1,0)) errors++;
+            if (forkFuzzTest(KEY_UNIQUE_ALPHA,rc4rand()%10000+1,
+                             RAX_FLAG_DENSE)) errors++;
+            if (forkFuzzTest(KEY_HEX,rc4rand()%10000+1,RAX_FLAG_RANK))
+                errors++;
+        }
+        if (forkFuzzTest(KEY_CHAIN,300,RAX_FLAG_RANK)) errors++;
+        /* Range deletion. */
+        for (int i = 0; i < 10; i++) {
+            if (rangeFuzzTest(KEY_INT,rc4rand()%10000,0)) errors++;
+            if (rangeFuzzTest(KEY_RANDOM,rc4rand()%10000,RAX_FLAG_DENSE))
+                errors++;
+            if (rangeFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000,
+                              RAX_FLAG_RANK)) errors++;
+            if (rangeFuzzTest(KEY_HEX,rc4rand()%10000,RAX_FLAG_RANK))
+                errors++;
+        }
+        if (rangeFuzzTest(KEY_CHAIN,1000,RAX_FLAG_RANK)) errors++;
+        /* Set operations. */
+        for (int i = 0; i < 10; i++) {
+            if (setOpsFuzzTest(KEY_INT,rc4rand()%10000,0)) errors++;
+            if (setOpsFuzzTest(KEY_RANDOM,rc4rand()%10000,RAX_FLAG_DENSE))
+                errors++;
+            if (setOpsFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000,
+                               RAX_FLAG_RANK)) errors++;
+            if (setOpsFuzzTest(KEY_HEX,rc4rand()%10000,
+                               RAX_FLAG_RANK|RAX_FLAG_DENSE)) errors++;
+        }
+        if (setOpsFuzzTest(KEY_CHAIN,1000,RAX_FLAG_RANK)) errors++;
+        /* Finger hints. */
+        for (int i = 0; i < 10; i++) {
+            if (fingerFuzzTest(KEY_INT,rc4rand()%10000,0)) errors++;
+            if (fingerFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000,
+                               RAX_FLAG_RANK)) errors++;
+            if (fingerFuzzTest(KEY_HEX,rc4rand()%10000,
+                               RAX_FLAG_RANK|RAX_FLAG_DENSE)) errors++;
+        }
+        if (fingerFuzzTest(KEY_CHAIN,1000,RAX_FLAG_RANK)) errors++;
+        /* Lazy compaction. */
+        for (int i = 0; i < 10; i++) {
+            if (lazyFuzzTest(KEY_INT,rc4rand()%10000,0)) errors++;
+            if (lazyFuzzTest(KEY_RANDOM,rc4rand()%10000,RAX_FLAG_DENSE))
+                errors++;
+            if (lazyFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000,
+                             RAX_FLAG_RANK)) errors++;
+            if (lazyFuzzTest(KEY_HEX,rc4rand()%10000,
+                             RAX_FLAG_RANK|RAX_FLAG_DENSE)) errors++;
+        }
+        if (lazyFuzzTest(KEY_CHAIN,1000,RAX_FLAG_RANK)) errors++;
+        /* Removals with iterators. */
+        for (int i = 0; i < 10; i++) {
+            if (iteratorRemoveFuzzTest(KEY_INT,rc4rand()%10000+1,0)) errors++;
+            if (iteratorRemoveFuzzTest(KEY_RANDOM_SMALL_CSET,
+                rc4rand()%10000+1,RAX_FLAG_RANK)) errors++;
+            if (iteratorRemoveFuzzTest(KEY_RANDOM,rc4rand()%10000+1,
+                RAX_FLAG_DENSE|TEST_FLAG_ARENA)) errors++;
+            if (iteratorRemoveFuzzTest(KEY_HEX,rc4rand()%10000+1,
+                RAX_FLAG_LAZY_COMPACT|RAX_FLAG_RANK)) errors++;
+        }
+        if (iteratorRemoveFuzzTest(KEY_CHAIN,1000,RAX_FLAG_RANK)) errors++;
+        /* Sharded trees. */
+        for (int i = 0; i < 10; i++) {
+            if (shardedFuzzTest(KEY_INT,rc4rand()%10000+1,RAX_SHARD_HASH,
+                1+rc4rand()%16)) errors++;
+            if (shardedFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000+1,
+                RAX_SHARD_PREFIX,1+rc4rand()%16)) errors++;
+            if (shardedFuzzTest(KEY_RANDOM,rc4rand()%10000+1,
+                i % 2 ? RAX_SHARD_HASH : RAX_SHARD_PREFIX,256)) errors++;
+        }
+        if (shardedFuzzTest(KEY_CHAIN,1000,RAX_SHARD_HASH,8)) errors++;
+        /* Range splitting. */
+        for (int i = 0; i < 10; i++) {
+            if (splitRangesFuzzTest(KEY_INT,rc4rand()%100000+1,0)) errors++;
+            if (splitRangesFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%100000+1,
+                RAX_FLAG_RANK)) errors++;
+            if (splitRangesFuzzTest(KEY_HEX,rc4rand()%100000+1,
+                RAX_FLAG_DENSE)) errors++;
+        }
+        if (splitRangesFuzzTest(KEY_CHAIN,1000,0)) errors++;
+        /* Stream dumps. */
+        for (int i = 0; i < 10; i++) {
+            if (streamFuzzTest(KEY_INT,rc4rand()%100000+1,0)) errors++;
+            if (streamFuzzTest(KEY_RANDOM,rc4rand()%100000+1,
+                RAX_FLAG_RANK)) errors++;
+            if (streamFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%100000+1,
+                RAX_FLAG_DENSE|TEST_FLAG_ARENA)) errors++;
+        }
+        if (streamFuzzTest(KEY_CHAIN,1000,0)) errors++;
+        /* Prefix lookups. */
+        for (int i = 0; i < 10; i++) {
+            if (prefixFuzzTest(KEY_RANDOM_SMALL_CSET,rc4rand()%10000+1,0))
+                errors++;
+            if (prefixFuzzTest(KEY_INT,rc4rand()%10000+1,RAX_FLAG_DENSE))
+                errors++;
+            if (prefixFuzzTest(KEY_RANDOM_ALPHA,rc4rand()%10000+1,
+                RAX_FLAG_LAZY_COMPACT|TEST_FLAG_ARENA)) errors++;
+        }
+        if (prefixFuzzTest(KEY_CHAIN,1000,0)) errors++;
+        /* Leaf buckets. */
+        for (int i = 0; i < 10; i++) {
+            double alpha = (double)rc4rand() / RAND_MAX;
+            double beta = 1-alpha;
+            if (fuzzTestWithFlags(KEY_RANDOM,rc4rand()%10000,alpha,beta,
+                RAX_FLAG_BUCKETS)) errors++;
+            if (fuzzTestWithFlags(KEY_RANDOM_SMALL_CSET,rc4rand()%10000,
+                alpha,beta,RAX_FLAG_BUCKETS|RAX_FLAG_DENSE)) errors++;
+            if (inlineFuzzTest(KEY_INT,rc4rand()%10000,RAX_FLAG_BUCKETS))
+                errors++;
+            if (forkFuzzTest(KEY_HEX,rc4rand()%10000+1,RAX_FLAG_BUCKETS))
+                errors++;
+            if (rangeFuzzTest(KEY_RANDOM,rc4rand()%10000,RAX_FLAG_BUCKETS))
+                errors++;
+            if (fingerFuzzTest(KEY_UNIQUE_ALPHA,rc4rand()%10000,
+                RAX_FLAG_BUCKETS|TEST_FLAG_ARENA)) errors++;
+            if (lazyFuzzTest(KEY_HEX,rc4rand()%10000,RAX_FLAG_BUCKETS))
+                errors++;
+            if (iteratorRemoveFuzzTest(KEY_RANDOM_ALPHA,rc4rand()%10000+1,
+                RAX_FLAG_BUCKETS|RAX_FLAG_LAZY_COMPACT)) errors++;
+        }
+        if (fuzzTestWithFlags(KEY_RANDOM_ALPHA,1000000,.7,.3,
+            RAX_FLAG_BUCKETS|TEST_FLAG_ARENA)) errors++;
+        if (bulkLoadFuzzTest(KEY_RANDOM_SMALL_CSET,10000,RAX_FLAG_BUCKETS))
+            errors++;
+        if (splitRangesFuzzTest(KEY_INT,100000,RAX_FLAG_BUCKETS)) errors++;
+        if (streamFuzzTest(KEY_RANDOM,100000,RAX_FLAG_BUCKETS)) errors++;
+        if (prefixFuzzTest(KEY_RANDOM_SMALL_CSET,10000,RAX_FLAG_BUCKETS))
+            errors++;
+        if (fuzzTestWithFlags(KEY_CHAIN,1000,.7,.3,RAX_FLAG_BUCKETS))
+            errors++;
         printf("Iterator fuzz test: "); fflush(stdout);
         for (int i = 0; i < 100000; i++) {
-            if (iteratorFuzzTest(KEY_INT,100)) errors++;
-            if (iteratorFuzzTest(KEY_UNIQUE_ALPHA,100)) errors++;
-            if (iteratorFuzzTest(KEY_RANDOM_ALPHA,1000)) errors++;
-            if (iteratorFuzzTest(KEY_RANDOM,1000)) errors++;
+            if (iteratorFuzzTest(KEY_INT,100,0)) errors++;
+            if (iteratorFuzzTest(KEY_UNIQUE_ALPHA,100,0)) errors++;
+            if (iteratorFuzzTest(KEY_RANDOM_ALPHA,1000,0)) errors++;
+            if (iteratorFuzzTest(KEY_RANDOM,1000,0)) errors++;
+            if (i % 10 == 0 &&
+                iteratorFuzzTest(KEY_RANDOM,1000,RAX_FLAG_DENSE)) errors++;
+            if (i % 10 == 5 &&
+                iteratorFuzzTest(KEY_RANDOM_ALPHA,1000,TEST_FLAG_ARENA))
+                errors++;
+            if (i % 10 == 3 &&
+                iteratorFuzzTest(KEY_RANDOM,1000,RAX_FLAG_BUCKETS)) errors++;
             if (i && !(i % 100)) {
                 printf(".");
                 if (!(i % 1000)) {
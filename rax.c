@@ -36,6 +36,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include "rax.h"
 
 #ifndef RAX_MALLOC_INCLUDE
@@ -44,6 +45,41 @@
 
 #include RAX_MALLOC_INCLUDE
 
+/* Vector instructions used to scan the edges of wide nodes and to match
+ * compressed nodes. The kernel is selected at compile time according to
+ * what the compiler targets (for instance compile with -mavx2 or
+ * -march=native to use AVX2), the scalar code is always available as
+ * fallback and can be forced defining RAX_NO_SIMD. */
+#ifndef RAX_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RAX_USE_AVX2
+#define RAX_USE_SSE2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RAX_USE_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RAX_USE_NEON
+#endif
+#endif
+
+/* Atomic operations used by trees created with RAX_FLAG_CONCURRENT, where
+ * the root is published by the writer and loaded by the readers without
+ * locks. They are implemented with the GCC and clang builtins, and for other
+ * compilers concurrent trees are not available. */
+#if defined(__GNUC__) || defined(__clang__)
+#define RAX_HAVE_ATOMICS
+#define raxAtomicLoad(p) __atomic_load_n((p),__ATOMIC_ACQUIRE)
+#define raxAtomicStore(p,v) __atomic_store_n((p),(v),__ATOMIC_RELEASE)
+#define raxAtomicCAS(p,expected,v) __atomic_compare_exchange_n((p), \
+    (expected),(v),0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)
+#define raxAtomicFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define raxAtomicLoad(p) (*(p))
+#define raxAtomicStore(p,v) (*(p) = (v))
+#endif
+
 /* This is a special pointer that is guaranteed to never have the same value
  * of a radix tree node. It's used in order to report "not found" error without
  * requiring the function to have multiple return values. */
@@ -82,6 +118,59 @@ void raxSetDebugMsg(int onoff) {
     raxDebugMsg = onoff;
 }
 
+/* ------------------------------ Instrumentation -----------------------------
+ * Compiling with RAX_STATS defined, the events of the hot paths that explain
+ * the performance of a workload (node splits, reallocations, nodes visited
+ * by the walks, ...) are counted, into counters local to every thread, so
+ * that counting them needs no synchronization even in concurrent trees.
+ * The counters are returned by raxGetCounters(). Defining RAX_USDT as well,
+ * every event also fires an USDT probe of the "rax" provider, named as the
+ * counter and having the increment as argument, that can be traced with
+ * tools like bpftrace or perf. Without RAX_STATS the code is compiled out.
+ * -------------------------------------------------------------------------- */
+
+#ifdef RAX_STATS
+#if defined(__GNUC__) || defined(__clang__)
+static __thread raxCounters raxThreadCounters;
+#else
+static raxCounters raxThreadCounters;
+#endif
+
+#ifdef RAX_USDT
+#include <sys/sdt.h>
+#define raxProbe(event,n) DTRACE_PROBE1(rax,event,(n))
+#else
+#define raxProbe(event,n)
+#endif
+
+#define raxCount(event,n) do { \
+    raxThreadCounters.event += (n); \
+    raxProbe(event,n); \
+} while(0)
+#else
+#define raxCount(event,n) do {} while(0)
+#endif
+
+/* Fill 'c' with the counters of the calling thread. Returns 1, or 0 if
+ * Rax was compiled without RAX_STATS, in which case the counters are all
+ * zero. */
+int raxGetCounters(raxCounters *c) {
+#ifdef RAX_STATS
+    *c = raxThreadCounters;
+    return 1;
+#else
+    memset(c,0,sizeof(*c));
+    return 0;
+#endif
+}
+
+/* Reset the counters of the calling thread. */
+void raxResetCounters(void) {
+#ifdef RAX_STATS
+    memset(&raxThreadCounters,0,sizeof(raxThreadCounters));
+#endif
+}
+
 /* ------------------------- raxStack functions --------------------------
  * The raxStack is a simple stack of pointers that is capable of switching
  * from using a stack-allocated array to dynamic heap once a given number of
@@ -93,23 +182,32 @@ void raxSetDebugMsg(int onoff) {
 /* Initialize the stack. */
 static inline void raxStackInit(raxStack *ts) {
     ts->stack = ts->static_items;
+    ts->childidx = ts->static_childidx;
     ts->items = 0;
     ts->maxitems = RAX_STACK_STATIC_ITEMS;
     ts->oom = 0;
+    ts->onheap = 0;
 }
 
-/* Push an item into the stack, returns 1 on success, 0 on out of memory. */
-static inline int raxStackPush(raxStack *ts, void *ptr) {
+/* Push an item into the stack, together with the index of the child that
+ * is followed from this node. Returns 1 on success, 0 on out of memory. */
+static inline int raxStackPush(raxStack *ts, void *ptr, int childidx) {
     if (ts->items == ts->maxitems) {
-        if (ts->stack == ts->static_items) {
-            ts->stack = rax_malloc(sizeof(void*)*ts->maxitems*2);
-            if (ts->stack == NULL) {
-                ts->stack = ts->static_items;
+        if (!ts->onheap) {
+            void **stack = rax_malloc(sizeof(void*)*ts->maxitems*2);
+            int *idx = rax_malloc(sizeof(int)*ts->maxitems*2);
+            if (stack == NULL || idx == NULL) {
+                if (stack) rax_free(stack);
+                if (idx) rax_free(idx);
                 ts->oom = 1;
                 errno = ENOMEM;
                 return 0;
             }
-            memcpy(ts->stack,ts->static_items,sizeof(void*)*ts->maxitems);
+            memcpy(stack,ts->stack,sizeof(void*)*ts->maxitems);
+            memcpy(idx,ts->childidx,sizeof(int)*ts->maxitems);
+            ts->stack = stack;
+            ts->childidx = idx;
+            ts->onheap = 1;
         } else {
             void **newalloc = rax_realloc(ts->stack,sizeof(void*)*ts->maxitems*2);
             if (newalloc == NULL) {
@@ -118,10 +216,18 @@ static inline int raxStackPush(raxStack *ts, void *ptr) {
                 return 0;
             }
             ts->stack = newalloc;
+            int *newidx = rax_realloc(ts->childidx,sizeof(int)*ts->maxitems*2);
+            if (newidx == NULL) {
+                ts->oom = 1;
+                errno = ENOMEM;
+                return 0;
+            }
+            ts->childidx = newidx;
         }
         ts->maxitems *= 2;
     }
     ts->stack[ts->items] = ptr;
+    ts->childidx[ts->items] = childidx;
     ts->items++;
     return 1;
 }
@@ -134,6 +240,15 @@ static inline void *raxStackPop(raxStack *ts) {
     return ts->stack[ts->items];
 }
 
+/* Like raxStackPop(), but also returns by reference the index of the child
+ * that was followed from the popped node. */
+static inline void *raxStackPopChild(raxStack *ts, int *childidx) {
+    if (ts->items == 0) return NULL;
+    ts->items--;
+    *childidx = ts->childidx[ts->items];
+    return ts->stack[ts->items];
+}
+
 /* Return the stack item at the top of the stack without actually consuming
  * it. */
 static inline void *raxStackPeek(raxStack *ts) {
@@ -143,7 +258,419 @@ static inline void *raxStackPeek(raxStack *ts) {
 
 /* Free the stack in case we used heap allocation. */
 static inline void raxStackFree(raxStack *ts) {
-    if (ts->stack != ts->static_items) rax_free(ts->stack);
+    if (ts->onheap) {
+        rax_free(ts->stack);
+        rax_free(ts->childidx);
+    }
+}
+
+/* ------------------------- Edges scanning functions ------------------------
+ * Non compressed nodes store the children characters sorted inside the
+ * node data section, while compressed nodes store a string that must be
+ * matched against the key we are looking up. The following functions
+ * implement such scans: nodes with many children, and long compressed
+ * nodes, are scanned using vector instructions when available, otherwise
+ * we use a simple loop, that is also the fastest way to scan the small
+ * nodes that are the vast majority in most radix trees.
+ * ------------------------------------------------------------------------- */
+
+/* Nodes with less than this number of children are scanned with a simple
+ * loop even when vector instructions are available. */
+#define RAX_SIMD_MIN_EDGES 16
+
+#if defined(RAX_USE_NEON)
+/* NEON has no "movemask" instruction. Narrow the 0x00/0xff comparison
+ * result into a 64 bit integer having 4 bits for each byte instead. */
+static inline uint64_t raxNeonMask(uint8x16_t cmp) {
+    uint8x8_t res = vshrn_n_u16(vreinterpretq_u16_u8(cmp),4);
+    return vget_lane_u64(vreinterpret_u64_u8(res),0);
+}
+#endif
+
+/* Return the index of the edge 'c' in the array 'v' of 'size' edges, or
+ * 'size' if there is no such edge. */
+static inline int raxFindEdge(unsigned char *v, int size, unsigned char c) {
+    int j = 0;
+#if defined(RAX_USE_SSE2)
+    if (size >= RAX_SIMD_MIN_EDGES) {
+#if defined(RAX_USE_AVX2)
+        __m256i needle32 = _mm256_set1_epi8((char)c);
+        for (; j+32 <= size; j += 32) {
+            __m256i chunk = _mm256_loadu_si256((__m256i*)(v+j));
+            unsigned int mask = _mm256_movemask_epi8(
+                                    _mm256_cmpeq_epi8(chunk,needle32));
+            if (mask) return j+__builtin_ctz(mask);
+        }
+#endif
+        __m128i needle = _mm_set1_epi8((char)c);
+        for (; j+16 <= size; j += 16) {
+            __m128i chunk = _mm_loadu_si128((__m128i*)(v+j));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk,needle));
+            if (mask) return j+__builtin_ctz(mask);
+        }
+        /* Check the remaining edges loading the last 16 bytes of the
+         * array: there is no match in the part overlapping with what we
+         * already scanned, since edges are unique. */
+        if (j != size) {
+            __m128i chunk = _mm_loadu_si128((__m128i*)(v+size-16));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk,needle));
+            if (mask) return size-16+__builtin_ctz(mask);
+        }
+        return size;
+    }
+#elif defined(RAX_USE_NEON)
+    if (size >= RAX_SIMD_MIN_EDGES) {
+        uint8x16_t needle = vdupq_n_u8(c);
+        for (; j+16 <= size; j += 16) {
+            uint64_t mask = raxNeonMask(vceqq_u8(vld1q_u8(v+j),needle));
+            if (mask) return j+(__builtin_ctzll(mask)>>2);
+        }
+        if (j != size) {
+            uint64_t mask = raxNeonMask(vceqq_u8(vld1q_u8(v+size-16),needle));
+            if (mask) return size-16+(__builtin_ctzll(mask)>>2);
+        }
+        return size;
+    }
+#endif
+    for (; j < size; j++) {
+        if (v[j] == c) break;
+    }
+    return j;
+}
+
+/* Return the number of edges in the sorted array 'v' of 'size' edges that
+ * are smaller than 'c'. Note that 'c' can be 256, in that case all the
+ * edges are counted. This is used by the iterator in order to find the
+ * child following or preceding a given character. */
+static inline int raxCountEdgesLess(unsigned char *v, int size, int c) {
+    if (c > 255) return size;
+    int j = 0;
+#if defined(RAX_USE_SSE2)
+    if (size >= RAX_SIMD_MIN_EDGES) {
+        /* There is no unsigned bytes comparison in SSE2: flip the sign
+         * bit of both the operands and use the signed one. */
+        __m128i sign = _mm_set1_epi8((char)0x80);
+        __m128i needle = _mm_set1_epi8((char)(c^0x80));
+        int count = 0;
+        for (; j+16 <= size; j += 16) {
+            __m128i chunk = _mm_xor_si128(
+                _mm_loadu_si128((__m128i*)(v+j)),sign);
+            int mask = _mm_movemask_epi8(_mm_cmplt_epi8(chunk,needle));
+            count += __builtin_popcount(mask);
+            if (mask != 0xffff) return count; /* Edges are sorted. */
+        }
+        if (j != size) {
+            __m128i chunk = _mm_xor_si128(
+                _mm_loadu_si128((__m128i*)(v+size-16)),sign);
+            int mask = _mm_movemask_epi8(_mm_cmplt_epi8(chunk,needle));
+            count += __builtin_popcount(mask >> (16-(size-j)));
+        }
+        return count;
+    }
+#elif defined(RAX_USE_NEON)
+    if (size >= RAX_SIMD_MIN_EDGES) {
+        uint8x16_t needle = vdupq_n_u8(c);
+        int count = 0;
+        for (; j+16 <= size; j += 16) {
+            uint64_t mask = raxNeonMask(vcltq_u8(vld1q_u8(v+j),needle));
+            count += __builtin_popcountll(mask)>>2;
+            if (mask != UINT64_MAX) return count; /* Edges are sorted. */
+        }
+        if (j != size) {
+            uint64_t mask = raxNeonMask(vcltq_u8(vld1q_u8(v+size-16),needle));
+            count += __builtin_popcountll(mask >> (4*(16-(size-j))))>>2;
+        }
+        return count;
+    }
+#endif
+    while (j < size && v[j] < c) j++;
+    return j;
+}
+
+/* Return the length of the common prefix of 'a' and 'b', comparing at
+ * most 'max' bytes. Used in order to match compressed nodes. */
+static inline size_t raxMatchLen(unsigned char *a, unsigned char *b, size_t max) {
+    size_t j = 0;
+#if defined(RAX_USE_SSE2)
+#if defined(RAX_USE_AVX2)
+    for (; j+32 <= max; j += 32) {
+        __m256i va = _mm256_loadu_si256((__m256i*)(a+j));
+        __m256i vb = _mm256_loadu_si256((__m256i*)(b+j));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va,vb));
+        if (mask != 0xffffffff) return j+__builtin_ctz(~mask);
+    }
+#endif
+    for (; j+16 <= max; j += 16) {
+        __m128i va = _mm_loadu_si128((__m128i*)(a+j));
+        __m128i vb = _mm_loadu_si128((__m128i*)(b+j));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va,vb));
+        if (mask != 0xffff) return j+__builtin_ctz(~mask);
+    }
+#elif defined(RAX_USE_NEON)
+    for (; j+16 <= max; j += 16) {
+        uint64_t mask = raxNeonMask(vceqq_u8(vld1q_u8(a+j),vld1q_u8(b+j)));
+        if (mask != UINT64_MAX) return j+(__builtin_ctzll(~mask)>>2);
+    }
+#endif
+    for (; j < max; j++) {
+        if (a[j] != b[j]) break;
+    }
+    return j;
+}
+
+/* ------------------------------- Allocators -------------------------------
+ * Every tree allocates its nodes via the raxAllocator it was created with.
+ * The default allocator just uses rax_malloc() & co., that can be selected
+ * at compile time in rax_malloc.h. The iterators and the stacks used by the
+ * implementation always use the default allocator, since they are not part
+ * of a specific tree.
+ * --------------------------------------------------------------------------*/
+
+static void *raxDefaultMalloc(void *ctx, size_t size) {
+    (void)ctx;
+    return rax_malloc(size);
+}
+
+static void *raxDefaultRealloc(void *ctx, void *ptr, size_t size) {
+    (void)ctx;
+    return rax_realloc(ptr,size);
+}
+
+static void raxDefaultFree(void *ctx, void *ptr) {
+    (void)ctx;
+    rax_free(ptr);
+}
+
+static const raxAllocator raxDefaultAllocator = {
+    raxDefaultMalloc,
+    raxDefaultRealloc,
+    raxDefaultFree,
+    NULL,
+    NULL
+};
+
+/* In concurrent trees nodes are not freed immediately, since readers may
+ * still access them: they are retired instead, and freed later, once no
+ * reader can reach them anymore. See the "Concurrent trees" section. */
+typedef struct raxRetired {
+    void *ptr;              /* The retired node. */
+    uint64_t epoch;         /* Epoch when the node was retired. */
+} raxRetired;
+
+struct raxReader {
+    uint64_t epoch;         /* Epoch seen entering the read section, or zero
+                               when not reading. */
+    int inuse;              /* True if the reader slot is taken. */
+    raxConcurrency *concurrency; /* State of the tree of the reader. */
+    struct raxReader *next; /* Next reader of the same tree. */
+};
+
+struct raxConcurrency {
+    uint64_t epoch;         /* Current epoch, incremented after every
+                               modification is published. */
+    raxReader *readers;     /* List of the readers of the tree. */
+    raxRetired *retired;    /* Retired nodes, in epoch order. */
+    size_t numretired, maxretired;
+};
+
+static void raxRetire(rax *rax, void *ptr);
+
+/* Trees created by raxFork() share their nodes. The nodes referenced more
+ * than once, by parent nodes or tree heads, are tracked in a hash table
+ * with their number of references: nodes not in the table have a single
+ * reference. See the "Forked trees" section. */
+typedef struct raxSharedRef {
+    raxNode *node;          /* The node, or NULL for empty slots. */
+    size_t refs;            /* Number of references, always > 1. */
+} raxSharedRef;
+
+struct raxShared {
+    size_t trees;           /* Number of trees sharing this state. */
+    raxSharedRef *table;    /* Hash table with linear probing. */
+    size_t size, used;      /* Table slots (a power of two) and used ones. */
+};
+
+static void raxSharedDealloc(rax *rax, void *ptr);
+
+/* The slab arena is an allocator tuned for radix tree nodes. Node sizes
+ * are always multiples of the pointer size, and most nodes are small, so
+ * allocations up to RAX_ARENA_MAX_SMALL bytes are rounded to the next
+ * multiple of RAX_ARENA_QUANTUM, and served by a free list for every size
+ * class, or carving the memory from big blocks when the free list is
+ * empty. Bigger allocations are rare, and are just forwarded to
+ * rax_malloc(), but are tracked in a list in order to release them with
+ * the arena.
+ *
+ * Every allocation is prefixed by a word telling its size class, so that
+ * free and realloc don't need to know the allocation size:
+ *
+ * small allocation: [class][user data ...]
+ * big allocation:   [prev][next][class=0][user data ...]
+ *
+ * When an arena is used by a single tree, raxFree() does not need to visit
+ * the tree at all (unless there is a callback to call for every value):
+ * all the memory is released at once with raxArenaRelease(). */
+#define RAX_ARENA_QUANTUM 8
+#define RAX_ARENA_MAX_SMALL 512
+#define RAX_ARENA_CLASSES (RAX_ARENA_MAX_SMALL/RAX_ARENA_QUANTUM)
+#define RAX_ARENA_BLOCK_SIZE (64*1024)
+#define RAX_ARENA_PREFIX sizeof(uint64_t)
+
+typedef struct raxArenaBlock {
+    struct raxArenaBlock *next;
+    uint64_t data[]; /* Keep the allocations aligned. */
+} raxArenaBlock;
+
+typedef struct raxArenaBig {
+    struct raxArenaBig *prev, *next;
+    uint64_t class; /* Always 0 for big allocations. */
+} raxArenaBig;
+
+struct raxArena {
+    raxArenaBlock *blocks;  /* Blocks we carve small allocations from. */
+    unsigned char *free_ptr, *free_end; /* Unused space of the last block. */
+    void *freelist[RAX_ARENA_CLASSES]; /* Freed allocations of every class. */
+    raxArenaBig *big;       /* List of big allocations. */
+};
+
+/* Create a new arena. On out of memory NULL is returned. */
+raxArena *raxArenaNew(void) {
+    raxArena *arena = rax_malloc(sizeof(*arena));
+    if (arena == NULL) return NULL;
+    arena->blocks = NULL;
+    arena->free_ptr = arena->free_end = NULL;
+    memset(arena->freelist,0,sizeof(arena->freelist));
+    arena->big = NULL;
+    return arena;
+}
+
+/* Release all the memory allocated by the arena, and the arena itself. */
+void raxArenaRelease(raxArena *arena) {
+    while(arena->blocks) {
+        raxArenaBlock *next = arena->blocks->next;
+        rax_free(arena->blocks);
+        arena->blocks = next;
+    }
+    while(arena->big) {
+        raxArenaBig *next = arena->big->next;
+        rax_free(arena->big);
+        arena->big = next;
+    }
+    rax_free(arena);
+}
+
+/* Return the number of bytes usable in an allocation of the given class. */
+#define raxArenaClassSize(class) ((size_t)(class)*RAX_ARENA_QUANTUM)
+
+static void *raxArenaMalloc(void *ctx, size_t size) {
+    raxArena *arena = ctx;
+    if (size > RAX_ARENA_MAX_SMALL) {
+        raxArenaBig *big = rax_malloc(sizeof(*big)+size);
+        if (big == NULL) return NULL;
+        big->prev = NULL;
+        big->next = arena->big;
+        big->class = 0;
+        if (arena->big) arena->big->prev = big;
+        arena->big = big;
+        return big+1;
+    }
+
+    uint64_t class = (size+RAX_ARENA_QUANTUM-1)/RAX_ARENA_QUANTUM;
+    if (class == 0) class = 1;
+    void *ptr = arena->freelist[class-1];
+    if (ptr) {
+        memcpy(&arena->freelist[class-1],ptr,sizeof(void*));
+        return ptr;
+    }
+
+    /* Free list empty: take the memory from the current block, or from
+     * a new block if there is not enough space left. */
+    size_t needed = RAX_ARENA_PREFIX+raxArenaClassSize(class);
+    if ((size_t)(arena->free_end - arena->free_ptr) < needed) {
+        raxArenaBlock *block = rax_malloc(RAX_ARENA_BLOCK_SIZE);
+        if (block == NULL) return NULL;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->free_ptr = (unsigned char*)block->data;
+        arena->free_end = (unsigned char*)block+RAX_ARENA_BLOCK_SIZE;
+    }
+    memcpy(arena->free_ptr,&class,sizeof(class));
+    ptr = arena->free_ptr+RAX_ARENA_PREFIX;
+    arena->free_ptr += needed;
+    return ptr;
+}
+
+/* Return the size class of an allocation of the arena. */
+static inline uint64_t raxArenaClass(void *ptr) {
+    uint64_t class;
+    memcpy(&class,(unsigned char*)ptr-RAX_ARENA_PREFIX,sizeof(class));
+    return class;
+}
+
+static void raxArenaFree(void *ctx, void *ptr) {
+    raxArena *arena = ctx;
+    if (ptr == NULL) return;
+    uint64_t class = raxArenaClass(ptr);
+    if (class == 0) {
+        raxArenaBig *big = (raxArenaBig*)ptr-1;
+        if (big->prev) big->prev->next = big->next;
+        else arena->big = big->next;
+        if (big->next) big->next->prev = big->prev;
+        rax_free(big);
+    } else {
+        memcpy(ptr,&arena->freelist[class-1],sizeof(void*));
+        arena->freelist[class-1] = ptr;
+    }
+}
+
+static void *raxArenaRealloc(void *ctx, void *ptr, size_t size) {
+    raxArena *arena = ctx;
+    if (ptr == NULL) return raxArenaMalloc(arena,size);
+    uint64_t class = raxArenaClass(ptr);
+    size_t oldsize;
+
+    if (class == 0) {
+        raxArenaBig *big = (raxArenaBig*)ptr-1;
+        if (size > RAX_ARENA_MAX_SMALL) {
+            /* Big to big: just use realloc, and fix the list links. */
+            raxArenaBig *newbig = rax_realloc(big,sizeof(*big)+size);
+            if (newbig == NULL) return NULL;
+            if (newbig->prev) newbig->prev->next = newbig;
+            else arena->big = newbig;
+            if (newbig->next) newbig->next->prev = newbig;
+            return newbig+1;
+        }
+        oldsize = RAX_ARENA_MAX_SMALL+1; /* Anything bigger than 'size'. */
+    } else {
+        /* Nothing to do if the new size is in the same class. */
+        size_t newclass = (size+RAX_ARENA_QUANTUM-1)/RAX_ARENA_QUANTUM;
+        if (newclass == 0) newclass = 1;
+        if (newclass == class) return ptr;
+        oldsize = raxArenaClassSize(class);
+    }
+
+    void *newptr = raxArenaMalloc(arena,size);
+    if (newptr == NULL) return NULL;
+    memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+    raxArenaFree(arena,ptr);
+    return newptr;
+}
+
+static void raxArenaReleaseMethod(void *ctx) {
+    raxArenaRelease(ctx);
+}
+
+/* Fill 'alloc' so that it allocates memory from the specified arena. If
+ * 'release' is true, raxFree() will release the whole arena, so this
+ * should be used only when the arena is used by a single tree. Otherwise
+ * the nodes are freed one after the other, and the arena can be used by
+ * multiple trees, and must be released by the caller. */
+void raxArenaAllocator(raxArena *arena, raxAllocator *alloc, int release) {
+    alloc->malloc_fn = raxArenaMalloc;
+    alloc->realloc_fn = raxArenaRealloc;
+    alloc->free_fn = raxArenaFree;
+    alloc->release_fn = release ? raxArenaReleaseMethod : NULL;
+    alloc->ctx = arena;
 }
 
 /* ----------------------------------------------------------------------------
@@ -156,120 +683,458 @@ static inline void raxStackFree(raxStack *ts) {
  * bytes header. */
 #define raxPadding(nodesize) ((sizeof(void*)-((nodesize+4) % sizeof(void*))) & (sizeof(void*)-1))
 
+/* Return the padding of the node 'n'. The 32 bit links of the nodes of
+ * compact frozen images (see raxNodeLinkSize()) just need to be aligned to
+ * four bytes. */
+#define raxNodePadding(n) \
+    ((n)->islink32 ? (4-((n)->size % 4)) & 3 : raxPadding((n)->size))
+
+/* Dense nodes have an index of 256 bytes, one for every possible child
+ * character, after the padding. Non dense nodes don't pay for it. */
+#define RAX_DENSE_INDEX_LEN 256
+#define raxNodeIndexLen(n) ((n)->isdense ? RAX_DENSE_INDEX_LEN : 0)
+
+/* Non compressed nodes of trees created with RAX_FLAG_DENSE are turned
+ * into dense nodes when they reach RAX_DENSE_MIN_CHILDREN children, and
+ * back into normal nodes when they go under RAX_DENSE_SHRINK_CHILDREN
+ * children. The two thresholds are different in order to avoid converting
+ * the same node again and again when children are added and removed. */
+#define RAX_DENSE_MIN_CHILDREN 48
+#define RAX_DENSE_SHRINK_CHILDREN 40
+
+/* Return the pointer to the index of a dense node. */
+#define raxNodeIndex(n) ((n)->data+(n)->size+raxNodePadding(n))
+
+/* Return the number of child pointers of the node. */
+#define raxNodeNumChildren(n) ((n)->iscompr ? 1 : (n)->size)
+
+/* Nodes of trees created with RAX_FLAG_RANK have, after the child pointers,
+ * an array with the number of keys stored in the subtree of every child. */
+#define raxNodeCountsLen(n) \
+    ((n)->hascount ? sizeof(uint64_t)*raxNodeNumChildren(n) : 0)
+
+/* Return the size of every child link of the node: a pointer, or a 32 bit
+ * offset for the nodes of compact frozen images (see raxSerializeCompact()),
+ * that are never modified, so the code changing nodes works with pointers. */
+#define raxNodeLinkSize(n) ((n)->islink32 ? sizeof(uint32_t) : sizeof(raxNode*))
+
+/* Return the offset of the value section of the node, that is just after
+ * the child pointers (and the subtree counts, if any). */
+#define raxNodeValueOffset(n) ( \
+    sizeof(raxNode)+(n)->size+ \
+    raxNodePadding(n)+ \
+    raxNodeIndexLen(n)+ \
+    raxNodeLinkSize(n)*raxNodeNumChildren(n)+ \
+    raxNodeCountsLen(n) \
+)
+
+/* Return the pointer to the value section of the node. */
+#define raxNodeValue(n) (((unsigned char*)(n))+raxNodeValueOffset(n))
+
+/* Return the pointer to the subtree counts array of the node. */
+#define raxNodeCounts(n) (raxNodeValue(n)-raxNodeCountsLen(n))
+
 /* Return the pointer to the last child pointer in a node. For the compressed
  * nodes this is the only child pointer. */
 #define raxNodeLastChildPtr(n) ((raxNode**) ( \
-    ((char*)(n)) + \
-    raxNodeCurrentLength(n) - \
-    sizeof(raxNode*) - \
-    (((n)->iskey && !(n)->isnull) ? sizeof(void*) : 0) \
+    raxNodeCounts(n) - \
+    sizeof(raxNode*) \
 ))
 
 /* Return the pointer to the first child pointer. */
 #define raxNodeFirstChildPtr(n) ((raxNode**) ( \
     (n)->data + \
     (n)->size + \
-    raxPadding((n)->size)))
+    raxNodePadding(n) + \
+    raxNodeIndexLen(n)))
+
+/* Inline values are stored prefixed by their length, encoded as a varint:
+ * 7 bits per byte, least significant group first, with the most significant
+ * bit set in all the bytes but the last. So values up to 127 bytes just
+ * use a single byte of overhead. */
+static inline size_t raxVarintLen(uint64_t v) {
+    size_t len = 1;
+    while(v >= 128) {
+        v >>= 7;
+        len++;
+    }
+    return len;
+}
 
-/* Return the current total size of the node. Note that the second line
- * computes the padding after the string of characters, needed in order to
- * save pointers to aligned addresses. */
-#define raxNodeCurrentLength(n) ( \
-    sizeof(raxNode)+(n)->size+ \
-    raxPadding((n)->size)+ \
-    ((n)->iscompr ? sizeof(raxNode*) : sizeof(raxNode*)*(n)->size)+ \
-    (((n)->iskey && !(n)->isnull)*sizeof(void*)) \
-)
+static inline size_t raxVarintEncode(unsigned char *p, uint64_t v) {
+    size_t len = 0;
+    while(v >= 128) {
+        p[len++] = (v & 127) | 128;
+        v >>= 7;
+    }
+    p[len++] = v;
+    return len;
+}
+
+static inline size_t raxVarintDecode(unsigned char *p, uint64_t *v) {
+    uint64_t val = 0;
+    size_t len = 0;
+    int shift = 0;
+    while(p[len] & 128) {
+        val |= (uint64_t)(p[len] & 127) << shift;
+        shift += 7;
+        len++;
+    }
+    val |= (uint64_t)p[len] << shift;
+    *v = val;
+    return len+1;
+}
+
+/* Return the length of the value section of the node: zero if the node
+ * is not a key or has a NULL value, the size of a pointer, or, for inline
+ * values, the value length plus the length prefix. */
+static inline size_t raxNodeValueLen(raxNode *n) {
+    if (!n->iskey || n->isnull) return 0;
+    if (!n->isinline) return sizeof(void*);
+    uint64_t len;
+    size_t prefixlen = raxVarintDecode(raxNodeValue(n),&len);
+    return prefixlen+len;
+}
+
+/* Leaves of trees created with RAX_FLAG_BUCKETS may be buckets, that are
+ * flagged as dense nodes without children (dense nodes always have many
+ * children), and store their length. See the "Leaf buckets" section. */
+#define raxIsBucket(n) ((n)->isdense && (n)->size == 0)
+
+static inline size_t raxBucketLen(raxNode *n) {
+    uint16_t len;
+    memcpy(&len,n->data+sizeof(uint16_t),sizeof(len));
+    return len;
+}
+
+/* Return the current total size of the node. */
+#define raxNodeCurrentLength(n) \
+    (raxIsBucket(n) ? raxBucketLen(n) : \
+     raxNodeValueOffset(n)+raxNodeValueLen(n))
+
+/* Allocate, reallocate and free memory for the nodes of the tree 'rax',
+ * updating the count of the bytes used by the tree, that is the sum of the
+ * lengths of its nodes, as returned by raxNodeCurrentLength(), plus the
+ * rax structure itself. So the functions modifying a node length without
+ * reallocating it must update the count as well. The functions also bump
+ * the version of the tree, since the nodes cached by a raxFinger may be
+ * no longer valid. */
+static inline void *raxAlloc(rax *rax, size_t size) {
+    void *ptr = rax->alloc.malloc_fn(rax->alloc.ctx,size);
+    rax->version++;
+    if (ptr) rax->bytes += size;
+    else raxCount(oom,1);
+    return ptr;
+}
+
+/* Reallocate the node 'ptr', having length 'oldsize', to 'size' bytes.
+ * If shrinking the node fails, the callers just continue using the old
+ * node with the new length, so the count is updated anyway. */
+static inline void *raxRealloc(rax *rax, void *ptr, size_t oldsize, size_t size) {
+    void *newptr = rax->alloc.realloc_fn(rax->alloc.ctx,ptr,size);
+    if (newptr || size < oldsize) rax->bytes = rax->bytes-oldsize+size;
+    rax->version++;
+    raxCount(reallocs,1);
+    if (newptr == NULL) raxCount(oom,1);
+    else if (newptr != ptr) raxCount(reallocmoves,1);
+    return newptr;
+}
+
+/* Remove the node 'n' from the tree: it is retired in concurrent trees,
+ * released in forked trees, and otherwise freed. */
+static inline void raxDealloc(rax *rax, raxNode *n) {
+    if (n == NULL) return;
+    rax->bytes -= raxNodeCurrentLength(n);
+    rax->version++;
+    if (rax->concurrency) raxRetire(rax,n);
+    else if (rax->shared) raxSharedDealloc(rax,n);
+    else rax->alloc.free_fn(rax->alloc.ctx,n);
+}
+
+/* Free a node that was never linked to the tree. */
+static inline void raxFreeNode(rax *rax, raxNode *n) {
+    rax->bytes -= raxNodeCurrentLength(n);
+    rax->version++;
+    rax->alloc.free_fn(rax->alloc.ctx,n);
+}
+
+/* Update the index of the dense node 'n' for the edges starting at the
+ * 'start' position. Used when edges are added or removed, since all the
+ * following edges are shifted, and to populate the index of a node that
+ * was just turned into a dense node. */
+static void raxIndexUpdate(raxNode *n, int start) {
+    unsigned char *idx = raxNodeIndex(n);
+    for (int j = start; j < (int)n->size; j++) idx[n->data[j]] = j;
+}
+
+/* Get and set the number of keys in the subtree of the child 'j' of a
+ * node having subtree counts. */
+static inline uint64_t raxGetCount(raxNode *n, int j) {
+    uint64_t count;
+    memcpy(&count,raxNodeCounts(n)+sizeof(count)*j,sizeof(count));
+    return count;
+}
+
+static inline void raxSetCount(raxNode *n, int j, uint64_t count) {
+    memcpy(raxNodeCounts(n)+sizeof(count)*j,&count,sizeof(count));
+}
+
+/* Return the index of the child of the non compressed node 'n' for the
+ * character 'c', or n->size if there is no such child. */
+static inline int raxNodeFindEdge(raxNode *n, unsigned char c) {
+    if (n->isdense) {
+        /* The index entries of characters that are not edges are not
+         * meaningful, so we check that the edge at the position we got
+         * is actually 'c'. */
+        int j = raxNodeIndex(n)[c];
+        return (j < (int)n->size && n->data[j] == c) ? j : (int)n->size;
+    }
+    return raxFindEdge(n->data,n->size,c);
+}
+
+/* Return the child at index 'j' of the node 'n'. The child pointers of
+ * the nodes of frozen images (see raxSerialize()) are offsets from the start
+ * of the image, that is passed as 'base': for normal trees 'base' is zero,
+ * so this is just a load of the pointer. The nodes of compact images store
+ * instead 32 bit offsets in units of RAX_IMAGE_LINK_UNIT bytes. */
+#define RAX_IMAGE_LINK_UNIT 4
+static inline raxNode *raxChildAt(raxNode *n, int j, uintptr_t base) {
+    unsigned char *cp = (unsigned char*)raxNodeFirstChildPtr(n);
+    if (n->islink32) {
+        uint32_t off;
+        memcpy(&off,cp+sizeof(off)*j,sizeof(off));
+        return (raxNode*)(base+(uintptr_t)off*RAX_IMAGE_LINK_UNIT);
+    }
+    uintptr_t child;
+    memcpy(&child,cp+sizeof(child)*j,sizeof(child));
+    return (raxNode*)(base+child);
+}
 
 /* Allocate a new non compressed node with the specified number of children.
- * If datafiled is true, the allocation is made large enough to hold the
- * associated data pointer.
+ * The allocation is made large enough to hold 'valuelen' bytes of value
+ * section, that is the size of a pointer in order to store the associated
+ * data pointer, or zero if the node will not need a value.
  * Returns the new node pointer. On out of memory NULL is returned. */
-raxNode *raxNewNode(size_t children, int datafield) {
+raxNode *raxNewNode(rax *rax, size_t children, size_t valuelen) {
+    int hascount = (rax->flags & RAX_FLAG_RANK) != 0;
     size_t nodesize = sizeof(raxNode)+children+raxPadding(children)+
-                      sizeof(raxNode*)*children;
-    if (datafield) nodesize += sizeof(void*);
-    raxNode *node = rax_malloc(nodesize);
+                      sizeof(raxNode*)*children+valuelen;
+    if (hascount) nodesize += sizeof(uint64_t)*children;
+    raxNode *node = raxAlloc(rax,nodesize);
     if (node == NULL) return NULL;
     node->iskey = 0;
     node->isnull = 0;
     node->iscompr = 0;
+    node->isdense = 0;
+    node->isinline = 0;
+    node->hascount = hascount;
     node->size = children;
+    node->islink32 = 0;
+    node->needcompr = 0;
+    if (hascount) memset(raxNodeCounts(node),0,sizeof(uint64_t)*children);
     return node;
 }
 
 /* Allocate a new rax and return its pointer. On out of memory the function
- * returns NULL. */
-rax *raxNew(void) {
-    rax *rax = rax_malloc(sizeof(*rax));
+ * returns NULL. The 'flags' argument is used to enable optional features
+ * of the tree, see the RAX_FLAG_... defines in rax.h. The nodes, and the
+ * rax structure itself, are allocated using the specified allocator, that
+ * is copied inside the rax structure. Concurrent trees, that can't be
+ * compacted in place, don't support RAX_FLAG_LAZY_COMPACT, and trees with
+ * RAX_FLAG_BUCKETS don't support RAX_FLAG_RANK and RAX_FLAG_CONCURRENT: in
+ * these cases, as when atomics are not available, NULL is returned and errno
+ * is set to EINVAL. */
+rax *raxNewWithAllocator(const raxAllocator *alloc, int flags) {
+#ifndef RAX_HAVE_ATOMICS
+    if (flags & RAX_FLAG_CONCURRENT) {
+        errno = EINVAL;
+        return NULL;
+    }
+#endif
+    if ((flags & RAX_FLAG_CONCURRENT) && (flags & RAX_FLAG_LAZY_COMPACT)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((flags & RAX_FLAG_BUCKETS) &&
+        (flags & (RAX_FLAG_RANK|RAX_FLAG_CONCURRENT)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    rax *rax = alloc->malloc_fn(alloc->ctx,sizeof(*rax));
     if (rax == NULL) return NULL;
     rax->numele = 0;
     rax->numnodes = 1;
-    rax->head = raxNewNode(0,0);
+    rax->flags = flags;
+    rax->bytes = sizeof(*rax);
+    rax->version = 0;
+    rax->alloc = *alloc;
+    rax->concurrency = NULL;
+    rax->shared = NULL;
+    rax->head = raxNewNode(rax,0,0);
     if (rax->head == NULL) {
-        rax_free(rax);
+        alloc->free_fn(alloc->ctx,rax);
         return NULL;
-    } else {
-        return rax;
     }
+    if (flags & RAX_FLAG_CONCURRENT) {
+        rax->concurrency = rax_malloc(sizeof(raxConcurrency));
+        if (rax->concurrency == NULL) {
+            alloc->free_fn(alloc->ctx,rax->head);
+            alloc->free_fn(alloc->ctx,rax);
+            return NULL;
+        }
+        memset(rax->concurrency,0,sizeof(raxConcurrency));
+        rax->concurrency->epoch = 1;
+    }
+    return rax;
 }
 
-/* realloc the node to make room for auxiliary data in order
- * to store an item in that node. On out of memory NULL is returned. */
-raxNode *raxReallocForData(raxNode *n, void *data) {
-    if (data == NULL) return n; /* No reallocation needed, setting isnull=1 */
+/* Allocate a new rax using the default allocator. */
+rax *raxNewWithFlags(int flags) {
+    return raxNewWithAllocator(&raxDefaultAllocator,flags);
+}
+
+/* Allocate a new rax using its own slab arena, so that raxFree() can
+ * release all the tree memory at once. */
+rax *raxNewWithArena(int flags) {
+    raxAllocator alloc;
+    raxArena *arena = raxArenaNew();
+    if (arena == NULL) return NULL;
+    raxArenaAllocator(arena,&alloc,1);
+    rax *rax = raxNewWithAllocator(&alloc,flags);
+    if (rax == NULL) raxArenaRelease(arena);
+    return rax;
+}
+
+/* Allocate a new rax with the default options. */
+rax *raxNew(void) {
+    return raxNewWithFlags(0);
+}
+
+/* A value to store into a node, as passed to the insertion functions:
+ * either a pointer, or, if 'isinline' is true, 'len' bytes at 'buf' that
+ * are copied inside the node itself. */
+typedef struct raxValue {
+    void *ptr;
+    const unsigned char *buf;
+    size_t len;
+    int isinline;
+} raxValue;
+
+/* Return the length of the value section needed to store 'v'. */
+static inline size_t raxValueLen(const raxValue *v) {
+    if (v->isinline) return raxVarintLen(v->len)+v->len;
+    return v->ptr ? sizeof(void*) : 0;
+}
+
+/* realloc the node to make room for the value 'v', that may be bigger or
+ * smaller than the current one. On out of memory NULL is returned. */
+raxNode *raxReallocForValue(rax *rax, raxNode *n, const raxValue *v) {
     size_t curlen = raxNodeCurrentLength(n);
-    return rax_realloc(n,curlen+sizeof(void*));
+    size_t newlen = raxNodeValueOffset(n)+raxValueLen(v);
+    if (newlen == curlen) return n;
+    raxNode *newn = raxRealloc(rax,n,curlen,newlen);
+    /* Failing to shrink the node is not an error: the old node can still
+     * hold the new value. */
+    if (newn == NULL && newlen < curlen) return n;
+    return newn;
 }
 
 /* Set the node auxiliary data to the specified pointer. */
 void raxSetData(raxNode *n, void *data) {
     n->iskey = 1;
+    n->isinline = 0;
     if (data != NULL) {
         n->isnull = 0;
-        void **ndata = (void**)
-            ((char*)n+raxNodeCurrentLength(n)-sizeof(void*));
-        memcpy(ndata,&data,sizeof(data));
+        memcpy(raxNodeValue(n),&data,sizeof(data));
     } else {
         n->isnull = 1;
     }
 }
 
-/* Get the node auxiliary data. */
+/* Store the value 'v' into the node, that must have enough room for it,
+ * setting the node as a key. */
+static void raxStoreValue(raxNode *n, const raxValue *v) {
+    if (!v->isinline) {
+        raxSetData(n,v->ptr);
+        return;
+    }
+    n->iskey = 1;
+    n->isnull = 0;
+    n->isinline = 1;
+    unsigned char *p = raxNodeValue(n);
+    p += raxVarintEncode(p,v->len);
+    if (v->len) memcpy(p,v->buf,v->len);
+}
+
+/* Copy the key flags and the value of the node 'src' into 'dst', that must
+ * already have its final layout and enough room for the value. */
+static void raxCopyValue(raxNode *dst, raxNode *src) {
+    dst->iskey = src->iskey;
+    dst->isnull = src->isnull;
+    dst->isinline = src->isinline;
+    memcpy(raxNodeValue(dst),raxNodeValue(src),raxNodeValueLen(src));
+}
+
+/* Get the node auxiliary data. For inline values the pointer to the
+ * value bytes inside the node is returned. */
 void *raxGetData(raxNode *n) {
     if (n->isnull) return NULL;
-    void **ndata =(void**)((char*)n+raxNodeCurrentLength(n)-sizeof(void*));
+    unsigned char *p = raxNodeValue(n);
+    if (n->isinline) {
+        uint64_t len;
+        return p+raxVarintDecode(p,&len);
+    }
     void *data;
-    memcpy(&data,ndata,sizeof(data));
+    memcpy(&data,p,sizeof(data));
     return data;
 }
 
+/* Return the pointer to the inline value of the node, storing its length
+ * in '*len'. */
+static unsigned char *raxGetInlineData(raxNode *n, size_t *len) {
+    uint64_t vlen;
+    unsigned char *p = raxNodeValue(n);
+    p += raxVarintDecode(p,&vlen);
+    *len = vlen;
+    return p;
+}
+
 /* Add a new child to the node 'n' representing the character 'c' and return
  * its new pointer, as well as the child pointer by reference. Additionally
  * '***parentlink' is populated with the raxNode pointer-to-pointer of where
  * the new child was stored, which is useful for the caller to replace the
  * child pointer if it gets reallocated.
  *
+ * If the tree was created with RAX_FLAG_DENSE and the node reaches
+ * RAX_DENSE_MIN_CHILDREN children, it is also turned into a dense node.
+ *
  * On success the new parent node pointer is returned (it may change because
  * of the realloc, so the caller should discard 'n' and use the new value).
  * On out of memory NULL is returned, and the old node is still valid. */
-raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode ***parentlink) {
+raxNode *raxAddChild(rax *rax, raxNode *n, unsigned char c, raxNode **childptr, raxNode ***parentlink) {
     assert(n->iscompr == 0);
 
+    int wasdense = n->isdense;
+    int dense = wasdense || ((rax->flags & RAX_FLAG_DENSE) &&
+                             n->size+1 >= RAX_DENSE_MIN_CHILDREN);
     size_t curlen = raxNodeCurrentLength(n);
+    size_t valuelen = raxNodeValueLen(n);
     n->size++;
-    size_t newlen = raxNodeCurrentLength(n);
+    n->isdense = dense;
+    size_t newlen = raxNodeValueOffset(n)+valuelen;
     n->size--; /* For now restore the orignal size. We'll update it only on
                   success at the end. */
+    n->isdense = wasdense;
 
     /* Alloc the new child we will link to 'n'. */
-    raxNode *child = raxNewNode(0,0);
+    raxNode *child = raxNewNode(rax,0,0);
     if (child == NULL) return NULL;
 
     /* Make space in the original node. */
-    raxNode *newn = rax_realloc(n,newlen);
+    raxNode *newn = raxRealloc(rax,n,curlen,newlen);
     if (newn == NULL) {
-        rax_free(child);
+        raxDealloc(rax,child);
         return NULL;
     }
     n = newn;
@@ -278,7 +1143,8 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
      * pointer size, and the required node padding) bytes at the end, that is,
      * the additional char in the 'data' section, plus one pointer to the new
      * child, plus the padding needed in order to store addresses into aligned
-     * locations.
+     * locations. If the node is turning into a dense node, there is also
+     * space for the index.
      *
      * So if we start with the following node, having "abde" edges.
      *
@@ -300,53 +1166,59 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
      *
      * Let's find where to insert the new child in order to make sure
      * it is inserted in-place lexicographically. Assuming we are adding
-     * a child "c" in our case pos will be = 2 after the end of the following
-     * loop. */
-    int pos;
-    for (pos = 0; pos < n->size; pos++) {
-        if (n->data[pos] > c) break;
-    }
+     * a child "c" in our case pos will be = 2. */
+    int pos = raxCountEdgesLess(n->data,n->size,c);
 
-    /* Now, if present, move auxiliary data pointer at the end
-     * so that we can mess with the other data without overwriting it.
-     * We will obtain something like that:
+    /* Every section of the node (edges, index, child pointers, value)
+     * can only move forward, so we move them starting from the last one,
+     * in order to never overwrite data we still have to move. 'src' points
+     * to the sections in the old layout, 'dst' in the new one.
+     *
+     * To start, if present, move auxiliary data pointer (or the inline
+     * value) at the end. We will obtain something like that:
      *
      * [HDR*][abde][Aptr][Bptr][Dptr][Eptr][....][....]|AUXP|
      */
     unsigned char *src, *dst;
-    if (n->iskey && !n->isnull) {
-        src = ((unsigned char*)n+curlen-sizeof(void*));
-        dst = ((unsigned char*)n+newlen-sizeof(void*));
-        memmove(dst,src,sizeof(void*));
+    if (valuelen) {
+        src = ((unsigned char*)n+curlen-valuelen);
+        dst = ((unsigned char*)n+newlen-valuelen);
+        memmove(dst,src,valuelen);
     }
 
-    /* Compute the "shift", that is, how many bytes we need to move the
-     * pointers section forward because of the addition of the new child
-     * byte in the string section. Note that if we had no padding, that
-     * would be always "1", since we are adding a single byte in the string
-     * section of the node (where now there is "abde" basically).
-     *
-     * However we have padding, so it could be zero, or up to 8.
-     *
-     * Another way to think at the shift is, how many bytes we need to
-     * move child pointers forward *other than* the obvious sizeof(void*)
-     * needed for the additional pointer itself. */
-    size_t shift = newlen - curlen - sizeof(void*);
+    /* Compute where the child pointers start in the new layout: after the
+     * new edge character, the new padding, and the index if the node is
+     * dense. */
+    unsigned char *oldptrs = (unsigned char*) raxNodeFirstChildPtr(n);
+    unsigned char *newptrs = n->data+n->size+1+raxPadding(n->size+1)+
+                             (dense ? RAX_DENSE_INDEX_LEN : 0);
+
+    /* If the node has the subtree counts, they are stored just after the
+     * child pointers: move them as well, leaving space for the count of
+     * the new child, that is zero since its subtree is still empty. */
+    if (n->hascount) {
+        unsigned char *oldcounts = oldptrs+sizeof(raxNode*)*n->size;
+        unsigned char *newcounts = newptrs+sizeof(raxNode*)*(n->size+1);
+        memmove(newcounts+sizeof(uint64_t)*(pos+1),
+                oldcounts+sizeof(uint64_t)*pos,
+                sizeof(uint64_t)*(n->size-pos));
+        memmove(newcounts,oldcounts,sizeof(uint64_t)*pos);
+        memset(newcounts+sizeof(uint64_t)*pos,0,sizeof(uint64_t));
+    }
 
     /* We said we are adding a node with edge 'c'. The insertion
      * point is between 'b' and 'd', so the 'pos' variable value is
      * the index of the first child pointer that we need to move forward
      * to make space for our new pointer.
      *
-     * To start, move all the child pointers after the insertion point
-     * of shift+sizeof(pointer) bytes on the right, to obtain:
+     * Move all the child pointers after the insertion point in their new
+     * location, leaving space for one more pointer, to obtain:
      *
      * [HDR*][abde][Aptr][Bptr][....][....][Dptr][Eptr]|AUXP|
      */
-    src = n->data+n->size+
-          raxPadding(n->size)+
-          sizeof(raxNode*)*pos;
-    memmove(src+shift+sizeof(raxNode*),src,sizeof(raxNode*)*(n->size-pos));
+    src = oldptrs+sizeof(raxNode*)*pos;
+    dst = newptrs+sizeof(raxNode*)*(pos+1);
+    memmove(dst,src,sizeof(raxNode*)*(n->size-pos));
 
     /* Move the pointers to the left of the insertion position as well. Often
      * we don't need to do anything if there was already some padding to use. In
@@ -357,14 +1229,17 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
      *
      * [HDR*][abde][....][Aptr][Bptr][....][Dptr][Eptr]|AUXP|
      */
-    if (shift) {
-        src = (unsigned char*) raxNodeFirstChildPtr(n);
-        memmove(src+shift,src,sizeof(raxNode*)*pos);
+    if (newptrs != oldptrs) memmove(newptrs,oldptrs,sizeof(raxNode*)*pos);
+
+    /* If the node was already dense, also move the index just before the
+     * child pointers. */
+    if (wasdense) {
+        memmove(newptrs-RAX_DENSE_INDEX_LEN,oldptrs-RAX_DENSE_INDEX_LEN,
+                RAX_DENSE_INDEX_LEN);
     }
 
     /* Now make the space for the additional char in the data section,
-     * but also move the pointers before the insertion point to the right
-     * by shift bytes, in order to obtain the following:
+     * to obtain the following:
      *
      * [HDR*][ab.d][e...][Aptr][Bptr][....][Dptr][Eptr]|AUXP|
      */
@@ -378,8 +1253,9 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
      */
     n->data[pos] = c;
     n->size++;
-    src = (unsigned char*) raxNodeFirstChildPtr(n);
-    raxNode **childfield = (raxNode**)(src+sizeof(raxNode*)*pos);
+    n->isdense = dense;
+    if (dense) raxIndexUpdate(n,wasdense ? pos : 0);
+    raxNode **childfield = (raxNode**)(newptrs+sizeof(raxNode*)*pos);
     memcpy(childfield,&child,sizeof(child));
     *childptr = child;
     *parentlink = childfield;
@@ -394,128 +1270,594 @@ raxNode *raxAddChild(raxNode *n, unsigned char c, raxNode **childptr, raxNode **
  * The function also returns a child node, since the last node of the
  * compressed chain cannot be part of the chain: it has zero children while
  * we can only compress inner nodes with exactly one child each. */
-raxNode *raxCompressNode(raxNode *n, unsigned char *s, size_t len, raxNode **child) {
+raxNode *raxCompressNode(rax *rax, raxNode *n, unsigned char *s, size_t len, raxNode **child) {
     assert(n->size == 0 && n->iscompr == 0);
-    void *data = NULL; /* Initialized only to avoid warnings. */
     size_t newsize;
 
     debugf("Compress node: %.*s\n", (int)len,s);
 
     /* Allocate the child to link to this node. */
-    *child = raxNewNode(0,0);
+    *child = raxNewNode(rax,0,0);
     if (*child == NULL) return NULL;
 
     /* Make space in the parent node. */
+    size_t oldoffset = raxNodeValueOffset(n);
+    size_t valuelen = raxNodeValueLen(n);
     newsize = sizeof(raxNode)+len+raxPadding(len)+sizeof(raxNode*);
-    if (n->iskey) {
-        data = raxGetData(n); /* To restore it later. */
-        if (!n->isnull) newsize += sizeof(void*);
-    }
-    raxNode *newn = rax_realloc(n,newsize);
+    if (n->hascount) newsize += sizeof(uint64_t);
+    newsize += valuelen;
+    raxNode *newn = raxRealloc(rax,n,oldoffset+valuelen,newsize);
     if (newn == NULL) {
-        rax_free(*child);
+        raxDealloc(rax,*child);
         return NULL;
     }
     n = newn;
 
+    /* Move the value, if any, at its new position before writing the
+     * string, that may overlap with the old value position. */
     n->iscompr = 1;
     n->size = len;
+    memmove(raxNodeValue(n),(unsigned char*)n+oldoffset,valuelen);
     memcpy(n->data,s,len);
-    if (n->iskey) raxSetData(n,data);
+    if (n->hascount) raxSetCount(n,0,0);
     raxNode **childfield = raxNodeLastChildPtr(n);
     memcpy(childfield,child,sizeof(*child));
     return n;
 }
 
-/* Low level function that walks the tree looking for the string
- * 's' of 'len' bytes. The function returns the number of characters
- * of the key that was possible to process: if the returned integer
- * is the same as 'len', then it means that the node corresponding to the
- * string was found (however it may not be a key in case the node->iskey is
- * zero or if simply we stopped in the middle of a compressed node, so that
- * 'splitpos' is non zero).
- *
- * Otherwise if the returned integer is not the same as 'len', there was an
- * early stop during the tree walk because of a character mismatch.
- *
- * The node where the search ended (because the full string was processed
- * or because there was an early stop) is returned by reference as
- * '*stopnode' if the passed pointer is not NULL. This node link in the
- * parent's node is returned as '*plink' if not NULL. Finally, if the
- * search stopped in a compressed node, '*splitpos' returns the index
- * inside the compressed node where the search ended. This is useful to
- * know where to split the node for insertion.
- *
- * Note that when we stop in the middle of a compressed node with
- * a perfect match, this function will return a length equal to the
- * 'len' argument (all the key matched), and will return a *splitpos which is
- * always positive (that will represent the index of the character immediately
- * *after* the last match in the current compressed node).
+/* -------------------------------- Leaf buckets -----------------------------
+ * In trees created with RAX_FLAG_BUCKETS the keys below a leaf are stored in
+ * a "bucket" (see rax.h for the layout): a single small allocation holding
+ * up to RAX_BUCKET_MAX_KEYS whole suffixes, sorted, with their values. When
+ * the keys are sparse most of the nodes of a radix tree are chains leading
+ * to a single key: a bucket replaces all of them, so lookups touch fewer
+ * cache lines and the tree uses fewer nodes, at the cost of a binary search
+ * among the entries of the bucket.
  *
- * When instead we stop at a compressed node and *splitpos is zero, it
- * means that the current node represents the key (that is, none of the
- * compressed node characters are needed to represent the key, just all
- * its parents nodes). */
-static inline size_t raxLowWalk(rax *rax, unsigned char *s, size_t len, raxNode **stopnode, raxNode ***plink, int *splitpos, raxStack *ts) {
-    raxNode *h = rax->head;
-    raxNode **parentlink = &rax->head;
+ * When a bucket can no longer hold a new key it is burst: its keys are moved
+ * into a node for their common prefix, if any, followed by a node having a
+ * child for every first byte of the rest of the suffixes, stored again into
+ * buckets, and the insertion continues walking the new nodes.
+ * -------------------------------------------------------------------------- */
+
+#define RAX_BUCKET_MAX_KEYS 16  /* Max entries of a bucket. */
+#define RAX_BUCKET_MAX_LEN 512  /* Max length of a bucket, header included. */
+#define RAX_BUCKET_HDR_LEN (sizeof(raxNode)+sizeof(uint16_t)*2)
+
+/* Flags of the bucket entries. */
+#define RAX_BUCKET_NULL 1       /* The value is NULL, and is not stored. */
+#define RAX_BUCKET_INLINE 2     /* The value is stored inline. */
+
+/* An entry of a bucket, as decoded by raxBucketGet(): the suffix of the key,
+ * and the value, that is a pointer stored at 'value' unless it is NULL, or,
+ * for inline values, 'vlen' bytes at 'value'. The same structure describes
+ * the entries to store into a bucket, see raxBucketStore(). */
+typedef struct raxBucketItem {
+    unsigned char *suffix;
+    size_t len;
+    int flags;
+    unsigned char *value;
+    size_t vlen;                /* Length of the stored value bytes. */
+} raxBucketItem;
+
+static inline unsigned int raxBucketCount(raxNode *n) {
+    uint16_t count;
+    memcpy(&count,n->data,sizeof(count));
+    return count;
+}
 
-    size_t i = 0; /* Position in the string. */
-    size_t j = 0; /* Position in the node children (or bytes if compressed).*/
-    while(h->size && i < len) {
-        debugnode("Lookup current node",h);
-        unsigned char *v = h->data;
+/* Decode the entry 'j' of the bucket 'n' into 'e'. */
+static inline void raxBucketGet(raxNode *n, int j, raxBucketItem *e) {
+    uint16_t off;
+    uint64_t len;
+    memcpy(&off,n->data+sizeof(uint16_t)*(j+2),sizeof(off));
+    unsigned char *p = (unsigned char*)n+off;
+    p += raxVarintDecode(p,&len);
+    e->suffix = p;
+    e->len = len;
+    p += len;
+    e->flags = *p++;
+    if (e->flags & RAX_BUCKET_INLINE) {
+        p += raxVarintDecode(p,&len);
+        e->vlen = len;
+    } else {
+        e->vlen = (e->flags & RAX_BUCKET_NULL) ? 0 : sizeof(void*);
+    }
+    e->value = p;
+}
 
-        if (h->iscompr) {
-            for (j = 0; j < h->size && i < len; j++, i++) {
-                if (v[j] != s[i]) break;
-            }
-            if (j != h->size) break;
-        } else {
-            /* Even when h->size is large, linear scan provides good
-             * performances compared to other approaches that are in theory
-             * more sounding, like performing a binary search. */
-            for (j = 0; j < h->size; j++) {
-                if (v[j] == s[i]) break;
-            }
-            if (j == h->size) break;
-            i++;
-        }
+/* Return the value of the entry: like raxGetData(), the pointer to the
+ * value bytes is returned for inline values. */
+static inline void *raxBucketData(raxBucketItem *e) {
+    if (e->flags & RAX_BUCKET_NULL) return NULL;
+    if (e->flags & RAX_BUCKET_INLINE) return e->value;
+    void *data;
+    memcpy(&data,e->value,sizeof(data));
+    return data;
+}
 
-        if (ts) raxStackPush(ts,h); /* Save stack of parent nodes. */
-        raxNode **children = raxNodeFirstChildPtr(h);
-        if (h->iscompr) j = 0; /* Compressed node only child is at index 0. */
-        memcpy(&h,children+j,sizeof(h));
-        parentlink = children+j;
-        j = 0; /* If the new node is compressed and we do not
-                  iterate again (since i == l) set the split
-                  position to 0 to signal this node represents
-                  the searched key. */
+/* Return the value of the entry as returned by reference as the old value
+ * by the insertion and removal functions: NULL for inline values. */
+static inline void *raxBucketOldData(raxBucketItem *e) {
+    return (e->flags & RAX_BUCKET_INLINE) ? NULL : raxBucketData(e);
+}
+
+/* Return true if the value of the current element of the iterator 'it'
+ * is inline, that is, if it->data points to it->data_len bytes. */
+static inline int raxIteratorIsInline(raxIterator *it) {
+    if (raxIsBucket(it->node)) {
+        raxBucketItem e;
+        raxBucketGet(it->node,it->bucketpos,&e);
+        return (e.flags & RAX_BUCKET_INLINE) != 0;
     }
-    debugnode("Lookup stop node is",h);
-    if (stopnode) *stopnode = h;
-    if (plink) *plink = parentlink;
-    if (splitpos && h->iscompr) *splitpos = j;
-    return i;
+    return it->node->isinline && !it->node->isnull;
 }
 
-/* Insert the element 's' of size 'len', setting as auxiliary data
- * the pointer 'data'. If the element is already present, the associated
- * data is updated (only if 'overwrite' is set to 1), and 0 is returned,
- * otherwise the element is inserted and 1 is returned. On out of memory the
- * function returns 0 as well but sets errno to ENOMEM, otherwise errno will
- * be set to 0.
- */
-int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old, int overwrite) {
-    size_t i;
+/* Compare the suffix of the entry with the string 's' of 'len' bytes. */
+static inline int raxBucketCompare(raxBucketItem *e, unsigned char *s, size_t len) {
+    size_t minlen = e->len < len ? e->len : len;
+    int cmp = minlen ? memcmp(e->suffix,s,minlen) : 0;
+    if (cmp == 0) cmp = (e->len > len) - (e->len < len);
+    return cmp;
+}
+
+/* Look up the suffix 's' of 'len' bytes in the bucket 'n' with a binary
+ * search. Returns 1 if it is found, storing the entry in '*e' if not NULL,
+ * otherwise 0. In both cases '*pos', if not NULL, is set to the position
+ * of the first entry not smaller than the suffix. */
+static inline int raxBucketFind(raxNode *n, unsigned char *s, size_t len, int *pos, raxBucketItem *e) {
+    int lo = 0, hi = raxBucketCount(n);
+    raxBucketItem item;
+    while(lo < hi) {
+        int mid = (lo+hi)/2;
+        raxBucketGet(n,mid,&item);
+        int cmp = raxBucketCompare(&item,s,len);
+        if (cmp == 0) {
+            if (pos) *pos = mid;
+            if (e) *e = item;
+            return 1;
+        }
+        if (cmp < 0) lo = mid+1;
+        else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return 0;
+}
+
+/* Describe with 'e' the entry for the suffix 's' of 'len' bytes with the
+ * value 'v', or with the value of the key node 'n' if 'v' is NULL. */
+static void raxBucketItemInit(raxBucketItem *e, unsigned char *s, size_t len, const raxValue *v, raxNode *n) {
+    e->suffix = s;
+    e->len = len;
+    e->value = NULL;
+    e->vlen = 0;
+    if (v ? v->isinline : n->isinline) {
+        e->flags = RAX_BUCKET_INLINE;
+        if (v) {
+            e->value = (unsigned char*)v->buf;
+            e->vlen = v->len;
+        } else {
+            e->value = raxGetInlineData(n,&e->vlen);
+        }
+    } else if (v ? v->ptr == NULL : n->isnull) {
+        e->flags = RAX_BUCKET_NULL;
+    } else {
+        e->flags = 0;
+        e->value = v ? (unsigned char*)&v->ptr : raxNodeValue(n);
+        e->vlen = sizeof(void*);
+    }
+}
+
+/* Fill 'v' with the value of the entry, in order to store it into a node. */
+static void raxBucketItemValue(raxBucketItem *e, raxValue *v) {
+    v->isinline = (e->flags & RAX_BUCKET_INLINE) != 0;
+    v->ptr = v->isinline ? NULL : raxBucketData(e);
+    v->buf = e->value;
+    v->len = e->vlen;
+}
+
+/* Return the length of the bucket storing the 'count' entries 'items', or
+ * zero if they don't fit into a bucket. */
+static size_t raxBucketFits(raxBucketItem *items, int count) {
+    if (count > RAX_BUCKET_MAX_KEYS) return 0;
+    size_t len = RAX_BUCKET_HDR_LEN+sizeof(uint16_t)*count;
+    for (int j = 0; j < count; j++) {
+        raxBucketItem *e = items+j;
+        if (e->len > RAX_BUCKET_MAX_LEN || e->vlen > RAX_BUCKET_MAX_LEN)
+            return 0;
+        len += raxVarintLen(e->len)+e->len+1+e->vlen;
+        if (e->flags & RAX_BUCKET_INLINE) len += raxVarintLen(e->vlen);
+        if (len > RAX_BUCKET_MAX_LEN) return 0;
+    }
+    return len;
+}
+
+/* Store the 'count' entries 'items', sorted by suffix, that must fit into a
+ * bucket (see raxBucketFits()), into a bucket. The node 'n' is reallocated
+ * in order to become the bucket, or, if 'n' is NULL, a new node is
+ * allocated. The entries may point inside 'n', since they are encoded into
+ * a buffer before reallocating it. Returns the bucket, or NULL on out of
+ * memory, leaving 'n' untouched. */
+static raxNode *raxBucketStore(rax *rax, raxNode *n, raxBucketItem *items, int count) {
+    unsigned char buf[RAX_BUCKET_MAX_LEN];
+    uint16_t len = raxBucketFits(items,count), c = count;
+    uint16_t off = RAX_BUCKET_HDR_LEN+sizeof(uint16_t)*count;
+    assert(len != 0 && count != 0);
+    memcpy(buf+sizeof(raxNode),&c,sizeof(c));
+    memcpy(buf+sizeof(raxNode)+sizeof(c),&len,sizeof(len));
+    for (int j = 0; j < count; j++) {
+        raxBucketItem *e = items+j;
+        unsigned char *p = buf+off;
+        memcpy(buf+RAX_BUCKET_HDR_LEN+sizeof(off)*j,&off,sizeof(off));
+        p += raxVarintEncode(p,e->len);
+        if (e->len) memcpy(p,e->suffix,e->len);
+        p += e->len;
+        *p++ = e->flags;
+        if (e->flags & RAX_BUCKET_INLINE) p += raxVarintEncode(p,e->vlen);
+        if (e->vlen) memcpy(p,e->value,e->vlen);
+        p += e->vlen;
+        off = p-buf;
+    }
+
+    raxNode *newn;
+    int needcompr = n ? n->needcompr : 0;
+    if (n) {
+        size_t oldlen = raxNodeCurrentLength(n);
+        newn = raxRealloc(rax,n,oldlen,len);
+        if (newn == NULL && len < oldlen) newn = n;
+    } else {
+        newn = raxAlloc(rax,len);
+    }
+    if (newn == NULL) return NULL;
+    memcpy(newn->data,buf+sizeof(raxNode),len-sizeof(raxNode));
+    newn->iskey = 0;
+    newn->isnull = 0;
+    newn->iscompr = 0;
+    newn->isdense = 1;
+    newn->isinline = 0;
+    newn->hascount = 0;
+    newn->size = 0;
+    newn->islink32 = 0;
+    newn->needcompr = needcompr;
+    return newn;
+}
+
+/* Allocate a leaf representing a key with the value of the entry 'e'. */
+static raxNode *raxBucketNewLeaf(rax *rax, raxBucketItem *e) {
+    raxValue v;
+    raxBucketItemValue(e,&v);
+    raxNode *n = raxNewNode(rax,0,raxValueLen(&v));
+    if (n) raxStoreValue(n,&v);
+    return n;
+}
+
+/* Burst the bucket 'n': its keys are moved into a new subtree, formed by a
+ * node for the common prefix of the suffixes (if any), and a node having
+ * the empty suffix as key (if any), with a child for every first byte of
+ * the other suffixes, that is a bucket with the rest of their suffixes, or
+ * just a key if the rest is empty. Returns the root of the subtree, that
+ * the caller should link in place of 'n', or NULL on out of memory. */
+static raxNode *raxBucketBurst(rax *rax, raxNode *n) {
+    raxBucketItem items[RAX_BUCKET_MAX_KEYS];
+    raxNode *nodes[RAX_BUCKET_MAX_KEYS+2];
+    int count = raxBucketCount(n), numnodes = 0, children = 0;
+    if (count == 0) return NULL; /* Only full buckets are burst. */
+    for (int j = 0; j < count; j++) raxBucketGet(n,j,items+j);
+
+    /* The entries are sorted, so the common prefix of all the suffixes is
+     * the one of the first and the last. */
+    raxBucketItem *last = items+count-1;
+    size_t prefixlen = raxMatchLen(items[0].suffix,last->suffix,
+        items[0].len < last->len ? items[0].len : last->len);
+    unsigned char *prefix = items[0].suffix;
+    for (int j = 0; j < count; j++) {
+        items[j].suffix += prefixlen;
+        items[j].len -= prefixlen;
+        if (items[j].len && (j == 0 || items[j-1].len == 0 ||
+            items[j].suffix[0] != items[j-1].suffix[0])) children++;
+    }
+
+    /* The empty suffix, if any, is the first entry: it is the key of the
+     * branching node. */
+    int first = items[0].len == 0;
+    raxValue v = {NULL,NULL,0,0};
+    if (first) raxBucketItemValue(items,&v);
+    raxNode *root, *branch = raxNewNode(rax,children,raxValueLen(&v));
+    if (branch == NULL) goto oom;
+    nodes[numnodes++] = branch;
+    if (first) raxStoreValue(branch,&v);
+    root = branch;
+    if (prefixlen) {
+        size_t nodesize = sizeof(raxNode)+prefixlen+raxPadding(prefixlen)+
+                          sizeof(raxNode*);
+        root = raxAlloc(rax,nodesize);
+        if (root == NULL) goto oom;
+        nodes[numnodes++] = root;
+        root->iskey = 0;
+        root->isnull = 0;
+        root->iscompr = prefixlen > 1;
+        root->isdense = 0;
+        root->isinline = 0;
+        root->hascount = 0;
+        root->size = prefixlen;
+        root->islink32 = 0;
+        memcpy(root->data,prefix,prefixlen);
+        memcpy(raxNodeLastChildPtr(root),&branch,sizeof(branch));
+    }
+
+    /* Create a child for every group of entries with the same first
+     * byte. */
+    int c = 0;
+    for (int j = first, k; j < count; j = k) {
+        unsigned char edge = items[j].suffix[0];
+        for (k = j; k < count && items[k].suffix[0] == edge; k++) {
+            items[k].suffix++;
+            items[k].len--;
+        }
+        raxNode *child;
+        if (k-j == 1 && items[j].len == 0)
+            child = raxBucketNewLeaf(rax,items+j);
+        else
+            child = raxBucketStore(rax,NULL,items+j,k-j);
+        if (child == NULL) goto oom;
+        nodes[numnodes++] = child;
+        branch->data[c] = edge;
+        memcpy(raxNodeFirstChildPtr(branch)+c,&child,sizeof(child));
+        c++;
+    }
+    root->needcompr = n->needcompr;
+    rax->numnodes += numnodes;
+    return root;
+
+oom:
+    for (int j = 0; j < numnodes; j++) raxFreeNode(rax,nodes[j]);
+    return NULL;
+}
+
+/* Insert the suffix 's' of 'len' bytes with the value 'v' into the bucket
+ * 'h', linked by 'parentlink'. The return value, the old value and errno
+ * are like raxLowInsert(), but if the bucket can't hold the key it is
+ * burst, and -1 is returned: the caller should insert the key again,
+ * walking the new nodes. */
+static int raxBucketInsert(rax *rax, raxNode *h, raxNode **parentlink, unsigned char *s, size_t len, const raxValue *v, void **old, int overwrite) {
+    raxBucketItem items[RAX_BUCKET_MAX_KEYS+1];
+    int count = raxBucketCount(h), pos;
+    int found = raxBucketFind(h,s,len,&pos,items);
+    if (found) {
+        if (old) *old = raxBucketOldData(items);
+        if (!overwrite) {
+            errno = 0;
+            return 0;
+        }
+    }
+    for (int j = 0; j < count; j++)
+        raxBucketGet(h,j,items+j+(!found && j >= pos));
+    raxBucketItemInit(items+pos,s,len,v,NULL);
+    if (raxBucketFits(items,count+!found)) {
+        raxNode *newh = raxBucketStore(rax,h,items,count+!found);
+        if (newh == NULL) {
+            errno = ENOMEM;
+            return 0;
+        }
+        memcpy(parentlink,&newh,sizeof(newh));
+        if (found) {
+            errno = 0;
+            return 0;
+        }
+        rax->numele++;
+        return 1;
+    }
+
+    raxNode *sub = raxBucketBurst(rax,h);
+    if (sub == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    memcpy(parentlink,&sub,sizeof(sub));
+    raxDealloc(rax,h);
+    rax->numnodes--;
+    return -1;
+}
+
+/* Turn the bucket 'n' into an empty leaf, that is not a key. Returns the
+ * node, that may have been reallocated. */
+static raxNode *raxBucketClear(rax *rax, raxNode *n) {
+    size_t oldlen = raxNodeCurrentLength(n);
+    n->isdense = 0;
+    raxNode *newn = raxRealloc(rax,n,oldlen,raxNodeCurrentLength(n));
+    return newn ? newn : n;
+}
+
+/* Remove the suffix 's' of 'len' bytes from the bucket '*link'. Returns 1
+ * and the old value by reference if it was found, otherwise 0. The last
+ * key of a bucket leaves an empty leaf that is not a key, that the caller
+ * should remove as usually. */
+static int raxBucketRemove(rax *rax, raxNode **link, unsigned char *s, size_t len, void **old) {
+    raxBucketItem items[RAX_BUCKET_MAX_KEYS];
+    raxNode *h, *newh;
+    memcpy(&h,link,sizeof(h));
+    int count = raxBucketCount(h), pos;
+    if (!raxBucketFind(h,s,len,&pos,items)) return 0;
+    if (old) *old = raxBucketOldData(items);
+    if (count == 1) {
+        newh = raxBucketClear(rax,h);
+    } else {
+        for (int j = 0; j < count; j++)
+            if (j != pos) raxBucketGet(h,j,items+j-(j > pos));
+        newh = raxBucketStore(rax,h,items,count-1);
+    }
+    /* Shrinking the bucket never fails. */
+    memcpy(link,&newh,sizeof(newh));
+    rax->numele--;
+    return 1;
+}
+
+/* If the rest 's' of 'len' bytes of a key, after the leaf 'h', can be
+ * stored together with the key of the leaf, if any, into a bucket, turn
+ * 'h', linked by 'parentlink', into such a bucket. Returns 1 if the key
+ * was stored, 0 if the keys don't fit into a bucket, and -1 on out of
+ * memory. */
+static int raxBucketFromLeaf(rax *rax, raxNode *h, raxNode **parentlink, unsigned char *s, size_t len, const raxValue *v) {
+    raxBucketItem items[2];
+    int count = 0;
+    if (h->iskey) raxBucketItemInit(items+count++,NULL,0,NULL,h);
+    raxBucketItemInit(items+count++,s,len,v,NULL);
+    if (!raxBucketFits(items,count)) return 0;
+    raxNode *newh = raxBucketStore(rax,h,items,count);
+    if (newh == NULL) return -1;
+    memcpy(parentlink,&newh,sizeof(newh));
+    return 1;
+}
+
+/* Low level function that walks the tree looking for the string
+ * 's' of 'len' bytes. The function returns the number of characters
+ * of the key that was possible to process: if the returned integer
+ * is the same as 'len', then it means that the node corresponding to the
+ * string was found (however it may not be a key in case the node->iskey is
+ * zero or if simply we stopped in the middle of a compressed node, so that
+ * 'splitpos' is non zero).
+ *
+ * Otherwise if the returned integer is not the same as 'len', there was an
+ * early stop during the tree walk because of a character mismatch.
+ *
+ * The node where the search ended (because the full string was processed
+ * or because there was an early stop) is returned by reference as
+ * '*stopnode' if the passed pointer is not NULL. This node link in the
+ * parent's node is returned as '*plink' if not NULL. Finally, if the
+ * search stopped in a compressed node, '*splitpos' returns the index
+ * inside the compressed node where the search ended. This is useful to
+ * know where to split the node for insertion.
+ *
+ * Note that when we stop in the middle of a compressed node with
+ * a perfect match, this function will return a length equal to the
+ * 'len' argument (all the key matched), and will return a *splitpos which is
+ * always positive (that will represent the index of the character immediately
+ * *after* the last match in the current compressed node).
+ *
+ * When instead we stop at a compressed node and *splitpos is zero, it
+ * means that the current node represents the key (that is, none of the
+ * compressed node characters are needed to represent the key, just all
+ * its parents nodes).
+ *
+ * The walk is implemented by raxLowWalkBase(), that also walks frozen
+ * images, where 'base' is the address of the image (see raxChildAt()),
+ * and 'plink' is not meaningful. In turn it is implemented by
+ * raxLowWalkFrom(), that starts the walk from the node 'h', linked by
+ * 'parentlink', after the first 'i' bytes of the string: it is used by
+ * raxFinger to resume the walk from the middle of the tree. */
+static inline size_t raxLowWalkFrom(uintptr_t base, raxNode *h, raxNode **parentlink, size_t i, unsigned char *s, size_t len, raxNode **stopnode, raxNode ***plink, int *splitpos, raxStack *ts) {
+    size_t j = 0; /* Position in the node children (or bytes if compressed).*/
+    raxCount(walks,1);
+    while(h->size && i < len) {
+        debugnode("Lookup current node",h);
+        unsigned char *v = h->data;
+
+        if (h->iscompr) {
+            size_t max = len-i < h->size ? len-i : h->size;
+            j = raxMatchLen(v,s+i,max);
+            i += j;
+            if (j != h->size) break;
+        } else {
+            /* Even when h->size is large, linear scan provides good
+             * performances compared to other approaches that are in theory
+             * more sounding, like performing a binary search. Wide nodes
+             * are scanned using vector instructions if possible. */
+            j = raxNodeFindEdge(h,s[i]);
+            if (j == h->size) break;
+            i++;
+        }
+
+        if (h->iscompr) j = 0; /* Compressed node only child is at index 0. */
+        if (ts) raxStackPush(ts,h,j); /* Save stack of parent nodes. */
+        parentlink = raxNodeFirstChildPtr(h)+j;
+        h = raxChildAt(h,j,base);
+        raxCount(walknodes,1);
+        j = 0; /* If the new node is compressed and we do not
+                  iterate again (since i == l) set the split
+                  position to 0 to signal this node represents
+                  the searched key. */
+    }
+    debugnode("Lookup stop node is",h);
+    if (stopnode) *stopnode = h;
+    if (plink) *plink = parentlink;
+    if (splitpos && h->iscompr) *splitpos = j;
+    return i;
+}
+
+static inline size_t raxLowWalkBase(rax *rax, uintptr_t base, unsigned char *s, size_t len, raxNode **stopnode, raxNode ***plink, int *splitpos, raxStack *ts) {
+    return raxLowWalkFrom(base,raxAtomicLoad(&rax->head),&rax->head,0,
+                          s,len,stopnode,plink,splitpos,ts);
+}
+
+static inline size_t raxLowWalk(rax *rax, unsigned char *s, size_t len, raxNode **stopnode, raxNode ***plink, int *splitpos, raxStack *ts) {
+    return raxLowWalkBase(rax,0,s,len,stopnode,plink,splitpos,ts);
+}
+
+/* In trees having subtree counts, add 'delta' to the counts of all the
+ * nodes in the path of the key 's' of 'len' bytes, that must be a key
+ * already stored in the tree. This is called after a key is inserted, with
+ * delta 1, and before it is removed, with delta -1. The set operations also
+ * call it for the prefix of a subtree they moved, that ends at a node, in
+ * order to account for all its keys. */
+static void raxUpdateCounts(rax *rax, unsigned char *s, size_t len, int64_t delta) {
+    if (!(rax->flags & RAX_FLAG_RANK)) return;
+    raxNode *h = rax->head;
+    size_t i = 0;
+    while(i < len) {
+        int j = 0;
+        if (h->iscompr) {
+            i += h->size;
+        } else {
+            j = raxNodeFindEdge(h,s[i]);
+            i++;
+        }
+        raxSetCount(h,j,raxGetCount(h,j)+delta);
+        memcpy(&h,raxNodeFirstChildPtr(h)+j,sizeof(h));
+    }
+}
+
+static int raxConcurrentInsert(rax *rax, unsigned char *s, size_t len, const raxValue *v, void **old, int overwrite);
+static int raxConcurrentRemove(rax *rax, unsigned char *s, size_t len, void **old);
+static int raxUnshareKey(rax *rax, unsigned char *s, size_t len, int exists);
+static size_t raxFingerWalk(raxFinger *f, unsigned char *s, size_t len, raxNode **stopnode, raxNode ***plink, int *splitpos);
+
+/* Insert the element 's' of size 'len', setting as auxiliary data
+ * the value 'v'. If the element is already present, the associated
+ * data is updated (only if 'overwrite' is set to 1), and 0 is returned,
+ * otherwise the element is inserted and 1 is returned. On out of memory the
+ * function returns 0 as well but sets errno to ENOMEM, otherwise errno will
+ * be set to 0. The old value pointer is returned by reference only if it
+ * is not an inline value, otherwise NULL is returned.
+ *
+ * If 'f' is not NULL the lookup uses the hint 'f', see raxFingerWalk(): it
+ * is only passed for trees that are neither concurrent nor forked.
+ */
+static int raxLowInsert(rax *rax, unsigned char *s, size_t len, const raxValue *v, void **old, int overwrite, raxFinger *f) {
+    if (rax->flags & RAX_FLAG_CONCURRENT)
+        return raxConcurrentInsert(rax,s,len,v,old,overwrite);
+    if (rax->shared && !raxUnshareKey(rax,s,len,overwrite ? -1 : 0))
+        return 0;
+
+    size_t i;
     int j = 0; /* Split position. If raxLowWalk() stops in a compressed
                   node, the index 'j' represents the char we stopped within the
                   compressed node, that is, the position where to split the
                   node for insertion. */
     raxNode *h, **parentlink;
 
-    debugf("### Insert %.*s with value %p\n", (int)len, s, data);
-    i = raxLowWalk(rax,s,len,&h,&parentlink,&j,NULL);
+    debugf("### Insert %.*s with value %p\n", (int)len, s, v->ptr);
+    if (f) i = raxFingerWalk(f,s,len,&h,&parentlink,&j);
+    else i = raxLowWalk(rax,s,len,&h,&parentlink,&j,NULL);
+
+    /* If we stopped at a bucket the rest of the key is stored there. If
+     * the bucket was burst, continue the walk from the new nodes. */
+    while(raxIsBucket(h)) {
+        int retval = raxBucketInsert(rax,h,parentlink,s+i,len-i,v,old,
+                                     overwrite);
+        if (retval != -1) return retval;
+        memcpy(&h,parentlink,sizeof(h));
+        i = raxLowWalkFrom(0,h,parentlink,i,s,len,&h,&parentlink,&j,NULL);
+    }
 
     /* If i == len we walked following the whole string. If we are not
      * in the middle of a compressed node, the string is either already
@@ -524,9 +1866,13 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
      * data pointer. */
     if (i == len && (!h->iscompr || j == 0 /* not in the middle if j is 0 */)) {
         debugf("### Insert: node representing key exists\n");
-        /* Make space for the value pointer if needed. */
-        if (!h->iskey || (h->isnull && overwrite)) {
-            h = raxReallocForData(h,data);
+        /* Fetch the old value before the node is reallocated, since a
+         * smaller new value may no longer leave space for it. */
+        void *oldval = NULL;
+        if (h->iskey && !h->isinline) oldval = raxGetData(h);
+        /* Make space for the value if needed. */
+        if (!h->iskey || overwrite) {
+            h = raxReallocForValue(rax,h,v);
             if (h) memcpy(parentlink,&h,sizeof(h));
         }
         if (h == NULL) {
@@ -536,16 +1882,17 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
 
         /* Update the existing key if there is already one. */
         if (h->iskey) {
-            if (old) *old = raxGetData(h);
-            if (overwrite) raxSetData(h,data);
+            if (old) *old = oldval;
+            if (overwrite) raxStoreValue(h,v);
             errno = 0;
             return 0; /* Element already exists. */
         }
 
-        /* Otherwise set the node as a key. Note that raxSetData()
+        /* Otherwise set the node as a key. Note that raxStoreValue()
          * will set h->iskey. */
-        raxSetData(h,data);
+        raxStoreValue(h,v);
         rax->numele++;
+        raxUpdateCounts(rax,s,len,1);
         return 1; /* Element inserted. */
     }
 
@@ -694,26 +2041,29 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         /* Set the length of the additional nodes we will need. */
         size_t trimmedlen = j;
         size_t postfixlen = h->size - j - 1;
-        int split_node_is_key = !trimmedlen && h->iskey && !h->isnull;
+        size_t valuelen = raxNodeValueLen(h);
+        size_t countlen = h->hascount ? sizeof(uint64_t) : 0;
         size_t nodesize;
 
         /* 2: Create the split node. Also allocate the other nodes we'll need
-         *    ASAP, so that it will be simpler to handle OOM. */
-        raxNode *splitnode = raxNewNode(1, split_node_is_key);
+         *    ASAP, so that it will be simpler to handle OOM. The value of
+         *    the compressed node, if any, will be moved to the split node
+         *    or to the trimmed node. */
+        uint64_t oldbytes = rax->bytes;
+        raxNode *splitnode = raxNewNode(rax,1,trimmedlen ? 0 : valuelen);
         raxNode *trimmed = NULL;
         raxNode *postfix = NULL;
 
         if (trimmedlen) {
             nodesize = sizeof(raxNode)+trimmedlen+raxPadding(trimmedlen)+
-                       sizeof(raxNode*);
-            if (h->iskey && !h->isnull) nodesize += sizeof(void*);
-            trimmed = rax_malloc(nodesize);
+                       sizeof(raxNode*)+countlen+valuelen;
+            trimmed = raxAlloc(rax,nodesize);
         }
 
         if (postfixlen) {
             nodesize = sizeof(raxNode)+postfixlen+raxPadding(postfixlen)+
-                       sizeof(raxNode*);
-            postfix = rax_malloc(nodesize);
+                       sizeof(raxNode*)+countlen;
+            postfix = raxAlloc(rax,nodesize);
         }
 
         /* OOM? Abort now that the tree is untouched. */
@@ -721,32 +2071,41 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
             (trimmedlen && trimmed == NULL) ||
             (postfixlen && postfix == NULL))
         {
-            rax_free(splitnode);
-            rax_free(trimmed);
-            rax_free(postfix);
+            rax->alloc.free_fn(rax->alloc.ctx,splitnode);
+            rax->alloc.free_fn(rax->alloc.ctx,trimmed);
+            rax->alloc.free_fn(rax->alloc.ctx,postfix);
+            rax->bytes = oldbytes;
             errno = ENOMEM;
             return 0;
         }
+        raxCount(splits,1);
         splitnode->data[0] = h->data[j];
 
+        /* All the new nodes are in the path to $NEXT, so their subtree
+         * counts are the same as the one of $NEXT. The new key will be
+         * accounted later, once inserted. */
+        uint64_t nextcount = countlen ? raxGetCount(h,0) : 0;
+        if (countlen) raxSetCount(splitnode,0,nextcount);
+
+        /* All the new nodes take the place of the compressed node, so they
+         * inherit its mark in trees with lazy compaction. */
+        splitnode->needcompr = h->needcompr;
+        splitnode->islink32 = 0;
         if (j == 0) {
             /* 3a: Replace the old node with the split node. */
-            if (h->iskey) {
-                void *ndata = raxGetData(h);
-                raxSetData(splitnode,ndata);
-            }
+            if (h->iskey) raxCopyValue(splitnode,h);
             memcpy(parentlink,&splitnode,sizeof(splitnode));
         } else {
             /* 3b: Trim the compressed node. */
             trimmed->size = j;
             memcpy(trimmed->data,h->data,j);
             trimmed->iscompr = j > 1 ? 1 : 0;
-            trimmed->iskey = h->iskey;
-            trimmed->isnull = h->isnull;
-            if (h->iskey && !h->isnull) {
-                void *ndata = raxGetData(h);
-                raxSetData(trimmed,ndata);
-            }
+            trimmed->isdense = 0;
+            trimmed->hascount = h->hascount;
+            trimmed->needcompr = h->needcompr;
+            trimmed->islink32 = 0;
+            raxCopyValue(trimmed,h);
+            if (countlen) raxSetCount(trimmed,0,nextcount);
             raxNode **cp = raxNodeLastChildPtr(trimmed);
             memcpy(cp,&splitnode,sizeof(splitnode));
             memcpy(parentlink,&trimmed,sizeof(trimmed));
@@ -760,9 +2119,15 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
             /* 4a: create a postfix node. */
             postfix->iskey = 0;
             postfix->isnull = 0;
+            postfix->isdense = 0;
+            postfix->isinline = 0;
+            postfix->hascount = h->hascount;
+            postfix->needcompr = h->needcompr;
+            postfix->islink32 = 0;
             postfix->size = postfixlen;
             postfix->iscompr = postfixlen > 1;
             memcpy(postfix->data,h->data+j+1,postfixlen);
+            if (countlen) raxSetCount(postfix,0,nextcount);
             raxNode **cp = raxNodeLastChildPtr(postfix);
             memcpy(cp,&next,sizeof(next));
             rax->numnodes++;
@@ -778,7 +2143,7 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         /* 6. Continue insertion: this will cause the splitnode to
          * get a new child (the non common character at the currently
          * inserted key). */
-        rax_free(h);
+        raxDealloc(rax,h);
         h = splitnode;
     } else if (h->iscompr && i == len) {
     /* ------------------------- ALGORITHM 2 --------------------------- */
@@ -787,34 +2152,44 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
 
         /* Allocate postfix & trimmed nodes ASAP to fail for OOM gracefully. */
         size_t postfixlen = h->size - j;
+        size_t countlen = h->hascount ? sizeof(uint64_t) : 0;
         size_t nodesize = sizeof(raxNode)+postfixlen+raxPadding(postfixlen)+
-                          sizeof(raxNode*);
-        if (data != NULL) nodesize += sizeof(void*);
-        raxNode *postfix = rax_malloc(nodesize);
+                          sizeof(raxNode*)+countlen+raxValueLen(v);
+        uint64_t oldbytes = rax->bytes;
+        raxNode *postfix = raxAlloc(rax,nodesize);
 
-        nodesize = sizeof(raxNode)+j+raxPadding(j)+sizeof(raxNode*);
-        if (h->iskey && !h->isnull) nodesize += sizeof(void*);
-        raxNode *trimmed = rax_malloc(nodesize);
+        nodesize = sizeof(raxNode)+j+raxPadding(j)+sizeof(raxNode*)+
+                   countlen+raxNodeValueLen(h);
+        raxNode *trimmed = raxAlloc(rax,nodesize);
 
         if (postfix == NULL || trimmed == NULL) {
-            rax_free(postfix);
-            rax_free(trimmed);
+            rax->alloc.free_fn(rax->alloc.ctx,postfix);
+            rax->alloc.free_fn(rax->alloc.ctx,trimmed);
+            rax->bytes = oldbytes;
             errno = ENOMEM;
             return 0;
         }
+        raxCount(splits,1);
 
         /* 1: Save next pointer. */
         raxNode **childfield = raxNodeLastChildPtr(h);
         raxNode *next;
         memcpy(&next,childfield,sizeof(next));
+        uint64_t nextcount = countlen ? raxGetCount(h,0) : 0;
 
         /* 2: Create the postfix node. */
         postfix->size = postfixlen;
         postfix->iscompr = postfixlen > 1;
         postfix->iskey = 1;
         postfix->isnull = 0;
+        postfix->isdense = 0;
+        postfix->isinline = 0;
+        postfix->hascount = h->hascount;
+        postfix->needcompr = h->needcompr;
+        postfix->islink32 = 0;
         memcpy(postfix->data,h->data+j,postfixlen);
-        raxSetData(postfix,data);
+        if (countlen) raxSetCount(postfix,0,nextcount);
+        raxStoreValue(postfix,v);
         raxNode **cp = raxNodeLastChildPtr(postfix);
         memcpy(cp,&next,sizeof(next));
         rax->numnodes++;
@@ -822,14 +2197,14 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         /* 3: Trim the compressed node. */
         trimmed->size = j;
         trimmed->iscompr = j > 1;
-        trimmed->iskey = 0;
-        trimmed->isnull = 0;
+        trimmed->isdense = 0;
+        trimmed->hascount = h->hascount;
+        trimmed->needcompr = h->needcompr;
+        trimmed->islink32 = 0;
         memcpy(trimmed->data,h->data,j);
         memcpy(parentlink,&trimmed,sizeof(trimmed));
-        if (h->iskey) {
-            void *aux = raxGetData(h);
-            raxSetData(trimmed,aux);
-        }
+        raxCopyValue(trimmed,h);
+        if (countlen) raxSetCount(trimmed,0,nextcount);
 
         /* Fix the trimmed node child pointer to point to
          * the postfix node. */
@@ -839,7 +2214,8 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         /* Finish! We don't need to continue with the insertion
          * algorithm for ALGO 2. The key is already inserted. */
         rax->numele++;
-        rax_free(h);
+        raxDealloc(rax,h);
+        raxUpdateCounts(rax,s,len,1);
         return 1; /* Key inserted. */
     }
 
@@ -848,6 +2224,17 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
     while(i < len) {
         raxNode *child;
 
+        /* In trees with buckets, a leaf and the rest of the key are
+         * stored into a bucket, if they fit, instead of adding nodes. */
+        if (h->size == 0 && (rax->flags & RAX_FLAG_BUCKETS)) {
+            int retval = raxBucketFromLeaf(rax,h,parentlink,s+i,len-i,v);
+            if (retval == -1) goto oom;
+            if (retval == 1) {
+                rax->numele++;
+                return 1;
+            }
+        }
+
         /* If this node is going to have a single child, and there
          * are other characters, so that that would result in a chain
          * of single-childed nodes, turn it into a compressed node. */
@@ -856,7 +2243,7 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
             size_t comprsize = len-i;
             if (comprsize > RAX_NODE_MAX_SIZE)
                 comprsize = RAX_NODE_MAX_SIZE;
-            raxNode *newh = raxCompressNode(h,s+i,comprsize,&child);
+            raxNode *newh = raxCompressNode(rax,h,s+i,comprsize,&child);
             if (newh == NULL) goto oom;
             h = newh;
             memcpy(parentlink,&h,sizeof(h));
@@ -865,7 +2252,7 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         } else {
             debugf("Inserting normal node\n");
             raxNode **new_parentlink;
-            raxNode *newh = raxAddChild(h,s[i],&child,&new_parentlink);
+            raxNode *newh = raxAddChild(rax,h,s[i],&child,&new_parentlink);
             if (newh == NULL) goto oom;
             h = newh;
             memcpy(parentlink,&h,sizeof(h));
@@ -875,12 +2262,13 @@ int raxGenericInsert(rax *rax, unsigned char *s, size_t len, void *data, void **
         rax->numnodes++;
         h = child;
     }
-    raxNode *newh = raxReallocForData(h,data);
+    raxNode *newh = raxReallocForValue(rax,h,v);
     if (newh == NULL) goto oom;
     h = newh;
     if (!h->iskey) rax->numele++;
-    raxSetData(h,data);
+    raxStoreValue(h,v);
     memcpy(parentlink,&h,sizeof(h));
+    raxUpdateCounts(rax,s,len,1);
     return 1; /* Element inserted. */
 
 oom:
@@ -888,42 +2276,352 @@ oom:
      * already modified. Set the node as a key, and then remove it. However we
      * do that only if the node is a terminal node, otherwise if the OOM
      * happened reallocating a node in the middle, we don't need to free
-     * anything. */
-    if (h->size == 0) {
+     * anything. If the terminal node is already a key, the OOM happened
+     * before adding anything below it, and there is nothing to free as
+     * well: removing it would delete an unrelated key. */
+    if (h->size == 0 && !h->iskey) {
         h->isnull = 1;
         h->iskey = 1;
         rax->numele++; /* Compensate the next remove. */
+        raxUpdateCounts(rax,s,i,1);
         assert(raxRemove(rax,s,i,NULL) != 0);
     }
     errno = ENOMEM;
     return 0;
 }
 
+static int raxGenericInsert(rax *rax, unsigned char *s, size_t len, const raxValue *v, void **old, int overwrite) {
+    return raxLowInsert(rax,s,len,v,old,overwrite,NULL);
+}
+
 /* Overwriting insert. Just a wrapper for raxGenericInsert() that will
  * update the element if there is already one for the same key. */
 int raxInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old) {
-    return raxGenericInsert(rax,s,len,data,old,1);
+    raxValue v = {data,NULL,0,0};
+    return raxGenericInsert(rax,s,len,&v,old,1);
 }
 
 /* Non overwriting insert function: this if an element with the same key
  * exists, the value is not updated and the function returns 0.
  * This is a just a wrapper for raxGenericInsert(). */
 int raxTryInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old) {
-    return raxGenericInsert(rax,s,len,data,old,0);
+    raxValue v = {data,NULL,0,0};
+    return raxGenericInsert(rax,s,len,&v,old,0);
+}
+
+/* Insert the element 's' of size 'len', storing the 'vlen' bytes at 'val'
+ * inside the node itself as the element value, instead of a pointer. If
+ * the element already exists its value is updated. The return value and
+ * the error reporting are the same as raxInsert(). */
+int raxInsertInline(rax *rax, unsigned char *s, size_t len, const void *val, size_t vlen) {
+    raxValue v = {NULL,val,vlen,1};
+    return raxGenericInsert(rax,s,len,&v,NULL,1);
+}
+
+/* Return true if the walk of the key 's' of 'len' bytes, that stopped at
+ * the node 'h' after 'i' bytes with the split position 'splitpos' (see
+ * raxLowWalk()), found the key, describing its value with '*e' (see
+ * raxBucketItem). In trees with buckets, the key may be an entry of the
+ * bucket where the walk stopped. */
+static inline int raxWalkFound(raxNode *h, unsigned char *s, size_t i, size_t len, int splitpos, raxBucketItem *e) {
+    if (raxIsBucket(h)) return raxBucketFind(h,s+i,len-i,NULL,e);
+    if (i != len || (h->iscompr && splitpos != 0) || !h->iskey) return 0;
+    raxBucketItemInit(e,NULL,0,NULL,h);
+    return 1;
+}
+
+/* Return the value of the key 's' of 'len' bytes, or raxNotFound if the
+ * key is not in the tree. This is the core of the lookups, inlined by the
+ * callers, so that the ones using keys of a fixed length (see the integer
+ * keys functions) get a walk specialized for that length. */
+static inline void *raxFindValue(rax *rax, unsigned char *s, size_t len) {
+    raxNode *h;
+    int splitpos = 0;
+    size_t i = raxLowWalk(rax,s,len,&h,NULL,&splitpos,NULL);
+    if (raxIsBucket(h)) {
+        raxBucketItem e;
+        if (!raxBucketFind(h,s+i,len-i,NULL,&e)) return raxNotFound;
+        return raxBucketData(&e);
+    }
+    if (i != len || (h->iscompr && splitpos != 0) || !h->iskey)
+        return raxNotFound;
+    return raxGetData(h);
 }
 
 /* Find a key in the rax, returns raxNotFound special void pointer value
  * if the item was not found, otherwise the value associated with the
  * item is returned. */
 void *raxFind(rax *rax, unsigned char *s, size_t len) {
+    debugf("### Lookup: %.*s\n", (int)len, s);
+    return raxFindValue(rax,s,len);
+}
+
+/* Find a key having an inline value, stored with raxInsertInline().
+ * Returns the pointer to the value bytes, storing the value length in
+ * '*vlen', or raxNotFound if the key is not there (or has a value that
+ * is not inline). The returned pointer points inside the tree node, so
+ * it is only valid until the next modification of the tree. */
+void *raxFindInline(rax *rax, unsigned char *s, size_t len, size_t *vlen) {
     raxNode *h;
+    raxBucketItem e;
 
-    debugf("### Lookup: %.*s\n", (int)len, s);
+    debugf("### Lookup inline: %.*s\n", (int)len, s);
     int splitpos = 0;
     size_t i = raxLowWalk(rax,s,len,&h,NULL,&splitpos,NULL);
-    if (i != len || (h->iscompr && splitpos != 0) || !h->iskey)
+    if (!raxWalkFound(h,s,i,len,splitpos,&e) ||
+        !(e.flags & RAX_BUCKET_INLINE))
         return raxNotFound;
-    return raxGetData(h);
+    *vlen = e.vlen;
+    return e.value;
+}
+
+/* Walk the tree following the string 's' of 'len' bytes, like
+ * raxLowWalk() does, calling cb(privdata,s,i,data) for every key that is a
+ * prefix of the string, from the shortest, 'i' being the key length and
+ * 'data' its value. The walk stops when the callback returns 0. Returns the
+ * number of calls. */
+typedef int (*raxPrefixNodeCallback)(void *privdata, unsigned char *s, size_t len, void *data);
+static size_t raxLowWalkPrefixes(rax *rax, unsigned char *s, size_t len, raxPrefixNodeCallback cb, void *privdata) {
+    raxNode *h = raxAtomicLoad(&rax->head);
+    size_t i = 0, calls = 0;
+    raxCount(walks,1);
+    while(1) {
+        if (h->iskey) {
+            calls++;
+            if (!cb(privdata,s,i,raxGetData(h))) break;
+        }
+        if (raxIsBucket(h)) {
+            /* The entries that are prefixes of the rest of the string come
+             * before the ones greater than the rest, by increasing
+             * length. */
+            int count = raxBucketCount(h);
+            for (int j = 0; j < count; j++) {
+                raxBucketItem e;
+                raxBucketGet(h,j,&e);
+                size_t max = e.len < len-i ? e.len : len-i;
+                int cmp = max ? memcmp(e.suffix,s+i,max) : 0;
+                if (cmp > 0) break;
+                if (cmp < 0 || e.len > len-i) continue;
+                calls++;
+                if (!cb(privdata,s,i+e.len,raxBucketData(&e))) break;
+            }
+            break;
+        }
+        if (h->size == 0 || i == len) break;
+
+        int j = 0;
+        if (h->iscompr) {
+            if (len-i < h->size || memcmp(h->data,s+i,h->size)) break;
+            i += h->size;
+        } else {
+            j = raxNodeFindEdge(h,s[i]);
+            if (j == h->size) break;
+            i++;
+        }
+        h = raxChildAt(h,j,0);
+        raxCount(walknodes,1);
+    }
+    return calls;
+}
+
+/* raxLowWalkPrefixes() callback of raxFindLongestPrefix(), remembering the
+ * last key found. */
+typedef struct raxLongestPrefix {
+    void *data;
+    size_t len;
+} raxLongestPrefix;
+
+static int raxLongestPrefixCallback(void *privdata, unsigned char *s, size_t len, void *data) {
+    raxLongestPrefix *lp = privdata;
+    (void)s;
+    lp->data = data;
+    lp->len = len;
+    return 1;
+}
+
+/* Find the longest key of the tree that is a prefix of the string 's' of
+ * 'len' bytes (the string itself included), like the routing tables do
+ * with addresses. The value of the key is returned, and its length is
+ * stored in '*matched_len' if not NULL, otherwise raxNotFound is returned.
+ * The tree is walked just once, from the head to the node where the string
+ * diverges from the keys, as a raxFind() of the whole string would do. */
+void *raxFindLongestPrefix(rax *rax, unsigned char *s, size_t len, size_t *matched_len) {
+    raxLongestPrefix lp = {NULL,0};
+    if (raxLowWalkPrefixes(rax,s,len,raxLongestPrefixCallback,&lp) == 0)
+        return raxNotFound;
+    if (matched_len) *matched_len = lp.len;
+    return lp.data;
+}
+
+/* raxLowWalkPrefixes() callback of raxForEachPrefix(). */
+typedef struct raxEachPrefix {
+    raxPrefixCallback cb;
+    void *privdata;
+} raxEachPrefix;
+
+static int raxEachPrefixCallback(void *privdata, unsigned char *s, size_t len, void *data) {
+    raxEachPrefix *ep = privdata;
+    return ep->cb(ep->privdata,s,len,data);
+}
+
+/* Call cb(privdata,s,keylen,data) for every key of the tree that is a
+ * prefix of the string 's' of 'len' bytes (the string itself included),
+ * from the shortest to the longest, 'data' being the value of the key
+ * returned by raxFind(). The key is the first 'keylen' bytes of 's'. If
+ * the callback returns 0 no other key is reported. With a single walk of
+ * the tree, the function returns the number of times the callback was
+ * called. */
+size_t raxForEachPrefix(rax *rax, unsigned char *s, size_t len, raxPrefixCallback cb, void *privdata) {
+    raxEachPrefix ep = {cb,privdata};
+    return raxLowWalkPrefixes(rax,s,len,raxEachPrefixCallback,&ep);
+}
+
+/* The multi keys lookup and insertion functions below process the keys
+ * in groups of RAX_MANY_BATCH keys. */
+#define RAX_MANY_BATCH 16
+
+#if defined(__GNUC__) || defined(__clang__)
+#define raxPrefetch(p) __builtin_prefetch(p)
+#else
+#define raxPrefetch(p) ((void)(p))
+#endif
+
+/* Like raxLowWalk(), but walks the tree for 'count' keys at the same time
+ * ('count' must be at most RAX_MANY_BATCH): at every round each walk
+ * descends a single level, and the next node is prefetched, so that it
+ * is hopefully already in the cache when the same walk is resumed in the
+ * next round. This way the cache misses of the different keys overlap,
+ * instead of paying the full memory latency for every level of every key,
+ * as we do when calling raxLowWalk() for a key after the other.
+ *
+ * For every key, the node where the walk stopped, the number of matched
+ * characters, and the split position (see raxLowWalk()), are stored in
+ * the 'stopnode', 'matched' and 'splitpos' arrays. */
+static void raxLowWalkMany(rax *rax, unsigned char **keys, size_t *lens, size_t count, raxNode **stopnode, size_t *matched, int *splitpos) {
+    int active[RAX_MANY_BATCH];
+    size_t numactive = 0;
+    raxNode *head = raxAtomicLoad(&rax->head);
+
+    raxCount(walks,count);
+    for (size_t k = 0; k < count; k++) {
+        stopnode[k] = head;
+        matched[k] = 0;
+        splitpos[k] = 0;
+        active[numactive++] = k;
+    }
+
+    while(numactive) {
+        size_t a = 0;
+        while(a < numactive) {
+            int k = active[a];
+            raxNode *h = stopnode[k];
+            unsigned char *s = keys[k];
+            size_t len = lens[k], i = matched[k], j;
+            int done = 0;
+
+            if (h->size == 0 || i == len) {
+                done = 1;
+            } else if (h->iscompr) {
+                size_t max = len-i < h->size ? len-i : h->size;
+                j = raxMatchLen(h->data,s+i,max);
+                i += j;
+                if (j != h->size) {
+                    splitpos[k] = j;
+                    done = 1;
+                } else {
+                    j = 0;
+                }
+            } else {
+                j = raxNodeFindEdge(h,s[i]);
+                if (j == h->size) done = 1; else i++;
+            }
+            matched[k] = i;
+
+            if (done) {
+                /* Remove the walk from the active ones, replacing it
+                 * with the last one (that we'll process next). */
+                active[a] = active[--numactive];
+                continue;
+            }
+            raxNode **children = raxNodeFirstChildPtr(h);
+            memcpy(&h,children+j,sizeof(h));
+            raxPrefetch(h);
+            stopnode[k] = h;
+            raxCount(walknodes,1);
+            a++;
+        }
+    }
+}
+
+/* Lookup 'count' keys at once: the key number 'k' is the string
+ * 'keys[k]' of 'lens[k]' bytes, and its associated value is stored in
+ * 'results[k]', or raxNotFound if the key is not in the tree. The function
+ * returns the number of keys found.
+ *
+ * This is semantically the same as calling raxFind() for every key,
+ * however the lookups of groups of keys are interleaved, so that the
+ * memory accesses can be performed in parallel: in large trees that
+ * don't fit the CPU caches this is considerably faster. */
+size_t raxFindMany(rax *rax, unsigned char **keys, size_t *lens, size_t count, void **results) {
+    raxNode *h[RAX_MANY_BATCH];
+    size_t matched[RAX_MANY_BATCH];
+    int splitpos[RAX_MANY_BATCH];
+    size_t found = 0;
+
+    for (size_t start = 0; start < count; start += RAX_MANY_BATCH) {
+        size_t n = count-start;
+        if (n > RAX_MANY_BATCH) n = RAX_MANY_BATCH;
+        raxLowWalkMany(rax,keys+start,lens+start,n,h,matched,splitpos);
+        for (size_t k = 0; k < n; k++) {
+            raxBucketItem e;
+            if (!raxWalkFound(h[k],keys[start+k],matched[k],lens[start+k],
+                              splitpos[k],&e))
+            {
+                results[start+k] = raxNotFound;
+            } else {
+                results[start+k] = raxBucketData(&e);
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+/* Insert 'count' keys at once, with the same semantics of calling
+ * raxInsert() for every key: the key number 'k' is the string 'keys[k]'
+ * of 'lens[k]' bytes, and its associated value is 'data[k]'. If 'data' is
+ * NULL, all the keys are inserted with a NULL value. The function returns
+ * the number of keys that were not already in the tree.
+ *
+ * Since an insertion modifies the tree, the insertions can't be
+ * interleaved like the lookups of raxFindMany(): instead every group of
+ * keys is first walked in parallel, so that the nodes the insertions are
+ * going to modify are brought in the cache, and then inserted one after
+ * the other.
+ *
+ * On out of memory the function stops at the key that could not be
+ * inserted, and returns the number of keys added so far, setting errno to
+ * ENOMEM. Otherwise errno is set to 0. */
+size_t raxInsertMany(rax *rax, unsigned char **keys, size_t *lens, size_t count, void **data) {
+    raxNode *h[RAX_MANY_BATCH];
+    size_t matched[RAX_MANY_BATCH];
+    int splitpos[RAX_MANY_BATCH];
+    size_t inserted = 0;
+
+    for (size_t start = 0; start < count; start += RAX_MANY_BATCH) {
+        size_t n = count-start;
+        if (n > RAX_MANY_BATCH) n = RAX_MANY_BATCH;
+        raxLowWalkMany(rax,keys+start,lens+start,n,h,matched,splitpos);
+        for (size_t k = start; k < start+n; k++) {
+            if (raxInsert(rax,keys[k],lens[k],data ? data[k] : NULL,NULL)) {
+                inserted++;
+            } else if (errno == ENOMEM) {
+                return inserted;
+            }
+        }
+    }
+    errno = 0;
+    return inserted;
 }
 
 /* Return the memory address where the 'parent' node stores the specified
@@ -946,20 +2644,23 @@ raxNode **raxFindParentLink(raxNode *parent, raxNode *child) {
  * removal) is returned. Note that this function does not fix the pointer
  * of the parent node in its parent, so this task is up to the caller.
  * The function never fails for out of memory. */
-raxNode *raxRemoveChild(raxNode *parent, raxNode *child) {
+raxNode *raxRemoveChild(rax *rax, raxNode *parent, raxNode *child) {
     debugnode("raxRemoveChild before", parent);
+    size_t oldlen = raxNodeCurrentLength(parent);
+    raxNode *newnode;
+
     /* If parent is a compressed node (having a single child, as for definition
      * of the data structure), the removal of the child consists into turning
      * it into a normal node without children. */
     if (parent->iscompr) {
-        void *data = NULL;
-        if (parent->iskey) data = raxGetData(parent);
-        parent->isnull = 0;
+        unsigned char *value = raxNodeValue(parent);
+        size_t valuelen = raxNodeValueLen(parent);
         parent->iscompr = 0;
         parent->size = 0;
-        if (parent->iskey) raxSetData(parent,data);
-        debugnode("raxRemoveChild after", parent);
-        return parent;
+        memmove(raxNodeValue(parent),value,valuelen);
+        newnode = raxRealloc(rax,parent,oldlen,raxNodeCurrentLength(parent));
+        debugnode("raxRemoveChild after", newnode ? newnode : parent);
+        return newnode ? newnode : parent;
     }
 
     /* Otherwise we need to scan for the child pointer and memmove()
@@ -981,59 +2682,226 @@ raxNode *raxRemoveChild(raxNode *parent, raxNode *child) {
         e++;
     }
 
-    /* 3. Remove the edge and the pointer by memmoving the remaining children
-     *    pointer and edge bytes one position before. */
-    int taillen = parent->size - (e - parent->data) - 1;
+    /* 3. Remove the edge and the pointer by memmoving the remaining
+     *    sections of the node backward. Since all the sections (edges,
+     *    index, children pointers, value) can only move backward, we
+     *    start from the first one, so that we never overwrite something
+     *    we still need to move. Note that the removal of one edge
+     *    character may change the padding, so the pointers before the
+     *    deletion point may need to be moved as well. */
+    int pos = e - parent->data;
+    int taillen = parent->size - pos - 1;
     debugf("raxRemoveChild tail len: %d\n", taillen);
+    size_t valuelen = raxNodeValueLen(parent);
+    unsigned char *value = raxNodeValue(parent);
     memmove(e,e+1,taillen);
 
-    /* Compute the shift, that is the amount of bytes we should move our
-     * child pointers to the left, since the removal of one edge character
-     * and the corresponding padding change, may change the layout.
-     * We just check if in the old version of the node there was at the
-     * end just a single byte and all padding: in that case removing one char
-     * will remove a whole sizeof(void*) word. */
-    size_t shift = ((parent->size+4) % sizeof(void*)) == 1 ? sizeof(void*) : 0;
+    /* Compute the new layout: dense nodes going under the shrink threshold
+     * are turned back into normal nodes. */
+    int dense = parent->isdense &&
+                parent->size-1 >= RAX_DENSE_SHRINK_CHILDREN;
+    unsigned char *newptrs = parent->data+parent->size-1+
+                             raxPadding(parent->size-1)+
+                             (dense ? RAX_DENSE_INDEX_LEN : 0);
+
+    /* Move the index, if we still need it. */
+    if (dense) {
+        memmove(newptrs-RAX_DENSE_INDEX_LEN,
+                ((unsigned char*)cp)-RAX_DENSE_INDEX_LEN,
+                RAX_DENSE_INDEX_LEN);
+    }
 
     /* Move the children pointers before the deletion point. */
-    if (shift)
-        memmove(((char*)cp)-shift,cp,(parent->size-taillen-1)*sizeof(raxNode**));
-
-    /* Move the remaining "tail" pointers at the right position as well. */
-    size_t valuelen = (parent->iskey && !parent->isnull) ? sizeof(void*) : 0;
-    memmove(((char*)c)-shift,c+1,taillen*sizeof(raxNode**)+valuelen);
+    if (newptrs != (unsigned char*)cp)
+        memmove(newptrs,cp,pos*sizeof(raxNode*));
+
+    /* Move the remaining "tail" pointers at the right position as well,
+     * then the subtree counts, skipping the one of the removed child, and
+     * finally the value if any. */
+    memmove(newptrs+pos*sizeof(raxNode*),c+1,taillen*sizeof(raxNode*));
+    unsigned char *newvalue = newptrs+(parent->size-1)*sizeof(raxNode*);
+    if (parent->hascount) {
+        unsigned char *oldcounts = ((unsigned char*)cp)+
+                                   parent->size*sizeof(raxNode*);
+        memmove(newvalue,oldcounts,pos*sizeof(uint64_t));
+        memmove(newvalue+pos*sizeof(uint64_t),
+                oldcounts+(pos+1)*sizeof(uint64_t),
+                taillen*sizeof(uint64_t));
+        newvalue += (parent->size-1)*sizeof(uint64_t);
+    }
+    memmove(newvalue,value,valuelen);
 
     /* 4. Update size. */
     parent->size--;
+    parent->isdense = dense;
+    if (dense) raxIndexUpdate(parent,pos);
 
     /* realloc the node according to the theoretical memory usage, to free
      * data if we are over-allocating right now. */
-    raxNode *newnode = rax_realloc(parent,raxNodeCurrentLength(parent));
+    newnode = raxRealloc(rax,parent,oldlen,raxNodeCurrentLength(parent));
     if (newnode) {
         debugnode("raxRemoveChild after", newnode);
     }
-    /* Note: if rax_realloc() fails we just return the old address, which
+    /* Note: if the realloc fails we just return the old address, which
      * is valid. */
     return newnode ? newnode : parent;
 }
 
-/* Remove the specified item. Returns 1 if the item was found and
- * deleted, 0 otherwise. */
-int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
-    raxNode *h;
-    raxStack ts;
+/* Compress the chain of nodes starting at 'start', if it is a node that is
+ * not a key and has a single child: the node and the following ones that are
+ * not keys and have a single child are replaced by a single compressed
+ * node. Returns the new node, or 'start' itself if no compression was
+ * possible. An out of memory here just means we cannot optimize this node,
+ * but the tree is left in a consistent state, so 'start' is returned as
+ * well. The caller should fix the parent link if the node changed. */
+static raxNode *raxCompressChain(rax *rax, raxNode *start) {
+    raxNode *h = start;
+    if (h->iskey || (!h->iscompr && h->size != 1)) return start;
+
+    /* Scan chain of nodes we can compress. */
+    size_t comprsize = h->size;
+    int nodes = 1;
+    while(h->size != 0) {
+        raxNode **cp = raxNodeLastChildPtr(h);
+        memcpy(&h,cp,sizeof(h));
+        if (h->iskey || (!h->iscompr && h->size != 1)) break;
+        /* Stop here if going to the next node would result into
+         * a compressed node larger than h->size can hold. */
+        if (comprsize + h->size > RAX_NODE_MAX_SIZE) break;
+        nodes++;
+        comprsize += h->size;
+    }
+    if (nodes == 1) return start;
+
+    /* If we can compress, create the new node and populate it. */
+    size_t nodesize =
+        sizeof(raxNode)+comprsize+raxPadding(comprsize)+sizeof(raxNode*);
+    if (start->hascount) nodesize += sizeof(uint64_t);
+    raxNode *new = raxAlloc(rax,nodesize);
+    if (new == NULL) return start;
+    new->iskey = 0;
+    new->isnull = 0;
+    new->iscompr = 1;
+    new->isdense = 0;
+    new->isinline = 0;
+    new->hascount = start->hascount;
+    new->size = comprsize;
+    new->islink32 = 0;
+    new->needcompr = 0;
+    rax->numnodes++;
+    raxCount(recompressions,1);
+
+    /* None of the nodes of the chain is a key, so they all have the
+     * same subtree count of the child of the new node. */
+    if (new->hascount) raxSetCount(new,0,raxGetCount(start,0));
+
+    /* Scan again, this time to populate the new node content and
+     * to fix the new node child pointer. At the same time we free
+     * all the nodes that we'll no longer use. */
+    comprsize = 0;
+    h = start;
+    while(nodes--) {
+        memcpy(new->data+comprsize,h->data,h->size);
+        comprsize += h->size;
+        raxNode **cp = raxNodeLastChildPtr(h);
+        raxNode *tofree = h;
+        memcpy(&h,cp,sizeof(h));
+        raxDealloc(rax,tofree); rax->numnodes--;
+    }
+    debugnode("New node",new);
 
-    debugf("### Delete: %.*s\n", (int)len, s);
+    /* Now 'h' points to the first node that we still need to use,
+     * so our new node child pointer will point to it. */
+    raxNode **cp = raxNodeLastChildPtr(new);
+    memcpy(cp,&h,sizeof(h));
+
+    debugf("Compressed chain, %d total bytes\n", (int)comprsize);
+    return new;
+}
+
+/* Compress the chain of nodes the node 'h' belongs to, given the stack 'ts'
+ * of its parents: the upper node of the chain that is compressible is
+ * found going up, then the chain is compressed starting from it, fixing
+ * the link of its parent. */
+static void raxCompressPath(rax *rax, raxNode *h, raxStack *ts) {
+    debugnode("Compression may be needed",h);
+    debugf("Seek start node\n");
+
+    /* Try to reach the upper node that is compressible.
+     * At the end of the loop 'h' will point to the first node we
+     * can try to compress and 'parent' to its parent. */
+    raxNode *parent;
+    while(1) {
+        parent = raxStackPop(ts);
+        if (!parent || parent->iskey ||
+            (!parent->iscompr && parent->size != 1)) break;
+        h = parent;
+        debugnode("Going up to",h);
+    }
+    raxNode *start = h; /* Compression starting node. */
+    raxNode *new = raxCompressChain(rax,start);
+    if (new != start) {
+        /* Fix parent link. */
+        if (parent) {
+            raxNode **parentlink = raxFindParentLink(parent,start);
+            memcpy(parentlink,&new,sizeof(new));
+        } else {
+            rax->head = new;
+        }
+    }
+}
+
+/* In trees with lazy compaction, mark the node 'h', that may be compressed
+ * with the nodes around it, and its parents in the stack 'ts', so that
+ * raxCompactStep() can find it later descending the marked nodes. The
+ * parents of a marked node are always marked, so we can stop at the first
+ * one already marked. */
+static void raxMarkPath(raxNode *h, raxStack *ts) {
+    h->needcompr = 1;
+    for (size_t j = ts->items; j > 0; j--) {
+        raxNode *parent = ts->stack[j-1];
+        if (parent->needcompr) break;
+        parent->needcompr = 1;
+    }
+}
+
+/* Remove the specified item. Returns 1 if the item was found and
+ * deleted, 0 otherwise. In trees created with RAX_FLAG_LAZY_COMPACT the
+ * nodes that are no longer needed are freed as usual, but the chains of
+ * nodes that could be compressed are left as they are, see
+ * raxCompactStep(). */
+int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
+    if (rax->flags & RAX_FLAG_CONCURRENT)
+        return raxConcurrentRemove(rax,s,len,old);
+    if (rax->shared && !raxUnshareKey(rax,s,len,1)) return 0;
+
+    raxNode *h, **plink;
+    raxStack ts;
+
+    debugf("### Delete: %.*s\n", (int)len, s);
     raxStackInit(&ts);
     int splitpos = 0;
-    size_t i = raxLowWalk(rax,s,len,&h,NULL,&splitpos,&ts);
-    if (i != len || (h->iscompr && splitpos != 0) || !h->iskey) {
-        raxStackFree(&ts);
-        return 0;
+    size_t i = raxLowWalk(rax,s,len,&h,&plink,&splitpos,&ts);
+    if (raxIsBucket(h)) {
+        /* Keys stored in a bucket are just removed from it, but the last
+         * one leaves an empty leaf, to reclaim like the leaves below. */
+        int removed = raxBucketRemove(rax,plink,s+i,len-i,old);
+        memcpy(&h,plink,sizeof(h));
+        if (!removed || raxIsBucket(h)) {
+            raxStackFree(&ts);
+            return removed;
+        }
+    } else {
+        if (i != len || (h->iscompr && splitpos != 0) || !h->iskey) {
+            raxStackFree(&ts);
+            return 0;
+        }
+        if (old) *old = h->isinline ? NULL : raxGetData(h);
+        raxUpdateCounts(rax,s,len,-1);
+        rax->bytes -= raxNodeValueLen(h);
+        h->iskey = 0;
+        rax->numele--;
     }
-    if (old) *old = raxGetData(h);
-    h->iskey = 0;
-    rax->numele--;
 
     /* If this node has no children, the deletion needs to reclaim the
      * no longer used nodes. This is an iterative process that needs to
@@ -1051,7 +2919,7 @@ int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
             child = h;
             debugf("Freeing child %p [%.*s] key:%d\n", (void*)child,
                 (int)child->size, (char*)child->data, child->iskey);
-            rax_free(child);
+            raxDealloc(rax,child);
             rax->numnodes--;
             h = raxStackPop(&ts);
              /* If this node has more then one child, or actually holds
@@ -1061,7 +2929,7 @@ int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
         if (child) {
             debugf("Unlinking child %p from parent %p\n",
                 (void*)child, (void*)h);
-            raxNode *new = raxRemoveChild(h,child);
+            raxNode *new = raxRemoveChild(rax,h,child);
             if (new != h) {
                 raxNode *parent = raxStackPeek(&ts);
                 raxNode **parentlink;
@@ -1086,168 +2954,3256 @@ int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
         trycompress = 1;
     }
 
-    /* Don't try node compression if our nodes pointers stack is not
-     * complete because of OOM while executing raxLowWalk() */
-    if (trycompress && ts.oom) trycompress = 0;
+    /* Don't try node compression if our nodes pointers stack is not
+     * complete because of OOM while executing raxLowWalk() */
+    if (trycompress && ts.oom) trycompress = 0;
+
+    /* Recompression: if trycompress is true, 'h' points to a radix tree node
+     * that changed in a way that could allow to compress nodes in this
+     * sub-branch. Compressed nodes represent chains of nodes that are not
+     * keys and have a single child, so there are two deletion events that
+     * may alter the tree so that further compression is needed:
+     *
+     * 1) A node with a single child was a key and now no longer is a key.
+     * 2) A node with two children now has just one child.
+     *
+     * We try to navigate upward till there are other nodes that can be
+     * compressed, when we reach the upper node which is not a key and has
+     * a single child, we scan the chain of children to collect the
+     * compressable part of the tree, and replace the current node with the
+     * new one, fixing the child pointer to reference the first non
+     * compressable node.
+     *
+     * Example of case "1". A tree stores the keys "FOO" = 1 and
+     * "FOOBAR" = 2:
+     *
+     *
+     * "FOO" -> "BAR" -> [] (2)
+     *           (1)
+     *
+     * After the removal of "FOO" the tree can be compressed as:
+     *
+     * "FOOBAR" -> [] (2)
+     *
+     *
+     * Example of case "2". A tree stores the keys "FOOBAR" = 1 and
+     * "FOOTER" = 2:
+     *
+     *          |B| -> "AR" -> [] (1)
+     * "FOO" -> |-|
+     *          |T| -> "ER" -> [] (2)
+     *
+     * After the removal of "FOOTER" the resulting tree is:
+     *
+     * "FOO" -> |B| -> "AR" -> [] (1)
+     *
+     * That can be compressed into:
+     *
+     * "FOOBAR" -> [] (1)
+     */
+    if (trycompress) {
+        debugf("After removing %.*s:\n", (int)len, s);
+        if (rax->flags & RAX_FLAG_LAZY_COMPACT)
+            raxMarkPath(h,&ts);
+        else
+            raxCompressPath(rax,h,&ts);
+    }
+    raxStackFree(&ts);
+    return 1;
+}
+
+/* ---------------------------- Concurrent trees ----------------------------
+ * Trees created with RAX_FLAG_CONCURRENT can be read by many threads while
+ * a single writer (or many writers serialized by a lock) modifies them.
+ * Readers don't take locks and never wait.
+ *
+ * This works because the nodes reachable by the readers are never modified:
+ * every modification first copies the nodes in the path of the key, from the
+ * root to the node where the lookup of the key stops, then performs the
+ * normal insertion or deletion on the copied path (where only these nodes
+ * are modified), and finally publishes the new root with an atomic store.
+ * Readers loading the root before the store see the old version of the
+ * tree, the others the new one.
+ *
+ * The nodes of the old version that are no longer part of the new one (the
+ * copied nodes, and the ones the modification freed) can't be released
+ * immediately, since readers may still be visiting the old version: they are
+ * retired, and freed with epoch based reclamation. Readers announce the
+ * epoch they see entering a read section (raxReadBegin()), and nodes retired
+ * in a given epoch are freed once all the readers in a read section entered
+ * it in a later epoch, since they loaded the root after the node was
+ * unlinked. The writer advances the epoch and frees what it can after every
+ * modification.
+ * -------------------------------------------------------------------------- */
+
+/* Retire the node 'ptr' of a concurrent tree: it will be freed by
+ * raxReclaim() when no reader can access it anymore. The space for the
+ * retired nodes of a modification is reserved before starting it, so
+ * this normally can't fail. If it happens anyway, since we can't free a
+ * node readers may be visiting, the node is leaked. */
+static void raxRetire(rax *rax, void *ptr) {
+    raxConcurrency *cs = rax->concurrency;
+    if (ptr == NULL) return;
+    if (cs->numretired == cs->maxretired) {
+        size_t newmax = cs->maxretired ? cs->maxretired*2 : 64;
+        raxRetired *retired = rax_realloc(cs->retired,
+                                          sizeof(raxRetired)*newmax);
+        if (retired == NULL) return;
+        cs->retired = retired;
+        cs->maxretired = newmax;
+    }
+    cs->retired[cs->numretired].ptr = ptr;
+    cs->retired[cs->numretired].epoch = cs->epoch;
+    cs->numretired++;
+}
+
+/* Make sure there is space for at least 'count' more retired nodes. Returns
+ * 0 on out of memory, otherwise 1. */
+static int raxReserveRetired(raxConcurrency *cs, size_t count) {
+    if (cs->maxretired-cs->numretired >= count) return 1;
+    size_t newmax = cs->maxretired*2;
+    if (newmax < cs->numretired+count) newmax = cs->numretired+count;
+    raxRetired *retired = rax_realloc(cs->retired,sizeof(raxRetired)*newmax);
+    if (retired == NULL) return 0;
+    cs->retired = retired;
+    cs->maxretired = newmax;
+    return 1;
+}
+
+/* Called by the writer after publishing a modification: advance the epoch,
+ * and free the retired nodes that no reader can access anymore, that is,
+ * the ones retired in an epoch before the one of all the readers that are
+ * currently in a read section. */
+static void raxReclaim(rax *rax) {
+    raxConcurrency *cs = rax->concurrency;
+    uint64_t epoch = cs->epoch;
+
+    /* The fences order the store of the new root before the new epoch, and
+     * both before the loads of the readers epochs: a reader not seen in a
+     * read section here is going to load the new root. */
+    raxAtomicFence();
+    raxAtomicStore(&cs->epoch,epoch+1);
+    raxAtomicFence();
+
+    uint64_t min = epoch+1;
+    for (raxReader *r = raxAtomicLoad(&cs->readers); r; r = r->next) {
+        uint64_t e = raxAtomicLoad(&r->epoch);
+        if (e && e < min) min = e;
+    }
+    size_t j = 0;
+    while(j < cs->numretired && cs->retired[j].epoch < min) {
+        rax->alloc.free_fn(rax->alloc.ctx,cs->retired[j].ptr);
+        j++;
+    }
+    if (j) {
+        memmove(cs->retired,cs->retired+j,
+                sizeof(raxRetired)*(cs->numretired-j));
+        cs->numretired -= j;
+    }
+}
+
+/* Copy the nodes of 'path' from the one at index 'from' to the last one,
+ * linking every copy from the copy of its parent. Returns the copy of the
+ * node at 'from', or NULL on out of memory. */
+static raxNode *raxCopyNodes(rax *rax, raxStack *path, size_t from) {
+    raxNode *copy = NULL;
+    size_t j;
+    for (j = path->items; j-- > from; ) {
+        raxNode *n = path->stack[j];
+        size_t len = raxNodeCurrentLength(n);
+        raxNode *parent = raxAlloc(rax,len);
+        if (parent == NULL) break;
+        memcpy(parent,n,len);
+        if (copy) {
+            memcpy(raxNodeFirstChildPtr(parent)+path->childidx[j],
+                   &copy,sizeof(copy));
+        }
+        copy = parent;
+    }
+    if (j+1 != from) {
+        /* Out of memory: free the copies, from the top. */
+        while(++j < path->items) {
+            raxNode *child = NULL;
+            if (j != path->items-1) {
+                memcpy(&child,raxNodeFirstChildPtr(copy)+path->childidx[j],
+                       sizeof(child));
+            }
+            raxFreeNode(rax,copy);
+            copy = child;
+        }
+        return NULL;
+    }
+    return copy;
+}
+
+/* Prepare the modification of the concurrent tree 'rax': 'path' is the
+ * stack of the nodes in the path of the key to modify, from the root to the
+ * node where the lookup stops, as filled by raxLowWalk() (with the stop
+ * node pushed as well). The nodes of the path are copied, and the working
+ * tree 'w' is set up to use the copies, so that it can be modified with the
+ * normal functions without altering the nodes visible to the readers.
+ * Returns 0 on out of memory (the tree is not modified), otherwise 1. */
+static int raxCopyPath(rax *rax, struct rax *w, raxStack *path) {
+    /* Besides the copied nodes, a modification frees at most the nodes of
+     * the path, and a few nodes more when compressing nodes after a
+     * deletion. */
+    if (path->oom || !raxReserveRetired(rax->concurrency,path->items*2+16)) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    raxNode *copy = raxCopyNodes(rax,path,0);
+    if (copy == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    /* The working tree is the same tree but for the root, and it is not
+     * flagged as concurrent, so that the normal functions are used. */
+    *w = *rax;
+    w->flags &= ~RAX_FLAG_CONCURRENT;
+    w->head = copy;
+    return 1;
+}
+
+/* Publish the modified working tree 'w' set up by raxCopyPath(), retiring
+ * the original nodes of the path, and reclaim the nodes we can. */
+static void raxPublish(rax *rax, struct rax *w, raxStack *path) {
+    raxAtomicStore(&rax->head,w->head);
+    raxAtomicStore(&rax->numele,w->numele);
+    raxAtomicStore(&rax->numnodes,w->numnodes);
+    rax->bytes = w->bytes;
+    for (size_t j = 0; j < path->items; j++) raxDealloc(rax,path->stack[j]);
+    raxReclaim(rax);
+}
+
+/* raxGenericInsert() for concurrent trees. */
+static int raxConcurrentInsert(rax *rax, unsigned char *s, size_t len, const raxValue *v, void **old, int overwrite) {
+    raxStack path;
+    raxNode *h;
+    int splitpos = 0;
+    raxStackInit(&path);
+    size_t i = raxLowWalk(rax,s,len,&h,NULL,&splitpos,&path);
+    raxStackPush(&path,h,0);
+
+    /* Nothing to do if the key exists and we should not update it. */
+    if (!overwrite && i == len && (!h->iscompr || splitpos == 0) &&
+        h->iskey)
+    {
+        if (old) *old = h->isinline ? NULL : raxGetData(h);
+        raxStackFree(&path);
+        errno = 0;
+        return 0;
+    }
+
+    struct rax w;
+    if (!raxCopyPath(rax,&w,&path)) {
+        raxStackFree(&path);
+        return 0;
+    }
+    int retval = raxGenericInsert(&w,s,len,v,old,overwrite);
+    int saved_errno = errno;
+    raxPublish(rax,&w,&path);
+    raxStackFree(&path);
+    errno = saved_errno;
+    return retval;
+}
+
+/* raxRemove() for concurrent trees. */
+static int raxConcurrentRemove(rax *rax, unsigned char *s, size_t len, void **old) {
+    raxStack path;
+    raxNode *h;
+    int splitpos = 0;
+    raxStackInit(&path);
+    size_t i = raxLowWalk(rax,s,len,&h,NULL,&splitpos,&path);
+    raxStackPush(&path,h,0);
+
+    /* Nothing to do if the key is not there. */
+    if (i != len || (h->iscompr && splitpos != 0) || !h->iskey) {
+        raxStackFree(&path);
+        return 0;
+    }
+
+    struct rax w;
+    if (!raxCopyPath(rax,&w,&path)) {
+        raxStackFree(&path);
+        return 0;
+    }
+    int retval = raxRemove(&w,s,len,old);
+    raxPublish(rax,&w,&path);
+    raxStackFree(&path);
+    return retval;
+}
+
+/* Register a reader of the concurrent tree 'rax'. Every thread reading the
+ * tree while it is modified needs its own reader, and must perform lookups
+ * and iterations inside read sections, calling raxReadBegin() before and
+ * raxReadEnd() after: the nodes visited are guaranteed to remain valid, and
+ * unchanged, only inside the read section, so for instance a key returned
+ * by an iterator has to be processed before ending the read section, and
+ * the iterator must be seeked again after entering a new one. Read sections
+ * should be short, since the nodes retired while a reader is in a read
+ * section are not freed till it exits.
+ *
+ * This function can be called at any time, by any thread. The reader is
+ * released with raxReaderRelease(), or when the tree is freed. If the tree
+ * was not created with RAX_FLAG_CONCURRENT, NULL is returned and errno is
+ * set to EINVAL. On out of memory NULL is returned and errno is set to
+ * ENOMEM. */
+raxReader *raxReaderNew(rax *rax) {
+#ifdef RAX_HAVE_ATOMICS
+    if (!(rax->flags & RAX_FLAG_CONCURRENT)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Reuse a released reader if possible. */
+    raxConcurrency *cs = rax->concurrency;
+    raxReader *r;
+    for (r = raxAtomicLoad(&cs->readers); r; r = r->next) {
+        int inuse = 0;
+        if (raxAtomicCAS(&r->inuse,&inuse,1)) return r;
+    }
+
+    /* Otherwise add a new reader at the head of the list. */
+    r = rax_malloc(sizeof(*r));
+    if (r == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    r->epoch = 0;
+    r->inuse = 1;
+    r->concurrency = cs;
+    r->next = raxAtomicLoad(&cs->readers);
+    while(!raxAtomicCAS(&cs->readers,&r->next,r));
+    return r;
+#else
+    (void)rax;
+    errno = EINVAL;
+    return NULL;
+#endif
+}
+
+/* Release the reader 'r', that must not be in a read section. */
+void raxReaderRelease(raxReader *r) {
+    raxAtomicStore(&r->inuse,0);
+}
+
+/* Enter a read section, see raxReaderNew(). */
+void raxReadBegin(raxReader *r) {
+#ifdef RAX_HAVE_ATOMICS
+    raxAtomicStore(&r->epoch,raxAtomicLoad(&r->concurrency->epoch));
+    /* Our epoch must be visible to the writer before we load the root. */
+    raxAtomicFence();
+#else
+    (void)r;
+#endif
+}
+
+/* Exit a read section. */
+void raxReadEnd(raxReader *r) {
+    raxAtomicStore(&r->epoch,0);
+}
+
+/* ------------------------------ Forked trees ------------------------------
+ * raxFork() creates a new tree sharing all the nodes of the original one,
+ * in constant time. The trees are then modified independently: a node
+ * reachable from more than one tree is never modified, so before modifying
+ * a tree, the nodes of the path of the key that are shared with other
+ * trees are copied, exactly like it happens for concurrent trees, and then
+ * the normal insertion or deletion is performed.
+ *
+ * In order to know when a node is shared, and when it can be freed, nodes
+ * have a reference count, that is the number of pointers to the node,
+ * from parent nodes or from the head of a tree. Most nodes are referenced
+ * only once, so the counts are not stored in the nodes: the nodes with
+ * more than one reference are tracked in a hash table shared by all the
+ * trees forked from the same tree. A node is shared if it, or one of the
+ * nodes above it in the path from the root, has more than one reference.
+ *
+ * When a node is copied, the children of the copy gain a reference, and
+ * when the normal functions free a node that is still referenced by other
+ * trees, the node is just released, and its children gain a reference
+ * instead, since the node pointers to them were moved into other nodes.
+ * -------------------------------------------------------------------------- */
+
+/* Return the slot of the node 'n' in the hash table of shared nodes. */
+static inline size_t raxSharedSlot(raxShared *sh, raxNode *n) {
+    uint64_t h = (uint64_t)(uintptr_t)n * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 32)) & (sh->size-1);
+}
+
+/* Return the number of references of the node 'n'. */
+static size_t raxSharedRefs(raxShared *sh, raxNode *n) {
+    if (sh->used == 0) return 1;
+    for (size_t j = raxSharedSlot(sh,n); sh->table[j].node;
+         j = (j+1) & (sh->size-1))
+    {
+        if (sh->table[j].node == n) return sh->table[j].refs;
+    }
+    return 1;
+}
+
+/* Resize the hash table of shared nodes to 'size' slots. Returns 0 on
+ * out of memory, otherwise 1. */
+static int raxSharedResize(raxShared *sh, size_t size) {
+    raxSharedRef *table = rax_malloc(sizeof(raxSharedRef)*size);
+    if (table == NULL) return 0;
+    memset(table,0,sizeof(raxSharedRef)*size);
+    raxSharedRef *old = sh->table;
+    size_t oldsize = sh->size;
+    sh->table = table;
+    sh->size = size;
+    for (size_t j = 0; j < oldsize; j++) {
+        if (old[j].node == NULL) continue;
+        size_t k = raxSharedSlot(sh,old[j].node);
+        while(table[k].node) k = (k+1) & (size-1);
+        table[k] = old[j];
+    }
+    rax_free(old);
+    return 1;
+}
+
+/* Make sure that at least 'count' more nodes can be added to the hash
+ * table of shared nodes without exceeding half of its slots. Returns 0 on
+ * out of memory, otherwise 1. */
+static int raxSharedReserve(raxShared *sh, size_t count) {
+    size_t size = sh->size ? sh->size : 64;
+    while((sh->used+count)*2 > size) size *= 2;
+    if (size == sh->size) return 1;
+    return raxSharedResize(sh,size);
+}
+
+/* Add a reference to the node 'n'. The table is grown when it becomes half
+ * full: if this fails, there is still the space reserved in advance with
+ * raxSharedReserve() by the caller, so this function can't fail. */
+static void raxSharedIncr(raxShared *sh, raxNode *n) {
+    if ((sh->used+1)*2 > sh->size)
+        raxSharedResize(sh,sh->size ? sh->size*2 : 64);
+    size_t j;
+    for (j = raxSharedSlot(sh,n); sh->table[j].node;
+         j = (j+1) & (sh->size-1))
+    {
+        if (sh->table[j].node == n) {
+            sh->table[j].refs++;
+            return;
+        }
+    }
+    sh->table[j].node = n;
+    sh->table[j].refs = 2;
+    sh->used++;
+}
+
+/* Remove a reference from the node 'n', returning the number of references
+ * left: when zero, the node is no longer used and should be freed. */
+static size_t raxSharedDecr(raxShared *sh, raxNode *n) {
+    if (sh->used == 0) return 0;
+    size_t mask = sh->size-1, j;
+    for (j = raxSharedSlot(sh,n); sh->table[j].node; j = (j+1) & mask) {
+        if (sh->table[j].node == n) break;
+    }
+    if (sh->table[j].node == NULL) return 0;
+    if (--sh->table[j].refs > 1) return sh->table[j].refs;
+
+    /* Back to a single reference: remove the node from the table, moving
+     * back the following entries of the cluster that can't be found
+     * anymore after the slot is emptied. */
+    sh->table[j].node = NULL;
+    for (size_t k = (j+1) & mask; sh->table[k].node; k = (k+1) & mask) {
+        size_t home = raxSharedSlot(sh,sh->table[k].node);
+        if (((k-home) & mask) >= ((k-j) & mask)) {
+            sh->table[j] = sh->table[k];
+            sh->table[k].node = NULL;
+            j = k;
+        }
+    }
+    sh->used--;
+    return 1;
+}
+
+/* Called by raxDealloc() in forked trees: free the node 'ptr' if no other
+ * tree references it, otherwise release it. The normal functions free a
+ * node after moving the pointers to its children into other nodes, so in
+ * the latter case the children gain a reference. */
+static void raxSharedDealloc(rax *rax, void *ptr) {
+    raxNode *n = ptr;
+    if (raxSharedDecr(rax->shared,n) == 0) {
+        rax->alloc.free_fn(rax->alloc.ctx,ptr);
+        return;
+    }
+    raxNode **cp = raxNodeFirstChildPtr(n);
+    for (int k = 0; k < raxNodeNumChildren(n); k++) {
+        raxNode *child;
+        memcpy(&child,cp+k,sizeof(child));
+        raxSharedIncr(rax->shared,child);
+    }
+}
+
+/* Make the nodes of 'path' (as filled by raxLowWalk(), with the stop node
+ * pushed as well) not shared with other trees, copying them starting from
+ * the first shared one, so that they can be modified. Returns 0 on out of
+ * memory (the tree is not modified), otherwise 1. */
+static int raxUnsharePath(rax *rax, raxStack *path) {
+    raxShared *sh = rax->shared;
+    size_t from, j;
+
+    if (path->oom) {
+        errno = ENOMEM;
+        return 0;
+    }
+    for (from = 0; from < path->items; from++)
+        if (raxSharedRefs(sh,path->stack[from]) > 1) break;
+    if (from == path->items) return 1;
+
+    /* Reserve space for the children of the copies, plus the few nodes
+     * that a deletion may release when compressing nodes. */
+    size_t needed = 16;
+    for (j = from; j < path->items; j++)
+        needed += raxNodeNumChildren((raxNode*)path->stack[j]);
+    raxNode *copy = NULL;
+    if (raxSharedReserve(sh,needed)) copy = raxCopyNodes(rax,path,from);
+    if (copy == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    /* The children of the copies, but the ones in the path that were
+     * copied as well, are now referenced by the copies too. */
+    raxNode *n = copy;
+    for (j = from; j < path->items; j++) {
+        raxNode **cp = raxNodeFirstChildPtr(n);
+        raxNode *next = NULL;
+        for (int k = 0; k < raxNodeNumChildren(n); k++) {
+            raxNode *child;
+            memcpy(&child,cp+k,sizeof(child));
+            if (j != path->items-1 && k == path->childidx[j])
+                next = child;
+            else
+                raxSharedIncr(sh,child);
+        }
+        n = next;
+    }
+
+    /* The first shared node loses the reference of its parent, that is not
+     * shared, and is modified in place to point to the copy. The original
+     * nodes are no longer part of this tree. */
+    raxSharedDecr(sh,path->stack[from]);
+    for (j = from; j < path->items; j++)
+        rax->bytes -= raxNodeCurrentLength((raxNode*)path->stack[j]);
+    if (from == 0) {
+        rax->head = copy;
+    } else {
+        raxNode *parent = path->stack[from-1];
+        memcpy(raxNodeFirstChildPtr(parent)+path->childidx[from-1],
+               &copy,sizeof(copy));
+    }
+    return 1;
+}
+
+/* If all the trees 'rax' was forked with were freed, no node can be shared
+ * anymore: release the table of the references, so that the tree is no
+ * longer considered forked. */
+static void raxSharedRelease(rax *rax) {
+    if (rax->shared == NULL || rax->shared->trees != 1) return;
+    rax_free(rax->shared->table);
+    rax_free(rax->shared);
+    rax->shared = NULL;
+}
+
+/* Called before modifying a forked tree in the path of the key 's' of
+ * 'len' bytes: the path is made not shared with other trees. If 'exists'
+ * is 1 this happens only if the key exists, if 0 only if it does not
+ * exist, and if -1 in any case, so that operations that are not going to
+ * modify the tree don't copy nodes. Returns 0 on out of memory, otherwise
+ * 1. */
+static int raxUnshareKey(rax *rax, unsigned char *s, size_t len, int exists) {
+    /* If all the other trees were freed, no node can be shared. */
+    raxSharedRelease(rax);
+    if (rax->shared == NULL) return 1;
+
+    raxStack path;
+    raxNode *h;
+    int splitpos = 0;
+    raxStackInit(&path);
+    size_t i = raxLowWalk(rax,s,len,&h,NULL,&splitpos,&path);
+    raxStackPush(&path,h,0);
+    raxBucketItem e;
+    int found = raxWalkFound(h,s,i,len,splitpos,&e);
+    int retval = 1;
+    if (exists == -1 || exists == found) retval = raxUnsharePath(rax,&path);
+    raxStackFree(&path);
+    return retval;
+}
+
+/* Create a fork of the tree 'rax', that is, a new tree with the same
+ * content, that shares all the nodes with the original. This takes
+ * constant time regardless of the size of the tree, and after the fork the
+ * two trees are modified independently: the modifications of a tree copy
+ * only the nodes they need to change, if shared with other trees. Values
+ * are not copied, so raxFreeWithCallback() calls the callback only when
+ * freeing the last of the trees forked from each other, since before that
+ * the values may still be used by other trees.
+ *
+ * The function returns NULL on out of memory, setting errno to ENOMEM.
+ * Concurrent trees, and trees whose allocator releases all the memory at
+ * once, can't be forked: in this case NULL is returned and errno is set to
+ * EINVAL. */
+rax *raxFork(rax *rax) {
+    if (rax->concurrency || rax->alloc.release_fn) {
+        errno = EINVAL;
+        return NULL;
+    }
+    raxShared *sh = rax->shared;
+    if (sh == NULL) {
+        sh = rax_malloc(sizeof(*sh));
+        if (sh == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        sh->trees = 1;
+        sh->table = NULL;
+        sh->size = 0;
+        sh->used = 0;
+    }
+    struct rax *fork = NULL;
+    if (raxSharedReserve(sh,1))
+        fork = rax->alloc.malloc_fn(rax->alloc.ctx,sizeof(*fork));
+    if (fork == NULL) {
+        if (rax->shared == NULL) {
+            rax_free(sh->table);
+            rax_free(sh);
+        }
+        errno = ENOMEM;
+        return NULL;
+    }
+    rax->shared = sh;
+    *fork = *rax;
+    sh->trees++;
+    raxSharedIncr(sh,rax->head);
+    return fork;
+}
+
+/* ------------------------------ Lazy compaction ----------------------------
+ * Removing keys may leave chains of nodes that are not keys and have a
+ * single child, that raxRemove() normally compresses into a single node at
+ * once. When keys are removed and inserted again in the same part of the
+ * tree, as it happens with keys expiring and being refilled, this means
+ * splitting and compressing the same nodes over and over, allocating and
+ * freeing memory every time.
+ *
+ * In trees created with RAX_FLAG_LAZY_COMPACT the removals just mark the
+ * node where the compression should start, and its parents, using the
+ * 'needcompr' bit of the nodes, that costs no memory. The chains are left
+ * uncompressed, so that insertions in the same place reuse them without
+ * splitting nodes, and raxCompactStep() compresses them later, a few at a
+ * time, finding the marked nodes from the head in O(depth). Insertions
+ * don't compact the subtrees they walk: a split of a marked node passes the
+ * mark to the new nodes.
+ * -------------------------------------------------------------------------- */
+
+/* Compress up to 'max_nodes' of the marked nodes of a tree created with
+ * RAX_FLAG_LAZY_COMPACT (all of them if 'max_nodes' is zero), together
+ * with the chains of nodes around them. The function returns 1 if there
+ * are still marked nodes and it should be called again, otherwise 0.
+ *
+ * Marked nodes are processed deepest first, so that the subtree of a node
+ * is compressed before the node itself. Nodes shared with forked trees
+ * can't be modified, so forked trees are not compacted until the other
+ * trees are freed (1 is returned, since the work is still pending).
+ * Concurrent trees are not supported: 0 is returned and errno is set to
+ * EINVAL. On out of memory 0 is returned as well, and errno is set to
+ * ENOMEM. Otherwise errno is set to 0. */
+int raxCompactStep(rax *rax, size_t max_nodes) {
+    if (rax->concurrency) {
+        errno = EINVAL;
+        return 0;
+    }
+    errno = 0;
+    raxSharedRelease(rax);
+    if (rax->shared) return rax->head->needcompr;
+
+    size_t compacted = 0;
+    while(rax->head->needcompr && (!max_nodes || compacted < max_nodes)) {
+        raxStack ts;
+        raxStackInit(&ts);
+
+        /* Descend the marked nodes, down to one without marked children:
+         * the chains of its subtree are already compressed. */
+        raxNode *h = rax->head;
+        while(1) {
+            raxNode **cp = raxNodeFirstChildPtr(h), *child = NULL;
+            int numchildren = raxNodeNumChildren(h), j;
+            for (j = 0; j < numchildren; j++) {
+                memcpy(&child,cp+j,sizeof(child));
+                if (child->needcompr) break;
+            }
+            if (j == numchildren) break;
+            if (!raxStackPush(&ts,h,j)) {
+                raxStackFree(&ts);
+                return 0;
+            }
+            h = child;
+        }
+        h->needcompr = 0;
+        raxCompressPath(rax,h,&ts);
+        raxStackFree(&ts);
+        compacted++;
+    }
+    return rax->head->needcompr;
+}
+
+/* ------------------------------- Freeing trees -----------------------------
+ * Trees are freed with a depth-first scan that does not use recursion, so
+ * that the stack usage does not depend on the depth of the tree, and that
+ * can be split into many steps, keeping the state of the scan in a
+ * raxFreeJob structure. Every node is freed as soon as it is reached, after
+ * taking the pointers to its children: the scan continues with the first
+ * child, while the others are pushed into a stack. This way every node is
+ * accessed just once, and the nodes are freed in the order of the keys,
+ * that is often the order they were allocated if the tree was populated
+ * with sorted keys, so the memory tends to be accessed sequentially. Chains
+ * of nodes with a single child, that are what makes trees very deep, don't
+ * use the stack at all.
+ * -------------------------------------------------------------------------- */
+
+struct raxFreeJob {
+    rax *rax;
+    raxNode *next;          /* Next node to free, or NULL to pop one. */
+    raxStack stack;         /* The other nodes to free. */
+    void (*free_callback)(void*);
+    int freenodes;          /* If false, only the values are freed. */
+    int countshared;        /* Count the keys and nodes of shared subtrees. */
+    uint64_t keys;          /* Number of keys freed so far. */
+};
+
+/* Setup 'job' in order to free the subtree of 'n'. If 'freenodes' is false,
+ * the nodes are not freed, and the scan is only performed in order to call
+ * the callback for every value: this is used when the tree memory is
+ * released at once by the allocator. */
+static void raxFreeJobInit(raxFreeJob *job, rax *rax, raxNode *n, void (*free_callback)(void*), int freenodes) {
+    job->rax = rax;
+    job->next = n;
+    raxStackInit(&job->stack);
+    job->free_callback = free_callback;
+    job->freenodes = freenodes;
+    job->countshared = 0;
+    job->keys = 0;
+}
+
+/* Count the keys, the nodes and the bytes used by the nodes of the subtree
+ * of 'n'. */
+static void raxSubtreeSize(raxNode *n, uint64_t *keys, uint64_t *nodes, uint64_t *bytes) {
+    raxStack ts;
+    raxStackInit(&ts);
+    while(n || (n = raxStackPop(&ts)) != NULL) {
+        *keys += n->iskey;
+        if (raxIsBucket(n)) *keys += raxBucketCount(n);
+        (*nodes)++;
+        *bytes += raxNodeCurrentLength(n);
+        int numchildren = raxNodeNumChildren(n);
+        raxNode **cp = raxNodeFirstChildPtr(n);
+        for (int j = numchildren-1; j > 0; j--) {
+            raxNode *child;
+            memcpy(&child,cp+j,sizeof(child));
+            /* Out of memory: count this subtree with a nested scan. */
+            if (!raxStackPush(&ts,child,0))
+                raxSubtreeSize(child,keys,nodes,bytes);
+        }
+        if (numchildren) memcpy(&n,cp,sizeof(n));
+        else n = NULL;
+    }
+    raxStackFree(&ts);
+}
+
+/* Free the nodes of 'job', up to 'budget' nodes, or all of them if 'budget'
+ * is zero. Returns 1 if there are no nodes left, otherwise 0. In forked
+ * trees the nodes still referenced by other trees are just released,
+ * without visiting their children, but their keys and nodes are counted if
+ * 'countshared' is true. */
+static int raxFreeNodes(raxFreeJob *job, size_t budget) {
+    rax *rax = job->rax;
+    for (size_t freed = 0; ; freed++) {
+        raxNode *n = job->next;
+        if (n == NULL && (n = raxStackPop(&job->stack)) == NULL) return 1;
+        if (budget && freed == budget) {
+            job->next = n;
+            return 0;
+        }
+        job->next = NULL;
+        if (rax->shared) {
+            if (job->countshared && raxSharedRefs(rax->shared,n) > 1) {
+                uint64_t nodes = 0, bytes = 0;
+                raxSubtreeSize(n,&job->keys,&nodes,&bytes);
+                rax->numnodes -= nodes;
+                rax->bytes -= bytes;
+            }
+            if (raxSharedDecr(rax->shared,n) != 0) continue;
+        }
+        debugnode("free traversing",n);
+
+        int numchildren = raxNodeNumChildren(n);
+        raxNode **cp = raxNodeFirstChildPtr(n);
+        for (int j = numchildren-1; j > 0; j--) {
+            raxNode *child;
+            memcpy(&child,cp+j,sizeof(child));
+            if (!raxStackPush(&job->stack,child,0)) {
+                /* Out of memory: free this subtree with a nested scan,
+                 * that can still use the static part of its stack. */
+                raxFreeJob nested;
+                raxFreeJobInit(&nested,rax,child,job->free_callback,
+                               job->freenodes);
+                nested.countshared = job->countshared;
+                raxFreeNodes(&nested,0);
+                raxStackFree(&nested.stack);
+                job->keys += nested.keys;
+            }
+        }
+        if (numchildren) memcpy(&job->next,cp,sizeof(job->next));
+
+        if (n->iskey) {
+            job->keys++;
+            if (job->free_callback && !n->isnull && !n->isinline)
+                job->free_callback(raxGetData(n));
+        }
+        if (raxIsBucket(n)) {
+            int count = raxBucketCount(n);
+            job->keys += count;
+            for (int j = 0; job->free_callback && j < count; j++) {
+                raxBucketItem e;
+                raxBucketGet(n,j,&e);
+                if (e.flags == 0) job->free_callback(raxBucketData(&e));
+            }
+        }
+        if (job->freenodes) raxDealloc(rax,n);
+        rax->numnodes--;
+    }
+}
+
+/* Free the subtree of 'n', cut away from the tree, returning the number of
+ * keys it contained. Unlike what happens when freeing a whole tree, the
+ * keys and nodes of subtrees still used by forked trees are counted as
+ * well, since the tree is not going to be freed. */
+static uint64_t raxFreeSubtree(rax *rax, raxNode *n, void (*free_callback)(void*)) {
+    raxFreeJob job;
+    raxFreeJobInit(&job,rax,n,free_callback,1);
+    job.countshared = 1;
+    raxFreeNodes(&job,0);
+    raxStackFree(&job.stack);
+    return job.keys;
+}
+
+/* Setup 'job' in order to free the whole tree 'rax'. */
+static void raxFreeJobStart(raxFreeJob *job, rax *rax, void (*free_callback)(void*)) {
+    /* Concurrent trees: free the retired nodes and the readers, then the
+     * tree is freed as usual. */
+    raxConcurrency *cs = rax->concurrency;
+    if (cs) {
+        for (size_t j = 0; j < cs->numretired; j++)
+            rax->alloc.free_fn(rax->alloc.ctx,cs->retired[j].ptr);
+        while(cs->readers) {
+            raxReader *next = cs->readers->next;
+            rax_free(cs->readers);
+            cs->readers = next;
+        }
+        rax_free(cs->retired);
+        rax_free(cs);
+        rax->concurrency = NULL;
+    }
+
+    /* Forked trees share the values as well, so they are freed only with
+     * the last tree. */
+    if (rax->shared && rax->shared->trees > 1) free_callback = NULL;
+    int freenodes = rax->alloc.release_fn == NULL;
+    raxFreeJobInit(job,rax,rax->head,free_callback,freenodes);
+
+    /* The allocator can release all the memory at once: we need to visit
+     * the tree only if there are values to free. */
+    if (!freenodes && !free_callback) job->next = NULL;
+}
+
+/* Free what is left of the tree of 'job' once all its nodes are freed. */
+static void raxFreeJobEnd(raxFreeJob *job) {
+    rax *rax = job->rax;
+    raxStackFree(&job->stack);
+    if (rax->alloc.release_fn) {
+        rax->alloc.release_fn(rax->alloc.ctx);
+        return;
+    }
+    raxShared *sh = rax->shared;
+    if (sh) {
+        /* The nodes still used by other trees were not visited. */
+        rax->shared = NULL;
+        if (--sh->trees != 0) {
+            rax->alloc.free_fn(rax->alloc.ctx,rax);
+            return;
+        }
+        rax_free(sh->table);
+        rax_free(sh);
+    }
+    assert(rax->numnodes == 0);
+    rax->alloc.free_fn(rax->alloc.ctx,rax);
+}
+
+/* Free a whole radix tree, calling the specified callback in order to
+ * free the auxiliary data. */
+void raxFreeWithCallback(rax *rax, void (*free_callback)(void*)) {
+    raxFreeJob job;
+    raxFreeJobStart(&job,rax,free_callback);
+    raxFreeNodes(&job,0);
+    raxFreeJobEnd(&job);
+}
+
+/* Free a whole radix tree. */
+void raxFree(rax *rax) {
+    raxFreeWithCallback(rax,NULL);
+}
+
+/* Like raxFreeWithCallback(), but the tree is not freed immediately: the
+ * function takes constant time, and returns a job that frees the tree when
+ * raxFreeStep() is called, a bit at a time or all at once, in the same
+ * thread or in another one. After this call the tree can no longer be used.
+ *
+ * If there is not enough memory for the job, the tree is freed before
+ * returning, and NULL is returned setting errno to ENOMEM. */
+raxFreeJob *raxFreeAsync(rax *rax, void (*free_callback)(void*)) {
+    raxFreeJob *job = rax_malloc(sizeof(*job));
+    if (job == NULL) {
+        raxFreeWithCallback(rax,free_callback);
+        errno = ENOMEM;
+        return NULL;
+    }
+    raxFreeJobStart(job,rax,free_callback);
+    return job;
+}
+
+/* Free up to 'budget' nodes of the tree of a job returned by raxFreeAsync(),
+ * or all the nodes if 'budget' is zero. Returns 1 when the tree was freed
+ * completely, and so was the job, otherwise 0 is returned, and the function
+ * should be called again later. */
+int raxFreeStep(raxFreeJob *job, size_t budget) {
+    if (!raxFreeNodes(job,budget)) return 0;
+    raxFreeJobEnd(job);
+    rax_free(job);
+    return 1;
+}
+
+/* ------------------------------ Defragmentation ----------------------------
+ * raxDefragStep() moves the nodes of a tree to new allocations, a few nodes
+ * at a time, so that long lived trees can be defragmented without long
+ * pauses. The nodes are visited in depth-first order, and visiting a node
+ * means moving all its children, one after the other, so that siblings end
+ * up next to each other in memory, then the scan continues with the first
+ * child. The head is moved at the start of every pass.
+ *
+ * Between two calls the tree may be modified, so the cursor can't retain
+ * pointers to the nodes: it remembers the path of the next node to visit,
+ * that is the string of the edges from the head to the node. In depth-first
+ * order the paths are sorted, so the scan resumes from the first node with
+ * a path greater or equal to the saved one, that is found in O(depth).
+ * -------------------------------------------------------------------------- */
+
+/* Initialize a cursor for a new defragmentation pass. */
+void raxDefragStart(raxDefragCursor *c) {
+    c->path = c->path_static_string;
+    c->path_len = 0;
+    c->path_max = RAX_ITER_STATIC_LEN;
+}
+
+/* Release the memory used by a cursor. */
+void raxDefragStop(raxDefragCursor *c) {
+    if (c->path != c->path_static_string) rax_free(c->path);
+    raxDefragStart(c);
+}
+
+/* Set the string of a cursor, stored at '*buf' (that is initially the static
+ * buffer 'static_buf') having space for '*max' bytes, to its first 'len'
+ * bytes followed by the 'count' bytes at 's'. Returns 0 on out of memory
+ * (the string is not modified), otherwise 1. Used by the cursors of
+ * raxDefragStep() and raxScan(). */
+static int raxCursorSet(unsigned char **buf, size_t *max, unsigned char *static_buf, size_t len, const unsigned char *s, size_t count) {
+    if (*max < len+count) {
+        unsigned char *old = (*buf == static_buf) ? NULL : *buf;
+        size_t new_max = (len+count)*2;
+        unsigned char *newbuf = rax_realloc(old,new_max);
+        if (newbuf == NULL) {
+            errno = ENOMEM;
+            return 0;
+        }
+        if (old == NULL) memcpy(newbuf,static_buf,len);
+        *buf = newbuf;
+        *max = new_max;
+    }
+    if (count) memmove(*buf+len,s,count);
+    return 1;
+}
+
+/* Set the cursor path to the first 'len' bytes of the current path followed
+ * by the 'count' bytes at 's'. Returns 0 on out of memory, otherwise 1. */
+static int raxDefragSetPath(raxDefragCursor *c, size_t len, unsigned char *s, size_t count) {
+    if (!raxCursorSet(&c->path,&c->path_max,c->path_static_string,len,s,
+                      count)) return 0;
+    c->path_len = len+count;
+    return 1;
+}
+
+/* Move the node pointed by 'link', using the callback if any, otherwise
+ * copying the node to a new allocation of the tree allocator. On out of
+ * memory the node is just not moved. */
+static void raxDefragMove(rax *rax, raxNode **link, raxNodeCallback realloc_cb) {
+    raxNode *n;
+    memcpy(&n,link,sizeof(n));
+    if (rax->shared && raxSharedRefs(rax->shared,n) > 1) return;
+    rax->version++;
+    if (realloc_cb) {
+        if (realloc_cb(&n)) memcpy(link,&n,sizeof(n));
+        return;
+    }
+    size_t len = raxNodeCurrentLength(n);
+    raxNode *new = raxAlloc(rax,len);
+    if (new == NULL) return;
+    memcpy(new,n,len);
+    raxDealloc(rax,n);
+    memcpy(link,&new,sizeof(new));
+}
+
+/* Visit up to 'max_nodes' nodes of the tree (all the remaining ones if
+ * 'max_nodes' is zero), starting from the position of the cursor 'c' that
+ * must be initialized with raxDefragStart(), moving them to new memory.
+ * The nodes are passed to 'realloc_cb', that should set the node pointer
+ * to the new address and return 1 if it moved the node (freeing the old
+ * memory), otherwise 0. If 'realloc_cb' is NULL, all the nodes are moved
+ * allocating them again with the tree allocator.
+ *
+ * The function returns 1 if the pass is not complete and it should be
+ * called again, or 0 once all the nodes were visited: in this case the
+ * cursor is ready for a new pass. The tree can be modified between the
+ * calls: the nodes existing since the start of the pass are visited at
+ * least once, the others may not.
+ *
+ * Nodes shared with forked trees are not moved. Concurrent trees are not
+ * supported, since nodes visible to the readers can't be modified: 0 is
+ * returned and errno is set to EINVAL. On out of memory 0 is returned as
+ * well, errno is set to ENOMEM and the cursor is reset. Otherwise errno is
+ * set to 0. */
+int raxDefragStep(rax *rax, raxDefragCursor *c, size_t max_nodes, raxNodeCallback realloc_cb) {
+    if (rax->concurrency) {
+        errno = EINVAL;
+        return 0;
+    }
+    errno = 0;
+    raxStack ts; /* Parents of the current node. */
+    raxStackInit(&ts);
+    if (c->path_len == 0) raxDefragMove(rax,&rax->head,realloc_cb);
+    raxNode *n = rax->head;
+    size_t len = 0; /* Length of the path of 'n'. */
+    int up = 0; /* True if the subtree of 'n' was already visited. */
+
+    /* Seek the first node with a path greater or equal to the cursor. While
+     * the path of 'n' is a prefix of the cursor, the cursor is updated with
+     * the same edges, and once we find a greater path the scan resumes from
+     * there. */
+    size_t target = c->path_len;
+    while(len < target) {
+        unsigned char *s = c->path+len;
+        size_t left = target-len;
+        int i = 0, greater;
+        size_t edgelen = 1;
+        if (n->iscompr) {
+            int cmp = memcmp(n->data,s,n->size < left ? n->size : left);
+            greater = cmp > 0 || (cmp == 0 && n->size > left);
+            edgelen = n->size;
+            if (cmp < 0) {
+                up = 1;
+                break;
+            }
+        } else {
+            i = raxCountEdgesLess(n->data,n->size,s[0]);
+            if (i == (int)n->size) {
+                up = 1;
+                break;
+            }
+            greater = n->data[i] != s[0];
+        }
+        if (!raxStackPush(&ts,n,i) ||
+            !raxDefragSetPath(c,len,n->data+i,edgelen)) goto oom;
+        len += edgelen;
+        memcpy(&n,raxNodeFirstChildPtr(n)+i,sizeof(n));
+        if (greater) break;
+    }
+
+    size_t visited = 0;
+    while(1) {
+        if (!up) {
+            if (max_nodes && visited == max_nodes) {
+                raxStackFree(&ts);
+                return 1;
+            }
+            visited++;
+
+            /* Visit the node, then continue with the first child. The
+             * subtree of shared nodes is not visited. */
+            int numchildren = raxNodeNumChildren(n);
+            if (rax->shared && raxSharedRefs(rax->shared,n) > 1)
+                numchildren = 0;
+            raxNode **cp = raxNodeFirstChildPtr(n);
+            for (int j = 0; j < numchildren; j++)
+                raxDefragMove(rax,cp+j,realloc_cb);
+            if (numchildren) {
+                if (!raxStackPush(&ts,n,0) ||
+                    !raxDefragSetPath(c,len,n->data,
+                                      n->iscompr ? n->size : 1)) goto oom;
+                len = c->path_len;
+                memcpy(&n,cp,sizeof(n));
+                continue;
+            }
+        }
+
+        /* The subtree of 'n' is done: continue with the next child of the
+         * nearest parent having one. */
+        up = 0;
+        int i;
+        raxNode *parent;
+        while((parent = raxStackPopChild(&ts,&i)) != NULL) {
+            len -= parent->iscompr ? parent->size : 1;
+            if (!parent->iscompr && i+1 < (int)parent->size) break;
+        }
+        if (parent == NULL) {
+            /* Pass completed. */
+            raxStackFree(&ts);
+            raxDefragStop(c);
+            return 0;
+        }
+        i++;
+        if (!raxStackPush(&ts,parent,i) ||
+            !raxDefragSetPath(c,len,parent->data+i,1)) goto oom;
+        len++;
+        memcpy(&n,raxNodeFirstChildPtr(parent)+i,sizeof(n));
+    }
+
+oom:
+    raxStackFree(&ts);
+    raxDefragStop(c);
+    errno = ENOMEM;
+    return 0;
+}
+
+/* --------------------------------- Scanning -------------------------------
+ * raxScan() returns the keys of a tree a few at a time, like the Redis SCAN
+ * command, but the keys are returned in order, and the cursor is just the
+ * last key returned: every call seeks the first key greater than the cursor
+ * in O(depth), so the tree can be modified between the calls, and the keys
+ * that are in the tree for the whole scan are returned exactly once.
+ * -------------------------------------------------------------------------- */
+
+/* Initialize a cursor for a new scan. */
+void raxScanStart(raxScanCursor *c) {
+    c->key = c->key_static_string;
+    c->key_len = 0;
+    c->key_max = RAX_ITER_STATIC_LEN;
+    c->started = 0;
+}
+
+/* Release the memory used by a cursor. */
+void raxScanStop(raxScanCursor *c) {
+    if (c->key != c->key_static_string) rax_free(c->key);
+    raxScanStart(c);
+}
+
+/* Pass to the callback 'cb' up to 'count' keys (all the remaining ones if
+ * 'count' is zero) following the position of the cursor 'c', initialized
+ * with raxScanStart(), and update the cursor. The callback receives the
+ * 'privdata' pointer and an iterator positioned at the key, with the key
+ * and its value: it must not modify the tree.
+ *
+ * The function returns 1 if the scan is not complete, and it should be
+ * called again, or 0 when there are no more keys: in this case the cursor
+ * is ready for a new scan. The tree can be modified between the calls.
+ * On out of memory 0 is returned as well, setting errno to ENOMEM: the
+ * cursor is still valid and the call can be retried, but the last key
+ * passed to the callback may be returned again. Otherwise errno is set
+ * to 0. */
+int raxScan(rax *rax, raxScanCursor *c, size_t count, raxScanCallback cb, void *privdata) {
+    raxIterator it;
+    raxStart(&it,rax);
+    int retval;
+    if (c->started)
+        retval = raxSeek(&it,">",c->key,c->key_len);
+    else
+        retval = raxSeek(&it,"^",NULL,0);
+    if (retval == 0) {
+        raxStop(&it);
+        return 0;
+    }
+
+    size_t returned = 0;
+    int oom = 0;
+    retval = 1;
+    while(count == 0 || returned < count) {
+        errno = 0;
+        if (!raxNext(&it)) {
+            oom = errno == ENOMEM;
+            retval = 0;
+            break;
+        }
+        cb(privdata,&it);
+        /* Remember the last key returned. If we can't, the key will be
+         * returned again when the call is retried. */
+        if (!raxCursorSet(&c->key,&c->key_max,c->key_static_string,0,
+                          it.key,it.key_len))
+        {
+            oom = 1;
+            break;
+        }
+        c->key_len = it.key_len;
+        c->started = 1;
+        returned++;
+    }
+    raxStop(&it);
+    if (oom) {
+        errno = ENOMEM;
+        return 0;
+    }
+    if (retval == 0) raxScanStop(c);
+    errno = 0;
+    return retval;
+}
+
+/* ----------------------------- Range deletion ------------------------------
+ * raxRemoveRange() and raxRemovePrefix() remove all the keys of a range
+ * without removing them one after the other. Only the nodes having as key
+ * a prefix of one of the bounds of the range can contain both keys inside
+ * and outside the range: these are the nodes in the path of the bounds,
+ * that are visited recursively, cutting away their children having all the
+ * keys inside the range, that are just freed, and then fixing and
+ * compressing the nodes on the way back, once. The cost is so proportional
+ * to the depth of the bounds, plus the freeing of the removed nodes.
+ * -------------------------------------------------------------------------- */
+
+/* Result of the comparison of a key with a bound. */
+#define RAX_CMP_LESS 0      /* Key is smaller, and not a prefix of the bound. */
+#define RAX_CMP_PREFIX 1    /* Key is a proper prefix of the bound. */
+#define RAX_CMP_EQUAL 2     /* Key and bound are the same. */
+#define RAX_CMP_EXTENDS 3   /* Bound is a proper prefix of the key. */
+#define RAX_CMP_GREATER 4   /* Key is greater, and does not extend the bound. */
+
+/* Compare the key composed of the 'alen' bytes at 'a' followed by the
+ * 'blen' bytes at 'b' with the bound 'k' of 'klen' bytes. */
+static int raxCompareBound(const unsigned char *a, size_t alen, const unsigned char *b, size_t blen, const unsigned char *k, size_t klen) {
+    size_t n = alen < klen ? alen : klen;
+    int c = n ? memcmp(a,k,n) : 0;
+    if (c) return c < 0 ? RAX_CMP_LESS : RAX_CMP_GREATER;
+    if (alen > klen) return RAX_CMP_EXTENDS;
+    k += alen;
+    klen -= alen;
+    n = blen < klen ? blen : klen;
+    c = n ? memcmp(b,k,n) : 0;
+    if (c) return c < 0 ? RAX_CMP_LESS : RAX_CMP_GREATER;
+    if (blen > klen) return RAX_CMP_EXTENDS;
+    return blen == klen ? RAX_CMP_EQUAL : RAX_CMP_PREFIX;
+}
+
+/* The range of keys to remove: [start,end), or all the keys if 'end' is
+ * NULL, or, if 'prefix' is true, the keys starting with 'start'. */
+typedef struct raxRange {
+    unsigned char *start, *end;
+    size_t startlen, endlen;
+    int prefix;
+    raxNode *keep;          /* Subtree to unlink without freeing it. */
+    uint64_t keepkeys;      /* Number of keys of 'keep'. */
+    void (*free_callback)(void*);
+} raxRange;
+
+/* How the keys of a subtree relate to a range. */
+#define RAX_RANGE_OUT 0     /* No key of the subtree is inside the range. */
+#define RAX_RANGE_IN 1      /* All the keys of the subtree are inside. */
+#define RAX_RANGE_PARTIAL 2 /* The subtree may have keys inside and outside. */
+
+/* Tell how the keys of the subtree of the key composed of the 'alen' bytes
+ * at 'a' followed by the 'blen' bytes at 'b' relate to the range 'r'. For
+ * partial subtrees, the key is a prefix of one of the bounds, that is
+ * returned by reference in 'bound'. */
+static int raxRangeClassify(raxRange *r, const unsigned char *a, size_t alen, const unsigned char *b, size_t blen, unsigned char **bound) {
+    int lo = raxCompareBound(a,alen,b,blen,r->start,r->startlen);
+    *bound = r->start;
+    if (r->prefix) {
+        if (lo == RAX_CMP_EQUAL || lo == RAX_CMP_EXTENDS) return RAX_RANGE_IN;
+        return lo == RAX_CMP_PREFIX ? RAX_RANGE_PARTIAL : RAX_RANGE_OUT;
+    }
+    if (lo == RAX_CMP_LESS) return RAX_RANGE_OUT;
+    if (r->end == NULL)
+        return lo == RAX_CMP_PREFIX ? RAX_RANGE_PARTIAL : RAX_RANGE_IN;
+    int hi = raxCompareBound(a,alen,b,blen,r->end,r->endlen);
+    if (hi != RAX_CMP_LESS && hi != RAX_CMP_PREFIX) return RAX_RANGE_OUT;
+    if (lo != RAX_CMP_PREFIX && hi == RAX_CMP_LESS) return RAX_RANGE_IN;
+    if (lo != RAX_CMP_PREFIX) *bound = r->end;
+    return RAX_RANGE_PARTIAL;
+}
+
+/* Return true if the key composed of the 'alen' bytes at 'a' followed by
+ * the 'blen' bytes at 'b' is inside the range 'r'. */
+static int raxRangeHasKey(raxRange *r, const unsigned char *a, size_t alen, const unsigned char *b, size_t blen) {
+    int lo = raxCompareBound(a,alen,b,blen,r->start,r->startlen);
+    if (r->prefix) return lo == RAX_CMP_EQUAL || lo == RAX_CMP_EXTENDS;
+    if (lo == RAX_CMP_LESS || lo == RAX_CMP_PREFIX) return 0;
+    if (r->end == NULL) return 1;
+    int hi = raxCompareBound(a,alen,b,blen,r->end,r->endlen);
+    return hi == RAX_CMP_LESS || hi == RAX_CMP_PREFIX;
+}
+
+/* Like raxRemoveRangeNode(), for the bucket 'n': the entries inside the
+ * range are removed, and if no entry is left the bucket is freed, or, if
+ * it is the head, turned into an empty leaf. */
+static raxNode *raxRemoveRangeBucket(rax *rax, raxRange *r, raxNode *n, unsigned char *bound, size_t len, int ishead, uint64_t *removed) {
+    raxBucketItem items[RAX_BUCKET_MAX_KEYS];
+    int count = raxBucketCount(n), left = 0;
+    for (int j = 0; j < count; j++) {
+        raxBucketItem *e = items+left;
+        raxBucketGet(n,j,e);
+        if (!raxRangeHasKey(r,bound,len,e->suffix,e->len)) {
+            left++;
+            continue;
+        }
+        if (r->free_callback && e->flags == 0)
+            r->free_callback(raxBucketData(e));
+        (*removed)++;
+    }
+    if (left == count) return n;
+    /* Shrinking the bucket never fails. */
+    if (left) return raxBucketStore(rax,n,items,left);
+    if (ishead) return raxBucketClear(rax,n);
+    raxDealloc(rax,n);
+    rax->numnodes--;
+    return NULL;
+}
+
+/* Remove the keys inside the range 'r' from the subtree of the node 'n',
+ * having as key the first 'len' bytes of one of the bounds, 'bound'. The
+ * number of keys removed is added to 'removed'. Returns the node, that may
+ * have been reallocated or replaced by a compressed node, or NULL if the
+ * node has no keys left and was freed (the head is never freed). */
+static raxNode *raxRemoveRangeNode(rax *rax, raxRange *r, raxNode *n, unsigned char *bound, size_t len, int ishead, uint64_t *removed) {
+    if (raxIsBucket(n))
+        return raxRemoveRangeBucket(rax,r,n,bound,len,ishead,removed);
+    if (n->iskey && raxRangeHasKey(r,bound,len,NULL,0)) {
+        if (r->free_callback && !n->isnull && !n->isinline)
+            r->free_callback(raxGetData(n));
+        rax->bytes -= raxNodeValueLen(n);
+        n->iskey = 0;
+        (*removed)++;
+    }
+
+    /* Visit the children from the last, so that removing a child does not
+     * change the position of the ones still to visit. */
+    for (int j = raxNodeNumChildren(n)-1; j >= 0; j--) {
+        unsigned char *edge = n->iscompr ? n->data : n->data+j;
+        size_t edgelen = n->iscompr ? n->size : 1;
+        unsigned char *childbound;
+        int in = raxRangeClassify(r,bound,len,edge,edgelen,&childbound);
+        if (in == RAX_RANGE_OUT) continue;
+
+        raxNode *child, *newchild = NULL;
+        uint64_t childremoved = 0;
+        memcpy(&child,raxNodeFirstChildPtr(n)+j,sizeof(child));
+        if (in == RAX_RANGE_IN && child == r->keep) {
+            childremoved = r->keepkeys;
+        } else if (in == RAX_RANGE_IN) {
+            childremoved = raxFreeSubtree(rax,child,r->free_callback);
+        } else {
+            newchild = raxRemoveRangeNode(rax,r,child,childbound,
+                                          len+edgelen,0,&childremoved);
+        }
+        *removed += childremoved;
+        if (newchild == NULL) {
+            n = raxRemoveChild(rax,n,child);
+        } else {
+            memcpy(raxNodeFirstChildPtr(n)+j,&newchild,sizeof(newchild));
+            if (n->hascount)
+                raxSetCount(n,j,raxGetCount(n,j)-childremoved);
+        }
+    }
+
+    if (!ishead && !n->iskey && n->size == 0) {
+        raxDealloc(rax,n);
+        rax->numnodes--;
+        return NULL;
+    }
+    return raxCompressChain(rax,n);
+}
+
+/* Remove the keys of the range 'r' from the tree, returning the number of
+ * keys removed. */
+static uint64_t raxRemoveRangeGeneric(rax *rax, raxRange *r) {
+    errno = 0;
+    if (!r->prefix && r->end &&
+        raxCompareBound(r->start,r->startlen,NULL,0,r->end,r->endlen) >=
+        RAX_CMP_EQUAL) return 0;
+
+    /* Concurrent trees can only be modified one key at a time: remove the
+     * keys one after the other, seeking again the iterator after every
+     * deletion, since the nodes it visited may be freed. */
+    if (rax->concurrency) {
+        raxIterator it;
+        unsigned char *key = NULL;
+        uint64_t removed = 0;
+        raxStart(&it,rax);
+        int oom = 0;
+        raxSeek(&it,">=",r->start,r->startlen);
+        while(raxNext(&it) && raxRangeHasKey(r,it.key,it.key_len,NULL,0)) {
+            unsigned char *newkey = rax_realloc(key,it.key_len+1);
+            void *old;
+            if (newkey == NULL) {
+                oom = 1;
+                break;
+            }
+            key = newkey;
+            size_t keylen = it.key_len;
+            memcpy(key,it.key,keylen);
+            if (!raxRemove(rax,key,keylen,&old)) {
+                oom = 1;
+                break;
+            }
+            if (r->free_callback && old) r->free_callback(old);
+            removed++;
+            raxSeek(&it,">",key,keylen);
+        }
+        raxStop(&it);
+        rax_free(key);
+        errno = oom ? ENOMEM : 0;
+        return removed;
+    }
+
+    /* Forked trees: the nodes we may modify are the ones in the path of the
+     * bounds, so they must not be shared with other trees. The values are
+     * shared as well, so they are not freed. */
+    void (*free_callback)(void*) = r->free_callback;
+    if (rax->shared) {
+        if (!raxUnshareKey(rax,r->start,r->startlen,-1)) return 0;
+        if (rax->shared && r->end &&
+            !raxUnshareKey(rax,r->end,r->endlen,-1)) return 0;
+        if (rax->shared && rax->shared->trees > 1) r->free_callback = NULL;
+    }
+
+    uint64_t removed = 0;
+    rax->head = raxRemoveRangeNode(rax,r,rax->head,r->start,0,1,&removed);
+    rax->numele -= removed;
+    r->free_callback = free_callback;
+    errno = 0;
+    return removed;
+}
+
+/* Remove all the keys greater or equal to 'start' of 'startlen' bytes, and
+ * smaller than 'end' of 'endlen' bytes, or all the keys greater or equal to
+ * 'start' if 'end' is NULL. If 'free_callback' is not NULL, it is called for
+ * the values of the removed keys (but inline values). The function returns
+ * the number of keys removed. On out of memory (that can only happen in
+ * forked and concurrent trees) some or all the keys may not be removed,
+ * and errno is set to ENOMEM, otherwise errno is set to 0.
+ *
+ * Whole subtrees inside the range are just freed, so the function takes
+ * time proportional to the length of the bounds, plus the nodes removed.
+ * The only exception are concurrent trees, where the keys are removed one
+ * after the other. */
+uint64_t raxRemoveRange(rax *rax, unsigned char *start, size_t startlen, unsigned char *end, size_t endlen, void (*free_callback)(void*)) {
+    raxRange r = {start,end,startlen,endlen,0,NULL,0,free_callback};
+    return raxRemoveRangeGeneric(rax,&r);
+}
+
+/* Like raxRemoveRange(), but removes all the keys starting with the
+ * specified prefix. */
+uint64_t raxRemovePrefix(rax *rax, unsigned char *prefix, size_t len, void (*free_callback)(void*)) {
+    raxRange r = {prefix,NULL,len,0,1,NULL,0,free_callback};
+    return raxRemoveRangeGeneric(rax,&r);
+}
+
+/* Create the chain of compressed nodes for the 'len' bytes at 's' (that
+ * are more than zero), leading to 'child', that has 'count' keys. The
+ * number of nodes created is stored into 'nodes'. Returns the first node of
+ * the chain, or NULL on out of memory. */
+static raxNode *raxNewChain(rax *rax, unsigned char *s, size_t len, raxNode *child, uint64_t count, uint64_t *nodes) {
+    int hascount = (rax->flags & RAX_FLAG_RANK) != 0;
+    raxNode *next = child;
+    *nodes = 0;
+    while(len) {
+        size_t size = len > RAX_NODE_MAX_SIZE ? RAX_NODE_MAX_SIZE : len;
+        size_t nodesize = sizeof(raxNode)+size+raxPadding(size)+
+                          sizeof(raxNode*);
+        if (hascount) nodesize += sizeof(uint64_t);
+        raxNode *n = raxAlloc(rax,nodesize);
+        if (n == NULL) {
+            /* Free the nodes already created. */
+            while(next != child) {
+                raxNode *aux = next;
+                memcpy(&next,raxNodeLastChildPtr(aux),sizeof(next));
+                raxFreeNode(rax,aux);
+            }
+            return NULL;
+        }
+        n->iskey = 0;
+        n->isnull = 0;
+        n->iscompr = 1;
+        n->isdense = 0;
+        n->isinline = 0;
+        n->hascount = hascount;
+        n->size = size;
+        n->islink32 = 0;
+        n->needcompr = 0;
+        len -= size;
+        memcpy(n->data,s+len,size);
+        memcpy(raxNodeLastChildPtr(n),&next,sizeof(next));
+        if (hascount) raxSetCount(n,0,count);
+        next = n;
+        (*nodes)++;
+    }
+    return next;
+}
+
+/* Implement raxDetachPrefix() when the prefix of 'len' bytes ends inside
+ * the bucket 'h', reached after 'i' bytes: only some of the entries may
+ * start with the prefix, so they are inserted into the new tree, and then
+ * removed from the bucket. */
+static rax *raxDetachBucket(rax *rax, raxNode *h, unsigned char *prefix, size_t len, size_t i) {
+    struct rax *d = raxNewWithAllocator(&rax->alloc,rax->flags);
+    unsigned char *key = rax_malloc(i+RAX_BUCKET_MAX_LEN);
+    if (d == NULL || key == NULL) goto oom;
+    memcpy(key,prefix,i);
+    for (int j = 0; j < (int)raxBucketCount(h); j++) {
+        raxBucketItem e;
+        raxValue v;
+        raxBucketGet(h,j,&e);
+        if (e.len < len-i || memcmp(e.suffix,prefix+i,len-i)) continue;
+        memcpy(key+i,e.suffix,e.len);
+        raxBucketItemValue(&e,&v);
+        if (!raxLowInsert(d,key,i+e.len,&v,NULL,1,NULL)) goto oom;
+    }
+    rax_free(key);
+    raxRemovePrefix(rax,prefix,len,NULL);
+    errno = 0;
+    return d;
+
+oom:
+    if (d) raxFree(d);
+    rax_free(key);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/* Remove all the keys starting with the specified prefix, like
+ * raxRemovePrefix(), but instead of freeing them, return them in a new
+ * tree, using the same allocator and flags of the original one. This way
+ * the caller can free the removed keys later, or in a different thread
+ * (if the allocator can be used by different threads), without blocking
+ * while the nodes are freed. The removed keys are in a single subtree of
+ * the original tree, that is moved into the new tree as it is: the function
+ * takes time proportional to the length of the prefix, plus the time
+ * needed to count the nodes of the subtree, that is much less than the
+ * time needed to free them.
+ *
+ * The function returns NULL on out of memory, setting errno to ENOMEM (the
+ * tree is not modified). Like for raxFork(), concurrent trees and trees
+ * whose allocator releases all the memory at once are not supported, and
+ * NULL is returned setting errno to EINVAL. If the tree was forked, the new
+ * tree is forked from it as well, since they may share nodes. */
+rax *raxDetachPrefix(rax *rax, unsigned char *prefix, size_t len) {
+    if (rax->concurrency || rax->alloc.release_fn) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (rax->shared && !raxUnshareKey(rax,prefix,len,-1)) return NULL;
+
+    raxNode *h;
+    int splitpos = 0;
+    size_t i = raxLowWalk(rax,prefix,len,&h,NULL,&splitpos,NULL);
+    if (raxIsBucket(h) && i != len)
+        return raxDetachBucket(rax,h,prefix,len,i);
+    if (i != len) return raxNewWithAllocator(&rax->alloc,rax->flags);
+
+    /* Find the subtree to detach, and its key: if the prefix ends inside
+     * a compressed node, it's the subtree of its child. */
+    raxNode *sub = h;
+    unsigned char *key = prefix;
+    size_t keylen = len;
+    if (h->iscompr && splitpos != 0) {
+        memcpy(&sub,raxNodeFirstChildPtr(h),sizeof(sub));
+        keylen = len-splitpos+h->size;
+        key = rax_malloc(keylen);
+        if (key == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memcpy(key,prefix,len-splitpos);
+        memcpy(key+len-splitpos,h->data,h->size);
+    }
+    uint64_t keys = 0, nodes = 0, bytes = 0, chainnodes = 0;
+    raxSubtreeSize(sub,&keys,&nodes,&bytes);
+
+    /* Allocate the new tree, with the chain of nodes leading to the
+     * subtree, or, if the whole tree is detached, the new head of the
+     * original tree. The memory used by the new nodes is accounted to
+     * the tree using them. */
+    uint64_t oldbytes = rax->bytes;
+    struct rax *d = rax->alloc.malloc_fn(rax->alloc.ctx,sizeof(*d));
+    raxNode *head = NULL;
+    if (d) {
+        head = keylen ? raxNewChain(rax,key,keylen,sub,keys,&chainnodes) :
+                        raxNewNode(rax,0,0);
+    }
+    if (key != prefix) rax_free(key);
+    if (head == NULL) {
+        if (d) rax->alloc.free_fn(rax->alloc.ctx,d);
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t headbytes = rax->bytes-oldbytes;
+    *d = *rax;
+    d->numele = keys;
+    d->numnodes = nodes+chainnodes;
+    d->bytes = sizeof(*d)+bytes;
+    if (d->shared) d->shared->trees++;
+
+    if (keylen == 0) {
+        d->head = sub;
+        rax->head = head;
+        rax->numele = 0;
+        rax->numnodes = 1;
+        rax->bytes = sizeof(*rax)+headbytes;
+    } else {
+        d->head = head;
+        d->bytes += headbytes;
+        rax->bytes = oldbytes-bytes;
+        raxRange r = {prefix,NULL,len,0,1,sub,keys,NULL};
+        uint64_t removed = 0;
+        rax->head = raxRemoveRangeNode(rax,&r,rax->head,prefix,0,1,&removed);
+        rax->numele -= removed;
+        rax->numnodes -= nodes;
+    }
+    errno = 0;
+    return d;
+}
+
+/* ------------------------------ Set operations -----------------------------
+ * raxMerge(), raxIntersect() and raxDifference() combine two trees walking
+ * them together, visiting only the overlap, that is, the prefixes that are
+ * paths in both the trees. At every position of the walk the edges of the
+ * two trees are compared: an edge only present in one of the trees leads to
+ * a whole subtree of keys that are not in the other tree, that can be moved
+ * or freed as it is, without visiting it, while common edges lead to the
+ * next positions to visit.
+ *
+ * Since the two trees may have compressed nodes of different lengths, the
+ * same prefix may end in the middle of a compressed node of a tree, and at
+ * the boundary of a node in the other one, so a position is a node and an
+ * offset inside it. The walk does not modify the trees: it collects the
+ * changes to perform (the keys and the subtrees to insert or remove, by
+ * key) that are applied later, one after the other. The cost is so
+ * proportional to the overlap, plus the depth of the changes, instead of
+ * the size of the trees.
+ * -------------------------------------------------------------------------- */
+
+#define RAX_SET_MERGE 0
+#define RAX_SET_INTERSECT 1
+#define RAX_SET_DIFFERENCE 2
+
+/* Changes collected by the walk. */
+#define RAX_SETOP_INSERT 0  /* Insert the key of 'node' into dst. */
+#define RAX_SETOP_RESOLVE 1 /* Key of both trees: resolve the two values. */
+#define RAX_SETOP_GRAFT 2   /* Move the subtree of 'node' into dst. */
+#define RAX_SETOP_REMOVE 3  /* Remove the key from dst. */
+#define RAX_SETOP_PRUNE 4   /* Remove the keys starting with the key. */
+
+typedef struct raxSetChange {
+    int type;
+    size_t keyoff, keylen;  /* Key or prefix, stored in raxSetWalk.keys. */
+    raxNode *node;          /* Node of the source tree, if any. */
+} raxSetChange;
+
+/* A position of the walk: a node and an offset inside it, that can be
+ * non zero only for compressed nodes. */
+typedef struct raxSetPos {
+    raxNode *n;
+    size_t off;
+} raxSetPos;
+
+/* A position in both trees, with the next edges of the two to compare. */
+typedef struct raxSetFrame {
+    raxSetPos d, s;         /* Position in dst and in src. */
+    size_t len;             /* Length of the prefix of the position. */
+    int dj, sj;             /* Next edges to compare. */
+} raxSetFrame;
+
+typedef struct raxSetWalk {
+    int op;                 /* RAX_SET_... operation. */
+    int resolve;            /* Resolve the values of the common keys. */
+    unsigned char *key;     /* Prefix of the current position. */
+    size_t keymax;
+    raxSetFrame *frames;    /* Positions with edges still to compare. */
+    size_t numframes, maxframes;
+    raxSetChange *changes;  /* Changes to apply, in the order of the keys. */
+    size_t numchanges, maxchanges;
+    unsigned char *keys;    /* Keys of the changes. */
+    size_t keyslen, keysmax;
+    raxNode **visited;      /* Merge: nodes of src in the overlap. */
+    size_t numvisited, maxvisited;
+    uint64_t srckeys;       /* Merge: keys of src in the overlap. */
+} raxSetWalk;
+
+/* Return the array 'buf' of '*max' items of 'size' bytes, allocated or
+ * reallocated if needed in order to hold 'count' items, or NULL on out of
+ * memory (the old array is still valid). */
+static void *raxSetGrow(void *buf, size_t *max, size_t count, size_t size) {
+    if (buf && count <= *max) return buf;
+    size_t newmax = *max ? *max : 16;
+    while(newmax < count) newmax *= 2;
+    void *newbuf = rax_realloc(buf,newmax*size);
+    if (newbuf) *max = newmax;
+    return newbuf;
+}
+
+static void raxSetWalkFree(raxSetWalk *w) {
+    rax_free(w->key);
+    rax_free(w->frames);
+    rax_free(w->changes);
+    rax_free(w->keys);
+    rax_free(w->visited);
+}
+
+/* Return the edges of the position 'p', storing their number in 'count'. */
+static inline unsigned char *raxSetEdges(raxSetPos *p, int *count) {
+    if (p->n->iscompr) {
+        *count = 1;
+        return p->n->data+p->off;
+    }
+    *count = p->n->size;
+    return p->n->data;
+}
+
+/* Return the position following the edge 'j' of the position 'p'. */
+static inline raxSetPos raxSetChild(raxSetPos *p, int j) {
+    raxSetPos c = {p->n,p->off+1};
+    if (p->n->iscompr && c.off < p->n->size) return c;
+    memcpy(&c.n,raxNodeFirstChildPtr(p->n)+j,sizeof(c.n));
+    c.off = 0;
+    return c;
+}
+
+/* Add a change for the key composed of the first 'len' bytes of the current
+ * prefix, followed by the 'taillen' bytes at 'tail'. Returns 0 on out of
+ * memory. */
+static int raxSetAddChange(raxSetWalk *w, int type, size_t len, unsigned char *tail, size_t taillen, raxNode *node) {
+    raxSetChange *changes = raxSetGrow(w->changes,&w->maxchanges,
+                                       w->numchanges+1,sizeof(*changes));
+    if (changes == NULL) return 0;
+    w->changes = changes;
+    unsigned char *keys = raxSetGrow(w->keys,&w->keysmax,
+                                     w->keyslen+len+taillen,1);
+    if (keys == NULL) return 0;
+    w->keys = keys;
+    raxSetChange *c = changes+w->numchanges++;
+    c->type = type;
+    c->keyoff = w->keyslen;
+    c->keylen = len+taillen;
+    c->node = node;
+    if (len) memcpy(keys+w->keyslen,w->key,len);
+    if (taillen) memcpy(keys+w->keyslen+len,tail,taillen);
+    w->keyslen += len+taillen;
+    return 1;
+}
+
+/* Enter the position 'd' of dst and 's' of src, having a prefix of 'len'
+ * bytes, adding the changes for the keys they represent. Returns 0 on out
+ * of memory. */
+static int raxSetEnter(raxSetWalk *w, raxSetPos *d, raxSetPos *s, size_t len) {
+    raxSetFrame *frames = raxSetGrow(w->frames,&w->maxframes,
+                                     w->numframes+1,sizeof(*frames));
+    if (frames == NULL) return 0;
+    w->frames = frames;
+    raxSetFrame *f = frames+w->numframes++;
+    f->d = *d;
+    f->s = *s;
+    f->len = len;
+    f->dj = f->sj = 0;
+
+    if (w->op == RAX_SET_MERGE && s->off == 0) {
+        raxNode **visited = raxSetGrow(w->visited,&w->maxvisited,
+                                       w->numvisited+1,sizeof(*visited));
+        if (visited == NULL) return 0;
+        w->visited = visited;
+        visited[w->numvisited++] = s->n;
+    }
+
+    int dkey = d->off == 0 && d->n->iskey;
+    int skey = s->off == 0 && s->n->iskey;
+    int type = -1;
+    if (w->op == RAX_SET_MERGE && skey) {
+        w->srckeys++;
+        if (!dkey) type = RAX_SETOP_INSERT;
+        else if (w->resolve) type = RAX_SETOP_RESOLVE;
+    } else if (w->op == RAX_SET_INTERSECT && dkey) {
+        if (!skey) type = RAX_SETOP_REMOVE;
+        else if (w->resolve) type = RAX_SETOP_RESOLVE;
+    } else if (w->op == RAX_SET_DIFFERENCE && dkey && skey) {
+        type = RAX_SETOP_REMOVE;
+    }
+    if (type != -1 && !raxSetAddChange(w,type,len,NULL,0,s->n)) return 0;
+    return 1;
+}
+
+/* Walk the overlap of dst and src, collecting the changes to perform into
+ * 'w'. Returns 0 on out of memory. */
+static int raxSetWalkTrees(raxSetWalk *w, rax *dst, rax *src) {
+    raxSetPos d = {dst->head,0}, s = {src->head,0};
+    if (!raxSetEnter(w,&d,&s,0)) return 0;
+    while(w->numframes) {
+        raxSetFrame *f = w->frames+w->numframes-1;
+        int dn, sn;
+        unsigned char *de = raxSetEdges(&f->d,&dn);
+        unsigned char *se = raxSetEdges(&f->s,&sn);
+
+        /* The edges left in one of the trees only matter to the merge
+         * if they are in src, and to the intersection if they are in dst. */
+        if ((f->dj == dn && (f->sj == sn || w->op != RAX_SET_MERGE)) ||
+            (f->sj == sn && w->op != RAX_SET_INTERSECT))
+        {
+            w->numframes--;
+            continue;
+        }
+        unsigned char *key = raxSetGrow(w->key,&w->keymax,f->len+1,1);
+        if (key == NULL) return 0;
+        w->key = key;
+
+        if (f->sj == sn || (f->dj < dn && de[f->dj] < se[f->sj])) {
+            /* Subtree only in dst: removed by the intersection. */
+            key[f->len] = de[f->dj++];
+            if (w->op == RAX_SET_INTERSECT &&
+                !raxSetAddChange(w,RAX_SETOP_PRUNE,f->len+1,NULL,0,NULL))
+                return 0;
+            continue;
+        }
+        if (f->dj == dn || se[f->sj] < de[f->dj]) {
+            /* Subtree only in src: moved by the merge. If the edge ends
+             * inside a compressed node, the subtree to move is the one of
+             * its child, having as key the rest of the node as well. */
+            raxSetPos c = raxSetChild(&f->s,f->sj);
+            key[f->len] = se[f->sj++];
+            if (w->op != RAX_SET_MERGE) continue;
+            unsigned char *tail = NULL;
+            size_t taillen = 0;
+            if (c.off) {
+                tail = c.n->data+c.off;
+                taillen = c.n->size-c.off;
+                memcpy(&c.n,raxNodeFirstChildPtr(c.n),sizeof(c.n));
+            }
+            if (!raxSetAddChange(w,RAX_SETOP_GRAFT,f->len+1,tail,taillen,
+                                 c.n)) return 0;
+            continue;
+        }
+
+        /* Common edge: visit the next position. The current one is
+         * replaced if it has no other edges to compare, so that only the
+         * positions where the trees branch use the stack. */
+        raxSetPos cd = raxSetChild(&f->d,f->dj);
+        raxSetPos cs = raxSetChild(&f->s,f->sj);
+        size_t len = f->len+1;
+        key[f->len] = de[f->dj];
+        f->dj++;
+        f->sj++;
+        if (f->dj == dn && f->sj == sn) w->numframes--;
+        if (!raxSetEnter(w,&cd,&cs,len)) return 0;
+    }
+    return 1;
+}
+
+/* Get the value of the node 'n', that must be a key. */
+static void raxSetGetValue(raxNode *n, raxValue *v) {
+    v->isinline = n->isinline;
+    v->ptr = NULL;
+    v->buf = NULL;
+    v->len = 0;
+    if (n->isinline) v->buf = raxGetInlineData(n,&v->len);
+    else v->ptr = raxGetData(n);
+}
+
+/* Resolve the values of the key 's' of 'len' bytes of the tree 'rax' and of
+ * the node 'src' of the other tree, storing the value returned by the
+ * callback. The node is first made large enough for any of the values the
+ * callback may return, so that once the callback took its decision,
+ * storing the value cannot fail. Returns 0 on out of memory, in this case
+ * the callback is not called. */
+static int raxSetResolve(rax *rax, unsigned char *s, size_t len, raxNode *src, raxMergeCallback cb, void *privdata) {
+    raxNode *h, **plink;
+    raxLowWalk(rax,s,len,&h,&plink,NULL,NULL);
+    size_t curlen = raxNodeCurrentLength(h);
+    size_t vlen = raxNodeValueLen(h);
+    if (raxNodeValueLen(src) > vlen) vlen = raxNodeValueLen(src);
+    if (sizeof(void*) > vlen) vlen = sizeof(void*);
+    size_t alloclen = raxNodeValueOffset(h)+vlen;
+    if (alloclen > curlen) {
+        raxNode *newh = raxRealloc(rax,h,curlen,alloclen);
+        if (newh == NULL) return 0;
+        h = newh;
+        memcpy(plink,&h,sizeof(h));
+    } else {
+        alloclen = curlen;
+    }
+
+    void *a = raxGetData(h), *b = raxGetData(src);
+    void *data = cb(privdata,s,len,a,b);
+    if (data == b && data != a) raxCopyValue(h,src);
+    else if (data != a) raxSetData(h,data);
+
+    size_t newlen = raxNodeCurrentLength(h);
+    if (newlen != alloclen) {
+        /* Failing to shrink the node is not an error. */
+        raxNode *newh = raxRealloc(rax,h,alloclen,newlen);
+        if (newh) memcpy(plink,&newh,sizeof(newh));
+    }
+    return 1;
+}
+
+/* Move the subtree of the node 'sub' of another tree into the tree 'rax',
+ * where the key 's' of 'len' bytes, the key of 'sub', must have no node.
+ * A key with the same name is inserted first, creating the path leading to
+ * it, then its node is replaced by 'sub'. The counts of the keys and of the
+ * nodes of the tree are not updated, but the subtree counts are. Returns 0
+ * on out of memory. */
+static int raxSetGraft(rax *rax, unsigned char *s, size_t len, raxNode *sub) {
+    raxValue v = {NULL,NULL,0,0};
+    if (!raxGenericInsert(rax,s,len,&v,NULL,0)) return 0;
+    raxNode *leaf, **plink;
+    raxLowWalk(rax,s,len,&leaf,&plink,NULL,NULL);
+    memcpy(plink,&sub,sizeof(sub));
+    raxDealloc(rax,leaf);
+    rax->numnodes--;
+    rax->numele--;
+    if (rax->flags & RAX_FLAG_RANK) {
+        uint64_t keys = sub->iskey;
+        for (int j = 0; j < raxNodeNumChildren(sub); j++)
+            keys += raxGetCount(sub,j);
+        raxUpdateCounts(rax,s,len,(int64_t)keys-1);
+    }
+    return 1;
+}
+
+/* Compress the chain of nodes leading to the subtree with the key 's' of
+ * 'len' bytes, that was moved from another tree, so that its compressed
+ * nodes are joined with the ones created to reach it. */
+static void raxSetCompress(rax *rax, unsigned char *s, size_t len) {
+    raxNode *h;
+    raxStack ts;
+    raxStackInit(&ts);
+    raxLowWalk(rax,s,len,&h,NULL,NULL,&ts);
+    if (!ts.oom) raxCompressPath(rax,h,&ts);
+    raxStackFree(&ts);
+}
+
+/* Set the walk for the operation 'op' and check that dst can be modified
+ * this way. The walk does not know about buckets, so trees created with
+ * RAX_FLAG_BUCKETS are not supported. Returns 0 on error setting errno. */
+static int raxSetWalkInit(raxSetWalk *w, int op, int resolve, rax *dst, rax *src) {
+    memset(w,0,sizeof(*w));
+    w->op = op;
+    w->resolve = resolve;
+    raxSharedRelease(dst);
+    if (dst == src || dst->concurrency || dst->shared ||
+        ((dst->flags | src->flags) & RAX_FLAG_BUCKETS))
+    {
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+/* Move all the keys of 'src' into 'dst', leaving 'src' empty. The subtrees
+ * of 'src' having no keys in common with 'dst' are moved as they are,
+ * without visiting them, so the function takes time proportional to the
+ * part of the trees where both have keys, plus the depth of the subtrees
+ * moved. For the keys already in 'dst' the callback 'cb', if not NULL, is
+ * called with the key and the values of the key in 'dst' and in 'src' (for
+ * inline values, the pointers to their bytes), and the value it returns is
+ * stored in 'dst': returning one of the two values keeps it (inline values
+ * are copied), any other pointer is stored as the new value. The callback
+ * takes care of freeing the value that is not kept, if needed. Without a
+ * callback the values of 'dst' are kept.
+ *
+ * The nodes are moved between the trees, so they must use the same
+ * allocator and flags, and can't be concurrent trees, forked trees with
+ * forks not yet freed, or trees with buckets (see RAX_FLAG_BUCKETS, that
+ * no set operation supports): otherwise the function returns 0 setting
+ * errno to EINVAL. On success 1 is returned and errno is set to 0. On out
+ * of memory 0 is returned, errno is set to ENOMEM, and the merge is only
+ * partially performed: both trees are valid, and the keys not yet moved
+ * are still in 'src'. */
+int raxMerge(rax *dst, rax *src, raxMergeCallback cb, void *privdata) {
+    raxSetWalk w;
+    if (!raxSetWalkInit(&w,RAX_SET_MERGE,cb != NULL,dst,src)) return 0;
+    raxSharedRelease(src);
+    if (src->concurrency || src->shared || src->flags != dst->flags ||
+        memcmp(&src->alloc,&dst->alloc,sizeof(src->alloc)))
+    {
+        errno = EINVAL;
+        return 0;
+    }
+    if (!raxSetWalkTrees(&w,dst,src)) {
+        raxSetWalkFree(&w);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    size_t j;
+    for (j = 0; j < w.numchanges; j++) {
+        raxSetChange *c = w.changes+j;
+        unsigned char *key = w.keys+c->keyoff;
+        int ok;
+        if (c->type == RAX_SETOP_GRAFT) {
+            ok = raxSetGraft(dst,key,c->keylen,c->node);
+        } else if (c->type == RAX_SETOP_RESOLVE) {
+            ok = raxSetResolve(dst,key,c->keylen,c->node,cb,privdata);
+        } else {
+            raxValue v;
+            raxSetGetValue(c->node,&v);
+            ok = raxGenericInsert(dst,key,c->keylen,&v,NULL,0);
+        }
+        if (!ok) break;
+    }
+
+    if (j == w.numchanges) {
+        /* All the subtrees not moved were visited: free their nodes, but
+         * the head, that is reused as the head of the empty tree. The
+         * nodes and bytes of src not freed are the ones moved. */
+        uint64_t freedbytes = 0;
+        raxNode *head = src->head;
+        for (size_t k = 0; k < w.numvisited; k++) {
+            raxNode *n = w.visited[k];
+            freedbytes += raxNodeCurrentLength(n);
+            if (n != head) src->alloc.free_fn(src->alloc.ctx,n);
+        }
+        dst->numele += src->numele-w.srckeys;
+        dst->numnodes += src->numnodes-w.numvisited;
+        dst->bytes += src->bytes-sizeof(*src)-freedbytes;
+
+        head->iskey = 0;
+        head->isnull = 0;
+        head->iscompr = 0;
+        head->isdense = 0;
+        head->isinline = 0;
+        head->size = 0;
+        head->islink32 = 0;
+        head->needcompr = 0;
+        raxNode *newhead = src->alloc.realloc_fn(src->alloc.ctx,head,
+                                                 raxNodeCurrentLength(head));
+        if (newhead) src->head = newhead;
+        src->numele = 0;
+        src->numnodes = 1;
+        src->bytes = sizeof(*src)+raxNodeCurrentLength(src->head);
+        src->version++;
+    } else {
+        /* Out of memory: remove from src what was already moved. First
+         * the subtrees, that are unlinked like raxDetachPrefix() does,
+         * before removing keys may join their nodes with the parents. */
+        for (size_t k = 0; k < j; k++) {
+            raxSetChange *c = w.changes+k;
+            if (c->type != RAX_SETOP_GRAFT) continue;
+            unsigned char *key = w.keys+c->keyoff;
+            uint64_t keys = 0, nodes = 0, bytes = 0, removed = 0;
+            raxSubtreeSize(c->node,&keys,&nodes,&bytes);
+            raxRange r = {key,NULL,c->keylen,0,1,c->node,keys,NULL};
+            src->bytes -= bytes;
+            src->head = raxRemoveRangeNode(src,&r,src->head,key,0,1,
+                                           &removed);
+            src->numele -= removed;
+            src->numnodes -= nodes;
+            dst->numele += keys;
+            dst->numnodes += nodes;
+            dst->bytes += bytes;
+        }
+        for (size_t k = 0; k < j; k++) {
+            raxSetChange *c = w.changes+k;
+            if (c->type == RAX_SETOP_GRAFT) continue;
+            raxRemove(src,w.keys+c->keyoff,c->keylen,NULL);
+        }
+    }
+
+    for (size_t k = 0; k < j; k++) {
+        raxSetChange *c = w.changes+k;
+        if (c->type == RAX_SETOP_GRAFT)
+            raxSetCompress(dst,w.keys+c->keyoff,c->keylen);
+    }
+    int done = j == w.numchanges;
+    raxSetWalkFree(&w);
+    errno = done ? 0 : ENOMEM;
+    return done;
+}
+
+/* Remove from 'dst' all the keys that are not in 'src', that is not
+ * modified. The subtrees of 'dst' having no keys in common with 'src' are
+ * freed as they are, so the function takes time proportional to the part
+ * of the trees where both have keys, plus the nodes freed. If
+ * 'free_callback' is not NULL, it is called for the values of the removed
+ * keys (but inline values). For the keys in both trees the callback 'cb',
+ * if not NULL, is called like in raxMerge(), storing in 'dst' the value it
+ * returns, otherwise the values of 'dst' are kept.
+ *
+ * Concurrent trees, and forked trees with forks not yet freed, can't be
+ * used as 'dst': in this case 0 is returned and errno is set to EINVAL. On
+ * success 1 is returned and errno is set to 0. On out of memory 0 is
+ * returned, errno is set to ENOMEM, and the operation is only partially
+ * performed. */
+int raxIntersect(rax *dst, rax *src, raxMergeCallback cb, void *privdata, void (*free_callback)(void*)) {
+    raxSetWalk w;
+    if (!raxSetWalkInit(&w,RAX_SET_INTERSECT,cb != NULL,dst,src)) return 0;
+    if (!raxSetWalkTrees(&w,dst,src)) {
+        raxSetWalkFree(&w);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    int done = 1;
+    for (size_t j = 0; j < w.numchanges && done; j++) {
+        raxSetChange *c = w.changes+j;
+        unsigned char *key = w.keys+c->keyoff;
+        void *old;
+        if (c->type == RAX_SETOP_PRUNE) {
+            raxRemovePrefix(dst,key,c->keylen,free_callback);
+        } else if (c->type == RAX_SETOP_REMOVE) {
+            if (raxRemove(dst,key,c->keylen,&old) && old && free_callback)
+                free_callback(old);
+        } else {
+            done = raxSetResolve(dst,key,c->keylen,c->node,cb,privdata);
+        }
+    }
+    raxSetWalkFree(&w);
+    errno = done ? 0 : ENOMEM;
+    return done;
+}
+
+/* Remove from 'dst' all the keys that are in 'src', that is not modified.
+ * Only the part of the trees where both have keys is visited. If
+ * 'free_callback' is not NULL, it is called for the values of the removed
+ * keys (but inline values). Concurrent trees, and forked trees with forks
+ * not yet freed, can't be used as 'dst': in this case 0 is returned and
+ * errno is set to EINVAL. On success
+ * 1 is returned and errno is set to 0, on out of memory 0 is returned and
+ * errno is set to ENOMEM, without modifying the tree. */
+int raxDifference(rax *dst, rax *src, void (*free_callback)(void*)) {
+    raxSetWalk w;
+    if (!raxSetWalkInit(&w,RAX_SET_DIFFERENCE,0,dst,src)) return 0;
+    if (!raxSetWalkTrees(&w,dst,src)) {
+        raxSetWalkFree(&w);
+        errno = ENOMEM;
+        return 0;
+    }
+    for (size_t j = 0; j < w.numchanges; j++) {
+        raxSetChange *c = w.changes+j;
+        void *old;
+        if (raxRemove(dst,w.keys+c->keyoff,c->keylen,&old) && old &&
+            free_callback) free_callback(old);
+    }
+    raxSetWalkFree(&w);
+    errno = 0;
+    return 1;
+}
+
+/* ------------------------------ Bulk loading ------------------------------
+ * raxBulkLoad() builds a tree from keys provided in lexicographical order.
+ * Since the keys are sorted, every time a new key is received we know that
+ * all the nodes that are not in common with the previous key are complete,
+ * so they can be created directly with their final content, bottom-up,
+ * without splits or reallocations, and without walking the tree.
+ *
+ * The loader keeps a stack of "frames", the incomplete nodes in the path of
+ * the last key: the ones representing keys, and the ones where two keys
+ * diverge. Their completed children are stored in a second stack: since
+ * only the frame at the top can get new children, the children of every
+ * frame are contiguous, and are just above the children of its parent.
+ * The whole edge from a frame to every child (that may need a compressed
+ * node if longer than a single byte) is saved in a third stack of bytes,
+ * that is handled in the same way.
+ * ------------------------------------------------------------------------- */
+
+typedef struct raxBulkFrame {
+    size_t depth;       /* Length of the prefix represented by the node. */
+    int iskey;          /* True if the prefix is a key. */
+    void *data;         /* Value of the key. */
+    size_t firstchild;  /* Index of the first child in the children stack. */
+} raxBulkFrame;
+
+typedef struct raxBulkChild {
+    raxNode *node;      /* The child, already created. */
+    uint64_t count;     /* Number of keys in the child subtree. */
+    size_t edge;        /* Offset of the edge in the edge bytes stack. */
+    size_t edgelen;     /* Length of the edge. */
+} raxBulkChild;
+
+typedef struct raxBulkState {
+    raxBulkFrame *frames;
+    raxBulkChild *children;
+    unsigned char *edges;
+    unsigned char *prev;    /* Last key loaded. */
+    size_t numframes, maxframes;
+    size_t numchildren, maxchildren;
+    size_t edgeslen, maxedges;
+    size_t prevlen, maxprev;
+    void (*free_callback)(void*); /* Releases the values on errors. */
+} raxBulkState;
+
+/* Make sure the array '*buf' of '*max' items of 'itemsize' bytes can hold
+ * 'needed' items. Returns 0 on out of memory, otherwise 1. */
+static int raxBulkReserve(void **buf, size_t *max, size_t needed,
+                          size_t itemsize)
+{
+    if (needed <= *max) return 1;
+    size_t newmax = *max ? *max : 16;
+    while(newmax < needed) newmax *= 2;
+    void *newbuf = *buf ? rax_realloc(*buf,newmax*itemsize) :
+                          rax_malloc(newmax*itemsize);
+    if (newbuf == NULL) return 0;
+    *buf = newbuf;
+    *max = newmax;
+    return 1;
+}
+
+/* Release the arrays of the loader state. */
+static void raxBulkFreeState(raxBulkState *bs) {
+    if (bs->frames) rax_free(bs->frames);
+    if (bs->children) rax_free(bs->children);
+    if (bs->edges) rax_free(bs->edges);
+    if (bs->prev) rax_free(bs->prev);
+}
+
+/* Allocate a node with its final size, and populate it. 'children' and
+ * 'counts' are the child pointers and their subtree counts: one for
+ * compressed nodes, or 'size' for normal nodes. Returns NULL on out of
+ * memory. */
+static raxNode *raxBulkNewNode(rax *rax, int iscompr, unsigned char *data,
+                               size_t size, raxNode **children,
+                               uint64_t *counts, int iskey, void *value)
+{
+    size_t numchildren = iscompr ? 1 : size;
+    int dense = !iscompr && (rax->flags & RAX_FLAG_DENSE) &&
+                size >= RAX_DENSE_MIN_CHILDREN;
+    int hascount = (rax->flags & RAX_FLAG_RANK) != 0;
+    size_t nodesize = sizeof(raxNode)+size+raxPadding(size)+
+                      (dense ? RAX_DENSE_INDEX_LEN : 0)+
+                      sizeof(raxNode*)*numchildren+
+                      (hascount ? sizeof(uint64_t)*numchildren : 0)+
+                      ((iskey && value) ? sizeof(void*) : 0);
+    raxNode *n = raxAlloc(rax,nodesize);
+    if (n == NULL) return NULL;
+    n->iskey = 0;
+    n->isnull = 0;
+    n->iscompr = iscompr;
+    n->isdense = dense;
+    n->isinline = 0;
+    n->hascount = hascount;
+    n->size = size;
+    n->islink32 = 0;
+    n->needcompr = 0;
+    if (size) memcpy(n->data,data,size);
+    if (dense) raxIndexUpdate(n,0);
+    if (numchildren) {
+        memcpy(raxNodeFirstChildPtr(n),children,
+               sizeof(raxNode*)*numchildren);
+        if (hascount)
+            memcpy(raxNodeCounts(n),counts,sizeof(uint64_t)*numchildren);
+    }
+    if (iskey) raxSetData(n,value);
+    rax->numnodes++;
+    return n;
+}
+
+/* Create the nodes for the edge 's' of 'len' bytes leading to 'child',
+ * whose subtree has 'count' keys: a compressed node, or more if the edge is
+ * longer than the maximum node size, or just a normal node with a single
+ * child if the edge is one byte. The first node represents a key if 'iskey'
+ * is true. Returns the first node, or NULL on out of memory. */
+static raxNode *raxBulkNewChain(rax *rax, unsigned char *s, size_t len,
+                                raxNode *child, uint64_t count, int iskey,
+                                void *value)
+{
+    raxNode *last = child;
+    size_t pieces = (len+RAX_NODE_MAX_SIZE-1)/RAX_NODE_MAX_SIZE;
+    while(pieces--) {
+        size_t start = pieces*RAX_NODE_MAX_SIZE;
+        size_t size = len-start;
+        if (size > RAX_NODE_MAX_SIZE) size = RAX_NODE_MAX_SIZE;
+        raxNode *n = raxBulkNewNode(rax,size > 1,s+start,size,&child,&count,
+                                    start == 0 && iskey,value);
+        if (n == NULL) {
+            /* Free the nodes of the chain created so far. */
+            while(child != last) {
+                raxNode *next;
+                memcpy(&next,raxNodeFirstChildPtr(child),sizeof(next));
+                raxDealloc(rax,child);
+                rax->numnodes--;
+                child = next;
+            }
+            return NULL;
+        }
+        child = n;
+    }
+    return child;
+}
+
+/* Create the node for the frame at the top of the stack, using its
+ * children, and pop the frame and its children. The new node and its keys
+ * count are returned by reference, together with the frame depth. Returns
+ * 0 on out of memory, otherwise 1. */
+static int raxBulkCloseFrame(rax *rax, raxBulkState *bs, raxNode **node,
+                             uint64_t *count, size_t *depth)
+{
+    raxBulkFrame *f = bs->frames+bs->numframes-1;
+    raxBulkChild *c = bs->children+f->firstchild;
+    size_t numchildren = bs->numchildren-f->firstchild;
+    raxNode *n;
+
+    *count = f->iskey;
+    for (size_t j = 0; j < numchildren; j++) *count += c[j].count;
+
+    if (numchildren == 0) {
+        n = raxBulkNewNode(rax,0,NULL,0,NULL,NULL,f->iskey,f->data);
+    } else if (numchildren == 1) {
+        /* The whole edge goes in the node itself, that is compressed. */
+        n = raxBulkNewChain(rax,bs->edges+c[0].edge,c[0].edgelen,c[0].node,
+                            c[0].count,f->iskey,f->data);
+    } else {
+        unsigned char edges[256];
+        raxNode *ptrs[256];
+        uint64_t counts[256];
+        for (size_t j = 0; j < numchildren; j++) {
+            /* The first byte of the edge goes into this node, the rest
+             * into a compressed node before the child, if needed. */
+            edges[j] = bs->edges[c[j].edge];
+            if (c[j].edgelen > 1) {
+                raxNode *chain = raxBulkNewChain(rax,
+                    bs->edges+c[j].edge+1,c[j].edgelen-1,c[j].node,
+                    c[j].count,0,NULL);
+                if (chain == NULL) return 0;
+                /* From now on the chain is owned by the children stack,
+                 * so that it is released on errors. */
+                c[j].node = chain;
+                c[j].edgelen = 1;
+            }
+            ptrs[j] = c[j].node;
+            counts[j] = c[j].count;
+        }
+        n = raxBulkNewNode(rax,0,edges,numchildren,ptrs,counts,
+                           f->iskey,f->data);
+    }
+    if (n == NULL) return 0;
+
+    *node = n;
+    *depth = f->depth;
+    if (numchildren) bs->edgeslen = c[0].edge;
+    bs->numchildren = f->firstchild;
+    bs->numframes--;
+    return 1;
+}
+
+/* Push a new frame at the specified depth. Returns 0 on out of memory. */
+static int raxBulkPushFrame(raxBulkState *bs, size_t depth, int iskey,
+                            void *data)
+{
+    if (!raxBulkReserve((void**)&bs->frames,&bs->maxframes,bs->numframes+1,
+                        sizeof(raxBulkFrame))) return 0;
+    raxBulkFrame *f = bs->frames+bs->numframes++;
+    f->depth = depth;
+    f->iskey = iskey;
+    f->data = data;
+    f->firstchild = bs->numchildren;
+    return 1;
+}
+
+/* Add the node representing the prefix of the previous key of length
+ * 'depth' as a child of the frame at the top of the stack. Returns 0 on
+ * out of memory. */
+static int raxBulkAddChild(raxBulkState *bs, raxNode *node, uint64_t count,
+                           size_t depth)
+{
+    raxBulkFrame *f = bs->frames+bs->numframes-1;
+    size_t edgelen = depth-f->depth;
+    if (!raxBulkReserve((void**)&bs->children,&bs->maxchildren,
+                        bs->numchildren+1,sizeof(raxBulkChild)) ||
+        !raxBulkReserve((void**)&bs->edges,&bs->maxedges,
+                        bs->edgeslen+edgelen,1)) return 0;
+    raxBulkChild *c = bs->children+bs->numchildren++;
+    c->node = node;
+    c->count = count;
+    c->edge = bs->edgeslen;
+    c->edgelen = edgelen;
+    memcpy(bs->edges+bs->edgeslen,bs->prev+f->depth,edgelen);
+    bs->edgeslen += edgelen;
+    return 1;
+}
+
+/* Complete the frames deeper than 'depth', adding them as children of
+ * their parents. If the key that follows diverges from the previous one
+ * between two frames, a new frame is created at 'depth'. Returns 0 on out
+ * of memory. */
+static int raxBulkCloseFrames(rax *rax, raxBulkState *bs, size_t depth) {
+    while(bs->frames[bs->numframes-1].depth > depth) {
+        raxNode *node;
+        uint64_t count;
+        size_t nodedepth;
+        if (!raxBulkCloseFrame(rax,bs,&node,&count,&nodedepth)) return 0;
+        if (bs->frames[bs->numframes-1].depth < depth &&
+            !raxBulkPushFrame(bs,depth,0,NULL))
+        {
+            raxFreeSubtree(rax,node,bs->free_callback);
+            return 0;
+        }
+        if (!raxBulkAddChild(bs,node,count,nodedepth)) {
+            raxFreeSubtree(rax,node,bs->free_callback);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* raxBulkLoad() for trees with leaf buckets: the keys are inserted one
+ * after the other, so that the tree is the same the insertions would
+ * produce, checking the order like the normal loader does. */
+static int raxBucketBulkLoad(rax *rax, raxBulkLoadCallback next, void *privdata, void (*free_callback)(void*)) {
+    unsigned char *prev = NULL, *key;
+    size_t prevlen = 0, maxprev = 0, len;
+    void *data, *orphan = NULL;
+    int errcode = ENOMEM, res;
+
+    while((res = next(privdata,&key,&len,&data)) > 0) {
+        orphan = data;
+        if (rax->numele) {
+            size_t max = len < prevlen ? len : prevlen;
+            size_t common = raxMatchLen(prev,key,max);
+            if (common == len ||
+                (common < prevlen && key[common] < prev[common]))
+            {
+                errcode = EINVAL;
+                goto err;
+            }
+        }
+        if (!raxInsert(rax,key,len,data,NULL)) goto err;
+        orphan = NULL;
+        if (!raxBulkReserve((void**)&prev,&maxprev,len,1)) goto err;
+        if (len) memcpy(prev,key,len);
+        prevlen = len;
+    }
+    if (res < 0) {
+        errcode = errno;
+        goto err;
+    }
+    if (prev) rax_free(prev);
+    return 1;
+
+err:
+    raxRemoveRange(rax,(unsigned char*)"",0,NULL,0,free_callback);
+    if (free_callback && orphan) free_callback(orphan);
+    if (prev) rax_free(prev);
+    errno = errcode;
+    return 0;
+}
+
+/* Implements raxBulkLoad(). If the callback returns -1, setting errno, the
+ * loading fails with the same error. On errors, if 'free_callback' is not
+ * NULL, it is called for the values received so far. */
+static int raxGenericBulkLoad(rax *rax, raxBulkLoadCallback next, void *privdata, void (*free_callback)(void*)) {
+    if (rax->numele != 0 || rax->head->size != 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (rax->flags & RAX_FLAG_BUCKETS)
+        return raxBucketBulkLoad(rax,next,privdata,free_callback);
+
+    raxBulkState bs;
+    memset(&bs,0,sizeof(bs));
+    bs.free_callback = free_callback;
+    uint64_t numele = 0;
+    int errcode = ENOMEM, res;
+    void *orphan = NULL; /* Value not yet owned by a frame. */
+    if (!raxBulkPushFrame(&bs,0,0,NULL)) goto err; /* The root frame. */
+
+    unsigned char *key;
+    size_t len;
+    void *data;
+    while((res = next(privdata,&key,&len,&data)) > 0) {
+        orphan = data;
+        /* Compute the common prefix with the previous key, and check the
+         * keys order. */
+        size_t common = 0;
+        if (numele) {
+            size_t max = len < bs.prevlen ? len : bs.prevlen;
+            common = raxMatchLen(bs.prev,key,max);
+            if (common == len ||
+                (common < bs.prevlen && key[common] < bs.prev[common]))
+            {
+                errcode = EINVAL;
+                goto err;
+            }
+        }
+        if (!raxBulkCloseFrames(rax,&bs,common)) goto err;
+        if (len == 0) {
+            /* Only the first key can be the empty string. */
+            bs.frames[0].iskey = 1;
+            bs.frames[0].data = data;
+        } else {
+            if (!raxBulkPushFrame(&bs,len,1,data)) goto err;
+        }
+        orphan = NULL;
+        if (!raxBulkReserve((void**)&bs.prev,&bs.maxprev,len,1)) goto err;
+        if (len) memcpy(bs.prev,key,len);
+        bs.prevlen = len;
+        numele++;
+    }
+    if (res < 0) {
+        errcode = errno;
+        goto err;
+    }
+
+    if (numele) {
+        /* Complete the root, and replace the current empty head. */
+        raxNode *head;
+        uint64_t count;
+        size_t depth;
+        if (!raxBulkCloseFrames(rax,&bs,0) ||
+            !raxBulkCloseFrame(rax,&bs,&head,&count,&depth)) goto err;
+        raxNode *oldhead = rax->head;
+        raxAtomicStore(&rax->head,head);
+        raxAtomicStore(&rax->numele,numele);
+        raxAtomicStore(&rax->numnodes,rax->numnodes-1);
+        raxDealloc(rax,oldhead);
+        if (rax->concurrency) raxReclaim(rax);
+    }
+    raxBulkFreeState(&bs);
+    return 1;
+
+err:
+    /* Release the nodes created so far: all of them are reachable from the
+     * children stack. The values of the keys not yet in a node are in the
+     * frames. */
+    for (size_t j = 0; j < bs.numchildren; j++)
+        raxFreeSubtree(rax,bs.children[j].node,free_callback);
+    if (free_callback) {
+        for (size_t j = 0; j < bs.numframes; j++)
+            if (bs.frames[j].iskey && bs.frames[j].data)
+                free_callback(bs.frames[j].data);
+        if (orphan) free_callback(orphan);
+    }
+    raxBulkFreeState(&bs);
+    errno = errcode;
+    return 0;
+}
+
+/* Load into the empty radix tree 'rax' the keys returned by the 'next'
+ * callback, that must be returned in strictly increasing lexicographical
+ * order (the order of the iterator). The callback is called with the
+ * 'privdata' pointer, and returns 1 setting by reference the key, its
+ * length and its value, or 0 when there are no more keys. The key memory
+ * only needs to be valid until the next call of the callback.
+ *
+ * This is much faster than inserting the keys one after the other, since
+ * the nodes are created directly with their final size and content, and
+ * the tree is never walked. The resulting tree is the same. Trees with
+ * leaf buckets (RAX_FLAG_BUCKETS) are the exception: the keys are just
+ * inserted, since the buckets are formed and burst by the insertions.
+ *
+ * On success 1 is returned. If the tree is not empty, or if the keys are
+ * not in order (or are repeated), 0 is returned and errno is set to EINVAL.
+ * On out of memory 0 is returned and errno is set to ENOMEM. In both the
+ * error cases the tree is left empty: the callback values are not freed. */
+int raxBulkLoad(rax *rax, raxBulkLoadCallback next, void *privdata) {
+    return raxGenericBulkLoad(rax,next,privdata,NULL);
+}
+
+/* ------------------------------ Frozen images -----------------------------
+ * raxSerialize() produces a flat image of a tree, that can be written to a
+ * file and later used in place, for instance after mapping the file in
+ * memory, by the read only raxFrozen handle, without loading the tree.
+ *
+ * The image is an header followed by the nodes, in depth first order (every
+ * node is before its children), each aligned to the size of a pointer. The
+ * nodes have exactly the same layout of the nodes of the tree, so that the
+ * same lookup and iteration code works on images as well: the only
+ * difference is that the child pointers are offsets from the start of the
+ * image, which makes the image position independent. Pointer values are
+ * stored as they are, unless the serialization callback provides their
+ * content: in that case it is stored inline, as raxInsertInline() does.
+ *
+ * Since the node layout is the one of the tree, the image can only be used
+ * by programs with the same pointer size and byte order of the program that
+ * wrote it: both are recorded in the header, and checked by raxFrozenOpen().
+ *
+ * Compact images, produced by raxSerializeCompact(), use instead 32 bit
+ * child links, in units of RAX_IMAGE_LINK_UNIT bytes, setting the islink32
+ * bit of every node: the links, the padding and the nodes themselves are
+ * then just aligned to four bytes. In 64 bit builds this makes the images
+ * 35-40% smaller, so that lookups touch less cache lines, and images up to
+ * 16GB can be addressed.
+ * -------------------------------------------------------------------------- */
+
+#define RAX_IMAGE_MAGIC "RAXIMAGE"
+#define RAX_IMAGE_VERSION 1
+#define RAX_IMAGE_VERSION_COMPACT 2 /* Readers not knowing compact images
+                                       refuse them. */
+#define RAX_IMAGE_BYTEORDER 0x0102030405060708ULL
+
+typedef struct raxImageHeader {
+    char magic[8];          /* RAX_IMAGE_MAGIC, without null term. */
+    uint32_t version;       /* RAX_IMAGE_VERSION. */
+    uint32_t ptrsize;       /* sizeof(void*) of the writer. */
+    uint64_t byteorder;     /* RAX_IMAGE_BYTEORDER in the writer order. */
+    uint64_t len;           /* Total length of the image. */
+    uint64_t head;          /* Offset of the root node. */
+    uint64_t numele;        /* Number of keys. */
+    uint64_t numnodes;      /* Number of nodes. */
+    uint64_t flags;         /* RAX_FLAG_... flags of the tree. */
+} raxImageHeader;
+
+/* Round 'len' up to a multiple of 'unit', that is a power of two. */
+#define raxImageAlign(len,unit) (((len)+(unit)-1) & ~(size_t)((unit)-1))
+
+typedef struct raxImageWriter {
+    unsigned char *buf;
+    size_t len, max;
+    raxSerializeCallback valfn;
+    void *privdata;
+    int compact;            /* Write 32 bit child links. */
+    size_t align;           /* Alignment of the nodes. */
+    int errcode;            /* Errno to set on failure. */
+} raxImageWriter;
+
+/* Append to the image the node 'n' and, recursively, all its subtree.
+ * The offset of the node is returned by reference in '*offset'. Returns 0
+ * on error, setting w->errcode, otherwise 1. */
+static int raxSerializeNode(raxImageWriter *w, raxNode *n, uint64_t *offset) {
+    /* Get the value to store in the image. */
+    raxValue v = {NULL,NULL,0,0};
+    if (n->iskey && !n->isnull) {
+        if (n->isinline) {
+            v.buf = raxGetInlineData(n,&v.len);
+            v.isinline = 1;
+        } else {
+            v.ptr = raxGetData(n);
+            const void *buf;
+            size_t len;
+            if (w->valfn && w->valfn(w->privdata,v.ptr,&buf,&len)) {
+                v.buf = buf;
+                v.len = len;
+                v.isinline = 1;
+            }
+        }
+    }
+
+    /* Append the node, with the right room for the value. In compact
+     * images the padding and the links are smaller, so the layout of the
+     * copy is computed from its own header. */
+    raxNode hdr = *n;
+    hdr.islink32 = w->compact;
+    int numchildren = raxNodeNumChildren(n);
+    size_t cpoff = (unsigned char*)raxNodeFirstChildPtr(&hdr)-
+                   (unsigned char*)&hdr;
+    size_t linksize = raxNodeLinkSize(&hdr);
+    size_t nodelen = raxNodeValueOffset(&hdr)+raxValueLen(&v);
+    size_t alignedlen = raxImageAlign(nodelen,w->align);
+    if (w->max-w->len < alignedlen) {
+        size_t newmax = w->max*2;
+        if (newmax-w->len < alignedlen) newmax = w->len+alignedlen;
+        unsigned char *newbuf = rax_realloc(w->buf,newmax);
+        if (newbuf == NULL) {
+            w->errcode = ENOMEM;
+            return 0;
+        }
+        w->buf = newbuf;
+        w->max = newmax;
+    }
+    uint64_t nodeoff = w->len;
+    raxNode *copy = (raxNode*)(w->buf+nodeoff);
+    memcpy(copy,&hdr,sizeof(hdr));
+    memcpy(copy->data,n->data,n->size);
+    memset(copy->data+n->size,0,raxNodePadding(copy));
+    memcpy(raxNodeIndex(copy),raxNodeIndex(n),raxNodeIndexLen(n));
+    memcpy(raxNodeCounts(copy),raxNodeCounts(n),raxNodeCountsLen(n));
+    copy->iskey = 0;
+    copy->isnull = 0;
+    copy->isinline = 0;
+    copy->needcompr = 0;
+    if (n->iskey) raxStoreValue(copy,&v);
+    memset(w->buf+nodeoff+nodelen,0,alignedlen-nodelen);
+    w->len += alignedlen;
+    *offset = nodeoff;
+
+    /* Append the children, and store their offsets in the node. Since the
+     * buffer may be reallocated, we don't retain pointers into it. */
+    raxNode **cp = raxNodeFirstChildPtr(n);
+    for (int j = 0; j < numchildren; j++) {
+        raxNode *child;
+        memcpy(&child,cp+j,sizeof(child));
+        uint64_t childoff;
+        if (!raxSerializeNode(w,child,&childoff)) return 0;
+        unsigned char *link = w->buf+nodeoff+cpoff+linksize*j;
+        if (w->compact) {
+            if (childoff/RAX_IMAGE_LINK_UNIT > UINT32_MAX) {
+                w->errcode = EFBIG;
+                return 0;
+            }
+            uint32_t off = childoff/RAX_IMAGE_LINK_UNIT;
+            memcpy(link,&off,sizeof(off));
+        } else {
+            uintptr_t ptr = childoff;
+            memcpy(link,&ptr,sizeof(ptr));
+        }
+    }
+    return 1;
+}
+
+/* Implements raxSerialize() and raxSerializeCompact(). */
+static unsigned char *raxGenericSerialize(rax *rax, raxSerializeCallback valfn, void *privdata, int compact, size_t *len) {
+    raxImageWriter w;
+    if (rax->flags & RAX_FLAG_BUCKETS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    w.max = sizeof(raxImageHeader)+32*rax->numnodes;
+    w.len = sizeof(raxImageHeader);
+    w.valfn = valfn;
+    w.privdata = privdata;
+    w.compact = compact;
+    w.align = compact ? RAX_IMAGE_LINK_UNIT : sizeof(void*);
+    w.errcode = ENOMEM;
+    w.buf = rax_malloc(w.max);
+    if (w.buf == NULL) goto err;
+
+    uint64_t head;
+    if (!raxSerializeNode(&w,rax->head,&head)) goto err;
+
+    raxImageHeader hdr;
+    memset(&hdr,0,sizeof(hdr));
+    memcpy(hdr.magic,RAX_IMAGE_MAGIC,sizeof(hdr.magic));
+    hdr.version = compact ? RAX_IMAGE_VERSION_COMPACT : RAX_IMAGE_VERSION;
+    hdr.ptrsize = sizeof(void*);
+    hdr.byteorder = RAX_IMAGE_BYTEORDER;
+    hdr.len = w.len;
+    hdr.head = head;
+    hdr.numele = rax->numele;
+    hdr.numnodes = rax->numnodes;
+    hdr.flags = rax->flags;
+    memcpy(w.buf,&hdr,sizeof(hdr));
+    *len = w.len;
+    return w.buf;
+
+err:
+    rax_free(w.buf);
+    errno = w.errcode;
+    return NULL;
+}
+
+/* Serialize the radix tree 'rax' into a flat image, that can be used in
+ * place (for instance by mapping in memory a file where the image was
+ * written) with raxFrozenOpen(). The image does not reference the tree:
+ * the tree can be modified or freed later.
+ *
+ * Values are stored as they are: inline values are copied, and pointers are
+ * stored without changes, which is only useful for values that are not
+ * actual pointers, or that point to memory shared with the image users.
+ * If 'valfn' is not NULL, it is called for every key having a non NULL
+ * pointer value, as valfn(privdata,value,&buf,&len): if the callback
+ * returns 1, the 'len' bytes at 'buf' are stored in the image instead of
+ * the pointer, as an inline value, otherwise the pointer is stored.
+ *
+ * On success the image is returned, and its length is stored in '*len'.
+ * The memory is allocated with rax_malloc(), and should be released with
+ * rax_free(). On out of memory NULL is returned and errno is set to ENOMEM.
+ * The frozen lookups don't know about buckets, so trees created with
+ * RAX_FLAG_BUCKETS can't be serialized: NULL is returned and errno is set
+ * to EINVAL. */
+unsigned char *raxSerialize(rax *rax, raxSerializeCallback valfn, void *privdata, size_t *len) {
+    return raxGenericSerialize(rax,valfn,privdata,0,len);
+}
+
+/* Like raxSerialize(), but produces a compact image, where the child links
+ * are 32 bit offsets instead of pointers, and the nodes are aligned to four
+ * bytes: in 64 bit builds a compact image is usually 35-40% smaller than
+ * the normal one. Compact images are used with raxFrozenOpen() like the
+ * normal ones, with the same read only API. If the image would be too
+ * large for the 32 bit links (16GB), NULL is returned and errno is set to
+ * EFBIG. */
+unsigned char *raxSerializeCompact(rax *rax, raxSerializeCallback valfn, void *privdata, size_t *len) {
+    return raxGenericSerialize(rax,valfn,privdata,1,len);
+}
+
+/* Initialize the frozen handle 'f' in order to access the image of 'len'
+ * bytes at 'image', produced by raxSerialize() or raxSerializeCompact().
+ * Nothing is allocated nor copied, so this takes constant time, and the
+ * image must remain valid and unchanged as long as the handle is used.
+ * The image must be aligned to the size of a pointer (memory returned by
+ * malloc() or mmap() always is).
+ *
+ * On success 1 is returned. If the image is not valid, or was produced by a
+ * program with a different pointer size or byte order, 0 is returned and
+ * errno is set to EINVAL. Only the header is checked: the image content is
+ * trusted. */
+int raxFrozenOpen(raxFrozen *f, const void *image, size_t len) {
+    raxImageHeader hdr;
+    if (len < sizeof(hdr) || (uintptr_t)image % sizeof(void*)) goto einval;
+    memcpy(&hdr,image,sizeof(hdr));
+    if (memcmp(hdr.magic,RAX_IMAGE_MAGIC,sizeof(hdr.magic)) != 0 ||
+        (hdr.version != RAX_IMAGE_VERSION &&
+         hdr.version != RAX_IMAGE_VERSION_COMPACT) ||
+        hdr.ptrsize != sizeof(void*) ||
+        hdr.byteorder != RAX_IMAGE_BYTEORDER ||
+        hdr.len > len ||
+        hdr.len < sizeof(hdr)+sizeof(raxNode) ||
+        hdr.head < sizeof(hdr) ||
+        hdr.head > hdr.len-sizeof(raxNode)) goto einval;
+
+    memset(f,0,sizeof(*f));
+    f->rt.head = (raxNode*)((unsigned char*)image+hdr.head);
+    f->rt.numele = hdr.numele;
+    f->rt.numnodes = hdr.numnodes;
+    f->rt.bytes = hdr.len;
+    f->rt.flags = hdr.flags;
+    f->image = image;
+    f->len = hdr.len;
+    return 1;
+
+einval:
+    errno = EINVAL;
+    return 0;
+}
+
+/* Like raxFind(), but looks up the key in the frozen image 'f'. For inline
+ * values the returned pointer points inside the image. */
+void *raxFrozenFind(raxFrozen *f, unsigned char *s, size_t len) {
+    raxNode *h;
+
+    debugf("### Frozen lookup: %.*s\n", (int)len, s);
+    int splitpos = 0;
+    size_t i = raxLowWalkBase(&f->rt,(uintptr_t)f->image,s,len,&h,NULL,
+                              &splitpos,NULL);
+    if (i != len || (h->iscompr && splitpos != 0) || !h->iskey)
+        return raxNotFound;
+    return raxGetData(h);
+}
+
+/* Like raxFindInline(), but looks up the key in the frozen image 'f'. */
+void *raxFrozenFindInline(raxFrozen *f, unsigned char *s, size_t len, size_t *vlen) {
+    raxNode *h;
+
+    debugf("### Frozen lookup inline: %.*s\n", (int)len, s);
+    int splitpos = 0;
+    size_t i = raxLowWalkBase(&f->rt,(uintptr_t)f->image,s,len,&h,NULL,
+                              &splitpos,NULL);
+    if (i != len || (h->iscompr && splitpos != 0) || !h->iskey ||
+        !h->isinline)
+        return raxNotFound;
+    return raxGetInlineData(h,vlen);
+}
+
+/* Initialize an iterator for the frozen image 'f'. The iterator is used
+ * exactly like the ones of normal trees, with raxSeek(), raxNext(),
+ * raxPrev(), raxSelect() (for images of trees with subtree counts),
+ * raxRandomWalk(), and finally raxStop(). The node callback is not
+ * supported, since the image can't be modified. */
+void raxFrozenStart(raxIterator *it, raxFrozen *f) {
+    raxStart(it,&f->rt);
+    it->base = (uintptr_t)f->image;
+}
+
+/* ------------------------------ Stream dumps ------------------------------
+ * raxDumpStream() writes the keys of a tree, in order, as a stream meant to
+ * be sent or stored, for instance for replication or backups, and loaded
+ * back by raxLoadStream(). Unlike frozen images, the format does not depend
+ * on the node layout, the pointer size or the byte order.
+ *
+ * The stream starts with RAX_STREAM_MAGIC followed by the version byte, and
+ * is then made of blocks. Every block has an header of four 32 bit little
+ * endian integers: the payload length, the number of keys in the payload,
+ * the CRC32-C of the payload, and the CRC32-C of the first two fields, so
+ * that the loader never trusts a corrupted length.
+ *
+ * Keys are front coded: since they are sorted, every key is stored as the
+ * number of bytes in common with the previous key, followed by the length
+ * of the rest of the key and by its bytes. The first key of every block is
+ * stored in full. After the key there is the value, as a single varint 0
+ * for NULL, 1 followed by the varint of pointers stored as they are, or
+ * the length plus 2 followed by the bytes of inline or encoded values.
+ * Varints are unsigned LEB128.
+ *
+ * Blocks are flushed once their payload reaches RAX_STREAM_BLOCK_SIZE
+ * bytes, so both the writer and the loader only need memory for a block
+ * and a key. The last block has no keys, and its payload is the number of
+ * keys of the stream, as a 64 bit little endian integer.
+ * ------------------------------------------------------------------------- */
+
+#define RAX_STREAM_MAGIC "RAXDUMP"  /* Followed by the version byte. */
+#define RAX_STREAM_MAGIC_LEN 7
+#define RAX_STREAM_VERSION 1
+#define RAX_STREAM_BLOCK_SIZE 65536
+#define RAX_STREAM_HDR_LEN 16
+#define RAX_STREAM_MAX_RECORD 40    /* Varints of a record. */
+#define RAX_STREAM_MAX_LEN (1<<28)  /* Max length of keys and values. */
+/* A block is flushed as soon as its payload reaches RAX_STREAM_BLOCK_SIZE,
+ * so no valid payload can be longer than this. */
+#define RAX_STREAM_MAX_PAYLOAD (RAX_STREAM_BLOCK_SIZE+RAX_STREAM_MAX_RECORD+\
+                                2*RAX_STREAM_MAX_LEN)
+
+/* Fill 'table' for the byte at a time computation of the CRC32-C
+ * (Castagnoli), that detects more errors than the CRC16 of Redis Cluster,
+ * and can be computed faster. */
+static void raxCrc32cInit(uint32_t *table) {
+    for (uint32_t j = 0; j < 256; j++) {
+        uint32_t c = j;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78 & -(c & 1));
+        table[j] = c;
+    }
+}
+
+static uint32_t raxCrc32c(const uint32_t *table, const unsigned char *p, size_t len) {
+    uint32_t crc = 0xffffffff;
+    while(len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void raxStreamPut32(unsigned char *p, uint32_t v) {
+    for (int j = 0; j < 4; j++) p[j] = v >> (j*8);
+}
+
+static uint32_t raxStreamGet32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static void raxStreamPut64(unsigned char *p, uint64_t v) {
+    for (int j = 0; j < 8; j++) p[j] = v >> (j*8);
+}
+
+static uint64_t raxStreamGet64(const unsigned char *p) {
+    return (uint64_t)raxStreamGet32(p) | (uint64_t)raxStreamGet32(p+4) << 32;
+}
+
+/* Store 'v' as a varint at 'p', returning the number of bytes used. */
+static size_t raxStreamPutVarint(unsigned char *p, uint64_t v) {
+    size_t len = 0;
+    while(v >= 0x80) {
+        p[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[len++] = v;
+    return len;
+}
+
+/* Read a varint at '*p', not going past 'end', and advance '*p'. Returns 0
+ * if the varint is truncated or too long. */
+static int raxStreamGetVarint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 1;
+    }
+    return 0;
+}
 
-    /* Recompression: if trycompress is true, 'h' points to a radix tree node
-     * that changed in a way that could allow to compress nodes in this
-     * sub-branch. Compressed nodes represent chains of nodes that are not
-     * keys and have a single child, so there are two deletion events that
-     * may alter the tree so that further compression is needed:
-     *
-     * 1) A node with a single child was a key and now no longer is a key.
-     * 2) A node with two children now has just one child.
-     *
-     * We try to navigate upward till there are other nodes that can be
-     * compressed, when we reach the upper node which is not a key and has
-     * a single child, we scan the chain of children to collect the
-     * compressable part of the tree, and replace the current node with the
-     * new one, fixing the child pointer to reference the first non
-     * compressable node.
-     *
-     * Example of case "1". A tree stores the keys "FOO" = 1 and
-     * "FOOBAR" = 2:
-     *
-     *
-     * "FOO" -> "BAR" -> [] (2)
-     *           (1)
-     *
-     * After the removal of "FOO" the tree can be compressed as:
-     *
-     * "FOOBAR" -> [] (2)
-     *
-     *
-     * Example of case "2". A tree stores the keys "FOOBAR" = 1 and
-     * "FOOTER" = 2:
-     *
-     *          |B| -> "AR" -> [] (1)
-     * "FOO" -> |-|
-     *          |T| -> "ER" -> [] (2)
-     *
-     * After the removal of "FOOTER" the resulting tree is:
-     *
-     * "FOO" -> |B| -> "AR" -> [] (1)
-     *
-     * That can be compressed into:
-     *
-     * "FOOBAR" -> [] (1)
-     */
-    if (trycompress) {
-        debugf("After removing %.*s:\n", (int)len, s);
-        debugnode("Compression may be needed",h);
-        debugf("Seek start node\n");
+typedef struct raxStreamWriter {
+    raxStreamWriteCallback writefn;
+    void *privdata;
+    unsigned char *buf;     /* Block header followed by the payload. */
+    size_t len, max;        /* Bytes used in 'buf', and its size. */
+    uint32_t numkeys;       /* Keys in the current block. */
+    uint32_t crctable[256];
+} raxStreamWriter;
+
+/* Write the current block, that is left empty. Returns 0 on write errors. */
+static int raxStreamFlush(raxStreamWriter *w) {
+    unsigned char *hdr = w->buf;
+    size_t paylen = w->len-RAX_STREAM_HDR_LEN;
+    raxStreamPut32(hdr,paylen);
+    raxStreamPut32(hdr+4,w->numkeys);
+    raxStreamPut32(hdr+8,raxCrc32c(w->crctable,hdr+RAX_STREAM_HDR_LEN,paylen));
+    raxStreamPut32(hdr+12,raxCrc32c(w->crctable,hdr,8));
+    if (!w->writefn(w->privdata,w->buf,w->len)) return 0;
+    w->len = RAX_STREAM_HDR_LEN;
+    w->numkeys = 0;
+    return 1;
+}
 
-        /* Try to reach the upper node that is compressible.
-         * At the end of the loop 'h' will point to the first node we
-         * can try to compress and 'parent' to its parent. */
-        raxNode *parent;
-        while(1) {
-            parent = raxStackPop(&ts);
-            if (!parent || parent->iskey ||
-                (!parent->iscompr && parent->size != 1)) break;
-            h = parent;
-            debugnode("Going up to",h);
+/* Write all the keys of the tree 'rax' as a stream, calling
+ * writefn(privdata,buf,len) for every piece of the stream, that returns 1
+ * on success, or 0 to interrupt the dump. Inline values are stored as they
+ * are. Pointer values, if 'valfn' is not NULL, are passed to it, exactly
+ * like raxSerialize() does, and the bytes returned are stored in their
+ * place, otherwise the pointer itself is stored, which is only useful if it
+ * is not an actual pointer, for instance for small integers.
+ *
+ * Returns 1 on success. On out of memory 0 is returned and errno is set to
+ * ENOMEM, while if writefn() fails, 0 is returned and errno is set to EIO.
+ * Keys and values longer than RAX_STREAM_MAX_LEN can't be dumped, and make
+ * the function return 0 with errno set to EINVAL. The tree is not
+ * modified. */
+int raxDumpStream(rax *rax, raxStreamWriteCallback writefn, raxSerializeCallback valfn, void *privdata) {
+    raxStreamWriter w;
+    raxIterator it;
+    unsigned char *prev = NULL;
+    size_t prevlen = 0, prevmax = 0;
+    uint64_t numkeys = 0;
+    int errcode = ENOMEM;
+
+    w.writefn = writefn;
+    w.privdata = privdata;
+    w.len = RAX_STREAM_HDR_LEN;
+    w.max = RAX_STREAM_BLOCK_SIZE+RAX_STREAM_HDR_LEN;
+    w.numkeys = 0;
+    w.buf = rax_malloc(w.max);
+    if (w.buf == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    raxCrc32cInit(w.crctable);
+    raxStart(&it,rax);
+
+    unsigned char magic[RAX_STREAM_MAGIC_LEN+1];
+    memcpy(magic,RAX_STREAM_MAGIC,RAX_STREAM_MAGIC_LEN);
+    magic[RAX_STREAM_MAGIC_LEN] = RAX_STREAM_VERSION;
+    if (!writefn(privdata,magic,sizeof(magic))) goto ioerr;
+
+    if (!raxSeek(&it,"^",NULL,0)) goto err;
+    while(raxNext(&it)) {
+        /* Select the bytes of the value, if any. */
+        const void *vbuf = NULL;
+        size_t vlen = 0;
+        int bytes = raxIteratorIsInline(&it);
+        if (bytes) {
+            vbuf = it.data;
+            vlen = it.data_len;
+        } else if (it.data && valfn) {
+            bytes = valfn(privdata,it.data,&vbuf,&vlen);
         }
-        raxNode *start = h; /* Compression starting node. */
 
-        /* Scan chain of nodes we can compress. */
-        size_t comprsize = h->size;
-        int nodes = 1;
-        while(h->size != 0) {
-            raxNode **cp = raxNodeLastChildPtr(h);
-            memcpy(&h,cp,sizeof(h));
-            if (h->iskey || (!h->iscompr && h->size != 1)) break;
-            /* Stop here if going to the next node would result into
-             * a compressed node larger than h->size can hold. */
-            if (comprsize + h->size > RAX_NODE_MAX_SIZE) break;
-            nodes++;
-            comprsize += h->size;
-        }
-        if (nodes > 1) {
-            /* If we can compress, create the new node and populate it. */
-            size_t nodesize =
-                sizeof(raxNode)+comprsize+raxPadding(comprsize)+sizeof(raxNode*);
-            raxNode *new = rax_malloc(nodesize);
-            /* An out of memory here just means we cannot optimize this
-             * node, but the tree is left in a consistent state. */
-            if (new == NULL) {
-                raxStackFree(&ts);
-                return 1;
-            }
-            new->iskey = 0;
-            new->isnull = 0;
-            new->iscompr = 1;
-            new->size = comprsize;
-            rax->numnodes++;
+        if (it.key_len > RAX_STREAM_MAX_LEN || vlen > RAX_STREAM_MAX_LEN) {
+            errcode = EINVAL;
+            goto err;
+        }
 
-            /* Scan again, this time to populate the new node content and
-             * to fix the new node child pointer. At the same time we free
-             * all the nodes that we'll no longer use. */
-            comprsize = 0;
-            h = start;
-            while(h->size != 0) {
-                memcpy(new->data+comprsize,h->data,h->size);
-                comprsize += h->size;
-                raxNode **cp = raxNodeLastChildPtr(h);
-                raxNode *tofree = h;
-                memcpy(&h,cp,sizeof(h));
-                rax_free(tofree); rax->numnodes--;
-                if (h->iskey || (!h->iscompr && h->size != 1)) break;
-            }
-            debugnode("New node",new);
+        size_t common = 0;
+        if (w.numkeys) {
+            size_t max = it.key_len < prevlen ? it.key_len : prevlen;
+            common = raxMatchLen(prev,it.key,max);
+        }
+        size_t needed = w.len+RAX_STREAM_MAX_RECORD+(it.key_len-common)+vlen;
+        if (!raxBulkReserve((void**)&w.buf,&w.max,needed,1)) goto err;
+
+        unsigned char *p = w.buf+w.len;
+        p += raxStreamPutVarint(p,common);
+        p += raxStreamPutVarint(p,it.key_len-common);
+        memcpy(p,it.key+common,it.key_len-common);
+        p += it.key_len-common;
+        if (bytes) {
+            p += raxStreamPutVarint(p,(uint64_t)vlen+2);
+            if (vlen) memcpy(p,vbuf,vlen);
+            p += vlen;
+        } else if (it.data == NULL) {
+            *p++ = 0;
+        } else {
+            *p++ = 1;
+            p += raxStreamPutVarint(p,(uintptr_t)it.data);
+        }
+        w.len = p-w.buf;
+        w.numkeys++;
+        numkeys++;
+
+        if (!raxBulkReserve((void**)&prev,&prevmax,it.key_len,1)) goto err;
+        if (it.key_len) memcpy(prev,it.key,it.key_len);
+        prevlen = it.key_len;
+        if (w.len-RAX_STREAM_HDR_LEN >= RAX_STREAM_BLOCK_SIZE &&
+            !raxStreamFlush(&w)) goto ioerr;
+    }
+    if (errno == ENOMEM) goto err;
+
+    /* Last block, with the keys of the stream. */
+    if (w.numkeys && !raxStreamFlush(&w)) goto ioerr;
+    raxStreamPut64(w.buf+w.len,numkeys);
+    w.len += 8;
+    if (!raxStreamFlush(&w)) goto ioerr;
+    raxStop(&it);
+    rax_free(w.buf);
+    rax_free(prev);
+    errno = 0;
+    return 1;
 
-            /* Now 'h' points to the first node that we still need to use,
-             * so our new node child pointer will point to it. */
-            raxNode **cp = raxNodeLastChildPtr(new);
-            memcpy(cp,&h,sizeof(h));
+ioerr:
+    errcode = EIO;
+err:
+    raxStop(&it);
+    rax_free(w.buf);
+    rax_free(prev);
+    errno = errcode;
+    return 0;
+}
 
-            /* Fix parent link. */
-            if (parent) {
-                raxNode **parentlink = raxFindParentLink(parent,start);
-                memcpy(parentlink,&new,sizeof(new));
-            } else {
-                rax->head = new;
-            }
+typedef struct raxStreamReader {
+    raxStreamReadCallback readfn;
+    raxStreamLoadCallback valfn;
+    void *privdata;
+    unsigned char *buf;     /* Payload of the current block. */
+    size_t max;             /* Size of 'buf'. */
+    const unsigned char *p, *end; /* Next record, and end of the payload. */
+    uint32_t left;          /* Keys still to read in the block. */
+    int first;              /* The next key is the first of the block. */
+    unsigned char *key;     /* Last key read. */
+    size_t keylen, keymax;
+    uint64_t numkeys;       /* Keys read so far. */
+    int done;               /* The last block was read. */
+    uint32_t crctable[256];
+} raxStreamReader;
+
+/* Read 'len' bytes of the stream into 'buf'. Returns 0 if the stream
+ * ends before. */
+static int raxStreamRead(raxStreamReader *r, void *buf, size_t len) {
+    return r->readfn(r->privdata,buf,len) == len;
+}
 
-            debugf("Compressed %d nodes, %d total bytes\n",
-                nodes, (int)comprsize);
+/* Read the next block of the stream. Returns 0 setting errno on errors. */
+static int raxStreamReadBlock(raxStreamReader *r) {
+    unsigned char hdr[RAX_STREAM_HDR_LEN];
+    if (!raxStreamRead(r,hdr,sizeof(hdr))) {
+        errno = EIO;
+        return 0;
+    }
+    uint32_t paylen = raxStreamGet32(hdr);
+    uint32_t numkeys = raxStreamGet32(hdr+4);
+    if (raxCrc32c(r->crctable,hdr,8) != raxStreamGet32(hdr+12) ||
+        paylen > RAX_STREAM_MAX_PAYLOAD ||
+        (numkeys == 0 && paylen != 8))
+    {
+        errno = EINVAL;
+        return 0;
+    }
+    if (!raxBulkReserve((void**)&r->buf,&r->max,paylen,1)) {
+        errno = ENOMEM;
+        return 0;
+    }
+    if (!raxStreamRead(r,r->buf,paylen)) {
+        errno = EIO;
+        return 0;
+    }
+    if (raxCrc32c(r->crctable,r->buf,paylen) != raxStreamGet32(hdr+8)) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (numkeys == 0) {
+        /* Last block: check that no key was lost. */
+        if (raxStreamGet64(r->buf) != r->numkeys) {
+            errno = EINVAL;
+            return 0;
         }
+        r->done = 1;
     }
-    raxStackFree(&ts);
+    r->end = r->buf+paylen;
+    r->p = r->done ? r->end : r->buf;
+    r->left = numkeys;
+    r->first = 1;
     return 1;
 }
 
-/* This is the core of raxFree(): performs a depth-first scan of the
- * tree and releases all the nodes found. */
-void raxRecursiveFree(rax *rax, raxNode *n, void (*free_callback)(void*)) {
-    debugnode("free traversing",n);
-    int numchildren = n->iscompr ? 1 : n->size;
-    raxNode **cp = raxNodeLastChildPtr(n);
-    while(numchildren--) {
-        raxNode *child;
-        memcpy(&child,cp,sizeof(child));
-        raxRecursiveFree(rax,child,free_callback);
-        cp--;
+/* The raxBulkLoad() callback of raxLoadStream(), returning the keys of the
+ * stream, or -1 setting errno on errors. Since the keys are checked to be
+ * in order, the loader can only fail because of the memory. */
+static int raxStreamNextKey(void *privdata, unsigned char **key, size_t *len, void **data) {
+    raxStreamReader *r = privdata;
+    while(r->left == 0) {
+        /* All the payload of the block must be used by its keys. */
+        if (r->p != r->end) goto corrupted;
+        if (r->done) return 0;
+        if (!raxStreamReadBlock(r)) return -1;
     }
-    debugnode("free depth-first",n);
-    if (free_callback && n->iskey && !n->isnull)
-        free_callback(raxGetData(n));
-    rax_free(n);
-    rax->numnodes--;
-}
 
-/* Free a whole radix tree, calling the specified callback in order to
- * free the auxiliary data. */
-void raxFreeWithCallback(rax *rax, void (*free_callback)(void*)) {
-    raxRecursiveFree(rax,rax->head,free_callback);
-    assert(rax->numnodes == 0);
-    rax_free(rax);
+    uint64_t common, suffixlen, vfield;
+    if (!raxStreamGetVarint(&r->p,r->end,&common) ||
+        !raxStreamGetVarint(&r->p,r->end,&suffixlen) ||
+        common > r->keylen || (r->first && common != 0) ||
+        suffixlen > (uint64_t)(r->end-r->p)) goto corrupted;
+
+    /* The key must be greater than the previous one. The common prefix
+     * is not the longest one for the first key of a block. */
+    const unsigned char *suffix = r->p;
+    if (r->numkeys) {
+        size_t oldlen = r->keylen-common;
+        size_t minlen = suffixlen < oldlen ? suffixlen : oldlen;
+        int cmp = minlen ? memcmp(suffix,r->key+common,minlen) : 0;
+        if (cmp < 0 || (cmp == 0 && suffixlen <= oldlen)) goto corrupted;
+    }
+    r->p += suffixlen;
+    if (!raxBulkReserve((void**)&r->key,&r->keymax,common+suffixlen,1)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (suffixlen) memcpy(r->key+common,suffix,suffixlen);
+    r->keylen = common+suffixlen;
+
+    if (!raxStreamGetVarint(&r->p,r->end,&vfield)) goto corrupted;
+    if (vfield == 0) {
+        *data = NULL;
+    } else if (vfield == 1) {
+        uint64_t v;
+        if (!raxStreamGetVarint(&r->p,r->end,&v) || v > UINTPTR_MAX)
+            goto corrupted;
+        *data = (void*)(uintptr_t)v;
+    } else {
+        uint64_t vlen = vfield-2;
+        if (vlen > (uint64_t)(r->end-r->p) || r->valfn == NULL ||
+            !r->valfn(r->privdata,r->p,vlen,data)) goto corrupted;
+        r->p += vlen;
+    }
+
+    r->left--;
+    r->first = 0;
+    r->numkeys++;
+    *key = r->key;
+    *len = r->keylen;
+    return 1;
+
+corrupted:
+    errno = EINVAL;
+    return -1;
 }
 
-/* Free a whole radix tree. */
-void raxFree(rax *rax) {
-    raxFreeWithCallback(rax,NULL);
+/* Load into the empty tree 'rax' a stream written by raxDumpStream(),
+ * calling readfn(privdata,buf,len) to read the next 'len' bytes of the
+ * stream into 'buf', that returns the number of bytes read, like fread().
+ * The keys go directly into the tree as raxBulkLoad() does, without any
+ * insertion, and only a block of the stream is in memory at a time.
+ * Pointer values are restored as they were, while the values stored as
+ * bytes are passed to valfn(privdata,buf,len,&data), that returns 1
+ * setting the value to store, or 0 if the bytes can't be decoded. If
+ * 'valfn' is NULL such values are not accepted. The stream is read up to
+ * its last block, so it can be followed by other data.
+ *
+ * Returns 1 on success. Otherwise 0 is returned, and errno is set to
+ * EINVAL if the tree is not empty, or if the stream is corrupted or can't
+ * be decoded, to EIO if readfn() returns less than the bytes requested, or
+ * to ENOMEM on out of memory. On errors the tree is left empty, and, if
+ * 'free_callback' is not NULL, it is called for the values of the keys
+ * read so far, like raxFreeWithCallback() does. */
+int raxLoadStream(rax *rax, raxStreamReadCallback readfn, raxStreamLoadCallback valfn, void (*free_callback)(void*), void *privdata) {
+    raxStreamReader r;
+    memset(&r,0,sizeof(r));
+    r.readfn = readfn;
+    r.valfn = valfn;
+    r.privdata = privdata;
+    raxCrc32cInit(r.crctable);
+
+    int retval = 0;
+    unsigned char magic[RAX_STREAM_MAGIC_LEN+1];
+    if (rax->numele != 0 || rax->head->size != 0) {
+        errno = EINVAL;
+    } else if (!raxStreamRead(&r,magic,sizeof(magic))) {
+        errno = EIO;
+    } else if (memcmp(magic,RAX_STREAM_MAGIC,RAX_STREAM_MAGIC_LEN) != 0 ||
+               magic[RAX_STREAM_MAGIC_LEN] != RAX_STREAM_VERSION) {
+        errno = EINVAL;
+    } else {
+        retval = raxGenericBulkLoad(rax,raxStreamNextKey,&r,free_callback);
+    }
+    rax_free(r.buf);
+    rax_free(r.key);
+    if (retval) errno = 0;
+    return retval;
 }
 
 /* ------------------------------- Iterator --------------------------------- */
@@ -1261,26 +6217,94 @@ void raxStart(raxIterator *it, rax *rt) {
     it->key_len = 0;
     it->key = it->key_static_string;
     it->key_max = RAX_ITER_STATIC_LEN;
+    it->key_onheap = 0;
     it->data = NULL;
+    it->data_len = 0;
     it->node_cb = NULL;
+    it->bucketpos = 0;
+    it->base = 0;
     raxStackInit(&it->stack);
 }
 
+/* Like raxStart(), but the iterator uses the 'keycap' bytes at 'keybuf'
+ * for its key, and the 'stackcap' bytes at 'stackbuf', that must be
+ * aligned like a pointer, for the path of nodes (RAX_ITER_STACK_ITEM_LEN
+ * bytes for every node), instead of the small buffers inside the
+ * structure. This way seeks and iterations don't allocate memory as long
+ * as the keys and the depth of the tree fit the buffers, that can be
+ * thread local scratch memory: larger keys or paths still use buffers
+ * allocated as usual. The buffers are owned by the caller, that must not
+ * use them until raxStop(), which does not free them. Buffers that are
+ * NULL, or smaller than the ones inside the structure, are not used. */
+void raxStartWithBuffers(raxIterator *it, rax *rt, unsigned char *keybuf, size_t keycap, void *stackbuf, size_t stackcap) {
+    raxStart(it,rt);
+    if (keybuf && keycap > RAX_ITER_STATIC_LEN) {
+        it->key = keybuf;
+        it->key_max = keycap;
+    }
+    size_t items = stackbuf ? stackcap/RAX_ITER_STACK_ITEM_LEN : 0;
+    if (items > RAX_STACK_STATIC_ITEMS) {
+        it->stack.stack = stackbuf;
+        it->stack.childidx = (int*)(it->stack.stack+items);
+        it->stack.maxitems = items;
+    }
+}
+
+/* Reset the iterator to the state raxStart() leaves it in, in order to
+ * reuse it for the tree 'rt', or for the same tree if 'rt' is NULL (that
+ * is the way to reuse the iterators of frozen images), without releasing
+ * its buffers: the ones of raxStartWithBuffers(), or the ones allocated
+ * when the keys or the paths did not fit, that are kept for the next
+ * seeks. So an iterator that is reset instead of being stopped and
+ * started again stops allocating once its buffers fit the keys. The node
+ * callback is cleared, and the iterator must be seeked again. */
+void raxIteratorReset(raxIterator *it, rax *rt) {
+    if (rt) {
+        it->rt = rt;
+        it->base = 0;
+    }
+    it->flags = RAX_ITER_EOF;
+    it->key_len = 0;
+    it->data = NULL;
+    it->data_len = 0;
+    it->node_cb = NULL;
+    it->bucketpos = 0;
+    it->stack.items = 0;
+    it->stack.oom = 0;
+}
+
+/* Set the iterator data to the value of the current node. For inline
+ * values 'data' points to the value inside the node, and 'data_len' is
+ * set to the value length. */
+static inline void raxIteratorLoadData(raxIterator *it) {
+    if (raxIsBucket(it->node)) {
+        raxBucketItem e;
+        raxBucketGet(it->node,it->bucketpos,&e);
+        it->data = raxBucketData(&e);
+        it->data_len = (e.flags & RAX_BUCKET_INLINE) ? e.vlen : 0;
+    } else if (it->node->isinline && !it->node->isnull) {
+        it->data = raxGetInlineData(it->node,&it->data_len);
+    } else {
+        it->data = raxGetData(it->node);
+        it->data_len = 0;
+    }
+}
+
 /* Append characters at the current key string of the iterator 'it'. This
  * is a low level function used to implement the iterator, not callable by
  * the user. Returns 0 on out of memory, otherwise 1 is returned. */
 int raxIteratorAddChars(raxIterator *it, unsigned char *s, size_t len) {
     if (it->key_max < it->key_len+len) {
-        unsigned char *old = (it->key == it->key_static_string) ? NULL :
-                                                                  it->key;
+        unsigned char *old = it->key;
         size_t new_max = (it->key_len+len)*2;
-        it->key = rax_realloc(old,new_max);
+        it->key = rax_realloc(it->key_onheap ? old : NULL,new_max);
         if (it->key == NULL) {
-            it->key = (!old) ? it->key_static_string : old;
+            it->key = old;
             errno = ENOMEM;
             return 0;
         }
-        if (old == NULL) memcpy(it->key,it->key_static_string,it->key_len);
+        if (!it->key_onheap) memcpy(it->key,old,it->key_len);
+        it->key_onheap = 1;
         it->key_max = new_max;
     }
     /* Use memmove since there could be an overlap between 's' and
@@ -1296,6 +6320,26 @@ void raxIteratorDelChars(raxIterator *it, size_t count) {
     it->key_len -= count;
 }
 
+/* Move the iterator, that is at the bucket it->node, to the entry 'pos' of
+ * the bucket, appending its suffix to the key of the bucket. Returns 0 on
+ * out of memory, otherwise 1. */
+static int raxIteratorBucketSeek(raxIterator *it, int pos) {
+    raxBucketItem e;
+    raxBucketGet(it->node,pos,&e);
+    if (!raxIteratorAddChars(it,e.suffix,e.len)) return 0;
+    it->bucketpos = pos;
+    raxIteratorLoadData(it);
+    return 1;
+}
+
+/* Remove the suffix of the current entry of the bucket it->node from the
+ * key, that becomes the key of the bucket. */
+static void raxIteratorBucketLeave(raxIterator *it) {
+    raxBucketItem e;
+    raxBucketGet(it->node,it->bucketpos,&e);
+    raxIteratorDelChars(it,e.len);
+}
+
 /* Do an iteration step towards the next element. At the end of the step the
  * iterator key will represent the (new) current key. If it is not possible
  * to step in the specified direction since there are no longer elements, the
@@ -1324,6 +6368,14 @@ int raxIteratorNextStep(raxIterator *it, int noup) {
     size_t orig_stack_items = it->stack.items;
     raxNode *orig_node = it->node;
 
+    /* In a bucket, visit the next entry. After the last one, continue
+     * from the bucket as from any other leaf. */
+    if (!noup && raxIsBucket(it->node)) {
+        raxIteratorBucketLeave(it);
+        if (it->bucketpos+1 < (int)raxBucketCount(it->node))
+            return raxIteratorBucketSeek(it,it->bucketpos+1);
+    }
+
     while(1) {
         int children = it->node->iscompr ? 1 : it->node->size;
         if (!noup && children) {
@@ -1331,11 +6383,11 @@ int raxIteratorNextStep(raxIterator *it, int noup) {
             /* Seek the lexicographically smaller key in this subtree, which
              * is the first one found always going torwards the first child
              * of every successive node. */
-            if (!raxStackPush(&it->stack,it->node)) return 0;
+            if (!raxStackPush(&it->stack,it->node,0)) return 0;
             raxNode **cp = raxNodeFirstChildPtr(it->node);
             if (!raxIteratorAddChars(it,it->node->data,
                 it->node->iscompr ? it->node->size : 1)) return 0;
-            memcpy(&it->node,cp,sizeof(it->node));
+            it->node = raxChildAt(it->node,0,it->base);
             /* Call the node callback if any, and replace the node pointer
              * if the callback returns true. */
             if (it->node_cb && it->node_cb(&it->node))
@@ -1344,9 +6396,10 @@ int raxIteratorNextStep(raxIterator *it, int noup) {
              * way, since the key is lexicograhically smaller compared to
              * what follows in the sub-children. */
             if (it->node->iskey) {
-                it->data = raxGetData(it->node);
+                raxIteratorLoadData(it);
                 return 1;
             }
+            if (raxIsBucket(it->node)) return raxIteratorBucketSeek(it,0);
         } else {
             /* If we finished exporing the previous sub-tree, switch to the
              * new one: go upper until a node is found where there are
@@ -1355,8 +6408,9 @@ int raxIteratorNextStep(raxIterator *it, int noup) {
             while(1) {
                 int old_noup = noup;
 
-                /* Already on head? Can't go up, iteration finished. */
-                if (!noup && it->node == it->rt->head) {
+                /* Already on head (no parents in the stack)? Can't go up,
+                 * iteration finished. */
+                if (!noup && it->stack.items == 0) {
                     it->flags |= RAX_ITER_EOF;
                     it->stack.items = orig_stack_items;
                     it->key_len = orig_key_len;
@@ -1364,10 +6418,14 @@ int raxIteratorNextStep(raxIterator *it, int noup) {
                     return 1;
                 }
                 /* If there are no children at the current node, try parent's
-                 * next child. */
+                 * next child. The stack tells us the index of the child we
+                 * come from, unless we are starting from the node where a
+                 * seek stopped ('noup'): in that case the current key last
+                 * byte is the character to compare the parent edges with. */
                 unsigned char prevchild = it->key[it->key_len-1];
+                int childidx = -1;
                 if (!noup) {
-                    it->node = raxStackPop(&it->stack);
+                    it->node = raxStackPopChild(&it->stack,&childidx);
                 } else {
                     noup = 0;
                 }
@@ -1379,27 +6437,35 @@ int raxIteratorNextStep(raxIterator *it, int noup) {
                 /* Try visiting the next child if there was at least one
                  * additional child. */
                 if (!it->node->iscompr && it->node->size > (old_noup ? 0 : 1)) {
-                    raxNode **cp = raxNodeFirstChildPtr(it->node);
-                    int i = 0;
-                    while (i < it->node->size) {
-                        debugf("SCAN NEXT %c\n", it->node->data[i]);
-                        if (it->node->data[i] > prevchild) break;
-                        i++;
-                        cp++;
+                    /* The first child greater than the one we come from
+                     * is the next one, or, if we don't know where we come
+                     * from, the one at the index equal to the number of
+                     * edges that are smaller or equal to the key last
+                     * byte. */
+                    int i;
+                    if (childidx != -1) {
+                        i = childidx+1;
+                    } else {
+                        i = raxCountEdgesLess(it->node->data,it->node->size,
+                                              (int)prevchild+1);
                     }
+                    raxNode **cp = raxNodeFirstChildPtr(it->node)+i;
+                    debugf("SCAN NEXT found index %d\n", i);
                     if (i != it->node->size) {
                         debugf("SCAN found a new node\n");
                         raxIteratorAddChars(it,it->node->data+i,1);
-                        if (!raxStackPush(&it->stack,it->node)) return 0;
-                        memcpy(&it->node,cp,sizeof(it->node));
+                        if (!raxStackPush(&it->stack,it->node,i)) return 0;
+                        it->node = raxChildAt(it->node,i,it->base);
                         /* Call the node callback if any, and replace the node
                          * pointer if the callback returns true. */
                         if (it->node_cb && it->node_cb(&it->node))
                             memcpy(cp,&it->node,sizeof(it->node));
                         if (it->node->iskey) {
-                            it->data = raxGetData(it->node);
+                            raxIteratorLoadData(it);
                             return 1;
                         }
+                        if (raxIsBucket(it->node))
+                            return raxIteratorBucketSeek(it,0);
                         break;
                     }
                 }
@@ -1420,10 +6486,12 @@ int raxSeekGreatest(raxIterator *it) {
             if (!raxIteratorAddChars(it,it->node->data+it->node->size-1,1))
                 return 0;
         }
-        raxNode **cp = raxNodeLastChildPtr(it->node);
-        if (!raxStackPush(&it->stack,it->node)) return 0;
-        memcpy(&it->node,cp,sizeof(it->node));
+        int last = it->node->iscompr ? 0 : it->node->size-1;
+        if (!raxStackPush(&it->stack,it->node,last)) return 0;
+        it->node = raxChildAt(it->node,last,it->base);
     }
+    if (raxIsBucket(it->node))
+        return raxIteratorBucketSeek(it,raxBucketCount(it->node)-1);
     return 1;
 }
 
@@ -1444,11 +6512,20 @@ int raxIteratorPrevStep(raxIterator *it, int noup) {
     size_t orig_stack_items = it->stack.items;
     raxNode *orig_node = it->node;
 
+    /* In a bucket, visit the previous entry. Before the first one,
+     * continue from the bucket as from any other leaf. */
+    if (!noup && raxIsBucket(it->node)) {
+        raxIteratorBucketLeave(it);
+        if (it->bucketpos > 0)
+            return raxIteratorBucketSeek(it,it->bucketpos-1);
+    }
+
     while(1) {
         int old_noup = noup;
 
-        /* Already on head? Can't go up, iteration finished. */
-        if (!noup && it->node == it->rt->head) {
+        /* Already on head (no parents in the stack)? Can't go up,
+         * iteration finished. */
+        if (!noup && it->stack.items == 0) {
             it->flags |= RAX_ITER_EOF;
             it->stack.items = orig_stack_items;
             it->key_len = orig_key_len;
@@ -1456,9 +6533,12 @@ int raxIteratorPrevStep(raxIterator *it, int noup) {
             return 1;
         }
 
+        /* As in raxIteratorNextStep(), use the child index stored in the
+         * stack if we know it. */
         unsigned char prevchild = it->key[it->key_len-1];
+        int childidx = -1;
         if (!noup) {
-            it->node = raxStackPop(&it->stack);
+            it->node = raxStackPopChild(&it->stack,&childidx);
         } else {
             noup = 0;
         }
@@ -1471,14 +6551,14 @@ int raxIteratorPrevStep(raxIterator *it, int noup) {
         /* Try visiting the prev child if there is at least one
          * child. */
         if (!it->node->iscompr && it->node->size > (old_noup ? 0 : 1)) {
-            raxNode **cp = raxNodeLastChildPtr(it->node);
-            int i = it->node->size-1;
-            while (i >= 0) {
-                debugf("SCAN PREV %c\n", it->node->data[i]);
-                if (it->node->data[i] < prevchild) break;
-                i--;
-                cp--;
+            int i;
+            if (childidx != -1) {
+                i = childidx-1;
+            } else {
+                i = raxCountEdgesLess(it->node->data,it->node->size,
+                                      prevchild)-1;
             }
+            debugf("SCAN PREV found index %d\n", i);
             /* If we found a new subtree to explore in this node,
              * go deeper following all the last children in order to
              * find the key lexicographically greater. */
@@ -1486,8 +6566,8 @@ int raxIteratorPrevStep(raxIterator *it, int noup) {
                 debugf("SCAN found a new node\n");
                 /* Enter the node we just found. */
                 if (!raxIteratorAddChars(it,it->node->data+i,1)) return 0;
-                if (!raxStackPush(&it->stack,it->node)) return 0;
-                memcpy(&it->node,cp,sizeof(it->node));
+                if (!raxStackPush(&it->stack,it->node,i)) return 0;
+                it->node = raxChildAt(it->node,i,it->base);
                 /* Seek sub-tree max. */
                 if (!raxSeekGreatest(it)) return 0;
             }
@@ -1495,14 +6575,45 @@ int raxIteratorPrevStep(raxIterator *it, int noup) {
 
         /* Return the key: this could be the key we found scanning a new
          * subtree, or if we did not find a new subtree to explore here,
-         * before giving up with this node, check if it's a key itself. */
-        if (it->node->iskey) {
-            it->data = raxGetData(it->node);
+         * before giving up with this node, check if it's a key itself.
+         * The greatest key of a bucket was already loaded. */
+        if (it->node->iskey || raxIsBucket(it->node)) {
+            raxIteratorLoadData(it);
             return 1;
         }
     }
 }
 
+/* Seek the iterator like raxSeek(), when the lookup of the key 'ele' of
+ * 'len' bytes stopped at a bucket after 'i' bytes: the rest of the key is
+ * looked up among the entries, and if there is no entry satisfying the
+ * operator, the iteration continues from the bucket first or last entry. */
+static int raxSeekBucket(raxIterator *it, unsigned char *ele, size_t len, size_t i, int eq, int lt, int gt) {
+    int count = raxBucketCount(it->node), pos;
+    int found = raxBucketFind(it->node,ele+i,len-i,&pos,NULL);
+
+    /* The walk just followed the key, that leads to the bucket. */
+    if (!raxIteratorAddChars(it,ele,i)) return 0;
+    if (eq && found) return raxIteratorBucketSeek(it,pos);
+    if (gt) {
+        if (found) pos++;
+        if (pos < count) return raxIteratorBucketSeek(it,pos);
+        if (!raxIteratorBucketSeek(it,count-1)) return 0;
+        it->flags &= ~RAX_ITER_JUST_SEEKED;
+        if (!raxIteratorNextStep(it,0)) return 0;
+        it->flags |= RAX_ITER_JUST_SEEKED; /* Ignore next call. */
+    } else if (lt) {
+        if (pos > 0) return raxIteratorBucketSeek(it,pos-1);
+        if (!raxIteratorBucketSeek(it,0)) return 0;
+        it->flags &= ~RAX_ITER_JUST_SEEKED;
+        if (!raxIteratorPrevStep(it,0)) return 0;
+        it->flags |= RAX_ITER_JUST_SEEKED; /* Ignore next call. */
+    } else {
+        it->flags |= RAX_ITER_EOF;
+    }
+    return 1;
+}
+
 /* Seek an iterator at the specified element.
  * Return 0 if the seek failed for syntax error or out of memory. Otherwise
  * 1 is returned. When 0 is returned for out of memory, errno is set to
@@ -1536,7 +6647,7 @@ int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len) {
 
     /* If there are no elements, set the EOF condition immediately and
      * return. */
-    if (it->rt->numele == 0) {
+    if (raxAtomicLoad(&it->rt->numele) == 0) {
         it->flags |= RAX_ITER_EOF;
         return 1;
     }
@@ -1550,10 +6661,10 @@ int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len) {
     if (last) {
         /* Find the greatest key taking always the last child till a
          * final node is found. */
-        it->node = it->rt->head;
+        it->node = raxAtomicLoad(&it->rt->head);
         if (!raxSeekGreatest(it)) return 0;
-        assert(it->node->iskey);
-        it->data = raxGetData(it->node);
+        assert(it->node->iskey || raxIsBucket(it->node));
+        raxIteratorLoadData(it);
         return 1;
     }
 
@@ -1561,45 +6672,38 @@ int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len) {
      * perform a lookup, and later invoke the prev/next key code that
      * we already use for iteration. */
     int splitpos = 0;
-    size_t i = raxLowWalk(it->rt,ele,len,&it->node,NULL,&splitpos,&it->stack);
+    size_t i = raxLowWalkBase(it->rt,it->base,ele,len,&it->node,NULL,
+                              &splitpos,&it->stack);
 
     /* Return OOM on incomplete stack info. */
     if (it->stack.oom) return 0;
 
+    if (raxIsBucket(it->node)) return raxSeekBucket(it,ele,len,i,eq,lt,gt);
+
     if (eq && i == len && (!it->node->iscompr || splitpos == 0) &&
         it->node->iskey)
     {
         /* We found our node, since the key matches and we have an
          * "equal" condition. */
         if (!raxIteratorAddChars(it,ele,len)) return 0; /* OOM. */
-        it->data = raxGetData(it->node);
+        raxIteratorLoadData(it);
     } else if (lt || gt) {
         /* Exact key not found or eq flag not set. We have to set as current
          * key the one represented by the node we stopped at, and perform
          * a next/prev operation to seek. To reconstruct the key at this node
-         * we start from the parent and go to the current node, accumulating
-         * the characters found along the way. */
-        if (!raxStackPush(&it->stack,it->node)) return 0;
-        for (size_t j = 1; j < it->stack.items; j++) {
-            raxNode *parent = it->stack.stack[j-1];
-            raxNode *child = it->stack.stack[j];
+         * we start from the root and go to the current node, accumulating
+         * the characters of the children we followed, as remembered by the
+         * stack. */
+        for (size_t j = 0; j < it->stack.items; j++) {
+            raxNode *parent = it->stack.stack[j];
             if (parent->iscompr) {
                 if (!raxIteratorAddChars(it,parent->data,parent->size))
                     return 0;
             } else {
-                raxNode **cp = raxNodeFirstChildPtr(parent);
-                unsigned char *p = parent->data;
-                while(1) {
-                    raxNode *aux;
-                    memcpy(&aux,cp,sizeof(aux));
-                    if (aux == child) break;
-                    cp++;
-                    p++;
-                }
+                unsigned char *p = parent->data+it->stack.childidx[j];
                 if (!raxIteratorAddChars(it,p,1)) return 0;
             }
         }
-        raxStackPop(&it->stack);
 
         /* We need to set the iterator in the correct state to call next/prev
          * step in order to seek the desired element. */
@@ -1645,7 +6749,7 @@ int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len) {
                  * the previous sub-tree. */
                 if (nodechar < keychar) {
                     if (!raxSeekGreatest(it)) return 0;
-                    it->data = raxGetData(it->node);
+                    raxIteratorLoadData(it);
                 } else {
                     if (!raxIteratorAddChars(it,it->node->data,it->node->size))
                         return 0;
@@ -1675,49 +6779,319 @@ int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len) {
                  * node, but will be our match, representing the key "f".
                  *
                  * So in that case, we don't seek backward. */
-                it->data = raxGetData(it->node);
+                raxIteratorLoadData(it);
             } else {
                 if (gt && !raxIteratorNextStep(it,0)) return 0;
                 if (lt && !raxIteratorPrevStep(it,0)) return 0;
             }
             it->flags |= RAX_ITER_JUST_SEEKED; /* Ignore next call. */
         }
-    } else {
-        /* If we are here just eq was set but no match was found. */
+    } else {
+        /* If we are here just eq was set but no match was found. */
+        it->flags |= RAX_ITER_EOF;
+        return 1;
+    }
+    return 1;
+}
+
+/* Go to the next element in the scope of the iterator 'it'.
+ * If EOF (or out of memory) is reached, 0 is returned, otherwise 1 is
+ * returned. In case 0 is returned because of OOM, errno is set to ENOMEM. */
+int raxNext(raxIterator *it) {
+    if (!raxIteratorNextStep(it,0)) {
+        errno = ENOMEM;
+        return 0;
+    }
+    if (it->flags & RAX_ITER_EOF) {
+        errno = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* Go to the previous element in the scope of the iterator 'it'.
+ * If EOF (or out of memory) is reached, 0 is returned, otherwise 1 is
+ * returned. In case 0 is returned because of OOM, errno is set to ENOMEM. */
+int raxPrev(raxIterator *it) {
+    if (!raxIteratorPrevStep(it,0)) {
+        errno = ENOMEM;
+        return 0;
+    }
+    if (it->flags & RAX_ITER_EOF) {
+        errno = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* Remove from the tree the element the iterator 'it' is at, that is the
+ * last one returned by raxNext() or raxPrev(), or the one found by
+ * raxSeek(). The old value is returned by reference in '*old' if not NULL,
+ * like raxRemove() does.
+ *
+ * Instead of looking up the key again, the removal uses the path of nodes
+ * the iterator already has, and the iterator is then left positioned at
+ * the element following the removed one, as raxSeek(it,">",key,len) would
+ * do: the next raxNext() returns it. So removing many keys while scanning
+ * a range costs a single pass over the range:
+ *
+ *  raxSeek(&it,">=",start,startlen);
+ *  while(raxNext(&it)) {
+ *      if (compare(it.key,it.key_len,end,endlen) > 0) break;
+ *      if (expired(it.data)) raxIteratorRemove(&it,NULL);
+ *  }
+ *
+ * For concurrent and forked trees, whose removals copy the nodes of the
+ * path, and for keys stored in buckets, that may be rewritten by the
+ * removal, the key is removed with raxRemove() and the iterator is seeked
+ * again, that has the same effect with the cost of a lookup.
+ *
+ * Returns 1 if the element was removed, 0 if the iterator is not at an
+ * element (errno set to 0), or if a forked tree could not be modified for
+ * out of memory (errno set to ENOMEM). Frozen images can't be modified:
+ * in that case 0 is returned and errno is set to EINVAL. If the element
+ * was removed but the iterator can't be positioned on the following one
+ * for out of memory, 1 is returned but the iterator is at EOF and errno
+ * is set to ENOMEM. */
+int raxIteratorRemove(raxIterator *it, void **old) {
+    rax *rax = it->rt;
+    raxStack *ts = &it->stack;
+    raxNode *h = it->node;
+
+    if (it->base) {
+        errno = EINVAL;
+        return 0;
+    }
+    if ((it->flags & RAX_ITER_EOF) || h == NULL ||
+        (!h->iskey && !raxIsBucket(h)))
+    {
+        errno = 0;
+        return 0;
+    }
+    if ((rax->flags & RAX_FLAG_CONCURRENT) || rax->shared || ts->oom ||
+        raxIsBucket(h))
+    {
+        if (!raxRemove(rax,it->key,it->key_len,old)) return 0;
+        if (!raxSeek(it,">",it->key,it->key_len)) {
+            it->flags |= RAX_ITER_EOF;
+            errno = ENOMEM;
+        }
+        return 1;
+    }
+
+    debugf("### Iterator delete: %.*s\n", (int)it->key_len, it->key);
+    if (old) *old = h->isinline ? NULL : raxGetData(h);
+    if (rax->flags & RAX_FLAG_RANK) {
+        for (size_t j = 0; j < ts->items; j++) {
+            raxNode *parent = ts->stack[j];
+            int idx = ts->childidx[j];
+            raxSetCount(parent,idx,raxGetCount(parent,idx)-1);
+        }
+    }
+    rax->bytes -= raxNodeValueLen(h);
+    h->iskey = 0;
+    rax->numele--;
+
+    /* The removal is the same of raxRemove(), but we track the length of
+     * the key of the node 'h' in 'len', and how to find the next key from
+     * 'h': descending its subtree, or, if 'noup' is true, scanning its
+     * children following the one at the byte of the key after 'len'
+     * (that is the state raxSeek() passes to raxIteratorNextStep() on a
+     * mismatch). */
+    size_t len = it->key_len;
+    int noup = 0, trycompress = 0;
+    if (h->size == 0) {
+        raxNode *child = NULL;
+        while(h != rax->head) {
+            child = h;
+            raxDealloc(rax,child);
+            rax->numnodes--;
+            h = raxStackPop(ts);
+            len -= h->iscompr ? h->size : 1;
+            if (h->iskey || (!h->iscompr && h->size != 1)) break;
+        }
+        if (child == NULL) {
+            /* The head was the only node: the tree is now empty. */
+            it->flags |= RAX_ITER_EOF;
+            it->flags &= ~RAX_ITER_JUST_SEEKED;
+            return 1;
+        }
+        raxNode *new = raxRemoveChild(rax,h,child);
+        if (new != h) {
+            raxNode **parentlink = ts->items == 0 ? &rax->head :
+                raxNodeFirstChildPtr((raxNode*)ts->stack[ts->items-1])+
+                ts->childidx[ts->items-1];
+            memcpy(parentlink,&new,sizeof(new));
+        }
+        h = new;
+        noup = 1;
+        len++;
+        if (h->size == 1 && !h->iskey) trycompress = 1;
+    } else if (h->size == 1) {
+        trycompress = 1;
+    }
+
+    if (trycompress && (rax->flags & RAX_FLAG_LAZY_COMPACT)) {
+        raxMarkPath(h,ts);
+        trycompress = 0;
+    }
+    if (trycompress) {
+        /* Like raxCompressPath(), but keeping the stack and the key length
+         * of the node replacing the compressed chain. If the only child
+         * left in 'h' is before the removed one, all the keys of the chain
+         * are before the removed key, and the next key is found scanning
+         * the children of the parent of the chain. */
+        int skip = noup && h->data[0] < it->key[len-1];
+        if (noup) len--;
+        raxNode *start = h, *parent;
+        int idx = 0;
+        while(1) {
+            parent = raxStackPopChild(ts,&idx);
+            if (!parent || parent->iskey ||
+                (!parent->iscompr && parent->size != 1)) break;
+            start = parent;
+            len -= parent->iscompr ? parent->size : 1;
+        }
+        raxNode *new = raxCompressChain(rax,start);
+        if (new != start) {
+            if (parent)
+                memcpy(raxNodeFirstChildPtr(parent)+idx,&new,sizeof(new));
+            else
+                rax->head = new;
+        }
+        if (!skip) {
+            /* Can't fail: the stack already had room for the parent. */
+            if (parent) raxStackPush(ts,parent,idx);
+            h = new;
+            noup = 0;
+        } else if (parent) {
+            h = parent;
+            noup = 1;
+        } else {
+            it->flags |= RAX_ITER_EOF;
+            it->flags &= ~RAX_ITER_JUST_SEEKED;
+            return 1;
+        }
+    }
+
+    it->node = h;
+    it->key_len = len;
+    it->flags &= ~RAX_ITER_JUST_SEEKED;
+    if (!raxIteratorNextStep(it,noup)) {
         it->flags |= RAX_ITER_EOF;
+        errno = ENOMEM;
         return 1;
     }
+    if (!(it->flags & RAX_ITER_EOF)) it->flags |= RAX_ITER_JUST_SEEKED;
     return 1;
 }
 
-/* Go to the next element in the scope of the iterator 'it'.
- * If EOF (or out of memory) is reached, 0 is returned, otherwise 1 is
- * returned. In case 0 is returned because of OOM, errno is set to ENOMEM. */
-int raxNext(raxIterator *it) {
-    if (!raxIteratorNextStep(it,0)) {
-        errno = ENOMEM;
+/* Return the rank of the key 's' of 'len' bytes, that is, the number of keys
+ * in the tree that are lexicographically smaller than the specified key.
+ * The key itself does not need to be in the tree. The tree must be created
+ * with the RAX_FLAG_RANK flag, otherwise 0 is returned and errno is set
+ * to EINVAL. */
+uint64_t raxRank(rax *rax, unsigned char *s, size_t len) {
+    if (!(rax->flags & RAX_FLAG_RANK)) {
+        errno = EINVAL;
         return 0;
     }
-    if (it->flags & RAX_ITER_EOF) {
-        errno = 0;
-        return 0;
+    errno = 0;
+
+    raxNode *h = raxAtomicLoad(&rax->head);
+    uint64_t rank = 0;
+    size_t i = 0;
+    /* When the whole key is consumed at a node boundary, all the keys in
+     * the subtree of the current node are greater or equal to our key, so
+     * we can stop there. */
+    while(i < len) {
+        /* A key in the path is a prefix of our key, so it is smaller. */
+        if (h->iskey) rank++;
+        if (h->iscompr) {
+            size_t left = len-i;
+            size_t cmplen = left < h->size ? left : h->size;
+            size_t m = raxMatchLen(h->data,s+i,cmplen);
+            if (m < cmplen) {
+                /* Mismatch: the whole subtree is either smaller or greater
+                 * than our key. */
+                if (s[i+m] > h->data[m]) rank += raxGetCount(h,0);
+                break;
+            }
+            /* If our key ends in the middle of the compressed node, all
+             * the keys below are greater. */
+            if (left < h->size) break;
+            i += h->size;
+            memcpy(&h,raxNodeFirstChildPtr(h),sizeof(h));
+        } else {
+            int pos = raxCountEdgesLess(h->data,h->size,s[i]);
+            for (int j = 0; j < pos; j++) rank += raxGetCount(h,j);
+            if (pos == (int)h->size || h->data[pos] != s[i]) break;
+            i++;
+            memcpy(&h,raxNodeFirstChildPtr(h)+pos,sizeof(h));
+        }
     }
-    return 1;
+    return rank;
 }
 
-/* Go to the previous element in the scope of the iterator 'it'.
- * If EOF (or out of memory) is reached, 0 is returned, otherwise 1 is
- * returned. In case 0 is returned because of OOM, errno is set to ENOMEM. */
-int raxPrev(raxIterator *it) {
-    if (!raxIteratorPrevStep(it,0)) {
-        errno = ENOMEM;
+/* Seek the iterator to the key having the specified zero based rank, that
+ * is, the key that would be returned by the rank-th call to raxNext() after
+ * seeking the first element with "^". As for raxSeek(), raxNext() must be
+ * called in order to fetch the key, and then the iteration can continue in
+ * both directions. If the rank is out of range the iterator is set to EOF.
+ *
+ * The tree must be created with the RAX_FLAG_RANK flag, otherwise 0 is
+ * returned and errno is set to EINVAL. On out of memory 0 is returned and
+ * errno is set to ENOMEM, otherwise 1 is returned. */
+int raxSelect(raxIterator *it, uint64_t rank) {
+    if (!(it->rt->flags & RAX_FLAG_RANK)) {
+        errno = EINVAL;
         return 0;
     }
-    if (it->flags & RAX_ITER_EOF) {
-        errno = 0;
-        return 0;
+
+    it->stack.items = 0;
+    it->flags |= RAX_ITER_JUST_SEEKED;
+    it->flags &= ~RAX_ITER_EOF;
+    it->key_len = 0;
+    it->node = NULL;
+
+    if (rank >= raxAtomicLoad(&it->rt->numele)) {
+        it->flags |= RAX_ITER_EOF;
+        return 1;
+    }
+
+    /* Descend the tree: the keys are ordered so that a node key comes
+     * before all the keys in its subtree, and the subtrees of the children
+     * follow the order of the edges. Since the rank is in range, we always
+     * find the key before reaching a leaf. */
+    raxNode *h = raxAtomicLoad(&it->rt->head);
+    while(1) {
+        if (h->iskey) {
+            if (rank == 0) break;
+            rank--;
+        }
+        int numchildren = h->iscompr ? 1 : h->size;
+        int j;
+        for (j = 0; j < numchildren; j++) {
+            uint64_t count = raxGetCount(h,j);
+            if (rank < count) break;
+            rank -= count;
+        }
+        assert(j < numchildren);
+        if (h->iscompr) {
+            if (!raxIteratorAddChars(it,h->data,h->size)) goto oom;
+        } else {
+            if (!raxIteratorAddChars(it,h->data+j,1)) goto oom;
+        }
+        if (!raxStackPush(&it->stack,h,j)) goto oom;
+        h = raxChildAt(h,j,it->base);
     }
+    it->node = h;
+    raxIteratorLoadData(it);
     return 1;
+
+oom:
+    errno = ENOMEM;
+    return 0;
 }
 
 /* Perform a random walk starting in the current position of the iterator.
@@ -1731,29 +7105,59 @@ int raxPrev(raxIterator *it) {
  * tree, expect a disappointing distribution. A random walk produces good
  * random elements if the tree is not sparse, however in the case of a radix
  * tree certain keys will be reported much more often than others. At least
- * this function should be able to expore every possible element eventually. */
+ * this function should be able to expore every possible element eventually.
+ *
+ * However in trees created with the RAX_FLAG_RANK flag, when 'steps' is 0,
+ * the element is selected uniformly at random among all the elements of the
+ * tree, using raxSelect() with a random rank: just a single random
+ * number (that is a few rand() calls) is needed, and the cost is that of a
+ * lookup. */
 int raxRandomWalk(raxIterator *it, size_t steps) {
-    if (it->rt->numele == 0) {
+    uint64_t numele = raxAtomicLoad(&it->rt->numele);
+    if (numele == 0) {
         it->flags |= RAX_ITER_EOF;
         return 0;
     }
 
+    if (steps == 0 && (it->rt->flags & RAX_FLAG_RANK)) {
+        /* rand() may return just 15 or 31 random bits: combine a few
+         * calls in order to get a 64 bit random rank. */
+        uint64_t r = 0;
+        for (int j = 0; j < 5; j++) r = (r << 15) ^ (uint64_t)rand();
+        if (!raxSelect(it,r % numele)) return 0;
+        /* The element is already fetched, like in the normal walk. */
+        it->flags &= ~RAX_ITER_JUST_SEEKED;
+        return 1;
+    }
+
     if (steps == 0) {
-        size_t fle = 1+floor(log(it->rt->numele));
+        size_t fle = 1+floor(log(numele));
         fle *= 2;
         steps = 1 + rand() % fle;
     }
 
+    /* In a bucket the walk selects one of the entries, that are keys, or
+     * goes up: the suffix of the entry is added to the key at the end. */
     raxNode *n = it->node;
-    while(steps > 0 || !n->iskey) {
-        int numchildren = n->iscompr ? 1 : n->size;
-        int r = rand() % (numchildren+(n != it->rt->head));
+    int pos = -1; /* Entry of the bucket 'n' selected, if any. */
+    if (raxIsBucket(n)) {
+        raxIteratorBucketLeave(it);
+        pos = it->bucketpos;
+    }
+    while(steps > 0 || (!n->iskey && pos == -1)) {
+        int isbucket = raxIsBucket(n);
+        int numchildren = isbucket ? (int)raxBucketCount(n) :
+                          n->iscompr ? 1 : n->size;
+        int r = rand() % (numchildren+(it->stack.items != 0));
 
         if (r == numchildren) {
             /* Go up to parent. */
             n = raxStackPop(&it->stack);
             int todel = n->iscompr ? n->size : 1;
             raxIteratorDelChars(it,todel);
+            pos = -1;
+        } else if (isbucket) {
+            pos = r;
         } else {
             /* Select a random child. */
             if (n->iscompr) {
@@ -1761,17 +7165,247 @@ int raxRandomWalk(raxIterator *it, size_t steps) {
             } else {
                 if (!raxIteratorAddChars(it,n->data+r,1)) return 0;
             }
-            raxNode **cp = raxNodeFirstChildPtr(n)+r;
-            if (!raxStackPush(&it->stack,n)) return 0;
-            memcpy(&n,cp,sizeof(n));
+            if (!raxStackPush(&it->stack,n,r)) return 0;
+            n = raxChildAt(n,r,it->base);
         }
-        if (n->iskey) steps--;
+        if (n->iskey || pos != -1) steps--;
     }
     it->node = n;
-    it->data = raxGetData(it->node);
+    if (pos != -1) return raxIteratorBucketSeek(it,pos);
+    raxIteratorLoadData(it);
+    return 1;
+}
+
+/* Number of keys sampled for every range by raxSplitRanges() in trees
+ * without subtree counts. Trees with fewer keys than the samples are
+ * scanned instead, to find the exact boundaries. */
+#define RAX_SPLIT_SAMPLES 64
+
+/* Store the current key of the iterator as the boundary 'b'. Returns 0 on
+ * out of memory. */
+static int raxBoundSet(raxBound *b, raxIterator *it) {
+    b->key = rax_malloc(it->key_len ? it->key_len : 1);
+    if (b->key == NULL) return 0;
+    memcpy(b->key,it->key,it->key_len);
+    b->key_len = it->key_len;
+    return 1;
+}
+
+/* The 'i'-th of the 'n' ranks splitting 'numele' keys in equal parts,
+ * computed without overflowing. */
+static uint64_t raxSplitRank(uint64_t numele, size_t n, size_t i) {
+    return i*(numele/n) + i*(numele%n)/n;
+}
+
+/* Return a random number between 0 (included) and 1 (excluded), advancing
+ * the state 's' of a SplitMix64 generator. raxSplitRanges() has its own
+ * generator since rand() is not required to be thread safe, and this way
+ * the sequence of rand() seen by the program is not altered. */
+static double raxSplitRandom(uint64_t *s) {
+    uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (double)(z >> 11) / 9007199254740992.0; /* 2^53 */
+}
+
+/* Descend the tree from the head to a key selected by 'u', a number
+ * between 0 and 1, adding it to the tree of the samples 'samples' with its
+ * weight, the inverse of the probability of reaching it, accumulated into
+ * 'weights'. At every node the choice among stopping at the node, if it is
+ * a key, and going to one of the children, in this order, is taken by the
+ * digits of 'u' in base of the number of choices, so each choice has the
+ * same probability for random values of 'u', and the samples follow the
+ * order of 'u'. This way evenly spread values of 'u' sample the tree evenly
+ * regardless of its shape, and the weighted samples estimate the
+ * distribution of the keys. The random bits needed once the digits of 'u'
+ * are consumed are taken from the generator state 'seed'. Returns 0 on out
+ * of memory. */
+static int raxSplitSample(raxIterator *it, double u, uint64_t *seed, rax *samples, double *weights) {
+    raxNode *h = raxAtomicLoad(&it->rt->head);
+    double w = 1;
+    it->key_len = 0;
+    while(1) {
+        int numchildren = raxIsBucket(h) ? (int)raxBucketCount(h) :
+                          h->iscompr ? 1 : h->size;
+        int options = numchildren + h->iskey;
+        int r = 0;
+        if (options > 1) {
+            /* Take the next digit, and refill the bits consumed with new
+             * random ones once 'u' lost its precision. */
+            u *= options;
+            r = u < options ? (int)u : options-1;
+            u -= r;
+            if (u < 1e-9) u += raxSplitRandom(seed)*1e-9;
+        }
+        w *= options;
+        if (h->iskey && r-- == 0) break;
+        if (raxIsBucket(h)) {
+            /* The entries of a bucket are the choices, all keys. */
+            raxBucketItem e;
+            raxBucketGet(h,r,&e);
+            if (!raxIteratorAddChars(it,e.suffix,e.len)) return 0;
+            break;
+        }
+        if (h->iscompr) {
+            if (!raxIteratorAddChars(it,h->data,h->size)) return 0;
+        } else {
+            if (!raxIteratorAddChars(it,h->data+r,1)) return 0;
+        }
+        h = raxChildAt(h,r,it->base);
+    }
+
+    void *idx = raxFind(samples,it->key,it->key_len);
+    if (idx == raxNotFound) {
+        idx = (void*)(uintptr_t)raxSize(samples);
+        weights[(uintptr_t)idx] = 0;
+        if (!raxInsert(samples,it->key,it->key_len,idx,NULL)) return 0;
+    }
+    weights[(uintptr_t)idx] += w;
     return 1;
 }
 
+/* Find the boundaries of the 'n' ranges scanning all the keys of the tree,
+ * that has 'numele' keys, counting their ranks. The boundaries are stored
+ * in 'bounds', and their number in 'count'. Returns 0 on out of memory. */
+static int raxSplitScan(raxIterator *it, uint64_t numele, size_t n, raxBound *bounds, size_t *count) {
+    uint64_t rank = 0, last = 0;
+    size_t i = 1;
+    if (!raxSeek(it,"^",NULL,0)) return 0;
+    while(i < n && raxNext(it)) {
+        uint64_t target = raxSplitRank(numele,n,i);
+        if (rank == target && rank != last) {
+            if (!raxBoundSet(bounds+*count,it)) return 0;
+            (*count)++;
+            last = rank;
+        }
+        while(i < n && raxSplitRank(numele,n,i) <= rank) i++;
+        rank++;
+    }
+    return errno != ENOMEM;
+}
+
+/* Split the keys of the tree into 'n' ranges holding about the same number
+ * of keys, in order to process them in parallel. The boundaries between
+ * the ranges are stored in 'bounds', that must have room for n-1 of them:
+ * calling 'count' the number returned, the first range is from the first
+ * key of the tree up to bounds[0] excluded, the range 'i' is from
+ * bounds[i-1] included to bounds[i] excluded, and the last one is from
+ * bounds[count-1] to the end of the tree. The boundaries are keys of the
+ * tree, in strictly increasing order. Fewer than n-1 boundaries are
+ * returned if the tree has not enough keys, and no boundary at all if 'n'
+ * is less than 2 or the tree is empty.
+ *
+ * In trees with subtree counts the boundaries are found with raxSelect(),
+ * so the ranges are balanced exactly, with a cost proportional to 'n'
+ * multiplied by the depth of the tree. Otherwise the boundaries are
+ * estimated from RAX_SPLIT_SAMPLES random keys for every range, so the
+ * cost is still proportional to 'n', but the ranges are balanced only
+ * approximately. Small trees are scanned in full, and so are the trees
+ * whose samples don't represent the tree or can't separate all the ranges:
+ * in this case the cost is proportional to the number of keys.
+ *
+ * The keys of the boundaries are allocated, and must be released with
+ * raxFreeBounds(). On out of memory 0 is returned, and errno is set to
+ * ENOMEM, otherwise errno is set to 0.
+ *
+ * The random samples come from a generator local to the call, seeded from
+ * the number of keys and ranges, so the global rand() sequence is not
+ * used, and the function can be called by many threads at the same time,
+ * as long as the tree is not modified. In trees created with
+ * RAX_FLAG_CONCURRENT, that can be modified meanwhile, the call must be
+ * inside a read section, between raxReadBegin() and raxReadEnd(). */
+size_t raxSplitRanges(rax *rax, size_t n, raxBound *bounds) {
+    uint64_t numele = raxAtomicLoad(&rax->numele);
+    size_t count = 0;
+    struct rax *samples = NULL;
+    double *weights = NULL;
+    raxIterator it;
+
+    errno = 0;
+    if (n < 2 || numele == 0) return 0;
+    raxStart(&it,rax);
+    if (rax->flags & RAX_FLAG_RANK) {
+        /* Exact boundaries: the keys at ranks n/numele, 2*n/numele, ... */
+        uint64_t last = 0;
+        for (size_t i = 1; i < n; i++) {
+            uint64_t rank = raxSplitRank(numele,n,i);
+            if (rank == last) continue;
+            if (!raxSelect(&it,rank) || !raxBoundSet(bounds+count,&it))
+                goto oom;
+            count++;
+            last = rank;
+        }
+    } else if (numele <= (uint64_t)n*RAX_SPLIT_SAMPLES) {
+        /* Few keys: scan the tree counting the ranks. */
+        if (!raxSplitScan(&it,numele,n,bounds,&count)) goto oom;
+    } else {
+        /* Estimate the boundaries from the weighted samples: the range
+         * 'i' starts at the first sample preceded by i/n of the total
+         * weight. The samples are sorted by the tree storing them. */
+        size_t numsamples = n*RAX_SPLIT_SAMPLES;
+        uint64_t seed = numele ^ ((uint64_t)n << 32);
+        double total = 0, cum = 0;
+        samples = raxNew();
+        weights = rax_malloc(sizeof(double)*numsamples);
+        if (samples == NULL || weights == NULL) goto oom;
+        for (size_t j = 0; j < numsamples; j++) {
+            double u = (j+raxSplitRandom(&seed))/numsamples;
+            if (!raxSplitSample(&it,u,&seed,samples,weights)) goto oom;
+        }
+        for (uint64_t j = 0; j < raxSize(samples); j++) total += weights[j];
+
+        raxIterator si;
+        raxStart(&si,samples);
+        raxSeek(&si,"^",NULL,0);
+        size_t i = 1;
+        while(i < n && raxNext(&si)) {
+            if (cum >= total*i/n) {
+                if (!raxBoundSet(bounds+count,&si)) {
+                    raxStop(&si);
+                    goto oom;
+                }
+                count++;
+                while(i < n && cum >= total*i/n) i++;
+            }
+            cum += weights[(uintptr_t)si.data];
+        }
+        raxStop(&si);
+        raxFree(samples);
+        rax_free(weights);
+        samples = NULL;
+        weights = NULL;
+
+        /* The weights of the samples estimate the number of keys as well:
+         * when the estimate is far from the real one, like in trees with
+         * long chains of keys, that the samples hardly reach, the samples
+         * don't represent the tree, and may not even separate all the
+         * ranges. Scan the tree instead. */
+        double estimate = total/numsamples;
+        if (count < n-1 || estimate < numele/2.0 || estimate > numele*2.0) {
+            raxFreeBounds(bounds,count);
+            count = 0;
+            if (!raxSplitScan(&it,numele,n,bounds,&count)) goto oom;
+        }
+    }
+    raxStop(&it);
+    errno = 0;
+    return count;
+
+oom:
+    raxStop(&it);
+    if (samples) raxFree(samples);
+    rax_free(weights);
+    raxFreeBounds(bounds,count);
+    errno = ENOMEM;
+    return 0;
+}
+
+/* Release the keys of the 'count' boundaries returned by raxSplitRanges(). */
+void raxFreeBounds(raxBound *bounds, size_t count) {
+    for (size_t j = 0; j < count; j++) rax_free(bounds[j].key);
+}
+
 /* Compare the key currently pointed by the iterator to the specified
  * key according to the specified operator. Returns 1 if the comparison is
  * true, otherwise 0 is returned. */
@@ -1803,9 +7437,10 @@ int raxCompare(raxIterator *iter, const char *op, unsigned char *key, size_t key
     }
 }
 
-/* Free the iterator. */
+/* Free the iterator. The buffers passed to raxStartWithBuffers() are not
+ * freed, since they are owned by the caller. */
 void raxStop(raxIterator *it) {
-    if (it->key != it->key_static_string) rax_free(it->key);
+    if (it->key_onheap) rax_free(it->key);
     raxStackFree(&it->stack);
 }
 
@@ -1819,7 +7454,673 @@ int raxEOF(raxIterator *it) {
 
 /* Return the number of elements inside the radix tree. */
 uint64_t raxSize(rax *rax) {
-    return rax->numele;
+    return raxAtomicLoad(&rax->numele);
+}
+
+/* Return the memory used by the tree, in bytes: the length of all its
+ * nodes, plus the rax structure itself. This is updated every time a node
+ * is allocated, reallocated or freed, so it takes constant time. The
+ * overhead of the allocator is not included, and nodes shared with forked
+ * trees are counted in every tree using them. In concurrent trees only the
+ * writer can call this function. For frozen images, the image length is
+ * returned. */
+uint64_t raxMemoryUsage(rax *rax) {
+    return rax->bytes;
+}
+
+/* Add the node 'n', at depth 'depth', and its subtree to the statistics. */
+static void raxStatsSubtree(raxNode *n, int depth, raxTreeStats *stats) {
+    raxStack ts;
+    raxStackInit(&ts);
+    while(n || (n = raxStackPopChild(&ts,&depth)) != NULL) {
+        int numchildren = raxNodeNumChildren(n);
+        stats->nodes++;
+        stats->bytes += raxNodeCurrentLength(n);
+        stats->fanout[numchildren]++;
+        if (n->iskey) stats->keys++;
+        if (raxIsBucket(n)) {
+            stats->keys += raxBucketCount(n);
+            stats->buckets++;
+            stats->leaves++;
+        } else if (n->iscompr) {
+            int bucket = 0;
+            while((2u<<bucket) <= n->size) bucket++;
+            stats->compressed++;
+            stats->comprlen[bucket]++;
+        } else if (numchildren) {
+            stats->branching++;
+        } else {
+            stats->leaves++;
+        }
+        if (!raxIsBucket(n)) {
+            stats->padding += raxPadding(n->size);
+            if (n->isdense) stats->dense++;
+        }
+        if ((uint64_t)depth > stats->maxdepth) stats->maxdepth = depth;
+        stats->depth[depth < RAX_STATS_DEPTHS ? depth : RAX_STATS_DEPTHS-1]++;
+
+        /* The depth of the nodes is stored in the stack as child index. */
+        raxNode **cp = raxNodeFirstChildPtr(n);
+        for (int j = numchildren-1; j > 0; j--) {
+            raxNode *child;
+            memcpy(&child,cp+j,sizeof(child));
+            /* Out of memory: visit this subtree with a nested scan. */
+            if (!raxStackPush(&ts,child,depth+1))
+                raxStatsSubtree(child,depth+1,stats);
+        }
+        if (numchildren) {
+            memcpy(&n,cp,sizeof(n));
+            depth++;
+        } else {
+            n = NULL;
+        }
+    }
+    raxStackFree(&ts);
+}
+
+/* Walk the whole tree filling 'stats' with the number of nodes of every
+ * kind, the distribution of the number of children, of the length of the
+ * compressed nodes and of the depth of the nodes, and the bytes wasted
+ * in padding. Unlike raxMemoryUsage() this takes time proportional to the
+ * number of nodes. Frozen images are not supported. */
+void raxStats(rax *rax, raxTreeStats *stats) {
+    memset(stats,0,sizeof(*stats));
+    stats->bytes = sizeof(*rax);
+    raxStatsSubtree(rax->head,0,stats);
+}
+
+/* ------------------------------- Integer keys ------------------------------
+ * Trees keyed by integers, like IDs and timestamps, store them as fixed
+ * width big endian keys, so that the order of the keys in the tree is the
+ * numerical order, and the ranges of integers are ranges of keys. The
+ * functions below encode the integer into a buffer on the stack, and call
+ * the generic implementation with a length known at compile time: since
+ * the lookup walk is inlined, it is specialized by the compiler for keys of
+ * that length. The functions for every width are generated by the
+ * RAX_INTEGER_KEYS() macro, so the generic functions are not modified.
+ * -------------------------------------------------------------------------- */
+
+static inline void raxEncodeU64(unsigned char *buf, uint64_t v) {
+    for (int j = 7; j >= 0; j--) {
+        buf[j] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static inline uint64_t raxDecodeU64(const unsigned char *buf) {
+    uint64_t v = 0;
+    for (int j = 0; j < 8; j++) v = (v << 8) | buf[j];
+    return v;
+}
+
+static inline void raxEncodeU128(unsigned char *buf, raxU128 v) {
+    raxEncodeU64(buf,v.hi);
+    raxEncodeU64(buf+8,v.lo);
+}
+
+static inline raxU128 raxDecodeU128(const unsigned char *buf) {
+    raxU128 v;
+    v.hi = raxDecodeU64(buf);
+    v.lo = raxDecodeU64(buf+8);
+    return v;
+}
+
+/* Generate the functions for integer keys of type TYPE, encoded in LEN
+ * bytes by raxEncodeSUFFIX() and decoded by raxDecodeSUFFIX(). */
+#define RAX_INTEGER_KEYS(SUFFIX,TYPE,LEN) \
+int raxInsert##SUFFIX(rax *rax, TYPE key, void *data, void **old) { \
+    unsigned char buf[LEN]; \
+    raxEncode##SUFFIX(buf,key); \
+    raxValue v = {data,NULL,0,0}; \
+    return raxGenericInsert(rax,buf,LEN,&v,old,1); \
+} \
+\
+int raxTryInsert##SUFFIX(rax *rax, TYPE key, void *data, void **old) { \
+    unsigned char buf[LEN]; \
+    raxEncode##SUFFIX(buf,key); \
+    raxValue v = {data,NULL,0,0}; \
+    return raxGenericInsert(rax,buf,LEN,&v,old,0); \
+} \
+\
+int raxRemove##SUFFIX(rax *rax, TYPE key, void **old) { \
+    unsigned char buf[LEN]; \
+    raxEncode##SUFFIX(buf,key); \
+    return raxRemove(rax,buf,LEN,old); \
+} \
+\
+void *raxFind##SUFFIX(rax *rax, TYPE key) { \
+    unsigned char buf[LEN]; \
+    raxEncode##SUFFIX(buf,key); \
+    return raxFindValue(rax,buf,LEN); \
+} \
+\
+int raxSeek##SUFFIX(raxIterator *it, const char *op, TYPE key) { \
+    unsigned char buf[LEN]; \
+    raxEncode##SUFFIX(buf,key); \
+    return raxSeek(it,op,buf,LEN); \
+} \
+\
+int raxIteratorKey##SUFFIX(raxIterator *it, TYPE *key) { \
+    if (it->key_len != LEN) return 0; \
+    *key = raxDecode##SUFFIX(it->key); \
+    return 1; \
+}
+
+/* raxInsertU64(), raxTryInsertU64(), raxRemoveU64(), raxFindU64(),
+ * raxSeekU64(), raxIteratorKeyU64(), and the same for raxU128 keys. They
+ * work like the generic functions, and raxIteratorKeyU64() stores the
+ * current key of the iterator into '*key', returning 1, or returns 0 if
+ * the key is not 8 bytes long. */
+RAX_INTEGER_KEYS(U64,uint64_t,8)
+RAX_INTEGER_KEYS(U128,raxU128,16)
+
+/* ------------------------------- Finger hints ------------------------------
+ * A raxFinger remembers the path of the last key looked up or inserted with
+ * it, that is, the parents of the node where the lookup stopped, each with
+ * the index of the child followed. When the next key shares a prefix with
+ * the last one, as it happens inserting keys in order or looking up keys
+ * near to each other, the walk resumes from the deepest node of the path
+ * still in the shared prefix, saving the descent (and the cache misses) of
+ * the upper part of the tree.
+ *
+ * The nodes of the path are only valid as long as they are not reallocated
+ * or freed: the tree version, incremented by all the node allocations, is
+ * saved in the hint after every operation, and if the tree was modified in
+ * the meantime by other calls the path is just discarded. An insertion
+ * with the hint itself only modifies the node where the lookup stopped and
+ * the nodes below it, so the saved parents stay valid and the hint adopts
+ * the new version.
+ * -------------------------------------------------------------------------- */
+
+/* Initialize the hint 'f' for the tree 'rt'. The first operation with the
+ * hint performs a normal lookup, the next ones use its path. */
+void raxFingerStart(raxFinger *f, rax *rt) {
+    f->rt = rt;
+    f->version = rt->version;
+    f->key = f->key_static_string;
+    f->key_len = 0;
+    f->key_max = RAX_ITER_STATIC_LEN;
+    raxStackInit(&f->path);
+}
+
+/* Free the memory used by the hint, if any. */
+void raxFingerStop(raxFinger *f) {
+    if (f->key != f->key_static_string) rax_free(f->key);
+    raxStackFree(&f->path);
+}
+
+/* Lookup the key 's' of 'len' bytes like raxLowWalk(), but starting from
+ * the deepest node of the path saved in the hint 'f', if still valid,
+ * that is reached by the common prefix of 's' and the key of the last
+ * operation. The parents of the node where the lookup stops become the new
+ * path of the hint, and 's' its new key. Out of memory saving the path is
+ * not an error: the hint just remains empty. */
+static size_t raxFingerWalk(raxFinger *f, unsigned char *s, size_t len, raxNode **stopnode, raxNode ***plink, int *splitpos) {
+    rax *rax = f->rt;
+    raxStack *path = &f->path;
+    raxNode *h = rax->head, **parentlink = &rax->head;
+    size_t i = 0, k = 0;
+
+    if (f->version == rax->version && path->items) {
+        size_t max = f->key_len < len ? f->key_len : len;
+        size_t common = raxMatchLen(f->key,s,max);
+        /* Descend the saved path as long as the bytes of the edges
+         * followed are part of the common prefix. */
+        while(k < path->items) {
+            raxNode *n = path->stack[k];
+            size_t next = i+(n->iscompr ? n->size : 1);
+            if (next > common) break;
+            parentlink = raxNodeFirstChildPtr(n)+path->childidx[k];
+            memcpy(&h,parentlink,sizeof(h));
+            i = next;
+            k++;
+        }
+        if (k) raxCount(fingerhits,1);
+    }
+    path->items = k;
+
+    int saved_errno = errno;
+    i = raxLowWalkFrom(0,h,parentlink,i,s,len,stopnode,plink,splitpos,
+                       path);
+    if (len > f->key_max) {
+        unsigned char *key = f->key == f->key_static_string ?
+                             rax_malloc(len) : rax_realloc(f->key,len);
+        if (key) {
+            if (f->key == f->key_static_string) memcpy(key,f->key,f->key_len);
+            f->key = key;
+            f->key_max = len;
+        } else {
+            path->oom = 1;
+        }
+    }
+    if (path->oom) {
+        /* Some node or the key could not be saved. */
+        path->items = 0;
+        path->oom = 0;
+        f->key_len = 0;
+        errno = saved_errno;
+    } else {
+        if (len) memcpy(f->key,s,len);
+        f->key_len = len;
+    }
+    return i;
+}
+
+/* Like raxInsert(), but using the hint 'f', that must be started for the
+ * tree where the key is inserted. In concurrent and forked trees, where the
+ * insertion copies the nodes of the path, the hint is not used. */
+int raxInsertWithHint(raxFinger *f, unsigned char *s, size_t len, void *data, void **old) {
+    rax *rax = f->rt;
+    raxValue v = {data,NULL,0,0};
+    if (rax->concurrency || rax->shared) {
+        f->path.items = 0;
+        return raxGenericInsert(rax,s,len,&v,old,1);
+    }
+    int retval = raxLowInsert(rax,s,len,&v,old,1,f);
+    /* On out of memory the insertion may remove nodes of the path. */
+    if (retval == 0 && errno == ENOMEM) f->path.items = 0;
+    f->version = rax->version;
+    return retval;
+}
+
+/* Like raxFind(), but using the hint 'f', that must be started for the tree
+ * where the key is searched. */
+void *raxFindWithHint(raxFinger *f, unsigned char *s, size_t len) {
+    rax *rax = f->rt;
+    if (rax->concurrency) return raxFind(rax,s,len);
+
+    raxNode *h;
+    int splitpos = 0;
+    raxBucketItem e;
+    size_t i = raxFingerWalk(f,s,len,&h,NULL,&splitpos);
+    f->version = rax->version;
+    if (!raxWalkFound(h,s,i,len,splitpos,&e)) return raxNotFound;
+    return raxBucketData(&e);
+}
+
+/* ------------------------------ Sharded trees ------------------------------
+ * A sharded tree partitions the keys among many trees, the shards, each
+ * protected by its own lock, so that threads modifying keys of different
+ * shards can work in parallel. The shard of a key is selected by its first
+ * byte (RAX_SHARD_PREFIX), so that every shard holds a range of keys and
+ * the shards are in order, or by a hash of the key (RAX_SHARD_HASH), that
+ * spreads evenly keys sharing long prefixes, like the hash slots of Redis
+ * Cluster do.
+ *
+ * Iterators merge the shards in order. In order not to hold the locks while
+ * iterating, raxShardedSeek() forks every shard, so that the iterator visits
+ * a snapshot of the tree, and the writers can go on, copying the nodes they
+ * modify, as usual for forked trees, until the iterator is seeked again or
+ * stopped. Forks are taken and freed holding the lock of the shard, since
+ * they update the reference counts of the shared nodes.
+ * -------------------------------------------------------------------------- */
+
+typedef struct raxShard {
+    pthread_mutex_t lock;
+    rax *t;
+    char pad[64];           /* Don't share cache lines among locks. */
+} raxShard;
+
+struct raxSharded {
+    int numshards;
+    int mode;               /* RAX_SHARD_PREFIX or RAX_SHARD_HASH. */
+    raxShard *shards;
+};
+
+/* Return the shard of the key 's' of 'len' bytes. The hash is FNV-1a. */
+static raxShard *raxShardOf(raxSharded *s, unsigned char *key, size_t len) {
+    if (s->mode == RAX_SHARD_PREFIX) {
+        int c = len ? key[0] : 0;
+        return s->shards+(c*s->numshards/256);
+    }
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t j = 0; j < len; j++) {
+        h ^= key[j];
+        h *= 0x100000001b3ULL;
+    }
+    return s->shards+(h % s->numshards);
+}
+
+/* Create a sharded tree of 'numshards' shards, that are trees created with
+ * the RAX_FLAG_... 'flags', using the partitioning 'mode', RAX_SHARD_PREFIX
+ * or RAX_SHARD_HASH. With RAX_SHARD_PREFIX there can be at most 256 shards,
+ * one for every first byte. Concurrent trees, that have their own locking
+ * scheme, can't be sharded. On out of memory NULL is returned and errno is
+ * set to ENOMEM, and on invalid arguments errno is set to EINVAL. */
+raxSharded *raxShardedNew(int numshards, int mode, int flags) {
+    if (numshards < 1 || (mode != RAX_SHARD_PREFIX && mode != RAX_SHARD_HASH) ||
+        (mode == RAX_SHARD_PREFIX && numshards > 256) ||
+        (flags & RAX_FLAG_CONCURRENT))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    raxSharded *s = rax_malloc(sizeof(*s));
+    raxShard *shards = rax_malloc(sizeof(raxShard)*numshards);
+    if (s == NULL || shards == NULL) goto oom;
+    s->numshards = numshards;
+    s->mode = mode;
+    s->shards = shards;
+    int j;
+    for (j = 0; j < numshards; j++) {
+        shards[j].t = raxNewWithFlags(flags);
+        if (shards[j].t == NULL) break;
+        pthread_mutex_init(&shards[j].lock,NULL);
+    }
+    if (j == numshards) return s;
+    while(j--) {
+        raxFree(shards[j].t);
+        pthread_mutex_destroy(&shards[j].lock);
+    }
+
+oom:
+    rax_free(s);
+    rax_free(shards);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/* Like raxInsert(), for sharded trees. */
+int raxShardedInsert(raxSharded *s, unsigned char *key, size_t len, void *data, void **old) {
+    raxShard *sh = raxShardOf(s,key,len);
+    pthread_mutex_lock(&sh->lock);
+    int retval = raxInsert(sh->t,key,len,data,old);
+    int errcode = errno;
+    pthread_mutex_unlock(&sh->lock);
+    errno = errcode;
+    return retval;
+}
+
+/* Like raxTryInsert(), for sharded trees. */
+int raxShardedTryInsert(raxSharded *s, unsigned char *key, size_t len, void *data, void **old) {
+    raxShard *sh = raxShardOf(s,key,len);
+    pthread_mutex_lock(&sh->lock);
+    int retval = raxTryInsert(sh->t,key,len,data,old);
+    int errcode = errno;
+    pthread_mutex_unlock(&sh->lock);
+    errno = errcode;
+    return retval;
+}
+
+/* Like raxRemove(), for sharded trees. */
+int raxShardedRemove(raxSharded *s, unsigned char *key, size_t len, void **old) {
+    raxShard *sh = raxShardOf(s,key,len);
+    pthread_mutex_lock(&sh->lock);
+    int retval = raxRemove(sh->t,key,len,old);
+    pthread_mutex_unlock(&sh->lock);
+    return retval;
+}
+
+/* Like raxFind(), for sharded trees. */
+void *raxShardedFind(raxSharded *s, unsigned char *key, size_t len) {
+    raxShard *sh = raxShardOf(s,key,len);
+    pthread_mutex_lock(&sh->lock);
+    void *data = raxFind(sh->t,key,len);
+    pthread_mutex_unlock(&sh->lock);
+    return data;
+}
+
+/* Return the number of keys of the sharded tree. */
+uint64_t raxShardedSize(raxSharded *s) {
+    uint64_t size = 0;
+    for (int j = 0; j < s->numshards; j++) {
+        pthread_mutex_lock(&s->shards[j].lock);
+        size += raxSize(s->shards[j].t);
+        pthread_mutex_unlock(&s->shards[j].lock);
+    }
+    return size;
+}
+
+typedef struct raxShardedJob {
+    raxSharded *s;
+    int shard;
+    raxShardedCallback cb;
+    void *privdata;
+    pthread_t thread;
+} raxShardedJob;
+
+static void *raxShardedRunJob(void *arg) {
+    raxShardedJob *job = arg;
+    raxShard *sh = job->s->shards+job->shard;
+    pthread_mutex_lock(&sh->lock);
+    job->cb(job->privdata,job->shard,sh->t);
+    pthread_mutex_unlock(&sh->lock);
+    return NULL;
+}
+
+/* Call cb(privdata,shard,t) for every shard of 'shard' index and tree 't',
+ * each in its own thread while holding the lock of the shard, and wait for
+ * all the calls to return. The callback can read or modify the tree 't',
+ * but no other shard. If the threads can't be created, the calls are made
+ * by the calling thread. */
+void raxShardedForEach(raxSharded *s, raxShardedCallback cb, void *privdata) {
+    raxShardedJob *jobs = rax_malloc(sizeof(*jobs)*s->numshards);
+    if (jobs == NULL) {
+        raxShardedJob job;
+        job.s = s;
+        job.cb = cb;
+        job.privdata = privdata;
+        for (job.shard = 0; job.shard < s->numshards; job.shard++)
+            raxShardedRunJob(&job);
+        return;
+    }
+
+    /* The first shard is processed by the calling thread, and so are the
+     * shards we could not create a thread for. */
+    for (int j = 0; j < s->numshards; j++) {
+        jobs[j].s = s;
+        jobs[j].shard = j;
+        jobs[j].cb = cb;
+        jobs[j].privdata = privdata;
+    }
+    int numthreads = 0;
+    for (int j = 1; j < s->numshards; j++) {
+        if (pthread_create(&jobs[j].thread,NULL,raxShardedRunJob,jobs+j))
+            break;
+        numthreads++;
+    }
+    raxShardedRunJob(jobs);
+    for (int j = numthreads+1; j < s->numshards; j++) raxShardedRunJob(jobs+j);
+    for (int j = 1; j <= numthreads; j++) pthread_join(jobs[j].thread,NULL);
+    rax_free(jobs);
+}
+
+/* Free the sharded tree, calling free_callback, if not NULL, for the value
+ * of every key. There must be no iterators left. */
+void raxShardedFreeWithCallback(raxSharded *s, void (*free_callback)(void*)) {
+    for (int j = 0; j < s->numshards; j++) {
+        raxFreeWithCallback(s->shards[j].t,free_callback);
+        pthread_mutex_destroy(&s->shards[j].lock);
+    }
+    rax_free(s->shards);
+    rax_free(s);
+}
+
+/* Free the sharded tree. */
+void raxShardedFree(raxSharded *s) {
+    raxShardedFreeWithCallback(s,NULL);
+}
+
+/* Initialize the iterator 'it' of the sharded tree 's'. Like for the
+ * iterators of normal trees, it must be seeked with raxShardedSeek() before
+ * calling raxShardedNext() or raxShardedPrev(), and finally stopped with
+ * raxShardedStop(). Returns 0 on out of memory, setting errno to ENOMEM,
+ * otherwise 1. */
+int raxShardedStart(raxShardedIterator *it, raxSharded *s) {
+    int n = s->numshards;
+    it->s = s;
+    it->snap = rax_malloc(sizeof(rax*)*n);
+    it->its = rax_malloc(sizeof(raxIterator)*n);
+    it->pending = rax_malloc(sizeof(int)*n);
+    if (it->snap == NULL || it->its == NULL || it->pending == NULL) {
+        rax_free(it->snap);
+        rax_free(it->its);
+        rax_free(it->pending);
+        errno = ENOMEM;
+        return 0;
+    }
+    for (int j = 0; j < n; j++) {
+        it->snap[j] = NULL;
+        it->pending[j] = 0;
+    }
+    it->cur = -1;
+    it->dir = 1;
+    it->flags = RAX_ITER_EOF;
+    it->key = NULL;
+    it->key_len = 0;
+    it->data = NULL;
+    it->data_len = 0;
+    return 1;
+}
+
+/* Release the snapshot of every shard taken by the iterator. */
+static void raxShardedReleaseSnapshots(raxShardedIterator *it) {
+    for (int j = 0; j < it->s->numshards; j++) {
+        if (it->snap[j] == NULL) continue;
+        raxStop(&it->its[j]);
+        pthread_mutex_lock(&it->s->shards[j].lock);
+        raxFree(it->snap[j]);
+        pthread_mutex_unlock(&it->s->shards[j].lock);
+        it->snap[j] = NULL;
+    }
+}
+
+/* Move the iterator of the shard 'j' of the iterator 'it' to its next
+ * element in the iteration direction. Returns 0 on out of memory. */
+static int raxShardedAdvance(raxShardedIterator *it, int j) {
+    it->pending[j] = it->dir > 0 ? raxNext(&it->its[j]) : raxPrev(&it->its[j]);
+    return it->pending[j] || errno != ENOMEM;
+}
+
+/* Like raxSeek(), for sharded iterators. Every shard is seeked in a new
+ * snapshot of the shard, so the iterator sees all the modifications done
+ * before the call, and none of the ones done after it. Returns 0 on out of
+ * memory, setting errno to ENOMEM, or if the operator is invalid, setting
+ * errno to 0, otherwise 1. */
+int raxShardedSeek(raxShardedIterator *it, const char *op, unsigned char *ele, size_t len) {
+    raxSharded *s = it->s;
+    raxShardedReleaseSnapshots(it);
+    it->flags = RAX_ITER_EOF;
+    it->cur = -1;
+    if (op[0] != '>' && op[0] != '<' && op[0] != '=' && op[0] != '^' &&
+        op[0] != '$')
+    {
+        errno = 0;
+        return 0;
+    }
+    it->dir = (op[0] == '<' || op[0] == '$') ? -1 : 1;
+
+    /* With the "==" operator only the shard owning the key is seeked
+     * exactly: the other shards are positioned after it, so that the
+     * iteration can continue from the key, like it happens with raxSeek(). */
+    int exact = op[0] == '=';
+    int owner = exact ? raxShardOf(s,ele,len) - s->shards : -1;
+    for (int j = 0; j < s->numshards; j++) {
+        pthread_mutex_lock(&s->shards[j].lock);
+        it->snap[j] = raxFork(s->shards[j].t);
+        pthread_mutex_unlock(&s->shards[j].lock);
+        if (it->snap[j] == NULL) goto oom;
+        raxStart(&it->its[j],it->snap[j]);
+        const char *shardop = (exact && j != owner) ? ">" : op;
+        if (!raxSeek(&it->its[j],shardop,ele,len) || !raxShardedAdvance(it,j))
+            goto oom;
+    }
+    it->flags = (exact && !it->pending[owner]) ? RAX_ITER_EOF :
+                                                 RAX_ITER_JUST_SEEKED;
+    return 1;
+
+oom:
+    raxShardedReleaseSnapshots(it);
+    errno = ENOMEM;
+    return 0;
+}
+
+/* Compare the current keys of the iterators 'a' and 'b', returning a
+ * negative number, zero or a positive number if the key of 'a' is
+ * respectively smaller, equal or greater than the key of 'b'. */
+static int raxIteratorKeyCompare(raxIterator *a, raxIterator *b) {
+    size_t minlen = a->key_len < b->key_len ? a->key_len : b->key_len;
+    int cmp = memcmp(a->key,b->key,minlen);
+    if (cmp == 0 && a->key_len != b->key_len)
+        cmp = a->key_len < b->key_len ? -1 : 1;
+    return cmp;
+}
+
+/* Implements raxShardedNext() and raxShardedPrev(), 'dir' being 1 or -1. */
+static int raxShardedStep(raxShardedIterator *it, int dir) {
+    raxSharded *s = it->s;
+    if (it->flags & RAX_ITER_EOF) {
+        errno = 0;
+        return 0;
+    }
+    if (it->flags & RAX_ITER_JUST_SEEKED) {
+        /* Return the element found by the seek, in any direction. */
+        it->flags &= ~RAX_ITER_JUST_SEEKED;
+    } else if (dir != it->dir) {
+        /* Change of direction: seek every shard to the element before or
+         * after the current key, seeking the shard the key comes from as
+         * last, since the key is the one of its iterator. */
+        it->dir = dir;
+        const char *op = dir > 0 ? ">" : "<";
+        for (int k = 0; k < s->numshards; k++) {
+            int j = k == s->numshards-1 ? it->cur :
+                    (k >= it->cur ? k+1 : k);
+            if (!raxSeek(&it->its[j],op,it->key,it->key_len) ||
+                !raxShardedAdvance(it,j)) goto oom;
+        }
+    } else {
+        if (!raxShardedAdvance(it,it->cur)) goto oom;
+    }
+
+    /* Select the smallest pending element, or the greatest one iterating
+     * backward. With RAX_SHARD_PREFIX the shards are in order, so this is
+     * the one of the first shard having an element. */
+    int best = -1;
+    for (int k = 0; k < s->numshards; k++) {
+        int j = it->dir > 0 ? k : s->numshards-1-k;
+        if (!it->pending[j]) continue;
+        if (best == -1) {
+            best = j;
+            if (s->mode == RAX_SHARD_PREFIX) break;
+        } else {
+            int cmp = raxIteratorKeyCompare(&it->its[j],&it->its[best]);
+            if (cmp*it->dir < 0) best = j;
+        }
+    }
+    if (best == -1) {
+        it->flags |= RAX_ITER_EOF;
+        errno = 0;
+        return 0;
+    }
+    it->cur = best;
+    it->key = it->its[best].key;
+    it->key_len = it->its[best].key_len;
+    it->data = it->its[best].data;
+    it->data_len = it->its[best].data_len;
+    return 1;
+
+oom:
+    it->flags |= RAX_ITER_EOF;
+    errno = ENOMEM;
+    return 0;
+}
+
+/* Like raxNext(), for sharded iterators. */
+int raxShardedNext(raxShardedIterator *it) {
+    return raxShardedStep(it,1);
+}
+
+/* Like raxPrev(), for sharded iterators. */
+int raxShardedPrev(raxShardedIterator *it) {
+    return raxShardedStep(it,-1);
+}
+
+/* Release the iterator, and the snapshots of the shards it holds. */
+void raxShardedStop(raxShardedIterator *it) {
+    raxShardedReleaseSnapshots(it);
+    rax_free(it->snap);
+    rax_free(it->its);
+    rax_free(it->pending);
 }
 
 /* ----------------------------- Introspection ------------------------------ */
@@ -1834,6 +8135,7 @@ uint64_t raxSize(rax *rax) {
  *  [abc] (normal node with three children)
  *  [abc]=0x12345678 (node is a key, pointing to value 0x12345678)
  *  [] (a normal empty node)
+ *  {=0x1234 ab=0x5678} (bucket storing the keys "" and "ab")
  *
  *  Children are represented in new idented lines, each children prefixed by
  *  the "`-(x)" string, where "x" is the edge byte.
@@ -1854,8 +8156,28 @@ void raxRecursiveShow(int level, int lpad, raxNode *n) {
     char s = n->iscompr ? '"' : '[';
     char e = n->iscompr ? '"' : ']';
 
+    if (raxIsBucket(n)) {
+        int count = raxBucketCount(n);
+        putchar('{');
+        for (int j = 0; j < count; j++) {
+            raxBucketItem item;
+            raxBucketGet(n,j,&item);
+            printf("%s%.*s",j ? " " : "",(int)item.len,item.suffix);
+            if (item.flags & RAX_BUCKET_INLINE)
+                printf("=<%zu bytes>",item.vlen);
+            else
+                printf("=%p",raxBucketData(&item));
+        }
+        putchar('}');
+        return;
+    }
+
     int numchars = printf("%c%.*s%c", s, n->size, n->data, e);
-    if (n->iskey) {
+    if (n->iskey && n->isinline && !n->isnull) {
+        size_t vlen;
+        raxGetInlineData(n,&vlen);
+        numchars += printf("=<%zu bytes>",vlen);
+    } else if (n->iskey) {
         numchars += printf("=%p",raxGetData(n));
     }
 
@@ -1929,6 +8251,13 @@ unsigned long raxTouch(raxNode *n) {
     if (n->iskey) {
         sum += (unsigned long)raxGetData(n);
     }
+    if (raxIsBucket(n)) {
+        for (int j = 0; j < (int)raxBucketCount(n); j++) {
+            raxBucketItem e;
+            raxBucketGet(n,j,&e);
+            sum += (unsigned long)raxBucketData(&e);
+        }
+    }
 
     int numchildren = n->iscompr ? 1 : n->size;
     raxNode **cp = raxNodeFirstChildPtr(n);
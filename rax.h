@@ -32,6 +32,7 @@
 #define RAX_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /* Representation of a radix tree as implemented in this file, that contains
  * the strings "foo", "foobar" and "footer" after the insertion of each
@@ -94,12 +95,19 @@
  *
  */
 
-#define RAX_NODE_MAX_SIZE ((1<<29)-1)
+#define RAX_NODE_MAX_SIZE ((1<<24)-1)
 typedef struct raxNode {
     uint32_t iskey:1;     /* Does this node contain a key? */
     uint32_t isnull:1;    /* Associated value is NULL (don't store it). */
     uint32_t iscompr:1;   /* Node is compressed. */
-    uint32_t size:29;     /* Number of children, or compressed string len. */
+    uint32_t isdense:1;   /* Node has the children index. See below. */
+    uint32_t isinline:1;  /* Value is stored inline. See below. */
+    uint32_t hascount:1;  /* Node has the subtree counts. See below. */
+    uint32_t size:24;     /* Number of children, or compressed string len. */
+    uint32_t islink32:1;  /* Child links are 32 bit offsets. Only used by
+                             the nodes of compact frozen images. */
+    uint32_t needcompr:1; /* Subtree has chains of nodes to compress. See
+                             RAX_FLAG_LAZY_COMPACT. */
     /* Data layout is as follows:
      *
      * If node is not compressed we have 'size' bytes, one for each children
@@ -126,27 +134,126 @@ typedef struct raxNode {
      * (isnull=0), then after the raxNode pointers poiting to the
      * children, an additional value pointer is present (as you can see
      * in the representation above as "value-ptr" field).
+     *
+     * In trees created with the RAX_FLAG_DENSE flag, non compressed nodes
+     * having many children are turned into "dense" nodes (isdense=1): the
+     * layout is the same, but a 256 bytes index, storing for every child
+     * character the position of its edge, is stored after the padding and
+     * before the child pointers. This way the child for a given character
+     * is found in constant time, just checking that the edge at the
+     * position stored in the index is actually the character we want:
+     *
+     * [header isdense=1][abc][index][a-ptr][b-ptr][c-ptr](value-ptr?)
+     *
+     * Keys inserted with raxInsertInline() have the isinline bit set, and
+     * instead of the value pointer the value itself is stored, prefixed by
+     * its length encoded as a varint:
+     *
+     * [header iscompr=1 isinline=1][xyz][z-ptr][len][value bytes...]
+     *
+     * In trees created with the RAX_FLAG_RANK flag all the nodes have the
+     * hascount bit set, and after the child pointers an array of 64 bit
+     * counters is stored, one for each child, with the number of keys
+     * contained in the subtree of the child (the child itself included):
+     *
+     * [header hascount=1][abc][a-ptr][b-ptr][c-ptr][a-cnt][b-cnt][c-cnt]...
+     *
+     * In trees created with the RAX_FLAG_BUCKETS flag a leaf may be a
+     * "bucket" (isdense=1 and size=0, a combination otherwise unused),
+     * storing the whole suffixes of up to a few keys with their values,
+     * sorted, instead of a chain of nodes for each of them. After the
+     * header there are the number of entries and the length of the node,
+     * then the offset of every entry from the start of the node, all as
+     * 16 bit integers, and the entries:
+     *
+     * [header isdense=1][count][len][off]...[suffix-len][suffix][flags][value]
      */
     unsigned char data[];
 } raxNode;
 
+/* Flags that can be passed to raxNewWithFlags() in order to select
+ * optional features of the radix tree. */
+#define RAX_FLAG_DENSE (1<<0) /* Use dense nodes for nodes with many
+                                 children. Lookups are faster, at the cost
+                                 of a few bytes for each of such nodes. */
+#define RAX_FLAG_RANK (1<<1)  /* Maintain subtree counts in order to support
+                                 raxRank() and raxSelect() in logarithmic
+                                 time. */
+#define RAX_FLAG_CONCURRENT (1<<2) /* Allow lookups and iterations from other
+                                      threads while the tree is modified,
+                                      without locks. See raxReaderNew(). */
+#define RAX_FLAG_LAZY_COMPACT (1<<3) /* Removals don't compress the chains
+                                        of nodes they leave, that are just
+                                        marked and compressed later by
+                                        raxCompactStep(). */
+#define RAX_FLAG_BUCKETS (1<<4) /* Store the keys below a leaf in small
+                                   buckets of whole suffixes, burst into
+                                   nodes when full. */
+
+/* Allocator used by a radix tree for its nodes, see raxNewWithAllocator().
+ * The methods have the same semantics of malloc(), realloc() and free(),
+ * and are called with the 'ctx' pointer as first argument. The 'release_fn'
+ * method is optional: if not NULL, raxFree() does not free the nodes one
+ * after the other, and calls release_fn() instead, that is supposed to free
+ * all the memory allocated by the allocator at once (including the rax
+ * structure itself). */
+typedef struct raxAllocator {
+    void *(*malloc_fn)(void *ctx, size_t size);
+    void *(*realloc_fn)(void *ctx, void *ptr, size_t size);
+    void (*free_fn)(void *ctx, void *ptr);
+    void (*release_fn)(void *ctx);
+    void *ctx;
+} raxAllocator;
+
+/* Slab arena allocator, tuned for radix tree nodes. */
+typedef struct raxArena raxArena;
+
+/* State of trees created with RAX_FLAG_CONCURRENT, and their readers. */
+typedef struct raxConcurrency raxConcurrency;
+typedef struct raxReader raxReader;
+
+/* Reference counts of the nodes of trees created by raxFork(). */
+typedef struct raxShared raxShared;
+
+/* State of a tree freed by raxFreeAsync(). */
+typedef struct raxFreeJob raxFreeJob;
+
 typedef struct rax {
     raxNode *head;
     uint64_t numele;
     uint64_t numnodes;
+    uint64_t bytes;      /* Memory used by the nodes and this structure,
+                            see raxMemoryUsage(). */
+    int flags;           /* RAX_FLAG_... flags of this tree. */
+    raxAllocator alloc;  /* Allocator used for the nodes of this tree. */
+    raxConcurrency *concurrency; /* Readers and retired nodes of
+                                    concurrent trees, otherwise NULL. */
+    raxShared *shared;   /* Nodes shared with forked trees, or NULL. */
+    uint64_t version;    /* Incremented every time nodes are allocated,
+                            reallocated or freed, see raxFinger. */
 } rax;
 
 /* Stack data structure used by raxLowWalk() in order to, optionally, return
  * a list of parent nodes to the caller. The nodes do not have a "parent"
- * field for space concerns, so we use the auxiliary stack when needed. */
+ * field for space concerns, so we use the auxiliary stack when needed.
+ * For every parent node the stack also remembers the index of the child
+ * that was followed, so that iterators can move to the next or previous
+ * child without scanning the parent edges again. */
+#ifndef RAX_STACK_STATIC_ITEMS
 #define RAX_STACK_STATIC_ITEMS 32
+#endif
 typedef struct raxStack {
-    void **stack; /* Points to static_items or an heap allocated array. */
+    void **stack; /* Points to static_items, a caller buffer (see
+                     raxStartWithBuffers()) or an heap allocated array. */
+    int *childidx; /* Points to static_childidx, after the items of the
+                      caller buffer, or to an heap allocated array. */
     size_t items, maxitems; /* Number of items contained and total space. */
     /* Up to RAXSTACK_STACK_ITEMS items we avoid to allocate on the heap
-     * and use this static array of pointers instead. */
+     * and use these static arrays instead. */
     void *static_items[RAX_STACK_STATIC_ITEMS];
+    int static_childidx[RAX_STACK_STATIC_ITEMS];
     int oom; /* True if pushing into this stack failed for OOM at some point. */
+    int onheap; /* True if the arrays were allocated by the stack. */
 } raxStack;
 
 /* Optional callback used for iterators and be notified on each rax node,
@@ -164,8 +271,55 @@ typedef struct raxStack {
  * This is currently only supported in forward iterations (raxNext) */
 typedef int (*raxNodeCallback)(raxNode **noderef);
 
-/* Radix tree iterator state is encapsulated into this data structure. */
+/* Callback used by raxBulkLoad() in order to get the keys to load. */
+typedef int (*raxBulkLoadCallback)(void *privdata, unsigned char **key,
+                                   size_t *len, void **data);
+
+/* Callback used by raxForEachPrefix() for every key that is a prefix of the
+ * string, returning 0 to stop. */
+typedef int (*raxPrefixCallback)(void *privdata, unsigned char *key,
+                                 size_t len, void *data);
+
+/* Callback used by raxSerialize() in order to store values inside the
+ * image. */
+typedef int (*raxSerializeCallback)(void *privdata, void *data,
+                                    const void **buf, size_t *len);
+
+/* Callbacks used by raxDumpStream() and raxLoadStream() in order to write
+ * and read the stream, and to decode the values stored as bytes. */
+typedef int (*raxStreamWriteCallback)(void *privdata, const void *buf,
+                                      size_t len);
+typedef size_t (*raxStreamReadCallback)(void *privdata, void *buf,
+                                        size_t len);
+typedef int (*raxStreamLoadCallback)(void *privdata, const unsigned char *buf,
+                                     size_t len, void **data);
+
+/* Callback used by raxMerge() and raxIntersect() in order to resolve the
+ * values 'a' of the first tree and 'b' of the second one of a key stored
+ * in both, returning the value to keep. */
+typedef void *(*raxMergeCallback)(void *privdata, unsigned char *key,
+                                  size_t len, void *a, void *b);
+
+/* Read only handle of a tree image produced by raxSerialize() or
+ * raxSerializeCompact(). The nodes are the ones inside the image, that is
+ * used in place. */
+typedef struct raxFrozen {
+    rax rt;                 /* Tree header. The head points inside the image. */
+    const void *image;      /* Start of the image. */
+    size_t len;             /* Length of the image. */
+} raxFrozen;
+
+/* Radix tree iterator state is encapsulated into this data structure.
+ * RAX_ITER_STATIC_LEN and RAX_STACK_STATIC_ITEMS size the buffers inside
+ * the structure, used before allocating: they can be defined at compile
+ * time (with the same values for Rax and its users), for instance to use
+ * smaller iterators that get their buffers from raxStartWithBuffers(). */
+#ifndef RAX_ITER_STATIC_LEN
 #define RAX_ITER_STATIC_LEN 128
+#endif
+/* Bytes of the stack buffer passed to raxStartWithBuffers() used for every
+ * node of the path of the iterator. */
+#define RAX_ITER_STACK_ITEM_LEN (sizeof(void*)+sizeof(int))
 #define RAX_ITER_JUST_SEEKED (1<<0) /* Iterator was just seeked. Return current
                                        element for the first iteration and
                                        clear the flag. */
@@ -177,35 +331,230 @@ typedef struct raxIterator {
     rax *rt;                /* Radix tree we are iterating. */
     unsigned char *key;     /* The current string. */
     void *data;             /* Data associated to this key. */
+    size_t data_len;        /* Length of the data, for inline values. */
     size_t key_len;         /* Current key length. */
     size_t key_max;         /* Max key len the current key buffer can hold. */
+    int key_onheap;         /* True if 'key' was allocated by the iterator. */
     unsigned char key_static_string[RAX_ITER_STATIC_LEN];
     raxNode *node;          /* Current node. Only for unsafe iteration. */
     raxStack stack;         /* Stack used for unsafe iteration. */
     raxNodeCallback node_cb; /* Optional node callback. Normally set to NULL. */
+    int bucketpos;          /* Current entry, if 'node' is a bucket. */
+    uintptr_t base;         /* Start of the image for frozen images, or 0. */
 } raxIterator;
 
+/* Hint used by raxInsertWithHint() and raxFindWithHint(): it remembers the
+ * key of the last operation and the parents of the node where its lookup
+ * stopped, so that the lookup of a key sharing a prefix with it can start
+ * from the deepest of these nodes instead of the head. The nodes are only
+ * used if the tree version is still the one saved in the hint. */
+typedef struct raxFinger {
+    rax *rt;                /* Radix tree of the hint. */
+    uint64_t version;       /* Tree version when the path was saved. */
+    unsigned char *key;     /* Key of the last operation. */
+    size_t key_len;         /* Current key length. */
+    size_t key_max;         /* Max key len the current key buffer can hold. */
+    unsigned char key_static_string[RAX_ITER_STATIC_LEN];
+    raxStack path;          /* Parents of the node the lookup stopped at. */
+} raxFinger;
+
+/* Sharded trees: the keys are partitioned among many trees, each with its
+ * own lock, so that threads working on different shards don't contend. */
+#define RAX_SHARD_PREFIX 0  /* Shard by the first byte: preserves the order. */
+#define RAX_SHARD_HASH 1    /* Shard by a hash of the key. */
+typedef struct raxSharded raxSharded;
+
+/* Callback used by raxShardedForEach(), called with the tree of the shard
+ * 'shard' while holding its lock. */
+typedef void (*raxShardedCallback)(void *privdata, int shard, rax *t);
+
+/* Iterator of a sharded tree. It iterates a snapshot of every shard, taken
+ * by raxShardedSeek(), merging them in order. */
+typedef struct raxShardedIterator {
+    raxSharded *s;          /* Sharded tree we are iterating. */
+    rax **snap;             /* Snapshot of every shard (a fork). */
+    raxIterator *its;       /* Iterator of every snapshot. */
+    int *pending;           /* its[j] is at an element not yet returned. */
+    int cur;                /* Shard of the current element, or -1. */
+    int dir;                /* Iteration direction: 1 next, -1 prev. */
+    int flags;              /* RAX_ITER_JUST_SEEKED and RAX_ITER_EOF. */
+    unsigned char *key;     /* The current key. */
+    size_t key_len;         /* Current key length. */
+    void *data;             /* Data associated to this key. */
+    size_t data_len;        /* Length of inline data, 0 for pointers. */
+} raxShardedIterator;
+
+/* Position of an incremental defragmentation pass, see raxDefragStep(). */
+typedef struct raxDefragCursor {
+    unsigned char *path;    /* Path of the next node to visit. */
+    size_t path_len;        /* Current path length. */
+    size_t path_max;        /* Max path len the current buffer can hold. */
+    unsigned char path_static_string[RAX_ITER_STATIC_LEN];
+} raxDefragCursor;
+
+/* Position of a scan, see raxScan(). */
+typedef struct raxScanCursor {
+    unsigned char *key;     /* Last key returned. */
+    size_t key_len;         /* Last key length. */
+    size_t key_max;         /* Max key len the current buffer can hold. */
+    int started;            /* False if no key was returned yet. */
+    unsigned char key_static_string[RAX_ITER_STATIC_LEN];
+} raxScanCursor;
+
+/* Callback receiving the keys returned by raxScan(). */
+typedef void (*raxScanCallback)(void *privdata, raxIterator *it);
+
+/* Boundary between two ranges of keys, see raxSplitRanges(). */
+typedef struct raxBound {
+    unsigned char *key;     /* First key of the range. */
+    size_t key_len;         /* Key length. */
+} raxBound;
+
+/* Statistics about the structure of a tree, see raxStats(). */
+#define RAX_STATS_DEPTHS 64     /* Depths tracked, the last includes deeper. */
+#define RAX_STATS_LENGTHS 32    /* Buckets of the compressed nodes lengths. */
+typedef struct raxTreeStats {
+    uint64_t nodes;         /* Total number of nodes. */
+    uint64_t keys;          /* Keys: nodes representing a key, and the
+                               entries of the buckets. */
+    uint64_t compressed;    /* Compressed nodes. */
+    uint64_t branching;     /* Not compressed nodes with children. */
+    uint64_t leaves;        /* Nodes without children. */
+    uint64_t dense;         /* Nodes with the dense index. */
+    uint64_t buckets;       /* Leaves storing many keys, see RAX_FLAG_BUCKETS. */
+    uint64_t bytes;         /* Like raxMemoryUsage(), but walking the tree. */
+    uint64_t padding;       /* Bytes used to align the children pointers. */
+    uint64_t maxdepth;      /* Depth of the deepest node, the head is 0. */
+    uint64_t fanout[257];   /* Nodes by number of children. */
+    uint64_t comprlen[RAX_STATS_LENGTHS]; /* Compressed nodes by length:
+                                             bucket N counts the lengths
+                                             from 2^N to 2^(N+1)-1. */
+    uint64_t depth[RAX_STATS_DEPTHS]; /* Nodes by depth. */
+} raxTreeStats;
+
+/* Counters of the events of the hot paths, available compiling Rax with
+ * RAX_STATS defined, see raxGetCounters(). */
+typedef struct raxCounters {
+    uint64_t walks;         /* Lookups of keys into the tree. */
+    uint64_t walknodes;     /* Nodes descended into by the lookups. */
+    uint64_t splits;        /* Compressed nodes split by insertions. */
+    uint64_t reallocs;      /* Nodes reallocated. */
+    uint64_t reallocmoves;  /* Reallocations that moved the node. */
+    uint64_t recompressions; /* Chains of nodes compressed by removals. */
+    uint64_t oom;           /* Node allocations that failed. */
+    uint64_t fingerhits;    /* Lookups started below the head by a hint. */
+} raxCounters;
+
+/* Keys of 128 bits for the raxInsertU128() family of functions. They are
+ * ordered by 'hi', then by 'lo'. */
+typedef struct raxU128 {
+    uint64_t hi;
+    uint64_t lo;
+} raxU128;
+
 /* A special pointer returned for not found items. */
 extern void *raxNotFound;
 
 /* Exported API. */
 rax *raxNew(void);
+rax *raxNewWithFlags(int flags);
+rax *raxNewWithAllocator(const raxAllocator *alloc, int flags);
+rax *raxNewWithArena(int flags);
+raxArena *raxArenaNew(void);
+void raxArenaRelease(raxArena *arena);
+void raxArenaAllocator(raxArena *arena, raxAllocator *alloc, int release);
 int raxInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old);
 int raxTryInsert(rax *rax, unsigned char *s, size_t len, void *data, void **old);
+int raxInsertInline(rax *rax, unsigned char *s, size_t len, const void *val, size_t vlen);
 int raxRemove(rax *rax, unsigned char *s, size_t len, void **old);
+uint64_t raxRemoveRange(rax *rax, unsigned char *start, size_t startlen, unsigned char *end, size_t endlen, void (*free_callback)(void*));
+uint64_t raxRemovePrefix(rax *rax, unsigned char *prefix, size_t len, void (*free_callback)(void*));
+rax *raxDetachPrefix(rax *rax, unsigned char *prefix, size_t len);
 void *raxFind(rax *rax, unsigned char *s, size_t len);
+void *raxFindInline(rax *rax, unsigned char *s, size_t len, size_t *vlen);
+void *raxFindLongestPrefix(rax *rax, unsigned char *s, size_t len, size_t *matched_len);
+size_t raxForEachPrefix(rax *rax, unsigned char *s, size_t len, raxPrefixCallback cb, void *privdata);
+size_t raxFindMany(rax *rax, unsigned char **keys, size_t *lens, size_t count, void **results);
+size_t raxInsertMany(rax *rax, unsigned char **keys, size_t *lens, size_t count, void **data);
+int raxMerge(rax *dst, rax *src, raxMergeCallback cb, void *privdata);
+int raxIntersect(rax *dst, rax *src, raxMergeCallback cb, void *privdata, void (*free_callback)(void*));
+int raxDifference(rax *dst, rax *src, void (*free_callback)(void*));
+int raxBulkLoad(rax *rax, raxBulkLoadCallback next, void *privdata);
+unsigned char *raxSerialize(rax *rax, raxSerializeCallback valfn, void *privdata, size_t *len);
+unsigned char *raxSerializeCompact(rax *rax, raxSerializeCallback valfn, void *privdata, size_t *len);
+int raxDumpStream(rax *rax, raxStreamWriteCallback writefn, raxSerializeCallback valfn, void *privdata);
+int raxLoadStream(rax *rax, raxStreamReadCallback readfn, raxStreamLoadCallback valfn, void (*free_callback)(void*), void *privdata);
+int raxFrozenOpen(raxFrozen *f, const void *image, size_t len);
+void *raxFrozenFind(raxFrozen *f, unsigned char *s, size_t len);
+void *raxFrozenFindInline(raxFrozen *f, unsigned char *s, size_t len, size_t *vlen);
+void raxFrozenStart(raxIterator *it, raxFrozen *f);
 void raxFree(rax *rax);
 void raxFreeWithCallback(rax *rax, void (*free_callback)(void*));
+raxFreeJob *raxFreeAsync(rax *rax, void (*free_callback)(void*));
+int raxFreeStep(raxFreeJob *job, size_t budget);
+void raxDefragStart(raxDefragCursor *c);
+int raxDefragStep(rax *rax, raxDefragCursor *c, size_t max_nodes, raxNodeCallback realloc_cb);
+void raxDefragStop(raxDefragCursor *c);
+int raxCompactStep(rax *rax, size_t max_nodes);
+void raxScanStart(raxScanCursor *c);
+int raxScan(rax *rax, raxScanCursor *c, size_t count, raxScanCallback cb, void *privdata);
+void raxScanStop(raxScanCursor *c);
+raxReader *raxReaderNew(rax *rax);
+void raxReaderRelease(raxReader *r);
+void raxReadBegin(raxReader *r);
+void raxReadEnd(raxReader *r);
+rax *raxFork(rax *rax);
 void raxStart(raxIterator *it, rax *rt);
+void raxStartWithBuffers(raxIterator *it, rax *rt, unsigned char *keybuf, size_t keycap, void *stackbuf, size_t stackcap);
+void raxIteratorReset(raxIterator *it, rax *rt);
 int raxSeek(raxIterator *it, const char *op, unsigned char *ele, size_t len);
 int raxNext(raxIterator *it);
 int raxPrev(raxIterator *it);
+int raxIteratorRemove(raxIterator *it, void **old);
 int raxRandomWalk(raxIterator *it, size_t steps);
+uint64_t raxRank(rax *rax, unsigned char *s, size_t len);
+int raxSelect(raxIterator *it, uint64_t rank);
 int raxCompare(raxIterator *iter, const char *op, unsigned char *key, size_t key_len);
+size_t raxSplitRanges(rax *rax, size_t n, raxBound *bounds);
+void raxFreeBounds(raxBound *bounds, size_t count);
 void raxStop(raxIterator *it);
 int raxEOF(raxIterator *it);
+int raxInsertU64(rax *rax, uint64_t key, void *data, void **old);
+int raxTryInsertU64(rax *rax, uint64_t key, void *data, void **old);
+int raxRemoveU64(rax *rax, uint64_t key, void **old);
+void *raxFindU64(rax *rax, uint64_t key);
+int raxSeekU64(raxIterator *it, const char *op, uint64_t key);
+int raxIteratorKeyU64(raxIterator *it, uint64_t *key);
+int raxInsertU128(rax *rax, raxU128 key, void *data, void **old);
+int raxTryInsertU128(rax *rax, raxU128 key, void *data, void **old);
+int raxRemoveU128(rax *rax, raxU128 key, void **old);
+void *raxFindU128(rax *rax, raxU128 key);
+int raxSeekU128(raxIterator *it, const char *op, raxU128 key);
+int raxIteratorKeyU128(raxIterator *it, raxU128 *key);
+void raxFingerStart(raxFinger *f, rax *rt);
+int raxInsertWithHint(raxFinger *f, unsigned char *s, size_t len, void *data, void **old);
+void *raxFindWithHint(raxFinger *f, unsigned char *s, size_t len);
+void raxFingerStop(raxFinger *f);
+raxSharded *raxShardedNew(int numshards, int mode, int flags);
+int raxShardedInsert(raxSharded *s, unsigned char *key, size_t len, void *data, void **old);
+int raxShardedTryInsert(raxSharded *s, unsigned char *key, size_t len, void *data, void **old);
+int raxShardedRemove(raxSharded *s, unsigned char *key, size_t len, void **old);
+void *raxShardedFind(raxSharded *s, unsigned char *key, size_t len);
+uint64_t raxShardedSize(raxSharded *s);
+void raxShardedForEach(raxSharded *s, raxShardedCallback cb, void *privdata);
+void raxShardedFree(raxSharded *s);
+void raxShardedFreeWithCallback(raxSharded *s, void (*free_callback)(void*));
+int raxShardedStart(raxShardedIterator *it, raxSharded *s);
+int raxShardedSeek(raxShardedIterator *it, const char *op, unsigned char *ele, size_t len);
+int raxShardedNext(raxShardedIterator *it);
+int raxShardedPrev(raxShardedIterator *it);
+void raxShardedStop(raxShardedIterator *it);
 void raxShow(rax *rax);
 uint64_t raxSize(rax *rax);
+uint64_t raxMemoryUsage(rax *rax);
+void raxStats(rax *rax, raxTreeStats *stats);
+int raxGetCounters(raxCounters *c);
+void raxResetCounters(void);
 unsigned long raxTouch(raxNode *n);
 void raxSetDebugMsg(int onoff);
 